@@ -0,0 +1,108 @@
+#include <stdio.h>
+#include <new>
+#include <chrono>
+#include "FileHelperRK.h"
+
+// Host benchmark comparing readBytes() using the heap against readBytes() using an ArenaAllocator.
+// Heap usage is measured by counting calls to the global operator new.
+
+static size_t heapAllocations = 0;
+static size_t heapBytes = 0;
+
+void *operator new(size_t size) {
+    heapAllocations++;
+    heapBytes += size;
+    void *ptr = malloc(size ? size : 1);
+    if (!ptr) {
+        throw std::bad_alloc();
+    }
+    return ptr;
+}
+
+void *operator new[](size_t size) {
+    return operator new(size);
+}
+
+void operator delete(void *ptr) noexcept {
+    free(ptr);
+}
+
+void operator delete[](void *ptr) noexcept {
+    free(ptr);
+}
+
+void operator delete(void *ptr, size_t) noexcept {
+    free(ptr);
+}
+
+void operator delete[](void *ptr, size_t) noexcept {
+    free(ptr);
+}
+
+char runCwd[1024];
+char testPath[1024];
+
+static const size_t fileSizes[] = { 64, 512, 4096 };
+static const int iterations = 5000;
+
+FileHelperRK::StaticArenaAllocator<8192> arena;
+
+typedef std::chrono::high_resolution_clock Clock;
+
+void runBench(const char *name, const char *fileName, std::function<void()> fn) {
+    size_t startAllocations = heapAllocations;
+    size_t startBytes = heapBytes;
+    Clock::time_point start = Clock::now();
+
+    for(int ii = 0; ii < iterations; ii++) {
+        fn();
+    }
+
+    double usPerRead = (double)std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count() / iterations / 1000.0;
+
+    printf("%-10s %-12s %8.2f us/read %8.2f heap allocations/read %10.1f heap bytes/read\n", 
+        name, fileName, usPerRead, 
+        (double)(heapAllocations - startAllocations) / iterations,
+        (double)(heapBytes - startBytes) / iterations);
+}
+
+int main(int argc, char *argv[]) {
+    getcwd(runCwd, sizeof(runCwd));
+
+    snprintf(testPath, sizeof(testPath), "%s/test-output", runCwd);
+    mkdir(testPath, 0777); // make error, ignore error
+    chdir(testPath);
+
+    for(size_t size : fileSizes) {
+        char fileName[32];
+        snprintf(fileName, sizeof(fileName), "bench%d", (int)size);
+
+        uint8_t *data = new uint8_t[size];
+        for(size_t ii = 0; ii < size; ii++) {
+            data[ii] = (uint8_t)ii;
+        }
+        FileHelperRK::storeBytes(fileName, data, size);
+        delete[] data;
+
+        runBench("heap", fileName, [fileName]() {
+            uint8_t *dataPtr;
+            size_t dataLen;
+            FileHelperRK::readBytes(fileName, dataPtr, dataLen);
+            delete[] dataPtr;
+        });
+
+        runBench("heapOwned", fileName, [fileName]() {
+            FileHelperRK::OwnedBuffer buf;
+            FileHelperRK::readBytes(fileName, buf);
+        });
+
+        runBench("arena", fileName, [fileName]() {
+            FileHelperRK::OwnedBuffer buf;
+            FileHelperRK::readBytes(fileName, arena, buf);
+        });
+
+        unlink(fileName);
+    }
+    
+    return 0;
+}
@@ -4,510 +4,4607 @@
 #include <dirent.h>
 #include <sys/stat.h>
 
+#include <algorithm>
 #include <deque>
 
+#if defined(UNITTEST)
+// Host builds only; Device OS threads are not used for file operations
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#define FILEHELPER_HAS_THREADS 1
+#endif
+
+#if defined(UNITTEST)
+// Host builds only; the Device OS libc may ship the header without implementing statvfs()
+#include <sys/statvfs.h>
+#define FILEHELPER_HAS_STATVFS 1
+#endif
+
+#ifndef DT_UNKNOWN
+#define DT_UNKNOWN 0
+#endif
+
 
 const char *FileHelperRK::pathDelim = "/";
+const char *FileHelperRK::tempFileSuffix = ".fhtmp";
+#if defined(SYSTEM_VERSION_560) || defined(UNITTEST)
+const char *FileHelperRK::variantDeltaSuffix = ".delta";
+#endif // SYSTEM_VERSION_560
 
 static Logger _fileHelperLog("app.file");
 
+FileHelperRK::ParsedPath::~ParsedPath() {
+    if (buffer) {
+        free(buffer);
+        buffer = nullptr;
+    }
+}
+
+FileHelperRK::ParsedPath &FileHelperRK::ParsedPath::operator=(const ParsedPath &other) {
+    if (this != &other) {
+        clear();
+        if (other.buffer && reserve(other.pathLength + 1) == SYSTEM_ERROR_NONE) {
+            // Copy the whole path even if other has a prefix null terminator
+            memcpy(buffer, other.buffer, other.pathLength);
+            buffer[other.pathLength] = 0;
+            if (other.prefixEnd) {
+                buffer[other.prefixEnd] = pathDelim[0];
+            }
+            pathLength = other.pathLength;
+            parts = other.parts;
+            startsWithSlash = other.startsWithSlash;
+            endsWithSlash = other.endsWithSlash;
+        }
+    }
+    return *this;
+}
+
 int FileHelperRK::ParsedPath::parse(const char *path) {
     clear();
 
-    char *pathCopy = strdup(path);
-    if (!pathCopy) {
-        return SYSTEM_ERROR_NO_MEMORY;
+    size_t len = strlen(path);
+    startsWithSlash = (len > 0) && path[0] == pathDelim[0];
+    endsWithSlash = (len > 0) && path[len - 1] == pathDelim[0];
+
+    int result = reserve(len + 1);
+    if (result != SYSTEM_ERROR_NONE) {
+        return result;
     }
+    if (startsWithSlash) {
+        buffer[pathLength++] = pathDelim[0];
+    }
+    appendParts(path);
+
+    return SYSTEM_ERROR_NONE; // 0
+}
 
-    int len = strlen(pathCopy);
-    startsWithSlash = (len > 0) && pathCopy[0] == '/';
-    endsWithSlash = (len > 0) && pathCopy[len - 1] == '/';
+int FileHelperRK::ParsedPath::canonical(const char *path, const char *baseDir) {
+    clear();
 
-    char *save = nullptr;
-    const char *pathDelim = "/";
+    size_t len = strlen(path);
+    bool useBase = baseDir && *baseDir && (len == 0 || path[0] != pathDelim[0]);
 
-    const char *part = strtok_r(pathCopy, pathDelim, &save);
-    while(part) {
-        parts.push_back(part);
+    startsWithSlash = useBase ? (baseDir[0] == pathDelim[0]) : (len > 0 && path[0] == pathDelim[0]);
+    endsWithSlash = (len > 0) && path[len - 1] == pathDelim[0];
 
-        part = strtok_r(nullptr, pathDelim, &save);
+    int result = reserve((useBase ? strlen(baseDir) + 1 : 0) + len + 1);
+    if (result != SYSTEM_ERROR_NONE) {
+        return result;
     }
+    if (startsWithSlash) {
+        buffer[pathLength++] = pathDelim[0];
+    }
+    if (useBase) {
+        appendParts(baseDir);
+    }
+    appendParts(path);
 
-    if (!parts.empty()) {
-        String str = parts[parts.size() - 1];
-        
-        const char offset = str.lastIndexOf(".");
-        if (offset >= 0) {
-            fileBaseName = str.substring(0, offset);
-            fileExtension = str.substring(offset + 1);
+    normalize();
+
+    return SYSTEM_ERROR_NONE;
+}
+
+void FileHelperRK::ParsedPath::normalize() {
+    restorePrefix();
+
+    // Single pass; parts are only moved toward the beginning of the buffer
+    size_t numParts = 0;
+    size_t end = startsWithSlash ? 1 : 0;
+    for(size_t ii = 0; ii < parts.size(); ii++) {
+        Part part = parts[ii];
+        const char *src = &buffer[part.offset];
+
+        if (part.length == 1 && src[0] == '.') {
+            continue;
         }
-        else {
-            fileBaseName = str;
+        if (part.length == 2 && src[0] == '.' && src[1] == '.') {
+            const Part *prev = numParts ? &parts[numParts - 1] : nullptr;
+            if (prev && !(prev->length == 2 && buffer[prev->offset] == '.' && buffer[prev->offset + 1] == '.')) {
+                numParts--;
+                end = numParts ? (parts[numParts - 1].offset + parts[numParts - 1].length) : (startsWithSlash ? 1 : 0);
+                continue;
+            }
+            if (startsWithSlash) {
+                // Parent of the root is the root
+                continue;
+            }
+            // Leading .. in a relative path is kept
         }
-    }
 
+        if (numParts) {
+            buffer[end++] = pathDelim[0];
+        }
+        memmove(&buffer[end], src, part.length);
+        parts[numParts++] = Part({end, part.length});
+        end += part.length;
+    }
+    parts.resize(numParts);
+    if (buffer) {
+        buffer[end] = 0;
+    }
+    pathLength = end;
+}
 
-    return SYSTEM_ERROR_NONE; // 0
+void FileHelperRK::ParsedPath::appendParts(const char *path) {
+    // Copy the parts into the buffer separated by a single slash
+    while(*path) {
+        if (*path == pathDelim[0]) {
+            path++;
+            continue;
+        }
+        size_t partLen = strcspn(path, pathDelim);
+        if (!parts.empty()) {
+            buffer[pathLength++] = pathDelim[0];
+        }
+        parts.push_back(Part({pathLength, partLen}));
+        memcpy(&buffer[pathLength], path, partLen);
+        pathLength += partLen;
+        path += partLen;
+    }
+    buffer[pathLength] = 0;
 }
 
 void FileHelperRK::ParsedPath::clear() {
     parts.clear();
     startsWithSlash = false;
     endsWithSlash = false;
-    fileBaseName = "";
-    fileExtension = "";
+    pathLength = 0;
+    prefixEnd = 0;
+    if (buffer) {
+        buffer[0] = 0;
+    }
 }
 
-String FileHelperRK::ParsedPath::generatePathString(int numParts) {
-    String result;
+int FileHelperRK::ParsedPath::reserve(size_t size) {
+    if (size > bufferSize) {
+        char *newBuffer = (char *)realloc(buffer, size);
+        if (!newBuffer) {
+            return SYSTEM_ERROR_NO_MEMORY;
+        }
+        buffer = newBuffer;
+        bufferSize = size;
+    }
+    return SYSTEM_ERROR_NONE;
+}
 
-    if (numParts < 0 || numParts > (int)parts.size()) {
-        numParts = (int)parts.size();
+FileHelperRK::ParsedPath::PartView FileHelperRK::ParsedPath::getPartView(size_t index) const {
+    PartView view;
+    if (index < parts.size()) {
+        view.data = &buffer[parts[index].offset];
+        view.length = parts[index].length;
     }
+    return view;
+}
 
-    if (startsWithSlash) {
-        result.concat(pathDelim);
+/**
+ * @brief Find the last dot in a string that is not null-terminated
+ */
+static const char *_findLastDot(const char *str, size_t len) {
+    while(len > 0) {
+        if (str[--len] == '.') {
+            return &str[len];
+        }
     }
-    for(int ii = 0; ii < numParts; ii++) {
-        if (ii > 0) {
-            result.concat(pathDelim);
+    return nullptr;
+}
+
+FileHelperRK::ParsedPath::PartView FileHelperRK::ParsedPath::getFileBaseNameView() const {
+    PartView view;
+    if (!parts.empty()) {
+        view = getPartView(parts.size() - 1);
+        const char *dot = _findLastDot(view.data, view.length);
+        if (dot) {
+            view.length = dot - view.data;
         }
-        result.concat(parts[ii]);        
     }
+    return view;
+}
 
-    return result;
+FileHelperRK::ParsedPath::PartView FileHelperRK::ParsedPath::getFileExtensionView() const {
+    PartView view;
+    if (!parts.empty()) {
+        PartView last = getPartView(parts.size() - 1);
+        const char *dot = _findLastDot(last.data, last.length);
+        if (dot) {
+            view.data = dot + 1;
+            view.length = last.length - (dot + 1 - last.data);
+        }
+    }
+    return view;
 }
 
-int FileHelperRK::Usage::measure(const char *path, bool clearStats) {
-    int result = SYSTEM_ERROR_UNKNOWN;
+size_t FileHelperRK::ParsedPath::prefixLength(int numParts) const {
+    if (numParts < 0 || numParts > (int)parts.size()) {
+        numParts = (int)parts.size();
+    }
+    if (numParts == 0) {
+        return startsWithSlash ? 1 : 0;
+    }
+    return parts[numParts - 1].offset + parts[numParts - 1].length;
+}
 
-    clear();
+void FileHelperRK::ParsedPath::restorePrefix() {
+    if (prefixEnd) {
+        buffer[prefixEnd] = pathDelim[0];
+        prefixEnd = 0;
+    }
+}
 
-    result = walk(path, [this](const WalkParameters &walkParameters) {
-        if (walkParameters.isDirectory) {
-            numDirectories++;
-            sectors++;
-        }
-        else {
-            fileBytes += walkParameters.size;
-            sectors += ((walkParameters.size + 511) / 512) + 1;
-            numFiles++;        
-        }
-    });
+String FileHelperRK::ParsedPath::generatePathString(int numParts) {
+    String result;
+
+    // The null terminator written by getPrefix() may be inside the requested range
+    restorePrefix();
 
+    if (buffer) {
+        result.concat(buffer, prefixLength(numParts));
+    }
     return result;
 }
 
-void FileHelperRK::Usage::clear() {
-    fileBytes = 0;
-    sectors = 0;
-    numFiles = 0;
-    numDirectories = 0;
-}
+const char *FileHelperRK::ParsedPath::getPrefix(int numParts) {
+    restorePrefix();
 
-String FileHelperRK::Usage::toString() const {
-    return String::format("fileBytes=%d, sectors=%d, numFiles=%d, numDirectories=%d",
-        (int)fileBytes, (int)sectors, (int)numFiles, (int)numDirectories);
-}
+    if (numParts == 0 || parts.empty()) {
+        // Not in the buffer, because the first part follows the leading slash without a separator
+        return startsWithSlash ? pathDelim : "";
+    }
 
+    size_t len = prefixLength(numParts);
+    if (len < pathLength) {
+        // Always a slash between parts
+        buffer[len] = 0;
+        prefixEnd = len;
+    }
+    return buffer;
+}
 
-FileHelperRK::FileStreamBase::FileStreamBase() : fd(-1), closeFile(false) {
+int FileHelperRK::getFileSystemInfo(const char *path, FileSystemInfo &info) {
+#ifdef FILEHELPER_HAS_STATVFS
+    struct statvfs sv;
+    if (statvfs(path, &sv) == -1) {
+        return errnoToSystemError();
+    }
+    info.blockSize = sv.f_frsize ? sv.f_frsize : sv.f_bsize;
+    info.totalBlocks = sv.f_blocks;
+    info.freeBlocks = sv.f_bavail;
+    return SYSTEM_ERROR_NONE;
+#else
+    (void)path;
+    (void)info;
+    return SYSTEM_ERROR_NOT_SUPPORTED;
+#endif
 }
 
-FileHelperRK::FileStreamBase::FileStreamBase(int fd) : fd(fd), closeFile(false) {
+FileHelperRK::UsageModel *FileHelperRK::UsageModel::defaultModel = nullptr;
 
+// static
+FileHelperRK::UsageModel &FileHelperRK::UsageModel::getDefault() {
+    return defaultModel ? *defaultModel : LittleFSUsageModel::instance();
 }
 
-int FileHelperRK::FileStreamBase::open(const char *path, int mode, int perm) {
-    int result = SYSTEM_ERROR_UNKNOWN;
+// static
+FileHelperRK::LittleFSUsageModel &FileHelperRK::LittleFSUsageModel::instance() {
+    static LittleFSUsageModel model;
+    return model;
+}
 
-    fd = ::open(path, mode, perm);
-    if (fd != -1) {
-        closeFile = true;
+int FileHelperRK::LittleFSUsageModel::calibrate(const char *path) {
+    FileSystemInfo info;
 
-        result = SYSTEM_ERROR_NONE;
-    }
-    else {
-        _fileHelperLog.info("FileStream::open did not open fileName=%s errno=%d", path, errno);
-        result = errnoToSystemError();
+    int result = FileHelperRK::getFileSystemInfo(path, info);
+    if (result == SYSTEM_ERROR_NONE && info.blockSize) {
+        fsInfo = info;
+        blockSize = info.blockSize;
     }
     return result;
 }
 
-FileHelperRK::FileStreamBase::~FileStreamBase() {
-    if (closeFile && fd != -1) {
-        ::close(fd);
-        fd = -1;
+size_t FileHelperRK::LittleFSUsageModel::fileBlocks(size_t fileSize) const {
+    if (fileSize == 0 || fileSize <= getInlineMax()) {
+        return 0;
+    }
+    if (blockSize <= 128) {
+        // Too small to hold the skip-list pointers; not a valid LittleFS geometry
+        return (fileSize + blockSize - 1) / (blockSize ? blockSize : 1);
     }
-}
 
-int FileHelperRK::FileStreamBase::close() {
-    if (fd != -1) {
-        ::close(fd);
-        fd = -1;
+    // CTZ skip-list: block n (n > 0) begins with ctz(n) + 1 pointers to previous blocks
+    size_t blocks = 1;
+    size_t capacity = blockSize;
+    while(capacity < fileSize) {
+        capacity += blockSize - 4 * (__builtin_ctz((unsigned)blocks) + 1);
+        blocks++;
     }
-    return SYSTEM_ERROR_NONE;
+    return blocks;
 }
 
-int FileHelperRK::FileStreamRead::open(const char *path) {
-    int result = FileStreamBase::open(path, O_RDONLY, 0666);
-    if (result == SYSTEM_ERROR_NONE) {
-        fileOffset = 0;
-        updateFileSize();
+size_t FileHelperRK::LittleFSUsageModel::entryBytes(size_t nameLen, size_t fileSize, bool isDirectory) const {
+    // Name tag and name, struct tag and struct (directory pair, CTZ head and size, or inline data)
+    size_t bytes = 4 + nameLen + 4;
+    if (!isDirectory && fileSize <= getInlineMax()) {
+        bytes += fileSize;
     }
     else {
-        fileSize = fileOffset = 0;
+        bytes += 8;
     }
-
-    return result;
+    return bytes;
 }
 
-void FileHelperRK::FileStreamRead::updateFileSize() {
-    if (fd != -1) {
-        struct stat sb;
-        fstat(fd, &sb);
-        fileSize = sb.st_size;
+size_t FileHelperRK::LittleFSUsageModel::directoryBlocks(size_t metadataBytes) const {
+    // LittleFS splits a metadata pair when its compacted size exceeds half a block
+    size_t pairCapacity = blockSize / 2;
+    if (pairCapacity == 0) {
+        return 2;
     }
-    else {
-        fileSize = 0;
+    size_t pairs = (metadataBytes + pairCapacity - 1) / pairCapacity;
+    if (pairs == 0) {
+        pairs = 1;
     }
+    return pairs * 2;
 }
 
+int FileHelperRK::Usage::measure(const char *path, bool clearStats) {
+    int result = SYSTEM_ERROR_UNKNOWN;
 
-int FileHelperRK::FileStreamRead::available() {
-    return fileSize - fileOffset;
-}
+    clear();
 
-int FileHelperRK::FileStreamRead::read() {
-    int result = -1;
-    uint8_t c;
+    const UsageModel &usageModel = getModel();
+    blockSize = usageModel.getBlockSize();
 
-    if (fd != -1) {
-        if (fileOffset < fileSize) {
-            if (::read(fd, &c, 1) == 1) {
-                fileOffset++;
-                result = (int)c;
-            }
+    // Directory metadata bytes for each directory currently being walked, by depth. The walk is
+    // depth-first, so when an entry at depth n is reported, directories at depth n or deeper are complete.
+    std::vector<size_t> metadataBytes;
+    auto finishDirectories = [&](size_t depth) {
+        while(metadataBytes.size() > depth) {
+            blocks += usageModel.directoryBlocks(metadataBytes.back());
+            metadataBytes.pop_back();
         }
-    }
-    return result;
-}
+    };
+
+    result = walk(path, [&](const WalkParameters &walkParameters) {
+        size_t depth = (size_t) walkParameters.depth;
+        finishDirectories(depth);
+
+        if (depth > 0 && metadataBytes.size() == depth) {
+            const char *name = strrchr(walkParameters.path, pathDelim[0]);
+            name = name ? (name + 1) : walkParameters.path;
+            metadataBytes.back() += usageModel.entryBytes(strlen(name), walkParameters.size, walkParameters.isDirectory);
+        }
+
+        if (walkParameters.isDirectory) {
+            numDirectories++;
+            sectors++;
+            metadataBytes.push_back(0);
+        }
+        else {
+            fileBytes += walkParameters.size;
+            sectors += ((walkParameters.size + 511) / 512) + 1;
+            blocks += usageModel.fileBlocks(walkParameters.size);
+            numFiles++;        
+        }
+    });
+    finishDirectories(0);
 
-int FileHelperRK::FileStreamRead::peek() {
-    int result = read();
-    if (result >= 0) {
-        fileOffset--;
-        lseek(fd, fileOffset, SEEK_SET);
-    }
     return result;
 }
 
-void FileHelperRK::FileStreamRead::flush() {
+void FileHelperRK::Usage::clear() {
+    fileBytes = 0;
+    sectors = 0;
+    blocks = 0;
+    blockSize = 0;
+    numFiles = 0;
+    numDirectories = 0;
 }
 
-int FileHelperRK::FileStreamRead::rewind() {
-    lseek(fd, 0, SEEK_SET);
-    fileOffset = 0;
-    return SYSTEM_ERROR_NONE;
+String FileHelperRK::Usage::toString() const {
+    return String::format("fileBytes=%d, sectors=%d, blocks=%d, blockSize=%d, numFiles=%d, numDirectories=%d",
+        (int)fileBytes, (int)sectors, (int)blocks, (int)blockSize, (int)numFiles, (int)numDirectories);
 }
 
-size_t FileHelperRK::FileStreamRead::write(uint8_t) {
-    return 0;
-}
 
+FileHelperRK::UsageTracker *FileHelperRK::UsageTracker::activeTracker = nullptr;
 
-int FileHelperRK::FileStreamWrite::open(const char *path) {
-    return FileStreamBase::open(path, O_RDWR | O_CREAT | O_TRUNC, 0666);
+FileHelperRK::UsageTracker::UsageTracker(const char *root) : root(root) {
+    // Remove trailing slashes so parent paths compare correctly
+    while(this->root.length() > 1 && this->root.charAt(this->root.length() - 1) == pathDelim[0]) {
+        this->root.remove(this->root.length() - 1);
+    }
 }
 
-size_t FileHelperRK::FileStreamWrite::write(uint8_t c) {
-    size_t countResult = 0;
-    if (fd != -1) {
-        countResult = ::write(fd, &c, 1);
+FileHelperRK::UsageTracker::~UsageTracker() {
+    if (activeTracker == this) {
+        activeTracker = nullptr;
     }
-    return countResult;
 }
 
-size_t FileHelperRK::FileStreamWrite::write(const uint8_t *buffer, size_t size) {
-    size_t countResult = 0;
+int FileHelperRK::UsageTracker::begin() {
+    activeTracker = this;
 
-    if (fd != -1) {
-        countResult = ::write(fd, buffer, size);
+    if (snapshotPath.length()) {
+        int result = load();
+        if (result != SYSTEM_ERROR_NONE) {
+            _fileHelperLog.info("UsageTracker snapshot not loaded, will measure all result=%d", result);
+            dirs.clear();
+        }
     }
+    return SYSTEM_ERROR_NONE;
+}
 
-    return countResult;
+int FileHelperRK::UsageTracker::measure(Usage &usage) {
+    dirs.clear();
+    return update(usage);
 }
-    
 
-int FileHelperRK::mkdirs(const char *path) {
-    int result = SYSTEM_ERROR_UNKNOWN;
+int FileHelperRK::UsageTracker::update(Usage &usage) {
+    int result = SYSTEM_ERROR_NONE;
 
-    ParsedPath parsed;
-    result = parsed.parse(path);
-    if (result != SYSTEM_ERROR_NONE) {
-        return result;
+    usage.clear();
+    numRescanned = 0;
+
+    if (findDir(root) < 0) {
+        dirs.push_back(DirInfo({root, 0, 0, 0, 0, 0, 0, true}));
     }
 
-    int numParts = (int) parsed.getNumParts();
-    int curPart = numParts;
+    // Find directories that changed without a notification
+    for(size_t ii = 0; ii < dirs.size(); ) {
+        DirInfo &info = dirs[ii];
 
-    while(curPart > 0) {
         struct stat sb;
-
-        String partialPath = parsed.generatePathString(curPart);
-        result = stat(partialPath.c_str(), &sb);
-
-        // _fileHelperLog.trace("mkdirs test curPart=%d result=%d errno=%d partialPath=%s", curPart, result, errno, partialPath.c_str());
-
-        if (result == 0) {
-            if ((sb.st_mode & S_IFDIR) == 0) {
-                // Not a directory
-#if defined(SYSTEM_VERSION_550) || defined(UNITTEST)
-                return SYSTEM_ERROR_FILESYSTEM_NOTDIR;
-#else
-                return -1;
-#endif
+        if (stat(info.path, &sb) == -1 || (sb.st_mode & S_IFDIR) == 0) {
+            if (info.path == root) {
+                result = errnoToSystemError();
+                dirs.clear();
+                return result;
             }
-            break;
+            // Removed directory: drop it and its subdirectories, and rescan its parent
+            String path = info.path;
+            markDirty(path);
+            removeDir(path);
+            ii = 0;
+            continue;
         }
-        curPart--;
-    }
 
-    if (curPart == numParts) {
-        return SYSTEM_ERROR_NONE;
+        if (!info.dirty) {
+            if ((uint32_t)sb.st_mtime != info.mtime) {
+                info.dirty = true;
+            }
+            else
+            if (entryCountCheck && countEntries(info.path) != (int)info.numEntries) {
+                info.dirty = true;
+            }
+        }
+        ii++;
     }
 
-    for(curPart++; curPart <= numParts; curPart++){
-        String partialPath = parsed.generatePathString(curPart);
-        result = mkdir(partialPath.c_str(), 0777);
-
-        // _fileHelperLog.trace("mkdirs create curPart=%d result=%d errno=%d partialPath=%s", curPart, result, errno, partialPath.c_str());
+    // Rescan changed directories. Scanning can add new subdirectories (dirty) or remove deleted ones.
+    while(true) {
+        size_t index;
+        for(index = 0; index < dirs.size(); index++) {
+            if (dirs[index].dirty) {
+                break;
+            }
+        }
+        if (index >= dirs.size()) {
+            break;
+        }
 
-        if (result) {
+        result = scanDir(index);
+        if (result != SYSTEM_ERROR_NONE) {
             return result;
         }
+        numRescanned++;
     }
-    
-    result = SYSTEM_ERROR_NONE;
 
+    usage.blockSize = (model ? *model : UsageModel::getDefault()).getBlockSize();
+    for(auto it = dirs.begin(); it != dirs.end(); it++) {
+        usage.numDirectories++;
+        usage.numFiles += it->numFiles;
+        usage.fileBytes += it->fileBytes;
+        usage.sectors += it->sectors;
+        usage.blocks += it->blocks;
+    }
 
     return result;
 }
 
-int FileHelperRK::deleteRecursive(const char *path, bool contentsOfPathOnly) {
-    int result = SYSTEM_ERROR_UNKNOWN;
+int FileHelperRK::UsageTracker::scanDir(size_t index) {
+    // dirs may be reallocated when subdirectories are added, so don't keep a reference
+    String dirPath = dirs[index].path;
+    DirInfo info = dirs[index];
 
-    std::deque<String> filesToDelete;
-    std::deque<String> directoriesToDelete;
+    // _fileHelperLog.trace("UsageTracker scanDir %s", dirPath.c_str());
 
-    // _fileHelperLog.trace("deleteRecursive path=%s", path);  
+    struct stat sb;
+    if (stat(dirPath, &sb) == -1) {
+        return errnoToSystemError();
+    }
+    info.mtime = (uint32_t)sb.st_mtime;
+    info.numEntries = info.numFiles = info.fileBytes = info.blocks = 0;
+    info.sectors = 1;
+    info.dirty = false;
 
-    DIR *dirp = opendir(path);
-    if (dirp) {      
-        while(true) {
-            struct dirent *de = readdir(dirp);
-            if (!de) {
-                break;
-            }
-            // _fileHelperLog.trace("deleteRecursive de->d_name=%s", de->d_name);  
+    const UsageModel &usageModel = model ? *model : UsageModel::getDefault();
+    size_t metadataBytes = 0;
 
-            if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) {
-                continue;
-            }
+    std::vector<String> subdirs;
 
-            if (de->d_type & DT_DIR) {
-                directoriesToDelete.push_back(de->d_name);
-            }
-            else 
+    DIR *dirp = opendir(dirPath);
+    if (!dirp) {
+        return errnoToSystemError();
+    }
+    while(true) {
+        struct dirent *de = readdir(dirp);
+        if (!de) {
+            break;
+        }
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) {
+            continue;
+        }
+        info.numEntries++;
+
+        String childPath = pathJoin(dirPath, de->d_name);
+
+        bool isDirectory = (de->d_type & DT_DIR) != 0;
+        bool isFile = !isDirectory && (de->d_type & DT_REG) != 0;
+        if (isFile || de->d_type == DT_UNKNOWN) {
+            if (stat(childPath, &sb) == -1) {
+                continue;
+            }
+            isDirectory = (sb.st_mode & S_IFDIR) != 0;
+            isFile = (sb.st_mode & S_IFREG) != 0;
+        }
+
+        if (isDirectory) {
+            if (findDir(childPath) < 0) {
+                dirs.push_back(DirInfo({childPath, 0, 0, 0, 0, 0, 0, true}));
+            }
+            subdirs.push_back(childPath);
+            metadataBytes += usageModel.entryBytes(strlen(de->d_name), 0, true);
+        }
+        else
+        if (isFile) {
+            info.numFiles++;
+            info.fileBytes += sb.st_size;
+            info.sectors += ((sb.st_size + 511) / 512) + 1;
+            info.blocks += usageModel.fileBlocks(sb.st_size);
+            metadataBytes += usageModel.entryBytes(strlen(de->d_name), sb.st_size, false);
+        }
+    }
+    closedir(dirp);
+
+    info.blocks += usageModel.directoryBlocks(metadataBytes);
+
+    dirs[index] = info;
+
+    // Remove subdirectories that no longer exist
+    std::vector<String> removed;
+    for(auto it = dirs.begin(); it != dirs.end(); it++) {
+        int slash = it->path.lastIndexOf(pathDelim[0]);
+        if (slash < 0 || it->path == dirPath) {
+            continue;
+        }
+        String parent = (slash == 0) ? String(pathDelim) : it->path.substring(0, slash);
+        if (parent != dirPath) {
+            continue;
+        }
+        bool found = false;
+        for(auto it2 = subdirs.begin(); it2 != subdirs.end(); it2++) {
+            if (*it2 == it->path) {
+                found = true;
+                break;
+            }
+        }
+        if (!found) {
+            removed.push_back(it->path);
+        }
+    }
+    for(auto it = removed.begin(); it != removed.end(); it++) {
+        removeDir(*it);
+    }
+
+    return SYSTEM_ERROR_NONE;
+}
+
+int FileHelperRK::UsageTracker::findDir(const char *path) const {
+    for(size_t ii = 0; ii < dirs.size(); ii++) {
+        if (dirs[ii].path == path) {
+            return (int)ii;
+        }
+    }
+    return -1;
+}
+
+void FileHelperRK::UsageTracker::removeDir(const char *path) {
+    String prefix = pathJoin(path, "");
+    if (prefix.length() == 0 || prefix.charAt(prefix.length() - 1) != pathDelim[0]) {
+        prefix.concat(pathDelim);
+    }
+
+    for(auto it = dirs.begin(); it != dirs.end(); ) {
+        if (it->path == path || it->path.startsWith(prefix)) {
+            it = dirs.erase(it);
+        }
+        else {
+            it++;
+        }
+    }
+}
+
+void FileHelperRK::UsageTracker::markDirty(const char *path) {
+    if (saving || !path) {
+        return;
+    }
+
+    int index = findDir(path);
+    if (index >= 0) {
+        dirs[index].dirty = true;
+    }
+
+    // Mark the nearest tracked parent directory
+    String parent(path);
+    while(true) {
+        int slash = parent.lastIndexOf(pathDelim[0]);
+        if (slash < 0) {
+            break;
+        }
+        parent = (slash == 0) ? String(pathDelim) : parent.substring(0, slash);
+
+        index = findDir(parent);
+        if (index >= 0) {
+            dirs[index].dirty = true;
+            break;
+        }
+        if (slash == 0) {
+            break;
+        }
+    }
+}
+
+int FileHelperRK::UsageTracker::countEntries(const char *path) {
+    int count = 0;
+
+    DIR *dirp = opendir(path);
+    if (!dirp) {
+        return -1;
+    }
+    while(true) {
+        struct dirent *de = readdir(dirp);
+        if (!de) {
+            break;
+        }
+        if (strcmp(de->d_name, ".") != 0 && strcmp(de->d_name, "..") != 0) {
+            count++;
+        }
+    }
+    closedir(dirp);
+
+    return count;
+}
+
+int FileHelperRK::UsageTracker::save() {
+    if (snapshotPath.length() == 0) {
+        return SYSTEM_ERROR_INVALID_STATE;
+    }
+
+    // Format: root, then for each directory: path, mtime, numEntries, numFiles, fileBytes, sectors, blocks, dirty
+    // Strings are a uint16_t length followed by the characters (not null terminated)
+    std::vector<uint8_t> data;
+
+    auto appendBytes = [&data](const void *ptr, size_t len) {
+        data.insert(data.end(), (const uint8_t *)ptr, (const uint8_t *)ptr + len);
+    };
+    auto appendString = [&appendBytes](const String &str) {
+        uint16_t len = (uint16_t) str.length();
+        appendBytes(&len, sizeof(len));
+        appendBytes(str.c_str(), len);
+    };
+
+    appendString(root);
+    for(auto it = dirs.begin(); it != dirs.end(); it++) {
+        appendString(it->path);
+        appendBytes(&it->mtime, sizeof(it->mtime));
+        appendBytes(&it->numEntries, sizeof(it->numEntries));
+        appendBytes(&it->numFiles, sizeof(it->numFiles));
+        appendBytes(&it->fileBytes, sizeof(it->fileBytes));
+        appendBytes(&it->sectors, sizeof(it->sectors));
+        appendBytes(&it->blocks, sizeof(it->blocks));
+        uint8_t dirty = it->dirty ? 1 : 0;
+        appendBytes(&dirty, sizeof(dirty));
+    }
+
+    saving = true;
+    int result = storeBytesVersioned(snapshotPath, data.data(), data.size(), snapshotVersion, STORE_ATOMIC);
+    saving = false;
+
+    return result;
+}
+
+int FileHelperRK::UsageTracker::load() {
+    OwnedBuffer buf;
+
+    int result = readBytes(snapshotPath, buf);
+    if (result != SYSTEM_ERROR_NONE) {
+        return result;
+    }
+
+    StructHeader header;
+    if (buf.size() < sizeof(StructHeader)) {
+        return SYSTEM_ERROR_BAD_DATA;
+    }
+    memcpy(&header, buf.data(), sizeof(StructHeader));
+    if (header.magic != structMagic || header.version != snapshotVersion || header.headerSize != sizeof(StructHeader) || 
+        header.dataSize != buf.size() - sizeof(StructHeader)) {
+        return SYSTEM_ERROR_BAD_DATA;
+    }
+    const uint8_t *data = buf.data() + sizeof(StructHeader);
+    if (header.crc != crc32(data, header.dataSize, crc32(&header, offsetof(StructHeader, crc)))) {
+        return SYSTEM_ERROR_BAD_DATA;
+    }
+
+    size_t offset = 0;
+    auto readBytes = [&](void *ptr, size_t len) {
+        if (offset + len > header.dataSize) {
+            return false;
+        }
+        memcpy(ptr, &data[offset], len);
+        offset += len;
+        return true;
+    };
+    auto readString = [&](String &str) {
+        uint16_t len;
+        if (!readBytes(&len, sizeof(len)) || offset + len > header.dataSize) {
+            return false;
+        }
+        str = "";
+        str.reserve(len);
+        for(uint16_t ii = 0; ii < len; ii++) {
+            str.concat((char)data[offset++]);
+        }
+        return true;
+    };
+
+    String savedRoot;
+    if (!readString(savedRoot) || savedRoot != root) {
+        return SYSTEM_ERROR_BAD_DATA;
+    }
+
+    dirs.clear();
+    while(offset < header.dataSize) {
+        DirInfo info;
+        uint8_t dirty;
+        if (!readString(info.path) || !readBytes(&info.mtime, sizeof(info.mtime)) || !readBytes(&info.numEntries, sizeof(info.numEntries)) ||
+            !readBytes(&info.numFiles, sizeof(info.numFiles)) || !readBytes(&info.fileBytes, sizeof(info.fileBytes)) ||
+            !readBytes(&info.sectors, sizeof(info.sectors)) || !readBytes(&info.blocks, sizeof(info.blocks)) || !readBytes(&dirty, sizeof(dirty))) {
+            dirs.clear();
+            return SYSTEM_ERROR_BAD_DATA;
+        }
+        info.dirty = (dirty != 0);
+        dirs.push_back(info);
+    }
+
+    return SYSTEM_ERROR_NONE;
+}
+
+FileHelperRK::FileStreamBase::FileStreamBase() : fd(-1), closeFile(false) {
+}
+
+FileHelperRK::FileStreamBase::FileStreamBase(int fd) : fd(fd), closeFile(false) {
+
+}
+
+int FileHelperRK::FileStreamBase::open(const char *path, int mode, int perm) {
+    int result = SYSTEM_ERROR_UNKNOWN;
+
+    fd = ::open(path, mode, perm);
+    if (fd != -1) {
+        closeFile = true;
+
+        result = SYSTEM_ERROR_NONE;
+    }
+    else {
+        _fileHelperLog.info("FileStream::open did not open fileName=%s errno=%d", path, errno);
+        result = errnoToSystemError();
+    }
+    return result;
+}
+
+FileHelperRK::FileStreamBase::~FileStreamBase() {
+    if (closeFile && fd != -1) {
+        ::close(fd);
+        fd = -1;
+    }
+}
+
+int FileHelperRK::FileStreamBase::close() {
+    if (fd != -1) {
+        ::close(fd);
+        fd = -1;
+    }
+    return SYSTEM_ERROR_NONE;
+}
+
+FileHelperRK::FileStreamRead::FileStreamRead() {
+}
+
+FileHelperRK::FileStreamRead::~FileStreamRead() {
+    if (bufferAllocated) {
+        delete[] buffer;
+    }
+}
+
+FileHelperRK::FileStreamRead &FileHelperRK::FileStreamRead::withBuffer(uint8_t *buf, size_t size) {
+    if (bufferAllocated) {
+        delete[] buffer;
+        bufferAllocated = false;
+    }
+    buffer = buf;
+    bufferSize = size;
+    discardBuffer();
+    return *this;
+}
+
+FileHelperRK::FileStreamRead &FileHelperRK::FileStreamRead::withBufferSize(size_t size) {
+    if (buffer && !bufferAllocated) {
+        // Caller-provided buffer takes precedence
+        return *this;
+    }
+    if (bufferAllocated) {
+        delete[] buffer;
+        buffer = nullptr;
+        bufferAllocated = false;
+    }
+    bufferSize = size;
+    return *this;
+}
+
+int FileHelperRK::FileStreamRead::open(const char *path) {
+    if (!buffer) {
+        if (bufferSize == 0) {
+            bufferSize = defaultBufferSize;
+        }
+        buffer = new uint8_t[bufferSize];
+        if (!buffer) {
+            fileSize = fileOffset = 0;
+            return SYSTEM_ERROR_NO_MEMORY;
+        }
+        bufferAllocated = true;
+    }
+    discardBuffer();
+
+    int result = FileStreamBase::open(path, O_RDONLY, 0666);
+    if (result == SYSTEM_ERROR_NONE) {
+        fileOffset = 0;
+        updateFileSize();
+    }
+    else {
+        fileSize = fileOffset = 0;
+    }
+
+    return result;
+}
+
+int FileHelperRK::FileStreamRead::close() {
+    FileStreamBase::close();
+
+    if (bufferAllocated) {
+        delete[] buffer;
+        buffer = nullptr;
+        bufferAllocated = false;
+    }
+    discardBuffer();
+    fileSize = fileOffset = 0;
+    return SYSTEM_ERROR_NONE;
+}
+
+void FileHelperRK::FileStreamRead::updateFileSize() {
+    if (fd != -1) {
+        struct stat sb;
+        fstat(fd, &sb);
+        fileSize = sb.st_size;
+    }
+    else {
+        fileSize = 0;
+    }
+}
+
+void FileHelperRK::FileStreamRead::discardBuffer() {
+    bufferPos = bufferLen = 0;
+}
+
+bool FileHelperRK::FileStreamRead::fillBuffer() {
+    if (bufferPos < bufferLen) {
+        return true;
+    }
+    discardBuffer();
+
+    if (fd == -1 || !buffer || fileOffset >= fileSize) {
+        return false;
+    }
+
+    size_t toRead = fileSize - fileOffset;
+    if (toRead > bufferSize) {
+        toRead = bufferSize;
+    }
+
+    int readLen = ::read(fd, buffer, toRead);
+    if (readLen <= 0) {
+        _fileHelperLog.info("FileStreamRead read failed offset=%d errno=%d", (int)fileOffset, errno);
+        return false;
+    }
+    bufferLen = (size_t)readLen;
+
+    return true;
+}
+
+int FileHelperRK::FileStreamRead::available() {
+    return fileSize - fileOffset;
+}
+
+int FileHelperRK::FileStreamRead::read() {
+    int result = -1;
+
+    if (fileOffset < fileSize && fillBuffer()) {
+        result = (int)buffer[bufferPos++];
+        fileOffset++;
+    }
+    return result;
+}
+
+int FileHelperRK::FileStreamRead::peek() {
+    int result = -1;
+
+    if (fileOffset < fileSize && fillBuffer()) {
+        result = (int)buffer[bufferPos];
+    }
+    return result;
+}
+
+size_t FileHelperRK::FileStreamRead::readBytes(char *dst, size_t length) {
+    size_t count = 0;
+
+    if (length > fileSize - fileOffset) {
+        length = fileSize - fileOffset;
+    }
+
+    while(count < length) {
+        if (bufferPos < bufferLen) {
+            // Copy what we have already buffered
+            size_t copyLen = bufferLen - bufferPos;
+            if (copyLen > length - count) {
+                copyLen = length - count;
+            }
+            memcpy(&dst[count], &buffer[bufferPos], copyLen);
+            bufferPos += copyLen;
+            fileOffset += copyLen;
+            count += copyLen;
+        }
+        else
+        if (length - count >= bufferSize) {
+            // Large read, bypass the buffer
+            if (fd == -1) {
+                break;
+            }
+            discardBuffer();
+            int readLen = ::read(fd, &dst[count], length - count);
+            if (readLen <= 0) {
+                _fileHelperLog.info("FileStreamRead readBytes failed offset=%d errno=%d", (int)fileOffset, errno);
+                break;
+            }
+            fileOffset += readLen;
+            count += readLen;
+        }
+        else {
+            if (!fillBuffer()) {
+                break;
+            }
+        }
+    }
+
+    return count;
+}
+
+void FileHelperRK::FileStreamRead::flush() {
+}
+
+int FileHelperRK::FileStreamRead::rewind() {
+    return seek(0);
+}
+
+int FileHelperRK::FileStreamRead::seek(size_t offset) {
+    if (fd == -1) {
+#if defined(SYSTEM_VERSION_550) || defined(UNITTEST)
+        return SYSTEM_ERROR_FILESYSTEM_BADF;
+#else
+        return SYSTEM_ERROR_INVALID_STATE;
+#endif
+    }
+    if (offset > fileSize) {
+        return SYSTEM_ERROR_INVALID_ARGUMENT;
+    }
+
+    // The buffer holds the file data from bufferStart to bufferStart + bufferLen
+    size_t bufferStart = fileOffset - bufferPos;
+    if (offset >= bufferStart && offset <= bufferStart + bufferLen) {
+        bufferPos = offset - bufferStart;
+    }
+    else {
+        if (lseek(fd, offset, SEEK_SET) == -1) {
+            _fileHelperLog.info("FileStreamRead seek failed offset=%d errno=%d", (int)offset, errno);
+            return errnoToSystemError();
+        }
+        discardBuffer();
+    }
+    fileOffset = offset;
+
+    return SYSTEM_ERROR_NONE;
+}
+
+size_t FileHelperRK::FileStreamRead::write(uint8_t) {
+    return 0;
+}
+
+
+FileHelperRK::FileStreamWrite::FileStreamWrite() {
+}
+
+FileHelperRK::FileStreamWrite::~FileStreamWrite() {
+    flushBuffer();
+    if (bufferAllocated) {
+        delete[] buffer;
+    }
+}
+
+FileHelperRK::FileStreamWrite &FileHelperRK::FileStreamWrite::withBuffer(uint8_t *buf, size_t size) {
+    if (bufferAllocated) {
+        delete[] buffer;
+        bufferAllocated = false;
+    }
+    buffer = buf;
+    bufferSize = size;
+    bufferLen = 0;
+    return *this;
+}
+
+FileHelperRK::FileStreamWrite &FileHelperRK::FileStreamWrite::withBufferSize(size_t size) {
+    if (buffer && !bufferAllocated) {
+        // Caller-provided buffer takes precedence
+        return *this;
+    }
+    if (bufferAllocated) {
+        delete[] buffer;
+        buffer = nullptr;
+        bufferAllocated = false;
+    }
+    bufferSize = size;
+    bufferLen = 0;
+    return *this;
+}
+
+int FileHelperRK::FileStreamWrite::open(const char *path) {
+    return open(path, O_RDWR | O_CREAT | O_TRUNC, 0666);
+}
+
+int FileHelperRK::FileStreamWrite::open(const char *path, int mode, int perm) {
+    if (!buffer) {
+        if (bufferSize == 0) {
+            bufferSize = defaultBufferSize;
+        }
+        buffer = new uint8_t[bufferSize];
+        if (!buffer) {
+            return SYSTEM_ERROR_NO_MEMORY;
+        }
+        bufferAllocated = true;
+    }
+    bufferLen = 0;
+    writeResult = SYSTEM_ERROR_NONE;
+    clearWriteError();
+
+    int result = FileStreamBase::open(path, mode, perm);
+    if (result == SYSTEM_ERROR_NONE) {
+        // Reported by flushBuffer() or close(), so opening does not notify
+        this->path = path;
+        changed = notified = false;
+    }
+    return result;
+}
+
+int FileHelperRK::FileStreamWrite::close() {
+    flushBuffer();
+    FileStreamBase::close();
+
+    // A file created or truncated by open() with no data written has not been reported yet
+    if (path.length() && !notified) {
+        notifyChanged(path);
+    }
+    path = "";
+    changed = notified = false;
+
+    if (bufferAllocated) {
+        delete[] buffer;
+        buffer = nullptr;
+        bufferAllocated = false;
+    }
+    bufferLen = 0;
+
+    return writeResult;
+}
+
+void FileHelperRK::FileStreamWrite::flush() {
+    flushBuffer();
+}
+
+int FileHelperRK::FileStreamWrite::flushBuffer() {
+    int result = SYSTEM_ERROR_NONE;
+
+    if (bufferLen > 0) {
+        result = writeFile(buffer, bufferLen);
+        bufferLen = 0;
+    }
+    if (changed && path.length()) {
+        // Unbuffered writes made by write() are also reported here
+        notifyChanged(path);
+        changed = false;
+        notified = true;
+    }
+    return result;
+}
+
+int FileHelperRK::FileStreamWrite::sync() {
+    int result = flushBuffer();
+    if (result == SYSTEM_ERROR_NONE && fd != -1) {
+        if (fsync(fd) == -1) {
+            _fileHelperLog.info("FileStreamWrite fsync failed errno=%d", errno);
+            result = errnoToSystemError();
+        }
+    }
+    return result;
+}
+
+int FileHelperRK::FileStreamWrite::writeFile(const uint8_t *data, size_t size) {
+    int result = SYSTEM_ERROR_NONE;
+
+    if (fd == -1) {
+#if defined(SYSTEM_VERSION_550) || defined(UNITTEST)
+        result = SYSTEM_ERROR_FILESYSTEM_BADF;
+#else
+        result = SYSTEM_ERROR_INVALID_STATE;
+#endif
+    }
+    else {
+        int writeLen = ::write(fd, data, size);
+        if (writeLen > 0) {
+            changed = true;
+        }
+        if (writeLen != (int)size) {
+            if (writeLen < 0) {
+                _fileHelperLog.error("FileStreamWrite write failed errno=%d", errno);
+                result = errnoToSystemError();
+            }
+            else {
+                _fileHelperLog.error("FileStreamWrite bad length expected=%d got=%d", (int)size, (int)writeLen);
+                result = SYSTEM_ERROR_IO;
+            }
+        }
+    }
+
+    if (result != SYSTEM_ERROR_NONE) {
+        if (writeResult == SYSTEM_ERROR_NONE) {
+            writeResult = result;
+        }
+        setWriteError(result);
+    }
+    return result;
+}
+
+size_t FileHelperRK::FileStreamWrite::write(uint8_t c) {
+    return write(&c, 1);
+}
+
+size_t FileHelperRK::FileStreamWrite::write(const uint8_t *data, size_t size) {
+    if (!buffer || bufferSize == 0) {
+        // Opened using FileStreamBase::open(), no buffer
+        return (writeFile(data, size) == SYSTEM_ERROR_NONE) ? size : 0;
+    }
+
+    if (bufferLen + size > bufferSize) {
+        if (flushBuffer() != SYSTEM_ERROR_NONE) {
+            return 0;
+        }
+    }
+
+    if (size >= bufferSize) {
+        // Large write, bypass the buffer
+        return (writeFile(data, size) == SYSTEM_ERROR_NONE) ? size : 0;
+    }
+
+    memcpy(&buffer[bufferLen], data, size);
+    bufferLen += size;
+
+    return size;
+}
+
+
+FileHelperRK::LogWriter::LogWriter(const char *dirPath, const char *baseName) : dirPath(dirPath), baseName(baseName) {
+}
+
+FileHelperRK::LogWriter::~LogWriter() {
+    close();
+}
+
+int FileHelperRK::LogWriter::begin() {
+    close();
+
+    int result = mkdirs(dirPath);
+    if (result != SYSTEM_ERROR_NONE) {
+        return result;
+    }
+
+    segments.clear();
+    totalSize = 0;
+
+    DIR *dirp = opendir(dirPath);
+    if (!dirp) {
+        _fileHelperLog.info("LogWriter could not open dir %s errno=%d", dirPath.c_str(), errno);
+        return errnoToSystemError();
+    }
+    while(true) {
+        struct dirent *de = readdir(dirp);
+        if (!de) {
+            break;
+        }
+        uint32_t seq;
+        if (!parseSegmentName(de->d_name, seq)) {
+            continue;
+        }
+        struct stat sb;
+        if (stat(getSegmentPath(seq), &sb) == -1 || (sb.st_mode & S_IFREG) == 0) {
+            continue;
+        }
+        segments.push_back(Segment({seq, (size_t)sb.st_size}));
+        totalSize += sb.st_size;
+    }
+    closedir(dirp);
+
+    std::sort(segments.begin(), segments.end(), [](const Segment &a, const Segment &b) {
+        return a.seq < b.seq;
+    });
+
+    uint32_t seq = 1;
+    if (!segments.empty()) {
+        const Segment &last = segments.back();
+        seq = last.seq;
+        if (maxSegmentRecords || (maxSegmentSize && last.size >= maxSegmentSize)) {
+            seq++;
+        }
+    }
+
+    result = openSegment(seq);
+    if (result == SYSTEM_ERROR_NONE) {
+        enforceTotalSize();
+    }
+    return result;
+}
+
+int FileHelperRK::LogWriter::append(const void *data, size_t size) {
+    int result = SYSTEM_ERROR_NONE;
+
+    if (!isOpen) {
+        return SYSTEM_ERROR_INVALID_STATE;
+    }
+
+    const Segment &cur = segments.back();
+    if (cur.size > 0 && ((maxSegmentSize && cur.size + size > maxSegmentSize) || (maxSegmentRecords && segmentRecords >= maxSegmentRecords))) {
+        result = rotate();
+        if (result != SYSTEM_ERROR_NONE) {
+            return result;
+        }
+    }
+
+    if (stream.write((const uint8_t *)data, size) != size) {
+        result = stream.getWriteError();
+        return (result != SYSTEM_ERROR_NONE) ? result : SYSTEM_ERROR_IO;
+    }
+    segments.back().size += size;
+    totalSize += size;
+    segmentRecords++;
+
+    if (syncEachRecord) {
+        result = sync();
+    }
+
+    enforceTotalSize();
+
+    return result;
+}
+
+int FileHelperRK::LogWriter::rotate() {
+    if (!isOpen) {
+        return SYSTEM_ERROR_INVALID_STATE;
+    }
+
+    uint32_t seq = segments.back().seq + 1;
+
+    int closeResult = close();
+    int result = openSegment(seq);
+    if (result == SYSTEM_ERROR_NONE) {
+        enforceTotalSize();
+    }
+    return (closeResult != SYSTEM_ERROR_NONE) ? closeResult : result;
+}
+
+int FileHelperRK::LogWriter::flush() {
+    if (!isOpen) {
+        return SYSTEM_ERROR_INVALID_STATE;
+    }
+    return stream.flushBuffer();
+}
+
+int FileHelperRK::LogWriter::sync() {
+    if (!isOpen) {
+        return SYSTEM_ERROR_INVALID_STATE;
+    }
+    return stream.sync();
+}
+
+int FileHelperRK::LogWriter::close() {
+    if (!isOpen) {
+        return SYSTEM_ERROR_NONE;
+    }
+    int result = stream.close();
+    isOpen = false;
+    return result;
+}
+
+void FileHelperRK::LogWriter::getSegmentPaths(std::vector<String> &paths) const {
+    paths.clear();
+    for(auto it = segments.begin(); it != segments.end(); it++) {
+        paths.push_back(getSegmentPath(it->seq));
+    }
+}
+
+String FileHelperRK::LogWriter::getSegmentPath(uint32_t seq) const {
+    return pathJoin(dirPath, String::format("%s.%08lu", baseName.c_str(), (unsigned long)seq));
+}
+
+int FileHelperRK::LogWriter::openSegment(uint32_t seq) {
+    String path = getSegmentPath(seq);
+
+    int result = stream.open(path, O_WRONLY | O_CREAT | O_APPEND, 0666);
+    if (result != SYSTEM_ERROR_NONE) {
+        _fileHelperLog.info("LogWriter could not open segment %s", path.c_str());
+        return result;
+    }
+
+    if (segments.empty() || segments.back().seq != seq) {
+        segments.push_back(Segment({seq, 0}));
+    }
+    segmentRecords = 0;
+    isOpen = true;
+
+    return SYSTEM_ERROR_NONE;
+}
+
+void FileHelperRK::LogWriter::enforceTotalSize() {
+    while(maxTotalSize && totalSize > maxTotalSize && segments.size() > 1) {
+        String path = getSegmentPath(segments.front().seq);
+        if (unlink(path) == -1) {
+            _fileHelperLog.info("LogWriter could not delete segment %s errno=%d", path.c_str(), errno);
+        }
+        notifyChanged(path);
+
+        totalSize -= segments.front().size;
+        segments.erase(segments.begin());
+    }
+}
+
+bool FileHelperRK::LogWriter::parseSegmentName(const char *name, uint32_t &seq) const {
+    size_t baseLen = baseName.length();
+
+    if (strncmp(name, baseName.c_str(), baseLen) != 0 || name[baseLen] != '.') {
+        return false;
+    }
+    const char *digits = &name[baseLen + 1];
+    if (*digits == 0) {
+        return false;
+    }
+    for(const char *cp = digits; *cp; cp++) {
+        if (*cp < '0' || *cp > '9') {
+            return false;
+        }
+    }
+    seq = (uint32_t) strtoul(digits, nullptr, 10);
+    return true;
+}
+
+const char *FileHelperRK::RecordQueue::headFileName = "queue.head";
+
+static const char *_recordQueuePrefix = "queue.";
+
+#if defined(SYSTEM_VERSION_560) || defined(UNITTEST)
+/**
+ * @brief Print that only counts the bytes written. Used to get the CBOR size of a Variant before writing it.
+ */
+class _FileHelperCountingPrint : public Print {
+public:
+    virtual size_t write(uint8_t c) { count++; return 1; };
+    virtual size_t write(const uint8_t *buffer, size_t size) { count += size; return size; };
+
+    size_t count = 0;
+};
+
+/**
+ * @brief Print that calculates a CRC-32 of the bytes written and passes them to another Print
+ */
+class _FileHelperCrcPrint : public Print {
+public:
+    _FileHelperCrcPrint(Print &out, uint32_t crc) : out(out), crc(crc) {};
+
+    virtual size_t write(uint8_t c) { return write(&c, 1); };
+    virtual size_t write(const uint8_t *buffer, size_t size) {
+        crc = FileHelperRK::crc32(buffer, size, crc);
+        return out.write(buffer, size);
+    };
+
+    Print &out;
+    uint32_t crc;
+};
+#endif // SYSTEM_VERSION_560
+
+FileHelperRK::RecordQueue::RecordQueue(const char *dirPath) : dirPath(dirPath) {
+}
+
+FileHelperRK::RecordQueue::~RecordQueue() {
+    close();
+}
+
+int FileHelperRK::RecordQueue::begin() {
+    close();
+
+    int result = mkdirs(dirPath);
+    if (result != SYSTEM_ERROR_NONE) {
+        return result;
+    }
+    cleanupTempFiles(dirPath, false);
+
+    segments.clear();
+    count = 0;
+
+    size_t prefixLen = strlen(_recordQueuePrefix);
+    DIR *dirp = opendir(dirPath);
+    if (!dirp) {
+        _fileHelperLog.info("RecordQueue could not open dir %s errno=%d", dirPath.c_str(), errno);
+        return errnoToSystemError();
+    }
+    while(true) {
+        struct dirent *de = readdir(dirp);
+        if (!de) {
+            break;
+        }
+        if (strncmp(de->d_name, _recordQueuePrefix, prefixLen) != 0 || de->d_name[prefixLen] == 0) {
+            continue;
+        }
+        bool isSegment = true;
+        for(const char *cp = &de->d_name[prefixLen]; *cp; cp++) {
+            if (*cp < '0' || *cp > '9') {
+                isSegment = false;
+                break;
+            }
+        }
+        if (isSegment) {
+            segments.push_back(Segment({(uint32_t)strtoul(&de->d_name[prefixLen], nullptr, 10), 0}));
+        }
+    }
+    closedir(dirp);
+
+    std::sort(segments.begin(), segments.end(), [](const Segment &a, const Segment &b) {
+        return a.seq < b.seq;
+    });
+
+    // A missing or invalid head pointer starts at the beginning of the oldest segment
+    String headPath = pathJoin(dirPath, headFileName);
+    if (readStructVersioned(headPath, head, headVersion) != SYSTEM_ERROR_NONE) {
+        head.seq = segments.empty() ? 1 : segments.front().seq;
+        head.offset = 0;
+    }
+
+    // Segments before the head segment were completely popped, but not deleted before reset
+    while(!segments.empty() && segments.front().seq < head.seq) {
+        String path = getSegmentPath(segments.front().seq);
+        unlink(path);
+        notifyChanged(path);
+        segments.erase(segments.begin());
+    }
+    if (!segments.empty() && segments.front().seq != head.seq) {
+        head.seq = segments.front().seq;
+        head.offset = 0;
+    }
+
+    bool torn = false;
+    for(size_t ii = 0; ii < segments.size(); ii++) {
+        bool isLast = (ii == segments.size() - 1);
+        size_t start = (ii == 0) ? head.offset : 0;
+        size_t end, fileSize;
+
+        // Only the last segment can contain a partially written record, so only it needs the CRC checked
+        count += scanSegment(segments[ii].seq, start, isLast, end, fileSize);
+        segments[ii].end = end;
+        if (ii == 0 && head.offset > end) {
+            head.offset = end;
+        }
+        if (isLast && end < fileSize) {
+            _fileHelperLog.info("RecordQueue ignoring partial record in segment %lu at %u", (unsigned long)segments[ii].seq, (unsigned)end);
+            torn = true;
+        }
+    }
+
+    if (!segments.empty() && !torn) {
+        // Append to the last segment
+        result = writer.open(getSegmentPath(segments.back().seq), O_WRONLY | O_CREAT | O_APPEND, 0666);
+        if (result != SYSTEM_ERROR_NONE) {
+            return result;
+        }
+        writerOpen = true;
+    }
+    // Otherwise the first push starts a new segment
+
+    isOpen = true;
+    removeConsumedSegments();
+
+    return SYSTEM_ERROR_NONE;
+}
+
+int FileHelperRK::RecordQueue::push(const void *data, size_t size) {
+    if (!isOpen) {
+        return SYSTEM_ERROR_INVALID_STATE;
+    }
+    if (!writerOpen || (segments.back().end > 0 && segments.back().end + size + 8 > maxSegmentSize)) {
+        int result = openNewSegment();
+        if (result != SYSTEM_ERROR_NONE) {
+            return result;
+        }
+    }
+
+    uint32_t len = (uint32_t) size;
+    uint32_t crc = crc32(data, size, crc32(&len, sizeof(len)));
+
+    writer.write((const uint8_t *)&len, sizeof(len));
+    writer.write((const uint8_t *)data, size);
+
+    return finishPush(size, crc);
+}
+
+#if defined(SYSTEM_VERSION_560) || defined(UNITTEST)
+int FileHelperRK::RecordQueue::pushVariant(const particle::Variant &variant) {
+    if (!isOpen) {
+        return SYSTEM_ERROR_INVALID_STATE;
+    }
+
+    _FileHelperCountingPrint countingPrint;
+    int result = particle::encodeToCBOR(variant, countingPrint);
+    if (result != SYSTEM_ERROR_NONE) {
+        return result;
+    }
+    size_t size = countingPrint.count;
+
+    if (!writerOpen || (segments.back().end > 0 && segments.back().end + size + 8 > maxSegmentSize)) {
+        result = openNewSegment();
+        if (result != SYSTEM_ERROR_NONE) {
+            return result;
+        }
+    }
+
+    uint32_t len = (uint32_t) size;
+    writer.write((const uint8_t *)&len, sizeof(len));
+
+    _FileHelperCrcPrint crcPrint(writer, crc32(&len, sizeof(len)));
+    result = particle::encodeToCBOR(variant, crcPrint);
+    if (result != SYSTEM_ERROR_NONE) {
+        // Partial record; start a new segment on the next push
+        writer.close();
+        writerOpen = false;
+        return result;
+    }
+
+    return finishPush(size, crcPrint.crc);
+}
+
+int FileHelperRK::RecordQueue::peekVariant(particle::Variant &variant) {
+    size_t size;
+
+    int result = seekHead(size);
+    if (result == SYSTEM_ERROR_NONE) {
+        result = readHeadData(size, nullptr);
+    }
+    if (result == SYSTEM_ERROR_NONE) {
+        result = reader.seek(head.offset + sizeof(uint32_t));
+    }
+    if (result == SYSTEM_ERROR_NONE) {
+        result = particle::decodeFromCBOR(variant, reader);
+    }
+    return result;
+}
+#endif // SYSTEM_VERSION_560
+
+int FileHelperRK::RecordQueue::finishPush(size_t size, uint32_t crc) {
+    writer.write((const uint8_t *)&crc, sizeof(crc));
+
+    int result = syncEachPush ? writer.sync() : writer.flushBuffer();
+    if (result == SYSTEM_ERROR_NONE && writer.getWriteError()) {
+        result = writer.getWriteError();
+    }
+    if (result != SYSTEM_ERROR_NONE) {
+        // The segment may contain a partial record, so don't append to it again
+        _fileHelperLog.info("RecordQueue push failed %d", result);
+        writer.close();
+        writerOpen = false;
+        return result;
+    }
+
+    segments.back().end += size + 8;
+    count++;
+    writerDirty = !syncEachPush;
+
+    return SYSTEM_ERROR_NONE;
+}
+
+int FileHelperRK::RecordQueue::peek(uint8_t *buf, size_t &size) {
+    size_t recordSize;
+
+    int result = seekHead(recordSize);
+    if (result != SYSTEM_ERROR_NONE) {
+        return result;
+    }
+    if (recordSize > size) {
+        size = recordSize;
+        return SYSTEM_ERROR_TOO_LARGE;
+    }
+    size = recordSize;
+
+    return readHeadData(recordSize, buf);
+}
+
+int FileHelperRK::RecordQueue::peek(OwnedBuffer &buffer, Allocator &allocator) {
+    size_t size;
+
+    buffer.free();
+
+    int result = seekHead(size);
+    if (result != SYSTEM_ERROR_NONE) {
+        return result;
+    }
+
+    uint8_t *ptr = allocator.allocate(size ? size : 1);
+    if (!ptr) {
+        return SYSTEM_ERROR_NO_MEMORY;
+    }
+    result = readHeadData(size, ptr);
+    if (result == SYSTEM_ERROR_NONE) {
+        buffer.set(ptr, size, &allocator);
+    }
+    else {
+        allocator.release(ptr);
+    }
+    return result;
+}
+
+int FileHelperRK::RecordQueue::pop() {
+    size_t size;
+
+    int result = seekHead(size);
+    if (result != SYSTEM_ERROR_NONE) {
+        return result;
+    }
+
+    head.offset += size + 8;
+    count--;
+    pendingPops++;
+
+    removeConsumedSegments();
+
+    if (pendingPops >= headSaveInterval) {
+        result = saveHead();
+    }
+    return result;
+}
+
+int FileHelperRK::RecordQueue::sync() {
+    int result = SYSTEM_ERROR_NONE;
+
+    if (!isOpen) {
+        return SYSTEM_ERROR_INVALID_STATE;
+    }
+    if (writerOpen && writerDirty) {
+        result = writer.sync();
+        writerDirty = false;
+    }
+    if (pendingPops) {
+        int saveResult = saveHead();
+        if (result == SYSTEM_ERROR_NONE) {
+            result = saveResult;
+        }
+    }
+    return result;
+}
+
+int FileHelperRK::RecordQueue::close() {
+    int result = SYSTEM_ERROR_NONE;
+
+    if (!isOpen) {
+        return SYSTEM_ERROR_NONE;
+    }
+
+    result = saveHead();
+
+    if (writerOpen) {
+        int closeResult = writer.close();
+        if (result == SYSTEM_ERROR_NONE) {
+            result = closeResult;
+        }
+        writerOpen = writerDirty = false;
+    }
+    if (readerOpen) {
+        reader.close();
+        readerOpen = false;
+    }
+    isOpen = false;
+
+    return result;
+}
+
+int FileHelperRK::RecordQueue::saveHead() {
+    pendingPops = 0;
+    return storeStructVersioned(pathJoin(dirPath, headFileName), head, headVersion, STORE_ATOMIC);
+}
+
+String FileHelperRK::RecordQueue::getSegmentPath(uint32_t seq) const {
+    return pathJoin(dirPath, String::format("%s%08lu", _recordQueuePrefix, (unsigned long)seq));
+}
+
+size_t FileHelperRK::RecordQueue::scanSegment(uint32_t seq, size_t offset, bool checkCrc, size_t &end, size_t &fileSize) {
+    size_t numRecords = 0;
+
+    end = fileSize = 0;
+
+    FileStreamRead stream;
+    if (stream.open(getSegmentPath(seq)) != SYSTEM_ERROR_NONE) {
+        return 0;
+    }
+    fileSize = (size_t) stream.available();
+    end = (offset < fileSize) ? offset : fileSize;
+
+    while(end + 8 <= fileSize) {
+        uint32_t len;
+        if (stream.seek(end) != SYSTEM_ERROR_NONE || stream.readBytes((uint8_t *)&len, sizeof(len)) != sizeof(len)) {
+            break;
+        }
+        if (len > fileSize - end - 8) {
+            break;
+        }
+        if (checkCrc) {
+            uint32_t crc = crc32(&len, sizeof(len));
+            uint8_t buf[64];
+            size_t remaining = len;
+            while(remaining > 0) {
+                size_t chunk = (remaining < sizeof(buf)) ? remaining : sizeof(buf);
+                if (stream.readBytes(buf, chunk) != chunk) {
+                    break;
+                }
+                crc = crc32(buf, chunk, crc);
+                remaining -= chunk;
+            }
+            uint32_t fileCrc;
+            if (remaining != 0 || stream.readBytes((uint8_t *)&fileCrc, sizeof(fileCrc)) != sizeof(fileCrc) || fileCrc != crc) {
+                break;
+            }
+        }
+        end += len + 8;
+        numRecords++;
+    }
+    stream.close();
+
+    return numRecords;
+}
+
+int FileHelperRK::RecordQueue::openNewSegment() {
+    if (writerOpen) {
+        writer.close();
+        writerOpen = writerDirty = false;
+    }
+
+    uint32_t seq = segments.empty() ? (head.seq ? head.seq : 1) : (segments.back().seq + 1);
+
+    int result = writer.open(getSegmentPath(seq), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0666);
+    if (result != SYSTEM_ERROR_NONE) {
+        return result;
+    }
+    writerOpen = true;
+
+    if (segments.empty()) {
+        head.seq = seq;
+        head.offset = 0;
+    }
+    segments.push_back(Segment({seq, 0}));
+
+    // The previous last segment may have been completely popped already
+    removeConsumedSegments();
+
+    return SYSTEM_ERROR_NONE;
+}
+
+int FileHelperRK::RecordQueue::seekHead(size_t &size) {
+    if (!isOpen) {
+        return SYSTEM_ERROR_INVALID_STATE;
+    }
+    if (count == 0) {
+        return SYSTEM_ERROR_NOT_FOUND;
+    }
+
+    const Segment &headSegment = segments.front();
+
+    if (readerOpen && (readerSeq != head.seq || readerEnd < headSegment.end)) {
+        reader.close();
+        readerOpen = false;
+    }
+    if (!readerOpen) {
+        if (writerOpen && writerDirty && headSegment.seq == segments.back().seq) {
+            // Make sure records pushed to the segment are visible to the reader
+            writer.sync();
+            writerDirty = false;
+        }
+        int result = reader.open(getSegmentPath(head.seq));
+        if (result != SYSTEM_ERROR_NONE) {
+            return result;
+        }
+        readerOpen = true;
+        readerSeq = head.seq;
+        readerEnd = (size_t) reader.available();
+    }
+
+    uint32_t len;
+    int result = reader.seek(head.offset);
+    if (result != SYSTEM_ERROR_NONE) {
+        return result;
+    }
+    if (reader.readBytes((uint8_t *)&len, sizeof(len)) != sizeof(len) || head.offset + len + 8 > headSegment.end) {
+        return SYSTEM_ERROR_BAD_DATA;
+    }
+    size = len;
+
+    return SYSTEM_ERROR_NONE;
+}
+
+int FileHelperRK::RecordQueue::readHeadData(size_t size, uint8_t *buf) {
+    uint32_t len = (uint32_t) size;
+    uint32_t crc = crc32(&len, sizeof(len));
+
+    if (buf) {
+        if (reader.readBytes(buf, size) != size) {
+            return SYSTEM_ERROR_IO;
+        }
+        crc = crc32(buf, size, crc);
+    }
+    else {
+        uint8_t tempBuf[64];
+        size_t remaining = size;
+        while(remaining > 0) {
+            size_t chunk = (remaining < sizeof(tempBuf)) ? remaining : sizeof(tempBuf);
+            if (reader.readBytes(tempBuf, chunk) != chunk) {
+                return SYSTEM_ERROR_IO;
+            }
+            crc = crc32(tempBuf, chunk, crc);
+            remaining -= chunk;
+        }
+    }
+
+    uint32_t fileCrc;
+    if (reader.readBytes((uint8_t *)&fileCrc, sizeof(fileCrc)) != sizeof(fileCrc) || fileCrc != crc) {
+        return SYSTEM_ERROR_BAD_DATA;
+    }
+    return SYSTEM_ERROR_NONE;
+}
+
+void FileHelperRK::RecordQueue::removeConsumedSegments() {
+    while(segments.size() > 1 && head.offset >= segments.front().end) {
+        uint32_t oldSeq = segments.front().seq;
+        segments.erase(segments.begin());
+
+        if (readerOpen && readerSeq == oldSeq) {
+            reader.close();
+            readerOpen = false;
+        }
+
+        // Save the new head before deleting the segment so a reset in between is recovered by begin()
+        head.seq = segments.front().seq;
+        head.offset = 0;
+        saveHead();
+
+        String path = getSegmentPath(oldSeq);
+        if (unlink(path) == -1) {
+            _fileHelperLog.info("RecordQueue could not delete segment %s errno=%d", path.c_str(), errno);
+        }
+        notifyChanged(path);
+    }
+}
+
+FileHelperRK::KeyValueStore::KeyValueStore(const char *fileName) : fileName(fileName) {
+    keyBuf[0] = 0;
+}
+
+FileHelperRK::KeyValueStore::~KeyValueStore() {
+    close();
+}
+
+int FileHelperRK::KeyValueStore::begin() {
+    int result;
+
+    close();
+
+    // Left over from a compaction that did not finish; the original file is still valid
+    unlink(getTempFileName(fileName));
+
+    index.clear();
+    fileSize = garbageBytes = 0;
+
+    struct stat sb;
+    if (stat(fileName, &sb) == -1 || sb.st_size == 0) {
+        FileHeader fileHeader = {fileMagic, fileVersion, sizeof(FileHeader)};
+        result = storeBytes(fileName, (const uint8_t *)&fileHeader, sizeof(fileHeader), STORE_ATOMIC | STORE_SYNC);
+        if (result != SYSTEM_ERROR_NONE) {
+            return result;
+        }
+    }
+
+    result = openFiles();
+    if (result != SYSTEM_ERROR_NONE) {
+        return result;
+    }
+
+    FileHeader fileHeader;
+    if (reader.readBytes((uint8_t *)&fileHeader, sizeof(fileHeader)) != sizeof(fileHeader) || 
+        fileHeader.magic != fileMagic || fileHeader.version != fileVersion || fileHeader.headerSize < sizeof(FileHeader)) {
+        _fileHelperLog.info("KeyValueStore invalid file %s", fileName.c_str());
+        closeFiles();
+        return SYSTEM_ERROR_BAD_DATA;
+    }
+
+    // Build the index. Records are applied in order, so the last record for a key wins.
+    size_t actualSize = readerEnd;
+    size_t offset = fileHeader.headerSize;
+    while(offset + sizeof(RecordHeader) + sizeof(uint32_t) <= actualSize) {
+        RecordHeader header;
+        if (reader.seek(offset) != SYSTEM_ERROR_NONE || reader.readBytes((uint8_t *)&header, sizeof(header)) != sizeof(header)) {
+            break;
+        }
+        size_t recordSize = sizeof(RecordHeader) + header.keyLen + header.valueLen + sizeof(uint32_t);
+        if (header.type < RECORD_BYTES || header.type > RECORD_TOMBSTONE || header.keyLen == 0 || header.reserved != 0 ||
+            header.valueLen > actualSize || offset + recordSize > actualSize) {
+            break;
+        }
+        if (reader.readBytes(keyBuf, header.keyLen) != header.keyLen) {
+            break;
+        }
+        keyBuf[header.keyLen] = 0;
+        if (strlen(keyBuf) != header.keyLen || readRecordValue(header, nullptr) != SYSTEM_ERROR_NONE) {
+            break;
+        }
+
+        // findKey() overwrites keyBuf
+        String key(keyBuf);
+        RecordHeader oldHeader;
+        int entryIndex = findKey(key, hashKey(key), oldHeader);
+
+        IndexEntry entry = {hashKey(key), (uint32_t)offset, (uint32_t)recordSize};
+        if (entryIndex >= 0) {
+            garbageBytes += index[entryIndex].recordSize;
+            if (header.type == RECORD_TOMBSTONE) {
+                index.erase(index.begin() + entryIndex);
+            }
+            else {
+                index[entryIndex] = entry;
+            }
+        }
+        else
+        if (header.type != RECORD_TOMBSTONE) {
+            auto it = std::upper_bound(index.begin(), index.end(), entry.hash, [](uint32_t hash, const IndexEntry &e) {
+                return hash < e.hash;
+            });
+            index.insert(it, entry);
+        }
+        if (header.type == RECORD_TOMBSTONE) {
+            garbageBytes += recordSize;
+        }
+
+        offset += recordSize;
+    }
+    fileSize = offset;
+    isOpen = true;
+
+    if (fileSize < actualSize) {
+        // Partially written record at the end; rewrite the file without it so appends are reachable
+        _fileHelperLog.info("KeyValueStore ignoring partial record at %u in %s", (unsigned)fileSize, fileName.c_str());
+        result = compact();
+        if (result != SYSTEM_ERROR_NONE) {
+            close();
+            return result;
+        }
+    }
+
+    return SYSTEM_ERROR_NONE;
+}
+
+int FileHelperRK::KeyValueStore::put(const char *key, const void *data, size_t size) {
+    RecordHeader header;
+    uint32_t crc;
+
+    if (!isOpen) {
+        return SYSTEM_ERROR_INVALID_STATE;
+    }
+    int entryIndex = findKey(key, hashKey(key), header);
+
+    int result = beginRecord(RECORD_BYTES, key, size, crc);
+    if (result != SYSTEM_ERROR_NONE) {
+        return result;
+    }
+    writer.write((const uint8_t *)data, size);
+    crc = crc32(data, size, crc);
+
+    return finishRecord(RECORD_BYTES, key, entryIndex, size, crc);
+}
+
+int FileHelperRK::KeyValueStore::get(const char *key, uint8_t *buf, size_t &size) {
+    RecordHeader header;
+
+    if (!isOpen) {
+        return SYSTEM_ERROR_INVALID_STATE;
+    }
+    if (findKey(key, hashKey(key), header) < 0) {
+        return SYSTEM_ERROR_NOT_FOUND;
+    }
+    if (header.valueLen > size) {
+        size = header.valueLen;
+        return SYSTEM_ERROR_TOO_LARGE;
+    }
+    size = header.valueLen;
+
+    return readRecordValue(header, buf);
+}
+
+int FileHelperRK::KeyValueStore::get(const char *key, OwnedBuffer &buffer, Allocator &allocator) {
+    RecordHeader header;
+
+    buffer.free();
+
+    if (!isOpen) {
+        return SYSTEM_ERROR_INVALID_STATE;
+    }
+    if (findKey(key, hashKey(key), header) < 0) {
+        return SYSTEM_ERROR_NOT_FOUND;
+    }
+
+    uint8_t *ptr = allocator.allocate(header.valueLen + 1);
+    if (!ptr) {
+        return SYSTEM_ERROR_NO_MEMORY;
+    }
+    int result = readRecordValue(header, ptr);
+    if (result == SYSTEM_ERROR_NONE) {
+        ptr[header.valueLen] = 0;
+        buffer.set(ptr, header.valueLen, &allocator);
+    }
+    else {
+        allocator.release(ptr);
+    }
+    return result;
+}
+
+int FileHelperRK::KeyValueStore::getString(const char *key, String &value) {
+    OwnedBuffer buffer;
+
+    value = "";
+
+    int result = get(key, buffer);
+    if (result == SYSTEM_ERROR_NONE) {
+        value = buffer.c_str();
+    }
+    return result;
+}
+
+int FileHelperRK::KeyValueStore::remove(const char *key) {
+    RecordHeader header;
+    uint32_t crc;
+
+    if (!isOpen) {
+        return SYSTEM_ERROR_INVALID_STATE;
+    }
+    int entryIndex = findKey(key, hashKey(key), header);
+    if (entryIndex < 0) {
+        return SYSTEM_ERROR_NOT_FOUND;
+    }
+
+    int result = beginRecord(RECORD_TOMBSTONE, key, 0, crc);
+    if (result != SYSTEM_ERROR_NONE) {
+        return result;
+    }
+    return finishRecord(RECORD_TOMBSTONE, key, entryIndex, 0, crc);
+}
+
+bool FileHelperRK::KeyValueStore::has(const char *key) {
+    RecordHeader header;
+
+    return isOpen && findKey(key, hashKey(key), header) >= 0;
+}
+
+#if defined(SYSTEM_VERSION_560) || defined(UNITTEST)
+int FileHelperRK::KeyValueStore::putVariant(const char *key, const particle::Variant &variant) {
+    RecordHeader header;
+    uint32_t crc;
+
+    if (!isOpen) {
+        return SYSTEM_ERROR_INVALID_STATE;
+    }
+
+    _FileHelperCountingPrint countingPrint;
+    int result = particle::encodeToCBOR(variant, countingPrint);
+    if (result != SYSTEM_ERROR_NONE) {
+        return result;
+    }
+
+    int entryIndex = findKey(key, hashKey(key), header);
+
+    result = beginRecord(RECORD_CBOR, key, countingPrint.count, crc);
+    if (result != SYSTEM_ERROR_NONE) {
+        return result;
+    }
+    _FileHelperCrcPrint crcPrint(writer, crc);
+    result = particle::encodeToCBOR(variant, crcPrint);
+    if (result != SYSTEM_ERROR_NONE) {
+        // Partial record, same recovery as a failed write in finishRecord()
+        _fileHelperLog.info("KeyValueStore encode failed %d, call begin() to recover", result);
+        closeFiles();
+        isOpen = false;
+        return result;
+    }
+
+    return finishRecord(RECORD_CBOR, key, entryIndex, countingPrint.count, crcPrint.crc);
+}
+
+int FileHelperRK::KeyValueStore::getVariant(const char *key, particle::Variant &variant) {
+    RecordHeader header;
+
+    if (!isOpen) {
+        return SYSTEM_ERROR_INVALID_STATE;
+    }
+    int entryIndex = findKey(key, hashKey(key), header);
+    if (entryIndex < 0) {
+        return SYSTEM_ERROR_NOT_FOUND;
+    }
+    if (header.type != RECORD_CBOR) {
+        return SYSTEM_ERROR_BAD_DATA;
+    }
+    int result = readRecordValue(header, nullptr);
+    if (result == SYSTEM_ERROR_NONE) {
+        result = reader.seek(index[entryIndex].offset + sizeof(RecordHeader) + header.keyLen);
+    }
+    if (result == SYSTEM_ERROR_NONE) {
+        result = particle::decodeFromCBOR(variant, reader);
+    }
+    return result;
+}
+#endif // SYSTEM_VERSION_560
+
+int FileHelperRK::KeyValueStore::getKeys(std::vector<String> &keys) {
+    keys.clear();
+
+    if (!isOpen) {
+        return SYSTEM_ERROR_INVALID_STATE;
+    }
+    for(auto it = index.begin(); it != index.end(); it++) {
+        RecordHeader header;
+        int result = readRecordHeader(*it, nullptr, header);
+        if (result != SYSTEM_ERROR_NONE) {
+            return result;
+        }
+        keys.push_back(keyBuf);
+    }
+    return SYSTEM_ERROR_NONE;
+}
+
+int FileHelperRK::KeyValueStore::compact() {
+    if (!isOpen) {
+        return SYSTEM_ERROR_INVALID_STATE;
+    }
+
+    int result = openReader(fileSize);
+    if (result != SYSTEM_ERROR_NONE) {
+        return result;
+    }
+
+    // Copy records in file order so the old file is read sequentially
+    std::vector<size_t> order(index.size());
+    for(size_t ii = 0; ii < order.size(); ii++) {
+        order[ii] = ii;
+    }
+    std::sort(order.begin(), order.end(), [this](size_t a, size_t b) {
+        return index[a].offset < index[b].offset;
+    });
+
+    String tempName = getTempFileName(fileName);
+    std::vector<uint32_t> newOffsets(index.size());
+
+    FileStreamWrite out;
+    result = out.open(tempName);
+    if (result != SYSTEM_ERROR_NONE) {
+        return result;
+    }
+
+    FileHeader fileHeader = {fileMagic, fileVersion, sizeof(FileHeader)};
+    out.write((const uint8_t *)&fileHeader, sizeof(fileHeader));
+    size_t newOffset = sizeof(FileHeader);
+
+    for(auto it = order.begin(); it != order.end() && result == SYSTEM_ERROR_NONE; it++) {
+        const IndexEntry &entry = index[*it];
+
+        result = reader.seek(entry.offset);
+        size_t remaining = entry.recordSize;
+        while(result == SYSTEM_ERROR_NONE && remaining > 0) {
+            uint8_t buf[128];
+            size_t chunk = (remaining < sizeof(buf)) ? remaining : sizeof(buf);
+            if (reader.readBytes(buf, chunk) != chunk) {
+                result = SYSTEM_ERROR_IO;
+                break;
+            }
+            out.write(buf, chunk);
+            remaining -= chunk;
+        }
+        newOffsets[*it] = (uint32_t) newOffset;
+        newOffset += entry.recordSize;
+    }
+
+    if (result == SYSTEM_ERROR_NONE) {
+        result = out.sync();
+    }
+    int closeResult = out.close();
+    if (result == SYSTEM_ERROR_NONE) {
+        result = closeResult;
+    }
+
+    closeFiles();
+    result = finishTempFile(tempName, fileName, result);
+    notifyChanged(fileName);
+
+    if (result == SYSTEM_ERROR_NONE) {
+        for(size_t ii = 0; ii < index.size(); ii++) {
+            index[ii].offset = newOffsets[ii];
+        }
+        fileSize = newOffset;
+        garbageBytes = 0;
+    }
+    else {
+        _fileHelperLog.info("KeyValueStore compact failed %d", result);
+    }
+
+    int openResult = openFiles();
+    if (openResult != SYSTEM_ERROR_NONE) {
+        isOpen = false;
+        if (result == SYSTEM_ERROR_NONE) {
+            result = openResult;
+        }
+    }
+    return result;
+}
+
+int FileHelperRK::KeyValueStore::compactIfNeeded() {
+    if (isOpen && needsCompaction()) {
+        return compact();
+    }
+    return SYSTEM_ERROR_NONE;
+}
+
+int FileHelperRK::KeyValueStore::sync() {
+    int result = SYSTEM_ERROR_NONE;
+
+    if (!isOpen) {
+        return SYSTEM_ERROR_INVALID_STATE;
+    }
+    if (writerDirty) {
+        result = writer.sync();
+        writerDirty = false;
+    }
+    return result;
+}
+
+int FileHelperRK::KeyValueStore::close() {
+    int result = SYSTEM_ERROR_NONE;
+
+    if (isOpen) {
+        result = sync();
+        closeFiles();
+        isOpen = false;
+    }
+    return result;
+}
+
+int FileHelperRK::KeyValueStore::findKey(const char *key, uint32_t hash, RecordHeader &header) {
+    auto it = std::lower_bound(index.begin(), index.end(), hash, [](const IndexEntry &e, uint32_t hash) {
+        return e.hash < hash;
+    });
+
+    // Different keys can have the same hash, so check the key in the file
+    for(; it != index.end() && it->hash == hash; it++) {
+        if (readRecordHeader(*it, key, header) == SYSTEM_ERROR_NONE) {
+            return (int)(it - index.begin());
+        }
+    }
+    return -1;
+}
+
+int FileHelperRK::KeyValueStore::readRecordHeader(const IndexEntry &entry, const char *key, RecordHeader &header) {
+    int result = openReader(entry.offset + entry.recordSize);
+    if (result == SYSTEM_ERROR_NONE) {
+        result = reader.seek(entry.offset);
+    }
+    if (result != SYSTEM_ERROR_NONE) {
+        return result;
+    }
+
+    if (reader.readBytes((uint8_t *)&header, sizeof(header)) != sizeof(header) ||
+        reader.readBytes(keyBuf, header.keyLen) != header.keyLen) {
+        return SYSTEM_ERROR_IO;
+    }
+    keyBuf[header.keyLen] = 0;
+
+    if (key && strcmp(key, keyBuf) != 0) {
+        return SYSTEM_ERROR_NOT_FOUND;
+    }
+    return SYSTEM_ERROR_NONE;
+}
+
+int FileHelperRK::KeyValueStore::readRecordValue(const RecordHeader &header, uint8_t *buf) {
+    uint32_t crc = crc32(&header, sizeof(header));
+    crc = crc32(keyBuf, header.keyLen, crc);
+
+    if (buf) {
+        if (reader.readBytes(buf, header.valueLen) != header.valueLen) {
+            return SYSTEM_ERROR_IO;
+        }
+        crc = crc32(buf, header.valueLen, crc);
+    }
+    else {
+        uint8_t tempBuf[64];
+        size_t remaining = header.valueLen;
+        while(remaining > 0) {
+            size_t chunk = (remaining < sizeof(tempBuf)) ? remaining : sizeof(tempBuf);
+            if (reader.readBytes(tempBuf, chunk) != chunk) {
+                return SYSTEM_ERROR_IO;
+            }
+            crc = crc32(tempBuf, chunk, crc);
+            remaining -= chunk;
+        }
+    }
+
+    uint32_t fileCrc;
+    if (reader.readBytes((uint8_t *)&fileCrc, sizeof(fileCrc)) != sizeof(fileCrc) || fileCrc != crc) {
+        return SYSTEM_ERROR_BAD_DATA;
+    }
+    return SYSTEM_ERROR_NONE;
+}
+
+int FileHelperRK::KeyValueStore::openReader(size_t end) {
+    if (readerOpen && end <= readerEnd) {
+        return SYSTEM_ERROR_NONE;
+    }
+    if (writerDirty) {
+        // Make sure records that were written are visible to the reader
+        writer.sync();
+        writerDirty = false;
+    }
+    if (readerOpen) {
+        reader.close();
+        readerOpen = false;
+    }
+    int result = reader.open(fileName);
+    if (result != SYSTEM_ERROR_NONE) {
+        return result;
+    }
+    readerOpen = true;
+    readerEnd = (size_t) reader.available();
+
+    return SYSTEM_ERROR_NONE;
+}
+
+int FileHelperRK::KeyValueStore::beginRecord(RecordType type, const char *key, size_t valueLen, uint32_t &crc) {
+    size_t keyLen = strlen(key);
+    if (keyLen == 0 || keyLen > maxKeyLen) {
+        return SYSTEM_ERROR_INVALID_ARGUMENT;
+    }
+
+    RecordHeader header = {(uint8_t)type, (uint8_t)keyLen, 0, (uint32_t)valueLen};
+    crc = crc32(&header, sizeof(header));
+    crc = crc32(key, keyLen, crc);
+
+    writer.write((const uint8_t *)&header, sizeof(header));
+    writer.write((const uint8_t *)key, keyLen);
+
+    return SYSTEM_ERROR_NONE;
+}
+
+int FileHelperRK::KeyValueStore::finishRecord(RecordType type, const char *key, int entryIndex, size_t valueLen, uint32_t crc) {
+    writer.write((const uint8_t *)&crc, sizeof(crc));
+
+    int result = syncEachWrite ? writer.sync() : writer.flushBuffer();
+    if (result == SYSTEM_ERROR_NONE && writer.getWriteError()) {
+        result = writer.getWriteError();
+    }
+    if (result != SYSTEM_ERROR_NONE) {
+        // The file may end with a partial record, so records appended after it would be lost.
+        // Stop writing; begin() will remove the partial record.
+        _fileHelperLog.info("KeyValueStore write failed %d, call begin() to recover", result);
+        closeFiles();
+        isOpen = false;
+        return result;
+    }
+    writerDirty = !syncEachWrite;
+
+    size_t recordSize = sizeof(RecordHeader) + strlen(key) + valueLen + sizeof(uint32_t);
+    IndexEntry entry = {hashKey(key), (uint32_t)fileSize, (uint32_t)recordSize};
+    fileSize += recordSize;
+
+    if (entryIndex >= 0) {
+        garbageBytes += index[entryIndex].recordSize;
+        if (type == RECORD_TOMBSTONE) {
+            index.erase(index.begin() + entryIndex);
+        }
+        else {
+            index[entryIndex] = entry;
+        }
+    }
+    else
+    if (type != RECORD_TOMBSTONE) {
+        auto it = std::upper_bound(index.begin(), index.end(), entry.hash, [](uint32_t hash, const IndexEntry &e) {
+            return hash < e.hash;
+        });
+        index.insert(it, entry);
+    }
+    if (type == RECORD_TOMBSTONE) {
+        garbageBytes += recordSize;
+    }
+
+    if (autoCompact && needsCompaction()) {
+        result = compact();
+    }
+    return result;
+}
+
+int FileHelperRK::KeyValueStore::openFiles() {
+    int result = writer.open(fileName, O_WRONLY | O_APPEND, 0666);
+    if (result != SYSTEM_ERROR_NONE) {
+        return result;
+    }
+    writerDirty = false;
+
+    return openReader(0);
+}
+
+void FileHelperRK::KeyValueStore::closeFiles() {
+    writer.close();
+    writerDirty = false;
+    if (readerOpen) {
+        reader.close();
+        readerOpen = false;
+    }
+}
+
+bool FileHelperRK::KeyValueStore::needsCompaction() const {
+    return garbageBytes >= minGarbageBytes && garbageBytes * 100 >= fileSize * (size_t)garbagePercent;
+}
+
+
+FileHelperRK::RecordFileBase::RecordFileBase(const char *fileName, size_t recordSize, uint16_t version) : 
+    fileName(fileName), recordSize(recordSize), version(version) {
+}
+
+FileHelperRK::RecordFileBase::~RecordFileBase() {
+    close();
+}
+
+int FileHelperRK::RecordFileBase::begin() {
+    int result;
+
+    close();
+
+    if (recordSize == 0) {
+        return SYSTEM_ERROR_INVALID_ARGUMENT;
+    }
+
+    struct stat sb;
+    if (stat(fileName, &sb) == -1 || sb.st_size == 0) {
+        FileHeader fileHeader = {recordFileMagic, version, sizeof(FileHeader), (uint32_t)recordSize};
+        result = storeBytes(fileName, (const uint8_t *)&fileHeader, sizeof(fileHeader), STORE_ATOMIC | STORE_SYNC);
+        if (result != SYSTEM_ERROR_NONE) {
+            return result;
+        }
+    }
+
+    fd = open(fileName, O_RDWR);
+    if (fd == -1) {
+        _fileHelperLog.info("RecordFile open failed %s errno=%d", fileName.c_str(), errno);
+        return errnoToSystemError();
+    }
+
+    FileHeader fileHeader;
+    if (read(fd, &fileHeader, sizeof(fileHeader)) != sizeof(fileHeader) || fstat(fd, &sb) == -1 ||
+        fileHeader.magic != recordFileMagic || fileHeader.headerSize < sizeof(FileHeader) || fileHeader.recordSize != recordSize) {
+        _fileHelperLog.info("RecordFile invalid file %s", fileName.c_str());
+        close();
+        return SYSTEM_ERROR_BAD_DATA;
+    }
+    if (fileHeader.version != version) {
+        _fileHelperLog.info("RecordFile version mismatch %s expected=%d got=%d", fileName.c_str(), (int)version, (int)fileHeader.version);
+        close();
+        return SYSTEM_ERROR_NOT_SUPPORTED;
+    }
+
+    headerSize = fileHeader.headerSize;
+    numRecords = ((size_t)sb.st_size > headerSize) ? ((size_t)sb.st_size - headerSize) / recordSize : 0;
+
+    return SYSTEM_ERROR_NONE;
+}
+
+int FileHelperRK::RecordFileBase::close() {
+    if (fd != -1) {
+        ::close(fd);
+        fd = -1;
+    }
+    numRecords = 0;
+    return SYSTEM_ERROR_NONE;
+}
+
+int FileHelperRK::RecordFileBase::sync() {
+    if (fd == -1) {
+#if defined(SYSTEM_VERSION_550) || defined(UNITTEST)
+        return SYSTEM_ERROR_FILESYSTEM_BADF;
+#else
+        return SYSTEM_ERROR_INVALID_STATE;
+#endif
+    }
+    if (fsync(fd) == -1) {
+        return errnoToSystemError();
+    }
+    return SYSTEM_ERROR_NONE;
+}
+
+int FileHelperRK::RecordFileBase::readRecords(size_t index, void *buf, size_t count, size_t *countRead) {
+    if (countRead) {
+        *countRead = 0;
+    }
+    if (fd == -1) {
+#if defined(SYSTEM_VERSION_550) || defined(UNITTEST)
+        return SYSTEM_ERROR_FILESYSTEM_BADF;
+#else
+        return SYSTEM_ERROR_INVALID_STATE;
+#endif
+    }
+    if (index >= numRecords) {
+        return SYSTEM_ERROR_NOT_FOUND;
+    }
+    if (count > numRecords - index) {
+        if (!countRead) {
+            return SYSTEM_ERROR_NOT_FOUND;
+        }
+        count = numRecords - index;
+    }
+
+    size_t len = count * recordSize;
+    if (lseek(fd, headerSize + index * recordSize, SEEK_SET) == -1) {
+        return errnoToSystemError();
+    }
+    ssize_t readResult = read(fd, buf, len);
+    if (readResult < 0) {
+        return errnoToSystemError();
+    }
+    if ((size_t)readResult != len) {
+        _fileHelperLog.info("RecordFile short read %s index=%d", fileName.c_str(), (int)index);
+        return SYSTEM_ERROR_IO;
+    }
+
+    if (countRead) {
+        *countRead = count;
+    }
+    return SYSTEM_ERROR_NONE;
+}
+
+int FileHelperRK::RecordFileBase::writeRecords(size_t index, const void *buf, size_t count) {
+    if (fd == -1) {
+#if defined(SYSTEM_VERSION_550) || defined(UNITTEST)
+        return SYSTEM_ERROR_FILESYSTEM_BADF;
+#else
+        return SYSTEM_ERROR_INVALID_STATE;
+#endif
+    }
+    if (index > numRecords) {
+        return SYSTEM_ERROR_INVALID_ARGUMENT;
+    }
+
+    size_t len = count * recordSize;
+    if (lseek(fd, headerSize + index * recordSize, SEEK_SET) == -1) {
+        return errnoToSystemError();
+    }
+    ssize_t writeResult = write(fd, buf, len);
+    if (writeResult < 0) {
+        _fileHelperLog.info("RecordFile write failed %s errno=%d", fileName.c_str(), errno);
+        return errnoToSystemError();
+    }
+    if (index + count > numRecords) {
+        // Only count complete records if the write was short
+        numRecords = index + (size_t)writeResult / recordSize;
+    }
+    if (writeResult > 0) {
+        notifyChanged(fileName);
+    }
+    if ((size_t)writeResult != len) {
+        return SYSTEM_ERROR_IO;
+    }
+
+    if (syncEachWrite) {
+        return sync();
+    }
+    return SYSTEM_ERROR_NONE;
+}
+
+int FileHelperRK::RecordFileBase::truncate(size_t count) {
+    if (fd == -1) {
+#if defined(SYSTEM_VERSION_550) || defined(UNITTEST)
+        return SYSTEM_ERROR_FILESYSTEM_BADF;
+#else
+        return SYSTEM_ERROR_INVALID_STATE;
+#endif
+    }
+    if (count >= numRecords) {
+        return SYSTEM_ERROR_NONE;
+    }
+    if (ftruncate(fd, headerSize + count * recordSize) == -1) {
+        return errnoToSystemError();
+    }
+    numRecords = count;
+    notifyChanged(fileName);
+
+    if (syncEachWrite) {
+        return sync();
+    }
+    return SYSTEM_ERROR_NONE;
+}
+    
+
+FileHelperRK::HeapAllocator &FileHelperRK::HeapAllocator::instance() {
+    static HeapAllocator heapAllocator;
+    return heapAllocator;
+}
+
+uint8_t *FileHelperRK::ArenaAllocator::allocate(size_t size) {
+    size_t start = (used + alignment - 1) & ~(alignment - 1);
+    if (size > arenaSize || start > arenaSize - size) {
+        _fileHelperLog.info("ArenaAllocator out of space size=%d used=%d arenaSize=%d", (int)size, (int)used, (int)arenaSize);
+        return nullptr;
+    }
+    if (numTracked < maxTracked && numUntracked == 0) {
+        tracked[numTracked] = start;
+        trackedReleased[numTracked] = false;
+        numTracked++;
+    }
+    else {
+        numUntracked++;
+    }
+    used = start + size;
+    numAllocations++;
+
+    return &arena[start];
+}
+
+void FileHelperRK::ArenaAllocator::release(uint8_t *ptr) {
+    if (numAllocations == 0) {
+        return;
+    }
+    if (--numAllocations == 0) {
+        // All allocations released, entire arena is available again
+        reset();
+        return;
+    }
+
+    size_t ii = numTracked;
+    while(ii > 0 && &arena[tracked[ii - 1]] != ptr) {
+        ii--;
+    }
+    if (ii > 0) {
+        trackedReleased[ii - 1] = true;
+    }
+    else 
+    if (numUntracked > 0) {
+        numUntracked--;
+    }
+
+    // Reclaim the space of released allocations at the top of the stack
+    while(numUntracked == 0 && numTracked > 0 && trackedReleased[numTracked - 1]) {
+        used = tracked[--numTracked];
+    }
+}
+
+FileHelperRK::OwnedBuffer &FileHelperRK::OwnedBuffer::operator=(OwnedBuffer &&other) {
+    if (this != &other) {
+        free();
+        ptr = other.ptr;
+        len = other.len;
+        allocator = other.allocator;
+        other.ptr = nullptr;
+        other.len = 0;
+        other.allocator = nullptr;
+    }
+    return *this;
+}
+
+void FileHelperRK::OwnedBuffer::set(uint8_t *ptr, size_t len, Allocator *allocator) {
+    free();
+    this->ptr = ptr;
+    this->len = len;
+    this->allocator = allocator;
+}
+
+void FileHelperRK::OwnedBuffer::free() {
+    if (ptr && allocator) {
+        allocator->release(ptr);
+    }
+    ptr = nullptr;
+    len = 0;
+    allocator = nullptr;
+}
+
+/**
+ * @brief Directories known to exist, most recently used first. Unused entries are empty.
+ */
+static String _mkdirsCache[FileHelperRK::mkdirsCacheSize];
+
+static bool _mkdirsCacheFind(const char *path) {
+    for(size_t ii = 0; ii < FileHelperRK::mkdirsCacheSize && _mkdirsCache[ii].length(); ii++) {
+        if (_mkdirsCache[ii].equals(path)) {
+            // Move to the front
+            std::rotate(&_mkdirsCache[0], &_mkdirsCache[ii], &_mkdirsCache[ii + 1]);
+            return true;
+        }
+    }
+    return false;
+}
+
+static void _mkdirsCacheAdd(const char *path) {
+    // Discard the least recently used entry
+    std::rotate(&_mkdirsCache[0], &_mkdirsCache[FileHelperRK::mkdirsCacheSize - 1], &_mkdirsCache[FileHelperRK::mkdirsCacheSize]);
+    _mkdirsCache[0] = path;
+}
+
+/**
+ * @brief mkdir() that returns success if the directory already exists
+ * 
+ * @return int 0 on success or an errno value
+ */
+static int _mkdirExistsOk(const char *path) {
+    if (mkdir(path, 0777) == 0) {
+        FileHelperRK::notifyChanged(path);
+        return 0;
+    }
+    int err = errno;
+    if (err == EEXIST) {
+        struct stat sb;
+        if (stat(path, &sb) == 0 && (sb.st_mode & S_IFDIR) == 0) {
+            return ENOTDIR;
+        }
+        return 0;
+    }
+    return err;
+}
+
+int FileHelperRK::mkdirs(const char *path) {
+    int result = SYSTEM_ERROR_UNKNOWN;
+
+    ParsedPath parsed;
+    result = parsed.parse(path);
+    if (result != SYSTEM_ERROR_NONE) {
+        return result;
+    }
+    // Avoid checking and creating the same directory more than once for paths like "a/../a/b",
+    // and use the same cache key for all ways of writing the path
+    parsed.normalize();
+
+    int numParts = (int) parsed.getNumParts();
+    if (numParts == 0) {
+        return SYSTEM_ERROR_NONE;
+    }
+
+    // Relative paths are not cached. They depend on the current directory, and would not match
+    // the absolute path of the same directory when it is invalidated.
+    bool useCache = parsed.getStartsWithSlash();
+
+    const char *fullPath = parsed.getPrefix();
+    if (useCache && _mkdirsCacheFind(fullPath)) {
+        return SYSTEM_ERROR_NONE;
+    }
+
+    // Usually the parent exists, so try to create the whole path first
+    int err = _mkdirExistsOk(fullPath);
+    if (err == ENOENT) {
+        // Create parents from the top down
+        for(int curPart = 1; curPart <= numParts; curPart++) {
+            const char *partialPath = parsed.getPrefix(curPart);
+
+            // _fileHelperLog.trace("mkdirs create curPart=%d partialPath=%s", curPart, partialPath);
+
+            err = _mkdirExistsOk(partialPath);
+            if (err != 0) {
+                break;
+            }
+        }
+    }
+
+    if (err != 0) {
+        _fileHelperLog.info("mkdirs failed path=%s errno=%d", path, err);
+        errno = err;
+#if defined(SYSTEM_VERSION_550) || defined(UNITTEST)
+        return errnoToSystemError();
+#else
+        return -1;
+#endif
+    }
+
+    if (useCache) {
+        _mkdirsCacheAdd(parsed.getPrefix());
+    }
+
+    return SYSTEM_ERROR_NONE;
+}
+
+void FileHelperRK::invalidateMkdirsCache(const char *path) {
+    ParsedPath parsed;
+    if (path) {
+        parsed.canonical(path);
+    }
+    const char *prefix = parsed.getPrefix();
+    size_t prefixLen = strlen(prefix);
+
+    size_t numKept = 0;
+    for(size_t ii = 0; ii < mkdirsCacheSize && _mkdirsCache[ii].length(); ii++) {
+        const char *entry = _mkdirsCache[ii].c_str();
+        // A relative path cannot be compared to the cached absolute paths, so it clears the whole cache
+        bool remove = !path || prefixLen == 0 || !parsed.getStartsWithSlash() || 
+            (strncmp(entry, prefix, prefixLen) == 0 && (entry[prefixLen] == 0 || entry[prefixLen] == pathDelim[0] || prefix[prefixLen - 1] == pathDelim[0]));
+        if (!remove) {
+            _mkdirsCache[numKept++] = _mkdirsCache[ii];
+        }
+    }
+    for(size_t ii = numKept; ii < mkdirsCacheSize; ii++) {
+        _mkdirsCache[ii] = "";
+    }
+}
+
+int FileHelperRK::deleteRecursive(const char *path, bool contentsOfPathOnly) {
+    return deleteRecursive(path, DeleteOptions().withContentsOfPathOnly(contentsOfPathOnly));
+}
+
+/**
+ * @brief Options, results, and error state for one deleteRecursive() call
+ * 
+ * Shared by the serial and parallel implementations. When threads are available, all
+ * members are protected by a mutex.
+ */
+class _FileHelperDeleteState {
+public:
+    _FileHelperDeleteState(const FileHelperRK::DeleteOptions &options, FileHelperRK::DeleteResult *deleteResult) : 
+        options(options), deleteResult(deleteResult) {};
+
+    /**
+     * @brief Delete a file and update the results
+     */
+    void deleteFile(const char *path) {
+        struct stat sb;
+        bool haveSize = deleteResult && stat(path, &sb) == 0;
+
+        if (unlink(path) == -1) {
+            _fileHelperLog.info("deleteRecursive unlink failed fileName=%s errno=%d", path, errno);
+            failed(path, FileHelperRK::errnoToSystemError());
+            return;
+        }
+        if (deleteResult) {
+#ifdef FILEHELPER_HAS_THREADS
+            std::lock_guard<std::mutex> lock(mutex);
+#endif
+            deleteResult->filesDeleted++;
+            if (haveSize) {
+                deleteResult->bytesFreed += (uint64_t)sb.st_size;
+            }
+        }
+    }
+
+    /**
+     * @brief Remove an empty directory and update the results
+     */
+    void removeDirectory(const char *path) {
+        if (rmdir(path) == -1) {
+            _fileHelperLog.info("deleteRecursive unlink self failed fileName=%s errno=%d", path, errno);
+            failed(path, FileHelperRK::errnoToSystemError());
+            return;
+        }
+        if (deleteResult) {
+#ifdef FILEHELPER_HAS_THREADS
+            std::lock_guard<std::mutex> lock(mutex);
+#endif
+            deleteResult->directoriesDeleted++;
+        }
+    }
+
+    /**
+     * @brief Record a failure. Stops the delete unless continueOnFailure is set.
+     */
+    void failed(const char *path, int error) {
+#ifdef FILEHELPER_HAS_THREADS
+        std::lock_guard<std::mutex> lock(mutex);
+#endif
+        if (firstError == SYSTEM_ERROR_NONE) {
+            firstError = error;
+        }
+        if (deleteResult) {
+            deleteResult->failures.push_back({path, error});
+        }
+        if (!options.continueOnFailure) {
+            stopped = true;
+        }
+    }
+
+    bool isStopped() {
+#ifdef FILEHELPER_HAS_THREADS
+        std::lock_guard<std::mutex> lock(mutex);
+#endif
+        return stopped;
+    }
+
+    void notifyChanged(const char *path) {
+#ifdef FILEHELPER_HAS_THREADS
+        std::lock_guard<std::mutex> lock(mutex);
+#endif
+        FileHelperRK::notifyChanged(path);
+    }
+
+    const FileHelperRK::DeleteOptions &options; //!< Options passed to deleteRecursive()
+    FileHelperRK::DeleteResult *deleteResult; //!< Results, or nullptr
+    int firstError = SYSTEM_ERROR_NONE; //!< First error, returned by deleteRecursive()
+    bool stopped = false; //!< Set on failure if not continueOnFailure
+#ifdef FILEHELPER_HAS_THREADS
+    std::mutex mutex; //!< Protects all members
+#endif
+};
+
+static void _deleteRecursiveSerial(const char *path, bool removeSelf, _FileHelperDeleteState &state) {
+    std::deque<String> filesToDelete;
+    std::deque<String> directoriesToDelete;
+
+    // _fileHelperLog.trace("deleteRecursive path=%s", path);  
+
+    DIR *dirp = opendir(path);
+    if (dirp) {      
+        while(true) {
+            struct dirent *de = readdir(dirp);
+            if (!de) {
+                break;
+            }
+            // _fileHelperLog.trace("deleteRecursive de->d_name=%s", de->d_name);  
+
+            if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) {
+                continue;
+            }
+
+            if (de->d_type & DT_DIR) {
+                directoriesToDelete.push_back(de->d_name);
+            }
+            else 
             if (de->d_type & DT_REG) {
                 filesToDelete.push_back(de->d_name);
             }
         }
-
-        closedir(dirp);        
+
+        closedir(dirp);        
+    }
+    else
+    if (!removeSelf) {
+        // When removing the directory, rmdir() reports the error instead
+        _fileHelperLog.info("deleteRecursive opendir failed fileName=%s errno=%d", path, errno);
+        state.failed(path, FileHelperRK::errnoToSystemError());
+        return;
+    }
+
+    while(!directoriesToDelete.empty() && !state.isStopped()) {
+        _deleteRecursiveSerial(FileHelperRK::pathJoin(path, directoriesToDelete.front()), true, state);
+        directoriesToDelete.pop_front();
+    }
+
+    while(!filesToDelete.empty() && !state.isStopped()) {
+        state.deleteFile(FileHelperRK::pathJoin(path, filesToDelete.front()));
+        filesToDelete.pop_front();
+    }
+
+    if (removeSelf && !state.isStopped()) {
+        state.removeDirectory(path);
+    }
+    state.notifyChanged(path);
+}
+
+#ifdef FILEHELPER_HAS_THREADS
+/**
+ * @brief Deletes a directory tree using a pool of threads. Used by deleteRecursive() with DeleteOptions.
+ * 
+ * Each directory is a unit of work. A thread pushes the subdirectories it finds onto the back of
+ * its own queue and takes work from the back of it (depth first). When its queue is empty, it 
+ * takes work from the front of another thread's queue (work stealing). A directory counts its
+ * own files plus its unfinished subdirectories; when that reaches zero it is removed and its 
+ * parent is updated, so files are always deleted before the directory containing them.
+ */
+class _FileHelperParallelDelete {
+public:
+    _FileHelperParallelDelete(_FileHelperDeleteState &state, size_t numThreads) : state(state), queues(numThreads) {};
+
+    void run(const char *path) {
+        Node *root = new Node(path, nullptr, !state.options.contentsOfPathOnly);
+        outstanding = 1;
+        push(0, root);
+
+        std::vector<std::thread> threads;
+        for(size_t ii = 1; ii < queues.size(); ii++) {
+            threads.push_back(std::thread(&_FileHelperParallelDelete::worker, this, ii));
+        }
+        worker(0);
+        for(auto &thread : threads) {
+            thread.join();
+        }
+    }
+
+protected:
+    struct Node {
+        Node(const char *path, Node *parent, bool removeSelf) : path(path), parent(parent), pending(1), removeSelf(removeSelf) {};
+        String path;
+        Node *parent;
+        std::atomic<int> pending; //!< 1 for this directory's files, plus 1 for each unfinished subdirectory
+        bool removeSelf;
+    };
+
+    struct Queue {
+        std::mutex mutex;
+        std::deque<Node *> nodes;
+    };
+
+    void worker(size_t id) {
+        while(outstanding > 0) {
+            size_t generation;
+            {
+                std::lock_guard<std::mutex> lock(waitMutex);
+                generation = pushCount;
+            }
+            Node *node = take(id);
+            if (node) {
+                processDir(id, node);
+                continue;
+            }
+
+            // Sleep until a directory is pushed after the take() above, or all of the work is done
+            std::unique_lock<std::mutex> lock(waitMutex);
+            waitCond.wait(lock, [&]() { return pushCount != generation || outstanding == 0; });
+        }
+    }
+
+    void push(size_t id, Node *node) {
+        {
+            std::lock_guard<std::mutex> lock(queues[id].mutex);
+            queues[id].nodes.push_back(node);
+        }
+        {
+            std::lock_guard<std::mutex> lock(waitMutex);
+            pushCount++;
+        }
+        waitCond.notify_one();
+    }
+
+    Node *take(size_t id) {
+        for(size_t ii = 0; ii < queues.size(); ii++) {
+            Queue &queue = queues[(id + ii) % queues.size()];
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            if (!queue.nodes.empty()) {
+                Node *node;
+                if (ii == 0) {
+                    node = queue.nodes.back();
+                    queue.nodes.pop_back();
+                }
+                else {
+                    node = queue.nodes.front();
+                    queue.nodes.pop_front();
+                }
+                return node;
+            }
+        }
+        return nullptr;
+    }
+
+    void processDir(size_t id, Node *node) {
+        std::vector<String> files;
+
+        // After a failure (without continueOnFailure), queued directories are only released
+        DIR *dirp = state.isStopped() ? nullptr : opendir(node->path);
+        if (dirp) {
+            while(true) {
+                struct dirent *de = readdir(dirp);
+                if (!de) {
+                    break;
+                }
+                if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) {
+                    continue;
+                }
+                if (de->d_type & DT_DIR) {
+                    // Other threads can start on subdirectories while this thread deletes the files
+                    node->pending++;
+                    outstanding++;
+                    push(id, new Node(FileHelperRK::pathJoin(node->path, de->d_name), node, true));
+                }
+                else 
+                if (de->d_type & DT_REG) {
+                    files.push_back(de->d_name);
+                }
+            }
+            closedir(dirp);
+        }
+        else
+        if (!node->removeSelf && !state.isStopped()) {
+            _fileHelperLog.info("deleteRecursive opendir failed fileName=%s errno=%d", node->path.c_str(), errno);
+            state.failed(node->path, FileHelperRK::errnoToSystemError());
+        }
+
+        for(const String &name : files) {
+            if (state.isStopped()) {
+                break;
+            }
+            state.deleteFile(FileHelperRK::pathJoin(node->path, name));
+        }
+
+        finishNode(node);
+        if (--outstanding == 0) {
+            // Wake the idle workers so they exit
+            std::lock_guard<std::mutex> lock(waitMutex);
+            waitCond.notify_all();
+        }
+    }
+
+    void finishNode(Node *node) {
+        while(node && --node->pending == 0) {
+            if (node->removeSelf && !state.isStopped()) {
+                state.removeDirectory(node->path);
+            }
+            state.notifyChanged(node->path);
+
+            Node *parent = node->parent;
+            delete node;
+            node = parent;
+        }
+    }
+
+    _FileHelperDeleteState &state; //!< Options, results, and errors
+    std::vector<Queue> queues; //!< One work queue per thread
+    std::atomic<size_t> outstanding{0}; //!< Directories queued or being processed
+    std::mutex waitMutex; //!< Protects pushCount, used with waitCond
+    std::condition_variable waitCond; //!< Signaled when a directory is pushed or outstanding reaches 0
+    size_t pushCount = 0; //!< Number of directories pushed so far
+};
+#endif // FILEHELPER_HAS_THREADS
+
+int FileHelperRK::deleteRecursive(const char *path, const DeleteOptions &options, DeleteResult *deleteResult) {
+    unsigned long start = millis();
+
+    invalidateMkdirsCache(path);
+
+    if (deleteResult) {
+        deleteResult->clear();
+    }
+    _FileHelperDeleteState state(options, deleteResult);
+
+#ifdef FILEHELPER_HAS_THREADS
+    // More threads than cores only adds contention
+    size_t numThreads = std::min(options.numThreads, (size_t)std::max(std::thread::hardware_concurrency(), 1u));
+    if (numThreads > 1) {
+        _FileHelperParallelDelete parallelDelete(state, numThreads);
+        parallelDelete.run(path);
+    }
+    else
+#endif // FILEHELPER_HAS_THREADS
+    {
+        _deleteRecursiveSerial(path, !options.contentsOfPathOnly, state);
+    }
+
+    if (deleteResult) {
+        deleteResult->elapsedMs = millis() - start;
+    }
+    return state.firstError;
+}
+
+String FileHelperRK::WalkParameters::toString() const {
+    if (isDirectory) {
+        return String::format("%s (directory)", path);
+    }
+    else {
+        return String::format("%s (%d bytes)", path, size);
+    }
+}
+
+
+int FileHelperRK::walk(const char *path, std::function<void(const WalkParameters &pParam)> cb) {
+    return walk(path, WalkOptions(), [cb](const WalkParameters &walkParameters) {
+        cb(walkParameters);
+        return WalkAction::CONTINUE;
+    });
+}
+
+int FileHelperRK::walk(const char *path, const WalkOptions &options, std::function<WalkAction(const WalkParameters &pParam)> cb) {
+    int result = SYSTEM_ERROR_UNKNOWN;
+    
+    struct stat sb;
+
+    result = stat(path, &sb);
+    if (result == -1) {
+        return errnoToSystemError();
+    }
+
+    WalkParameters walkParameters;
+    walkParameters.path = path;
+    walkParameters.depth = 0;
+
+    const char *name = strrchr(path, pathDelim[0]);
+    name = (name && name[1]) ? &name[1] : path;
+
+    if ((sb.st_mode & S_IFDIR) == 0) {
+        if (options.matches(name, false)) {
+            walkParameters.isDirectory = false;
+            walkParameters.size = sb.st_size;
+            cb(walkParameters);
+        }
+        return SYSTEM_ERROR_NONE;
+    }
+
+    if (options.matches(name, true)) {
+        walkParameters.isDirectory = true;
+        walkParameters.size = 0;
+        if (cb(walkParameters) != WalkAction::CONTINUE) {
+            return SYSTEM_ERROR_NONE;
+        }
+    }
+    if (options.maxDepth == 0) {
+        return SYSTEM_ERROR_NONE;
+    }
+
+    // One entry per level of depth. Each directory is read twice, the first pass for
+    // subdirectories and the second pass for files.
+    struct WalkLevel {
+        DIR *dirp;
+        size_t pathLen;
+        bool filesPass;
+    };
+    std::vector<WalkLevel> stack;
+
+    // Single path buffer that components are appended to and truncated from
+    String curPath(path);
+
+    stack.push_back(WalkLevel({opendir(path), curPath.length(), false}));
+
+    result = SYSTEM_ERROR_NONE;
+
+    while(!stack.empty()) {
+        WalkLevel &level = stack.back();
+        int depth = (int)stack.size();
+
+        struct dirent *de = level.dirp ? readdir(level.dirp) : nullptr;
+        if (!de) {
+            if (level.dirp && !level.filesPass && options.includeFiles) {
+                rewinddir(level.dirp);
+                level.filesPass = true;
+            }
+            else {
+                if (level.dirp) {
+                    closedir(level.dirp);
+                }
+                stack.pop_back();
+            }
+            continue;
+        }
+
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) {
+            continue;
+        }
+
+        bool isDirectory = (de->d_type & DT_DIR) != 0;
+        bool isFile = !isDirectory && (de->d_type & DT_REG) != 0;
+        bool haveStat = false;
+
+        if (de->d_type != DT_UNKNOWN) {
+            // Check type and name before building the path
+            if (level.filesPass ? !isFile : !isDirectory) {
+                continue;
+            }
+            if (isFile && !options.matches(de->d_name, false)) {
+                continue;
+            }
+        }
+
+        curPath.remove(level.pathLen);
+        if (curPath.length() && curPath.charAt(curPath.length() - 1) != pathDelim[0]) {
+            curPath.concat(pathDelim);
+        }
+        curPath.concat(de->d_name);
+
+        if (de->d_type == DT_UNKNOWN) {
+            // File system does not return types, need to stat
+            if (stat(curPath, &sb) == -1) {
+                result = errnoToSystemError();
+                break;
+            }
+            haveStat = true;
+            isDirectory = (sb.st_mode & S_IFDIR) != 0;
+            isFile = (sb.st_mode & S_IFREG) != 0;
+        }
+
+        walkParameters.path = curPath.c_str();
+        walkParameters.depth = depth;
+
+        if (!level.filesPass && isDirectory) {
+            // Directory type from readdir is sufficient, no stat needed
+            WalkAction action = WalkAction::CONTINUE;
+            if (options.matches(de->d_name, true)) {
+                walkParameters.isDirectory = true;
+                walkParameters.size = 0;
+                action = cb(walkParameters);
+            }
+            if (action == WalkAction::STOP) {
+                break;
+            }
+            if (action == WalkAction::CONTINUE && (options.maxDepth < 0 || depth < options.maxDepth)) {
+                // level is invalidated by push_back
+                stack.push_back(WalkLevel({opendir(curPath), curPath.length(), false}));
+            }
+        }
+        else
+        if (level.filesPass && isFile && options.matches(de->d_name, false)) {
+            if (!haveStat && stat(curPath, &sb) == -1) {
+                result = errnoToSystemError();
+                break;
+            }
+            walkParameters.isDirectory = false;
+            walkParameters.size = sb.st_size;
+            if (cb(walkParameters) == WalkAction::STOP) {
+                break;
+            }
+        }
+    }
+
+    // Only non-empty on error or STOP
+    for(auto it = stack.begin(); it != stack.end(); it++) {
+        if (it->dirp) {
+            closedir(it->dirp);
+        }
+    }
+
+    return result;
+}
+
+bool FileHelperRK::WalkOptions::matches(const char *name, bool isDirectory) const {
+    if (isDirectory) {
+        if (!includeDirectories) {
+            return false;
+        }
+    }
+    else {
+        if (!includeFiles) {
+            return false;
+        }
+        if (extension) {
+            // Same definition as ParsedPath::getFileExtension(): text after the last dot
+            const char *dot = strrchr(name, '.');
+            if (strcmp(dot ? &dot[1] : "", extension) != 0) {
+                return false;
+            }
+        }
+    }
+    if (pattern && !globMatch(pattern, name)) {
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Number of counters for the directories changed by notifyChanged()
+ * 
+ * Directories are assigned to a counter by the hash of their name (last path component), so
+ * the same directory matches whether it is given as an absolute or relative path. Directories
+ * with the same hash share a counter, which only causes extra rescans.
+ */
+static const size_t _notifyChangedDirCounts = 32;
+
+#ifdef FILEHELPER_HAS_THREADS
+typedef std::atomic<uint32_t> _NotifyChangedCounter;
+
+/**
+ * @brief Serializes UsageTracker::markDirty() when files are changed from multiple threads, such as storeBatch()
+ */
+static std::mutex _notifyChangedMutex;
+#else
+typedef uint32_t _NotifyChangedCounter;
+#endif
+
+static _NotifyChangedCounter _notifyChangedDirCount[_notifyChangedDirCounts]; //!< Incremented for changes in a directory
+static _NotifyChangedCounter _notifyChangedAllCount{0}; //!< Incremented for changes whose directory is not known
+static _NotifyChangedCounter _notifyChangedCount{0}; //!< Incremented for all changes
+
+/**
+ * @brief Get the counter index for the directory in the first len characters of path
+ * 
+ * @return int Index into _notifyChangedDirCount, or -1 if the directory name is not known (., .., or an empty relative path)
+ */
+static int _notifyChangedDirIndex(const char *path, size_t len) {
+    while(len > 0 && path[len - 1] == FileHelperRK::pathDelim[0]) {
+        len--;
+    }
+    size_t start = len;
+    while(start > 0 && path[start - 1] != FileHelperRK::pathDelim[0]) {
+        start--;
+    }
+    size_t nameLen = len - start;
+    if ((nameLen == 0 && path[0] != FileHelperRK::pathDelim[0]) || 
+        (nameLen == 1 && path[start] == '.') || (nameLen == 2 && path[start] == '.' && path[start + 1] == '.')) {
+        return -1;
+    }
+
+    // FNV-1a
+    uint32_t hash = 2166136261UL;
+    for(size_t ii = start; ii < len; ii++) {
+        hash = (hash ^ (uint8_t)path[ii]) * 16777619UL;
+    }
+    return (int)(hash % _notifyChangedDirCounts);
+}
+
+/**
+ * @brief Value that changes when notifyChanged() is called for anything in the directory path
+ */
+static uint32_t _notifyChangedCountForDir(const char *path) {
+    int index = _notifyChangedDirIndex(path, strlen(path));
+    if (index < 0) {
+        return _notifyChangedCount;
+    }
+    return _notifyChangedAllCount + _notifyChangedDirCount[index];
+}
+
+void FileHelperRK::notifyChanged(const char *path) {
+    _notifyChangedCount++;
+
+    // The directory containing path changed, and path itself if it is a directory
+    size_t len = strlen(path);
+    while(len > 0 && path[len - 1] == pathDelim[0]) {
+        len--;
+    }
+    size_t parentLen = len;
+    while(parentLen > 0 && path[parentLen - 1] != pathDelim[0]) {
+        parentLen--;
+    }
+    int parentIndex = (parentLen > 0) ? _notifyChangedDirIndex(path, parentLen) : -1;
+    int selfIndex = _notifyChangedDirIndex(path, len);
+    if (parentIndex < 0 || selfIndex < 0) {
+        _notifyChangedAllCount++;
+    }
+    if (parentIndex >= 0) {
+        _notifyChangedDirCount[parentIndex]++;
+    }
+    if (selfIndex >= 0 && selfIndex != parentIndex) {
+        _notifyChangedDirCount[selfIndex]++;
+    }
+
+#ifdef FILEHELPER_HAS_THREADS
+    std::lock_guard<std::mutex> lock(_notifyChangedMutex);
+#endif
+    if (UsageTracker::getActiveTracker()) {
+        UsageTracker::getActiveTracker()->markDirty(path);
+    }
+}
+
+bool FileHelperRK::globMatch(const char *pattern, const char *name) {
+    // Iterative matcher; on mismatch, backtrack to the most recent * only
+    const char *starPattern = nullptr;
+    const char *starName = nullptr;
+
+    while(*name) {
+        if (*pattern == '*') {
+            starPattern = pattern++;
+            starName = name;
+        }
+        else
+        if (*pattern == '?' || *pattern == *name) {
+            pattern++;
+            name++;
+        }
+        else
+        if (starPattern) {
+            pattern = starPattern + 1;
+            name = ++starName;
+        }
+        else {
+            return false;
+        }
+    }
+    while(*pattern == '*') {
+        pattern++;
+    }
+    return *pattern == 0;
+}
+
+void FileHelperRK::DirectoryListing::clear() {
+    entries.clear();
+    names.clear();
+    dirPath = "";
+    pattern = "";
+    valid = false;
+    fromCache = false;
+    dirMtime = 0;
+    changeCount = 0;
+}
+
+int FileHelperRK::listDirectory(const char *path, const ListOptions &options, DirectoryListing &listing) {
+    struct stat sb;
+
+    if (stat(path, &sb) == -1) {
+        listing.clear();
+        return errnoToSystemError();
+    }
+    if ((sb.st_mode & S_IFDIR) == 0) {
+        listing.clear();
+#if defined(SYSTEM_VERSION_550) || defined(UNITTEST)
+        return SYSTEM_ERROR_FILESYSTEM_NOTDIR;
+#else
+        return SYSTEM_ERROR_INVALID_ARGUMENT;
+#endif
+    }
+
+    // The snapshot keeps its own copy of the pattern, as the caller's pointer may not outlive it
+    const char *pattern = (options.pattern && *options.pattern) ? options.pattern : "";
+    ListOptions snapshotOptions = options;
+    snapshotOptions.pattern = nullptr;
+
+    if (options.cache && listing.valid && listing.dirPath.equals(path) && listing.options == snapshotOptions && listing.pattern.equals(pattern) &&
+        listing.dirMtime == sb.st_mtime && listing.changeCount == _notifyChangedCountForDir(path)) {
+        listing.fromCache = true;
+        return SYSTEM_ERROR_NONE;
+    }
+
+    // Keep the capacity of the vectors
+    listing.entries.clear();
+    listing.names.clear();
+    listing.valid = listing.fromCache = false;
+    listing.dirPath = path;
+    listing.options = snapshotOptions;
+    listing.pattern = pattern;
+    listing.dirMtime = sb.st_mtime;
+    listing.changeCount = _notifyChangedCountForDir(path);
+
+    bool doStat = options.stat || options.sort == ListSort::SIZE || options.sort == ListSort::MTIME;
+
+    DIR *dirp = opendir(path);
+    if (!dirp) {
+        _fileHelperLog.info("listDirectory opendir failed path=%s errno=%d", path, errno);
+        return errnoToSystemError();
+    }
+
+    // One string for the path of each entry, only used for stat
+    String entryPath = pathJoin(path, "x");
+    size_t entryPathBase = entryPath.length() - 1;
+
+    while(true) {
+        struct dirent *de = readdir(dirp);
+        if (!de) {
+            break;
+        }
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) {
+            continue;
+        }
+        if (*pattern && !globMatch(pattern, de->d_name)) {
+            continue;
+        }
+
+        bool isDirectory = (de->d_type & DT_DIR) != 0;
+        bool isFile = (de->d_type & DT_REG) != 0;
+        DirectoryListing::Entry entry = {(uint32_t)listing.names.size(), isDirectory, 0, 0};
+
+        if (doStat || de->d_type == DT_UNKNOWN) {
+            entryPath.remove(entryPathBase);
+            entryPath.concat(de->d_name);
+            if (stat(entryPath, &sb) == -1) {
+                continue;
+            }
+            isDirectory = (sb.st_mode & S_IFDIR) != 0;
+            isFile = (sb.st_mode & S_IFREG) != 0;
+            entry.isDirectory = isDirectory;
+            if (doStat) {
+                entry.size = isFile ? (size_t)sb.st_size : 0;
+                entry.mtime = sb.st_mtime;
+            }
+        }
+
+        if ((isDirectory && !options.includeDirectories) || (isFile && !options.includeFiles) || (!isDirectory && !isFile)) {
+            continue;
+        }
+
+        listing.names.insert(listing.names.end(), de->d_name, de->d_name + strlen(de->d_name) + 1);
+        listing.entries.push_back(entry);
+    }
+    closedir(dirp);
+
+    if (options.sort != ListSort::NONE) {
+        const char *names = listing.names.data();
+        ListSort sort = options.sort;
+        bool descending = options.descending;
+
+        std::sort(listing.entries.begin(), listing.entries.end(), [names, sort, descending](const DirectoryListing::Entry &a, const DirectoryListing::Entry &b) {
+            const DirectoryListing::Entry &first = descending ? b : a;
+            const DirectoryListing::Entry &second = descending ? a : b;
+
+            if (sort == ListSort::SIZE && first.size != second.size) {
+                return first.size < second.size;
+            }
+            if (sort == ListSort::MTIME && first.mtime != second.mtime) {
+                return first.mtime < second.mtime;
+            }
+            return strcmp(&names[first.nameOffset], &names[second.nameOffset]) < 0;
+        });
+    }
+
+    listing.valid = true;
+
+    return SYSTEM_ERROR_NONE;
+}
+
+
+int FileHelperRK::storeBytes(const char *fileName, const uint8_t *dataPtr, size_t dataLen, int flags, bool *written)
+{
+    int result = SYSTEM_ERROR_UNKNOWN;
+
+    if (written) {
+        *written = false;
+    }
+
+    if ((flags & STORE_IF_CHANGED) && compareBytes(fileName, dataPtr, dataLen)) {
+        // _fileHelperLog.trace("storeBytes unchanged fileName=%s", fileName);
+        return SYSTEM_ERROR_NONE;
+    }
+
+    String tempName;
+    const char *writeName = fileName;
+    if (flags & STORE_ATOMIC) {
+        tempName = getTempFileName(fileName);
+        writeName = tempName.c_str();
+    }
+
+    int fd = open(writeName, O_RDWR | O_CREAT | O_TRUNC, 0666);
+    if (fd != -1) {
+        if (dataPtr && dataLen > 0) {
+            int resultLen = write(fd, dataPtr, dataLen);
+            if (resultLen == (int) dataLen) {
+                result = SYSTEM_ERROR_NONE;
+            }
+            else {
+                _fileHelperLog.error("storeBytes bad length expected=%d got=%d", (int)dataLen, (int)resultLen);
+            }
+        }
+        else {
+            // Empty string, not an error
+            result = SYSTEM_ERROR_NONE;            
+        }
+
+        if (result == SYSTEM_ERROR_NONE && (flags & STORE_SYNC)) {
+            if (fsync(fd) == -1) {
+                _fileHelperLog.info("storeBytes fsync failed fileName=%s errno=%d", writeName, errno);
+                result = errnoToSystemError();
+            }
+        }
+
+        close(fd);
+    }
+    else {
+        _fileHelperLog.info("storeBytes did not open fileName=%s errno=%d", writeName, errno);
+        result = errnoToSystemError();
+    }
+
+    if (flags & STORE_ATOMIC) {
+        result = finishTempFile(tempName, fileName, result);
+    }
+
+    if (written && result == SYSTEM_ERROR_NONE) {
+        *written = true;
+    }
+    notifyChanged(fileName);
+
+    return result;
+}
+
+
+int FileHelperRK::storeString(const char *fileName, const String &data, int flags, bool *written)
+{
+    return storeBytes(fileName, (const uint8_t *)data.c_str(), data.length(), flags, written);
+}
+
+int FileHelperRK::storeString(const char *fileName, const char *str, int flags, bool *written)
+{
+    if (str) {
+        return storeBytes(fileName, (const uint8_t *)str, strlen(str), flags, written);
+    }
+    else {
+        return storeBytes(fileName, nullptr, 0, flags, written);
+    }
+}
+
+bool FileHelperRK::compareBytes(const char *fileName, const uint8_t *dataPtr, size_t dataLen) {
+    bool isEqual = false;
+
+    int fd = open(fileName, O_RDONLY);
+    if (fd != -1) {
+        struct stat sb = {0};
+        if (fstat(fd, &sb) == 0 && (size_t)sb.st_size == dataLen) {
+            uint8_t buf[64];
+            size_t offset = 0;
+
+            isEqual = true;
+            while(offset < dataLen) {
+                size_t count = dataLen - offset;
+                if (count > sizeof(buf)) {
+                    count = sizeof(buf);
+                }
+                int readLen = read(fd, buf, count);
+                if (readLen != (int)count || memcmp(buf, &dataPtr[offset], count) != 0) {
+                    isEqual = false;
+                    break;
+                }
+                offset += count;
+            }
+        }
+        close(fd);
+    }
+
+    return isEqual;
+}
+
+#if defined(SYSTEM_VERSION_560) || defined(UNITTEST)
+
+// Files used to replace a Variant file that has a delta log:
+// 1. The new file is written to fileName.vnew and synced
+// 2. fileName.delta is renamed to fileName.dold
+// 3. fileName.vnew is renamed to fileName
+// 4. fileName.dold is deleted
+// If fileName.dold exists, steps 1 and 2 completed, so _variantRecover() finishes 3 and 4.
+// These suffixes are not tempFileSuffix so cleanupTempFiles() does not remove them.
+static const char *_variantNewSuffix = ".vnew";
+static const char *_variantOldDeltaSuffix = ".dold";
+
+static bool _fileExists(const char *path) {
+    struct stat sb;
+    return stat(path, &sb) == 0;
+}
+
+/**
+ * @brief Finish or undo replacing a Variant file that was interrupted by a reset
+ */
+static void _variantRecover(const char *fileName) {
+    String newName = String(fileName) + _variantNewSuffix;
+    String oldDeltaName = String(fileName) + _variantOldDeltaSuffix;
+
+    if (_fileExists(oldDeltaName)) {
+        if (_fileExists(newName)) {
+            rename(newName, fileName);
+        }
+        unlink(oldDeltaName);
+        FileHelperRK::notifyChanged(fileName);
+    }
+    else
+    if (_fileExists(newName)) {
+        unlink(newName);
+    }
+}
+
+/**
+ * @brief Replace a Variant file with newName and remove its delta log (steps 2 - 4 above)
+ */
+static int _variantReplace(const char *fileName, const char *newName) {
+    String deltaName = String(fileName) + FileHelperRK::variantDeltaSuffix;
+    String oldDeltaName = String(fileName) + _variantOldDeltaSuffix;
+
+    if (rename(deltaName, oldDeltaName) == -1 && errno != ENOENT) {
+        _fileHelperLog.info("rename failed %s errno=%d", deltaName.c_str(), errno);
+        unlink(newName);
+        return FileHelperRK::errnoToSystemError();
+    }
+    if (rename(newName, fileName) == -1) {
+        _fileHelperLog.info("rename failed %s errno=%d", newName, errno);
+        int result = FileHelperRK::errnoToSystemError();
+        // Put the delta log back
+        rename(oldDeltaName, deltaName);
+        unlink(newName);
+        return result;
+    }
+    unlink(oldDeltaName);
+    FileHelperRK::notifyChanged(fileName);
+
+    return SYSTEM_ERROR_NONE;
+}
+
+int FileHelperRK::storeVariant(const char *fileName, const particle::Variant &variant, int flags) {
+    int result = SYSTEM_ERROR_UNKNOWN;
+
+    _variantRecover(fileName);
+
+    // If there is a delta log, it must be removed when the file is replaced, so always replace atomically
+    bool hasDelta = _fileExists(String(fileName) + variantDeltaSuffix);
+
+    String tempName;
+    const char *writeName = fileName;
+    if (hasDelta) {
+        tempName = String(fileName) + _variantNewSuffix;
+        writeName = tempName.c_str();
+        flags |= STORE_SYNC;
+    }
+    else
+    if (flags & STORE_ATOMIC) {
+        tempName = getTempFileName(fileName);
+        writeName = tempName.c_str();
+    }
+
+    FileHelperRK::FileStreamWrite stream;
+
+    result = stream.open(writeName);
+    if (result != SYSTEM_ERROR_NONE) {
+        return result;
+    }
+    result = particle::encodeToCBOR(variant, stream);
+
+    if (result == SYSTEM_ERROR_NONE && (flags & STORE_SYNC)) {
+        result = stream.sync();
+    }
+
+    int closeResult = stream.close();
+    if (result == SYSTEM_ERROR_NONE) {
+        result = closeResult;
+    }
+
+    if (hasDelta) {
+        if (result == SYSTEM_ERROR_NONE) {
+            result = _variantReplace(fileName, tempName);
+        }
+        else {
+            unlink(tempName);
+        }
+    }
+    else
+    if (flags & STORE_ATOMIC) {
+        result = finishTempFile(tempName, fileName, result);
+        notifyChanged(fileName);
+    }
+    // Otherwise the stream reported the change, and _variantReplace() reports the rename
+
+    return result;
+}
+
+/**
+ * @brief Operation in a Variant delta log record
+ */
+enum {
+    _VARIANT_DELTA_SET = 1,
+    _VARIANT_DELTA_REMOVE = 2
+};
+
+/**
+ * @brief Header at the beginning of a Variant delta log file
+ */
+struct _VariantDeltaHeader {
+    uint32_t magic;         //!< _variantDeltaMagic
+    uint16_t version;       //!< 1
+    uint16_t headerSize;    //!< sizeof(_VariantDeltaHeader)
+};
+static const uint32_t _variantDeltaMagic = 0x44564846; // "FHVD" in little endian
+
+static void _cborWriteHead(Print &out, uint8_t majorType, uint64_t value) {
+    uint8_t buf[9];
+    size_t len;
+
+    if (value < 24) {
+        buf[0] = (uint8_t)((majorType << 5) | value);
+        len = 1;
+    }
+    else {
+        int numBytes = (value <= 0xff) ? 1 : (value <= 0xffff) ? 2 : (value <= 0xffffffff) ? 4 : 8;
+        buf[0] = (uint8_t)((majorType << 5) | ((numBytes == 1) ? 24 : (numBytes == 2) ? 25 : (numBytes == 4) ? 26 : 27));
+        for(int ii = 0; ii < numBytes; ii++) {
+            buf[1 + ii] = (uint8_t)(value >> (8 * (numBytes - 1 - ii)));
+        }
+        len = 1 + numBytes;
+    }
+    out.write(buf, len);
+}
+
+/**
+ * @brief Encode a delta log record as a CBOR array [op, path] or [op, path, value]
+ */
+static int _variantWriteDelta(Print &out, int op, const char *path, const particle::Variant *value) {
+    size_t pathLen = strlen(path);
+
+    _cborWriteHead(out, 4, value ? 3 : 2);
+    _cborWriteHead(out, 0, (uint64_t)op);
+    _cborWriteHead(out, 3, pathLen);
+    out.write((const uint8_t *)path, pathLen);
+    if (value) {
+        return particle::encodeToCBOR(*value, out);
+    }
+    return SYSTEM_ERROR_NONE;
+}
+
+/**
+ * @brief Apply a set or remove operation to a Variant in RAM
+ * 
+ * @param doc Variant to modify
+ * @param path Remaining path. Map keys and decimal array indexes separated by slashes.
+ * @param op _VARIANT_DELTA_SET or _VARIANT_DELTA_REMOVE
+ * @param value Value to set
+ * @return true if the path was valid
+ */
+static bool _variantApply(particle::Variant &doc, const char *path, int op, const particle::Variant &value) {
+    while(*path == FileHelperRK::pathDelim[0]) {
+        path++;
+    }
+    if (*path == 0) {
+        doc = (op == _VARIANT_DELTA_SET) ? value : particle::Variant();
+        return true;
+    }
+
+    const char *end = strchr(path, FileHelperRK::pathDelim[0]);
+    String segment = end ? String(path).substring(0, end - path) : String(path);
+    bool isLast = !end || end[strspn(end, FileHelperRK::pathDelim)] == 0;
+
+    if (doc.isArray()) {
+        char *endNum = nullptr;
+        long index = strtol(segment, &endNum, 10);
+        if (segment.length() == 0 || *endNum != 0 || index < 0 || index > doc.size()) {
+            return false;
+        }
+        if (isLast && op == _VARIANT_DELTA_REMOVE) {
+            if (index < doc.size()) {
+                particle::Variant newArray;
+                newArray.asArray();
+                for(int ii = 0; ii < doc.size(); ii++) {
+                    if (ii != index) {
+                        newArray.append(doc.at(ii));
+                    }
+                }
+                doc = newArray;
+            }
+            return true;
+        }
+        if (index == doc.size()) {
+            if (op == _VARIANT_DELTA_REMOVE) {
+                return true;
+            }
+            doc.append(particle::Variant());
+        }
+        if (isLast) {
+            doc.asArray()[index] = value;
+            return true;
+        }
+        particle::Variant child = doc.at(index);
+        bool result = _variantApply(child, end, op, value);
+        doc.asArray()[index] = child;
+        return result;
     }
 
-    while(!directoriesToDelete.empty()) {
-        String newPath = pathJoin(path, directoriesToDelete.front());
-        result = deleteRecursive(newPath, false);
-        if (result) {
-            _fileHelperLog.info("deleteRecursive inner failure fileName=%s result=%d", newPath.c_str(), result);
+    if (!doc.isMap()) {
+        if (op == _VARIANT_DELTA_REMOVE) {
+            return true;
         }
-        directoriesToDelete.pop_front();
+        // Setting a key in a non-map (including null) makes it a map
+        doc.asMap();
     }
 
-    while(!filesToDelete.empty()) {
-        String newPath = pathJoin(path, filesToDelete.front());
-        result = unlink(newPath);
-        if (result == -1) {
-            _fileHelperLog.info("deleteRecursive unlink failed fileName=%s errno=%d", newPath.c_str(), errno);
-            result = errnoToSystemError();
-            break;
+    if (isLast) {
+        if (op == _VARIANT_DELTA_SET) {
+            doc.set(segment, value);
         }
-        filesToDelete.pop_front();
+        else {
+            doc.remove(segment);
+        }
+        return true;
     }
+    if (op == _VARIANT_DELTA_REMOVE && !doc.has(segment)) {
+        return true;
+    }
+    particle::Variant child = doc.get(segment);
+    bool result = _variantApply(child, end, op, value);
+    doc.set(segment, child);
+    return result;
+}
 
-    if (!contentsOfPathOnly) {
-        result = rmdir(path);
-        if (result == -1) {
-            _fileHelperLog.info("deleteRecursive unlink self failed fileName=%s errno=%d", path, errno);
-            result = errnoToSystemError();
+static int _cborReadHead(FileHelperRK::FileStreamRead &stream, uint8_t &majorType, uint8_t &info, uint64_t &value);
+
+/**
+ * @brief Find path in a Variant in RAM. Same path syntax and results as seekCborPath().
+ */
+static int _variantGetPath(const particle::Variant &doc, const char *path, particle::Variant &variant) {
+    particle::Variant cur = doc;
+
+    const char *segment = path;
+    while(segment && *segment) {
+        const char *end = strchr(segment, FileHelperRK::pathDelim[0]);
+        size_t segmentLen = end ? (size_t)(end - segment) : strlen(segment);
+        if (segmentLen == 0) {
+            segment++;
+            continue;
+        }
+        String key = String(segment).substring(0, segmentLen);
+
+        if (cur.isMap()) {
+            if (!cur.has(key)) {
+                return SYSTEM_ERROR_NOT_FOUND;
+            }
+            particle::Variant child = cur.get(key);
+            cur = child;
+        }
+        else
+        if (cur.isArray()) {
+            char *endNum = nullptr;
+            long index = strtol(key, &endNum, 10);
+            if (*endNum != 0 || key.charAt(0) < '0' || key.charAt(0) > '9' || index >= cur.size()) {
+                return SYSTEM_ERROR_NOT_FOUND;
+            }
+            particle::Variant child = cur.at(index);
+            cur = child;
         }
+        else {
+            return SYSTEM_ERROR_NOT_FOUND;
+        }
+        segment += segmentLen;
     }
+    variant = cur;
+    return SYSTEM_ERROR_NONE;
+}
 
-    return result;
+/**
+ * @brief Parse an array index in a path. Same rules as seekCborPath().
+ */
+static bool _variantParseIndex(const char *segment, long &index) {
+    if (*segment < '0' || *segment > '9') {
+        return false;
+    }
+    char *endNum = nullptr;
+    index = strtol(segment, &endNum, 10);
+    return *endNum == 0;
 }
 
-String FileHelperRK::WalkParameters::toString() const {
-    if (isDirectory) {
-        return String::format("%s (directory)", path);
+/**
+ * @brief Returns true if removing removePath from doc would move an omitted array element onto path
+ * 
+ * When doc is from _variantReadPartial(), only the items along path are present and the other
+ * elements of arrays are null placeholders. Removing an element at or before the element on path 
+ * shifts a placeholder onto path.
+ */
+static bool _variantRemoveShifts(const particle::Variant &doc, const char *removePath, const char *path) {
+    FileHelperRK::ParsedPath removeParsed, parsed;
+    if (removeParsed.parse(removePath) != SYSTEM_ERROR_NONE || parsed.parse(path) != SYSTEM_ERROR_NONE) {
+        return true;
     }
-    else {
-        return String::format("%s (%d bytes)", path, size);
+
+    // Level of the array that the element is removed from
+    int level = removeParsed.getNumParts() - 1;
+    if (level < 0 || level >= parsed.getNumParts()) {
+        return false;
+    }
+    for(int ii = 0; ii < level; ii++) {
+        FileHelperRK::ParsedPath::PartView a = removeParsed.getPartView(ii);
+        FileHelperRK::ParsedPath::PartView b = parsed.getPartView(ii);
+        if (a.length != b.length || memcmp(a.data, b.data, a.length) != 0) {
+            // Different branch
+            return false;
+        }
+    }
+
+    particle::Variant parent;
+    if (_variantGetPath(doc, removeParsed.getPrefix(level), parent) != SYSTEM_ERROR_NONE || !parent.isArray()) {
+        return false;
     }
+    long removeIndex, index;
+    if (!_variantParseIndex(removeParsed.getPart(level), removeIndex) || !_variantParseIndex(parsed.getPart(level), index)) {
+        return false;
+    }
+    return removeIndex <= index;
 }
 
+/**
+ * @brief Read the records in the delta log of fileName
+ * 
+ * @param fileName Base file name, not the name of the delta log
+ * @param variant Each valid record is applied to this Variant. If nullptr, only the CRCs are checked.
+ * @param validEnd If not nullptr, filled in with the offset just past the last valid record, or 0 if there is no log
+ * @param partialPath If not nullptr, variant is from _variantReadPartial() for this path
+ * @return int SYSTEM_ERROR_NONE, including when there is no log, or SYSTEM_ERROR_BAD_DATA if the log header is invalid.
+ * SYSTEM_ERROR_NOT_SUPPORTED if a record cannot be applied to a partial document (see _variantRemoveShifts()).
+ * 
+ * Reading stops at the first record with a bad length or CRC, such as a record that was partially 
+ * written when power was lost.
+ */
+static int _variantScanDelta(const char *fileName, particle::Variant *variant, size_t *validEnd, const char *partialPath) {
+    FileHelperRK::FileStreamRead stream;
 
-int FileHelperRK::walk(const char *path, std::function<void(const WalkParameters &pParam)> cb) {
-    int result = SYSTEM_ERROR_UNKNOWN;
-    
+    if (validEnd) {
+        *validEnd = 0;
+    }
 
-    struct stat sb;
+    if (stream.open(String(fileName) + FileHelperRK::variantDeltaSuffix) != SYSTEM_ERROR_NONE) {
+        // No delta log
+        return SYSTEM_ERROR_NONE;
+    }
 
-    result = stat(path, &sb);
-    if (result == -1) {
-        return errnoToSystemError();
+    _VariantDeltaHeader header;
+    size_t headerLen = stream.readBytes((uint8_t *)&header, sizeof(header));
+    if (headerLen < sizeof(header)) {
+        // Header was not completely written, treat as no log
+        return SYSTEM_ERROR_NONE;
+    }
+    if (header.magic != _variantDeltaMagic || header.headerSize < sizeof(header)) {
+        _fileHelperLog.info("invalid delta log for %s", fileName);
+        return SYSTEM_ERROR_BAD_DATA;
     }
 
-    WalkParameters walkParameters;
-    walkParameters.path = path;
+    size_t offset = header.headerSize;
+    while(true) {
+        uint32_t len;
+        if (stream.seek(offset) != SYSTEM_ERROR_NONE || stream.readBytes((uint8_t *)&len, sizeof(len)) != sizeof(len) || 
+            len + sizeof(uint32_t) > (size_t)stream.available()) {
+            break;
+        }
 
+        // Check the CRC before decoding
+        uint32_t crc = FileHelperRK::crc32(&len, sizeof(len));
+        uint8_t buf[64];
+        size_t remaining = len;
+        while(remaining > 0) {
+            size_t chunk = (remaining < sizeof(buf)) ? remaining : sizeof(buf);
+            if (stream.readBytes(buf, chunk) != chunk) {
+                break;
+            }
+            crc = FileHelperRK::crc32(buf, chunk, crc);
+            remaining -= chunk;
+        }
+        uint32_t fileCrc;
+        if (remaining != 0 || stream.readBytes((uint8_t *)&fileCrc, sizeof(fileCrc)) != sizeof(fileCrc) || fileCrc != crc) {
+            break;
+        }
 
-    if ((sb.st_mode & S_IFDIR) != 0) {
-        walkParameters.isDirectory = true;
-        walkParameters.size = 0;
-        cb(walkParameters);
+        if (variant) {
+            particle::Variant record;
+            if (stream.seek(offset + sizeof(len)) != SYSTEM_ERROR_NONE || particle::decodeFromCBOR(record, stream) != SYSTEM_ERROR_NONE) {
+                break;
+            }
+            if (record.isArray() && record.size() >= 2) {
+                int op = record.at(0).toInt();
+                String recordPath = record.at(1).toString();
+                if (partialPath && op == _VARIANT_DELTA_REMOVE && _variantRemoveShifts(*variant, recordPath, partialPath)) {
+                    return SYSTEM_ERROR_NOT_SUPPORTED;
+                }
+                // Paths are checked by patchVariant() before the record is written
+                _variantApply(*variant, recordPath, op, record.at(2));
+            }
+        }
 
-        // _fileHelperLog.trace("walk path=%s", path);  
-        std::deque<String> filesToCheck;
-        std::deque<String> directoriesToCheck;
+        offset += sizeof(len) + len + sizeof(uint32_t);
+    }
 
-        DIR *dirp = opendir(path);
-        if (dirp) {      
-            while(true) {
-                struct dirent *de = readdir(dirp);
-                if (!de) {
-                    break;
-                }
-                // _fileHelperLog.trace("walk de->d_name=%s", de->d_name);  
+    if (validEnd) {
+        *validEnd = offset;
+    }
+    return SYSTEM_ERROR_NONE;
+}
 
-                if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) {
-                    continue;
+/**
+ * @brief Read the base file and apply the delta log. Same as readVariant() without crash recovery.
+ * 
+ * @param validEnd If not nullptr, filled in with the offset just past the last valid record in the delta log
+ */
+static int _variantRead(const char *fileName, particle::Variant &variant, size_t *validEnd) {
+    FileHelperRK::FileStreamRead stream;
+
+    int result = stream.open(fileName);
+    if (result != SYSTEM_ERROR_NONE) {
+        if (!_fileExists(String(fileName) + FileHelperRK::variantDeltaSuffix)) {
+            return result;
+        }
+        // Created by patchVariant() only
+        variant = particle::Variant();
+        return _variantScanDelta(fileName, &variant, validEnd, nullptr);
+    }
+
+    result = particle::decodeFromCBOR(variant, stream);
+
+    stream.close();
+
+    if (result == SYSTEM_ERROR_NONE) {
+        result = _variantScanDelta(fileName, &variant, validEnd, nullptr);
+    }
+    return result;
+}
+
+/**
+ * @brief Read only the items along path from the base file, then apply the delta log
+ * 
+ * @param path Slash-separated path of map keys and array indexes
+ * @param withValue true to decode the item at path. If false, it is null, which is enough to check path with _variantApply().
+ * @param doc Filled in with a document that has the same maps, array sizes, and types along path as the whole
+ * document. Map keys that are not on path are omitted and other array elements are null.
+ * @param validEnd If not nullptr, filled in with the offset just past the last valid record in the delta log
+ * 
+ * Falls back to _variantRead() if the delta log removes an array element that shifts an omitted element
+ * onto path, or an array on path has an indefinite length.
+ */
+static int _variantReadPartial(const char *fileName, const char *path, bool withValue, particle::Variant &doc, size_t *validEnd) {
+    FileHelperRK::ParsedPath parsed;
+    int result = parsed.parse(path);
+    if (result != SYSTEM_ERROR_NONE) {
+        return result;
+    }
+    int numParts = parsed.getNumParts();
+
+    // nodes[ii] is the item at the first ii parts of path
+    std::vector<particle::Variant> nodes;
+
+    FileHelperRK::FileStreamRead stream;
+    result = stream.open(fileName);
+    if (result != SYSTEM_ERROR_NONE) {
+        if (!_fileExists(String(fileName) + FileHelperRK::variantDeltaSuffix)) {
+            return result;
+        }
+        // Created by patchVariant() only
+        result = SYSTEM_ERROR_NONE;
+    }
+    else {
+        for(int ii = 0; ii <= numParts; ii++) {
+            particle::Variant node;
+            if (ii == numParts) {
+                if (withValue) {
+                    result = particle::decodeFromCBOR(node, stream);
                 }
+                nodes.push_back(node);
+                break;
+            }
 
-                if (de->d_type & DT_DIR) {
-                    directoriesToCheck.push_back(de->d_name);
+            size_t start = stream.tell();
+            uint8_t majorType, info;
+            uint64_t value;
+            do {
+                result = _cborReadHead(stream, majorType, info, value);
+            } while(result == SYSTEM_ERROR_NONE && majorType == 6);
+            if (result != SYSTEM_ERROR_NONE) {
+                break;
+            }
+            if (majorType == 5) {
+                node.asMap();
+            }
+            else
+            if (majorType == 4) {
+                if (info == 31) {
+                    result = SYSTEM_ERROR_NOT_SUPPORTED;
+                    break;
                 }
-                else 
-                if (de->d_type & DT_REG) {
-                    filesToCheck.push_back(de->d_name);
+                if (value > (uint64_t)stream.available()) {
+                    result = SYSTEM_ERROR_BAD_DATA;
+                    break;
+                }
+                node.asArray();
+                for(uint64_t jj = 0; jj < value; jj++) {
+                    node.append(particle::Variant());
                 }
             }
+            // Otherwise a scalar, which cannot contain the rest of path, so its value is not needed
+            nodes.push_back(node);
 
-            closedir(dirp);        
-        }        
-
-        while(!directoriesToCheck.empty()) {
-            result = walk(pathJoin(path, directoriesToCheck.front()), cb);
-            if (result) {
-                return result;
+            result = stream.seek(start);
+            if (result == SYSTEM_ERROR_NONE) {
+                result = FileHelperRK::seekCborPath(stream, parsed.getPart(ii));
+            }
+            if (result == SYSTEM_ERROR_NOT_FOUND) {
+                // The rest of path does not exist in the base file
+                result = SYSTEM_ERROR_NONE;
+                break;
+            }
+            if (result != SYSTEM_ERROR_NONE) {
+                break;
             }
-            directoriesToCheck.pop_front();
         }
-        while(!filesToCheck.empty()) {
-            result = walk(pathJoin(path, filesToCheck.front()), cb);
-            if (result) {
-                return result;
+        stream.close();
+    }
+
+    if (result == SYSTEM_ERROR_NONE) {
+        // Put the items back together, from the end of path to the root
+        doc = nodes.empty() ? particle::Variant() : nodes.back();
+        for(int ii = (int)nodes.size() - 2; ii >= 0; ii--) {
+            particle::Variant parent = nodes[ii];
+            String part = parsed.getPart(ii);
+            if (parent.isMap()) {
+                parent.set(part, doc);
+            }
+            else {
+                parent.asArray()[strtol(part, nullptr, 10)] = doc;
             }
-            filesToCheck.pop_front();
+            doc = parent;
         }
+
+        result = _variantScanDelta(fileName, &doc, validEnd, path);
     }
-    else {
-        walkParameters.isDirectory = false;
-        walkParameters.size = sb.st_size;
-        cb(walkParameters);
+    if (result == SYSTEM_ERROR_NOT_SUPPORTED) {
+        result = _variantRead(fileName, doc, validEnd);
     }
+    return result;
+}
 
+static int _variantAppendDelta(const char *fileName, int op, const char *path, const particle::Variant *value, int flags, size_t *bytesWritten) {
+    int result;
+    size_t written = 0;
 
+    if (bytesWritten) {
+        *bytesWritten = 0;
+    }
 
-    return result;
-}
+    _variantRecover(fileName);
 
+    String deltaName = String(fileName) + FileHelperRK::variantDeltaSuffix;
 
-int FileHelperRK::storeBytes(const char *fileName, const uint8_t *dataPtr, size_t dataLen)
-{
-    int result = SYSTEM_ERROR_UNKNOWN;
+    // Check the path against the current document so an invalid path is an error now,
+    // instead of a record that is silently ignored when read. Only the items along path are read.
+    particle::Variant doc;
+    size_t deltaEnd = 0;
+    if (_fileExists(fileName) || _fileExists(deltaName)) {
+        result = _variantReadPartial(fileName, path, false, doc, &deltaEnd);
+        if (result != SYSTEM_ERROR_NONE) {
+            return result;
+        }
+    }
+    if (!_variantApply(doc, path, op, value ? *value : particle::Variant())) {
+        _fileHelperLog.info("patchVariant path not found fileName=%s path=%s", fileName, path);
+        return SYSTEM_ERROR_NOT_FOUND;
+    }
 
-    int fd = open(fileName, O_RDWR | O_CREAT | O_TRUNC, 0666);
-    if (fd != -1) {
-        if (dataPtr && dataLen > 0) {
-            int resultLen = write(fd, dataPtr, dataLen);
-            if (resultLen == (int) dataLen) {
-                result = SYSTEM_ERROR_NONE;
-            }
-            else {
-                _fileHelperLog.error("storeBytes bad length expected=%d got=%d", (int)dataLen, (int)resultLen);
-            }
+    _FileHelperCountingPrint countingPrint;
+    result = _variantWriteDelta(countingPrint, op, path, value);
+    if (result != SYSTEM_ERROR_NONE) {
+        return result;
+    }
+
+    struct stat sb;
+    bool newDelta = (deltaEnd == 0);
+    if (!newDelta && stat(deltaName, &sb) == 0 && (size_t)sb.st_size > deltaEnd) {
+        // Remove a partially written record, otherwise the records appended after it would never be read
+        _fileHelperLog.info("removing partial record from %s size=%d valid=%d", deltaName.c_str(), (int)sb.st_size, (int)deltaEnd);
+        int fd = open(deltaName, O_WRONLY);
+        if (fd == -1 || ftruncate(fd, deltaEnd) == -1) {
+            result = FileHelperRK::errnoToSystemError();
         }
-        else {
-            // Empty string, not an error
-            result = SYSTEM_ERROR_NONE;            
+        if (fd != -1) {
+            close(fd);
+        }
+        if (result != SYSTEM_ERROR_NONE) {
+            return result;
         }
+    }
+    size_t deltaSize = deltaEnd;
 
-        close(fd);
+    FileHelperRK::FileStreamWrite stream;
+    result = stream.open(deltaName, O_WRONLY | O_CREAT | O_APPEND | (newDelta ? O_TRUNC : 0), 0666);
+    if (result != SYSTEM_ERROR_NONE) {
+        return result;
     }
-    else {
-        _fileHelperLog.info("storeBytes did not open fileName=%s errno=%d", fileName, errno);
-        result = errnoToSystemError();
+    if (newDelta) {
+        _VariantDeltaHeader header = {_variantDeltaMagic, 1, sizeof(_VariantDeltaHeader)};
+        stream.write((const uint8_t *)&header, sizeof(header));
+        written += sizeof(header);
     }
 
+    // Same framing as RecordQueue: length, data, CRC-32 of length and data
+    uint32_t len = (uint32_t) countingPrint.count;
+    stream.write((const uint8_t *)&len, sizeof(len));
+    _FileHelperCrcPrint crcPrint(stream, FileHelperRK::crc32(&len, sizeof(len)));
+    _variantWriteDelta(crcPrint, op, path, value);
+    stream.write((const uint8_t *)&crcPrint.crc, sizeof(uint32_t));
+    written += len + 8;
+
+    if (flags & FileHelperRK::STORE_SYNC) {
+        result = stream.sync();
+    }
+    int closeResult = stream.close();
+    if (result == SYSTEM_ERROR_NONE) {
+        result = closeResult;
+    }
+    deltaSize += written;
+
+    if (result == SYSTEM_ERROR_NONE && deltaSize >= FileHelperRK::variantDeltaCompactSize) {
+        size_t baseSize = (stat(fileName, &sb) == 0) ? (size_t)sb.st_size : 0;
+        if (deltaSize >= baseSize) {
+            size_t compactWritten = 0;
+            result = FileHelperRK::compactVariant(fileName, &compactWritten);
+            written += compactWritten;
+        }
+    }
+
+    if (bytesWritten) {
+        *bytesWritten = written;
+    }
     return result;
 }
 
+int FileHelperRK::patchVariant(const char *fileName, const char *path, const particle::Variant &value, int flags, size_t *bytesWritten) {
+    return _variantAppendDelta(fileName, _VARIANT_DELTA_SET, path, &value, flags, bytesWritten);
+}
 
-int FileHelperRK::storeString(const char *fileName, const String &data)
-{
-    return storeBytes(fileName, (const uint8_t *)data.c_str(), data.length());
+int FileHelperRK::patchVariantRemove(const char *fileName, const char *path, int flags, size_t *bytesWritten) {
+    return _variantAppendDelta(fileName, _VARIANT_DELTA_REMOVE, path, nullptr, flags, bytesWritten);
 }
 
-int FileHelperRK::storeString(const char *fileName, const char *str)
-{
-    if (str) {
-        return storeBytes(fileName, (const uint8_t *)str, strlen(str));
+int FileHelperRK::compactVariant(const char *fileName, size_t *bytesWritten) {
+    if (bytesWritten) {
+        *bytesWritten = 0;
     }
-    else {
-        return storeBytes(fileName, nullptr, 0);
-    }
-}
 
-#if defined(SYSTEM_VERSION_560) || defined(UNITTEST)
-int FileHelperRK::storeVariant(const char *fileName, const particle::Variant &variant) {
-    int result = SYSTEM_ERROR_UNKNOWN;
+    _variantRecover(fileName);
 
-    FileHelperRK::FileStreamWrite stream;
+    if (!_fileExists(String(fileName) + variantDeltaSuffix)) {
+        return SYSTEM_ERROR_NONE;
+    }
 
-    result = stream.open(fileName);
+    particle::Variant variant;
+    int result = readVariant(fileName, variant);
     if (result != SYSTEM_ERROR_NONE) {
         return result;
     }
-    result = particle::encodeToCBOR(variant, stream);
 
-    stream.close();
+    // storeVariant() replaces the file and removes the delta log
+    result = storeVariant(fileName, variant, STORE_SYNC);
+    if (result == SYSTEM_ERROR_NONE && bytesWritten) {
+        struct stat sb;
+        if (stat(fileName, &sb) == 0) {
+            *bytesWritten = (size_t)sb.st_size;
+        }
+    }
+    return result;
+}
+#endif // SYSTEM_VERSION_560
+
+String FileHelperRK::getTempFileName(const char *fileName) {
+    String result(fileName);
+    result.concat(tempFileSuffix);
+    return result;
+}
+
+int FileHelperRK::finishTempFile(const char *tempName, const char *fileName, int result) {
+    if (result == SYSTEM_ERROR_NONE) {
+        if (rename(tempName, fileName) == -1) {
+            _fileHelperLog.info("rename failed tempName=%s fileName=%s errno=%d", tempName, fileName, errno);
+            result = errnoToSystemError();
+        }
+    }
+    if (result != SYSTEM_ERROR_NONE) {
+        // Leave the original file in place
+        unlink(tempName);
+    }
+    return result;
+}
+
+int FileHelperRK::cleanupTempFiles(const char *path, bool recursive) {
+    int result = SYSTEM_ERROR_NONE;
+    size_t suffixLen = strlen(tempFileSuffix);
+
+    std::deque<String> filesToDelete;
+    std::deque<String> directoriesToCheck;
+
+    DIR *dirp = opendir(path);
+    if (!dirp) {
+        _fileHelperLog.info("cleanupTempFiles did not open path=%s errno=%d", path, errno);
+        return errnoToSystemError();
+    }
+    while(true) {
+        struct dirent *de = readdir(dirp);
+        if (!de) {
+            break;
+        }
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) {
+            continue;
+        }
+
+        if (de->d_type & DT_DIR) {
+            if (recursive) {
+                directoriesToCheck.push_back(de->d_name);
+            }
+        }
+        else 
+        if (de->d_type & DT_REG) {
+            size_t nameLen = strlen(de->d_name);
+            if (nameLen > suffixLen && strcmp(&de->d_name[nameLen - suffixLen], tempFileSuffix) == 0) {
+                filesToDelete.push_back(de->d_name);
+            }
+        }
+    }
+    closedir(dirp);        
+
+    while(!filesToDelete.empty()) {
+        String newPath = pathJoin(path, filesToDelete.front());
+        _fileHelperLog.info("cleanupTempFiles removing %s", newPath.c_str());
+        if (unlink(newPath) == -1) {
+            _fileHelperLog.info("cleanupTempFiles unlink failed fileName=%s errno=%d", newPath.c_str(), errno);
+            result = errnoToSystemError();
+        }
+        notifyChanged(newPath);
+        filesToDelete.pop_front();
+    }
+
+    while(!directoriesToCheck.empty()) {
+        int tempResult = cleanupTempFiles(pathJoin(path, directoriesToCheck.front()), true);
+        if (tempResult != SYSTEM_ERROR_NONE) {
+            result = tempResult;
+        }
+        directoriesToCheck.pop_front();
+    }
+
+    return result;
+}
+
+int FileHelperRK::readBytes(const char *fileName, uint8_t *&dataPtr, size_t &dataLen, bool nullTerminate)
+{
+    return readBytes(fileName, HeapAllocator::instance(), dataPtr, dataLen, nullTerminate);
+}
+
+int FileHelperRK::readBytes(const char *fileName, OwnedBuffer &buffer, bool nullTerminate)
+{
+    return readBytes(fileName, HeapAllocator::instance(), buffer, nullTerminate);
+}
+
+int FileHelperRK::readBytes(const char *fileName, Allocator &allocator, OwnedBuffer &buffer, bool nullTerminate)
+{
+    uint8_t *dataPtr = nullptr;
+    size_t dataLen = 0;
+
+    buffer.free();
+
+    int result = readBytes(fileName, allocator, dataPtr, dataLen, nullTerminate);
+    if (dataPtr) {
+        buffer.set(dataPtr, dataLen, &allocator);
+    }
     return result;
 }
-#endif // SYSTEM_VERSION_560
 
-int FileHelperRK::readBytes(const char *fileName, uint8_t *&dataPtr, size_t &dataLen, bool nullTerminate)
+int FileHelperRK::readBytes(const char *fileName, Allocator &allocator, uint8_t *&dataPtr, size_t &dataLen, bool nullTerminate)
 {
     int result = SYSTEM_ERROR_UNKNOWN;
 
@@ -520,7 +4617,7 @@ int FileHelperRK::readBytes(const char *fileName, uint8_t *&dataPtr, size_t &dat
         result = fstat(fd, &sb); 
         if (result == 0) {
             if (sb.st_size > 0) {
-                dataPtr = new uint8_t[sb.st_size + (nullTerminate ? 1 : 0)];
+                dataPtr = allocator.allocate(sb.st_size + (nullTerminate ? 1 : 0));
                 if (dataPtr) {
                     int readLen = read(fd, dataPtr, sb.st_size);
                     if (readLen == sb.st_size) {
@@ -533,6 +4630,8 @@ int FileHelperRK::readBytes(const char *fileName, uint8_t *&dataPtr, size_t &dat
                     else {
                         _fileHelperLog.error("readBytes bad length expected=%d got=%d", (int)sb.st_size, (int)readLen);
                         result = errnoToSystemError();
+                        allocator.release(dataPtr);
+                        dataPtr = nullptr;
                     }        
                 }
                 else {
@@ -541,12 +4640,17 @@ int FileHelperRK::readBytes(const char *fileName, uint8_t *&dataPtr, size_t &dat
             }
             else {
                 // Empty file, not an error                
+                result = SYSTEM_ERROR_NONE;
+
                 if (nullTerminate) {
-                    dataPtr = new uint8_t[1];                    
-                    dataPtr[0] = 0;
+                    dataPtr = allocator.allocate(1);
+                    if (dataPtr) {
+                        dataPtr[0] = 0;
+                    }
+                    else {
+                        result = SYSTEM_ERROR_NO_MEMORY;
+                    }
                 }
-
-                result = SYSTEM_ERROR_NONE;
             }
 
             close(fd);
@@ -614,32 +4718,422 @@ int FileHelperRK::readBytesNoAlloc(const char *fileName, uint8_t *dataPtr, size_
 
 
 
+int FileHelperRK::storeBytesVersioned(const char *fileName, const uint8_t *dataPtr, size_t dataLen, uint16_t version, int flags) {
+    int result = SYSTEM_ERROR_UNKNOWN;
+
+    uint8_t *buf = new uint8_t[sizeof(StructHeader) + dataLen];
+    if (!buf) {
+        return SYSTEM_ERROR_NO_MEMORY;
+    }
+
+    StructHeader header;
+    header.magic = structMagic;
+    header.version = version;
+    header.headerSize = sizeof(StructHeader);
+    header.dataSize = dataLen;
+    header.crc = crc32(dataPtr, dataLen, crc32(&header, offsetof(StructHeader, crc)));
+
+    memcpy(buf, &header, sizeof(StructHeader));
+    if (dataLen) {
+        memcpy(&buf[sizeof(StructHeader)], dataPtr, dataLen);
+    }
+
+    result = storeBytes(fileName, buf, sizeof(StructHeader) + dataLen, flags);
+
+    delete[] buf;
+
+    return result;
+}
+
+int FileHelperRK::readBytesVersioned(const char *fileName, uint8_t *dataPtr, size_t dataLen, uint16_t version, std::function<int(uint16_t fileVersion, const uint8_t *data, size_t dataLen)> migrate) {
+    int result = SYSTEM_ERROR_UNKNOWN;
+
+    int fd = open(fileName, O_RDONLY);
+    if (fd == -1) {
+        _fileHelperLog.info("readBytesVersioned did not open fileName=%s errno=%d", fileName, errno);
+        return errnoToSystemError();
+    }
+
+    StructHeader header;
+    int readLen = read(fd, &header, sizeof(StructHeader));
+    if (readLen != sizeof(StructHeader) || header.magic != structMagic || header.headerSize < sizeof(StructHeader)) {
+        _fileHelperLog.info("readBytesVersioned invalid header fileName=%s", fileName);
+        close(fd);
+        return SYSTEM_ERROR_BAD_DATA;
+    }
+
+    // Check the sizes in the header against the file before allocating a buffer from them
+    struct stat sb;
+    if (fstat(fd, &sb) == -1 || (uint64_t)header.headerSize + header.dataSize > (uint64_t)sb.st_size) {
+        _fileHelperLog.info("readBytesVersioned header larger than file fileName=%s dataSize=%lu", fileName, (unsigned long)header.dataSize);
+        close(fd);
+        return SYSTEM_ERROR_BAD_DATA;
+    }
+
+    if (header.headerSize > sizeof(StructHeader)) {
+        // Written by a later version with a larger header
+        lseek(fd, header.headerSize, SEEK_SET);
+    }
+
+    if (header.version == version) {
+        if (header.dataSize == dataLen) {
+            readLen = read(fd, dataPtr, dataLen);
+            if (readLen == (int)dataLen && header.crc == crc32(dataPtr, dataLen, crc32(&header, offsetof(StructHeader, crc)))) {
+                result = SYSTEM_ERROR_NONE;
+            }
+            else {
+                _fileHelperLog.info("readBytesVersioned bad data fileName=%s readLen=%d", fileName, readLen);
+                result = SYSTEM_ERROR_BAD_DATA;
+            }
+        }
+        else {
+            _fileHelperLog.info("readBytesVersioned size mismatch fileName=%s expected=%d got=%d", fileName, (int)dataLen, (int)header.dataSize);
+            result = SYSTEM_ERROR_BAD_DATA;
+        }
+    }
+    else 
+    if (migrate) {
+        uint8_t *buf = new uint8_t[header.dataSize ? header.dataSize : 1];
+        if (buf) {
+            readLen = read(fd, buf, header.dataSize);
+            if (readLen == (int)header.dataSize && header.crc == crc32(buf, header.dataSize, crc32(&header, offsetof(StructHeader, crc)))) {
+                _fileHelperLog.info("readBytesVersioned migrating fileName=%s from version=%d to version=%d", fileName, (int)header.version, (int)version);
+                result = migrate(header.version, buf, header.dataSize);
+            }
+            else {
+                _fileHelperLog.info("readBytesVersioned bad data fileName=%s readLen=%d", fileName, readLen);
+                result = SYSTEM_ERROR_BAD_DATA;
+            }
+            delete[] buf;
+        }
+        else {
+            result = SYSTEM_ERROR_NO_MEMORY;
+        }
+    }
+    else {
+        _fileHelperLog.info("readBytesVersioned version mismatch fileName=%s expected=%d got=%d", fileName, (int)version, (int)header.version);
+        result = SYSTEM_ERROR_NOT_SUPPORTED;
+    }
+
+    close(fd);
+
+    return result;
+}
+
+static const uint32_t _crc32Table[256] = {
+    0x00000000, 0x77073096, 0xee0e612c, 0x990951ba, 0x076dc419, 0x706af48f,
+    0xe963a535, 0x9e6495a3, 0x0edb8832, 0x79dcb8a4, 0xe0d5e91e, 0x97d2d988,
+    0x09b64c2b, 0x7eb17cbd, 0xe7b82d07, 0x90bf1d91, 0x1db71064, 0x6ab020f2,
+    0xf3b97148, 0x84be41de, 0x1adad47d, 0x6ddde4eb, 0xf4d4b551, 0x83d385c7,
+    0x136c9856, 0x646ba8c0, 0xfd62f97a, 0x8a65c9ec, 0x14015c4f, 0x63066cd9,
+    0xfa0f3d63, 0x8d080df5, 0x3b6e20c8, 0x4c69105e, 0xd56041e4, 0xa2677172,
+    0x3c03e4d1, 0x4b04d447, 0xd20d85fd, 0xa50ab56b, 0x35b5a8fa, 0x42b2986c,
+    0xdbbbc9d6, 0xacbcf940, 0x32d86ce3, 0x45df5c75, 0xdcd60dcf, 0xabd13d59,
+    0x26d930ac, 0x51de003a, 0xc8d75180, 0xbfd06116, 0x21b4f4b5, 0x56b3c423,
+    0xcfba9599, 0xb8bda50f, 0x2802b89e, 0x5f058808, 0xc60cd9b2, 0xb10be924,
+    0x2f6f7c87, 0x58684c11, 0xc1611dab, 0xb6662d3d, 0x76dc4190, 0x01db7106,
+    0x98d220bc, 0xefd5102a, 0x71b18589, 0x06b6b51f, 0x9fbfe4a5, 0xe8b8d433,
+    0x7807c9a2, 0x0f00f934, 0x9609a88e, 0xe10e9818, 0x7f6a0dbb, 0x086d3d2d,
+    0x91646c97, 0xe6635c01, 0x6b6b51f4, 0x1c6c6162, 0x856530d8, 0xf262004e,
+    0x6c0695ed, 0x1b01a57b, 0x8208f4c1, 0xf50fc457, 0x65b0d9c6, 0x12b7e950,
+    0x8bbeb8ea, 0xfcb9887c, 0x62dd1ddf, 0x15da2d49, 0x8cd37cf3, 0xfbd44c65,
+    0x4db26158, 0x3ab551ce, 0xa3bc0074, 0xd4bb30e2, 0x4adfa541, 0x3dd895d7,
+    0xa4d1c46d, 0xd3d6f4fb, 0x4369e96a, 0x346ed9fc, 0xad678846, 0xda60b8d0,
+    0x44042d73, 0x33031de5, 0xaa0a4c5f, 0xdd0d7cc9, 0x5005713c, 0x270241aa,
+    0xbe0b1010, 0xc90c2086, 0x5768b525, 0x206f85b3, 0xb966d409, 0xce61e49f,
+    0x5edef90e, 0x29d9c998, 0xb0d09822, 0xc7d7a8b4, 0x59b33d17, 0x2eb40d81,
+    0xb7bd5c3b, 0xc0ba6cad, 0xedb88320, 0x9abfb3b6, 0x03b6e20c, 0x74b1d29a,
+    0xead54739, 0x9dd277af, 0x04db2615, 0x73dc1683, 0xe3630b12, 0x94643b84,
+    0x0d6d6a3e, 0x7a6a5aa8, 0xe40ecf0b, 0x9309ff9d, 0x0a00ae27, 0x7d079eb1,
+    0xf00f9344, 0x8708a3d2, 0x1e01f268, 0x6906c2fe, 0xf762575d, 0x806567cb,
+    0x196c3671, 0x6e6b06e7, 0xfed41b76, 0x89d32be0, 0x10da7a5a, 0x67dd4acc,
+    0xf9b9df6f, 0x8ebeeff9, 0x17b7be43, 0x60b08ed5, 0xd6d6a3e8, 0xa1d1937e,
+    0x38d8c2c4, 0x4fdff252, 0xd1bb67f1, 0xa6bc5767, 0x3fb506dd, 0x48b2364b,
+    0xd80d2bda, 0xaf0a1b4c, 0x36034af6, 0x41047a60, 0xdf60efc3, 0xa867df55,
+    0x316e8eef, 0x4669be79, 0xcb61b38c, 0xbc66831a, 0x256fd2a0, 0x5268e236,
+    0xcc0c7795, 0xbb0b4703, 0x220216b9, 0x5505262f, 0xc5ba3bbe, 0xb2bd0b28,
+    0x2bb45a92, 0x5cb36a04, 0xc2d7ffa7, 0xb5d0cf31, 0x2cd99e8b, 0x5bdeae1d,
+    0x9b64c2b0, 0xec63f226, 0x756aa39c, 0x026d930a, 0x9c0906a9, 0xeb0e363f,
+    0x72076785, 0x05005713, 0x95bf4a82, 0xe2b87a14, 0x7bb12bae, 0x0cb61b38,
+    0x92d28e9b, 0xe5d5be0d, 0x7cdcefb7, 0x0bdbdf21, 0x86d3d2d4, 0xf1d4e242,
+    0x68ddb3f8, 0x1fda836e, 0x81be16cd, 0xf6b9265b, 0x6fb077e1, 0x18b74777,
+    0x88085ae6, 0xff0f6a70, 0x66063bca, 0x11010b5c, 0x8f659eff, 0xf862ae69,
+    0x616bffd3, 0x166ccf45, 0xa00ae278, 0xd70dd2ee, 0x4e048354, 0x3903b3c2,
+    0xa7672661, 0xd06016f7, 0x4969474d, 0x3e6e77db, 0xaed16a4a, 0xd9d65adc,
+    0x40df0b66, 0x37d83bf0, 0xa9bcae53, 0xdebb9ec5, 0x47b2cf7f, 0x30b5ffe9,
+    0xbdbdf21c, 0xcabac28a, 0x53b39330, 0x24b4a3a6, 0xbad03605, 0xcdd70693,
+    0x54de5729, 0x23d967bf, 0xb3667a2e, 0xc4614ab8, 0x5d681b02, 0x2a6f2b94,
+    0xb40bbe37, 0xc30c8ea1, 0x5a05df1b, 0x2d02ef8d
+};
+
+uint32_t FileHelperRK::crc32(const void *data, size_t dataLen, uint32_t crc) {
+    const uint8_t *p = (const uint8_t *)data;
+
+    crc = ~crc;
+    for(size_t ii = 0; ii < dataLen; ii++) {
+        crc = _crc32Table[(crc ^ p[ii]) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
 int FileHelperRK::readString(const char *fileName, String &resultStr)
 {
     int result = SYSTEM_ERROR_UNKNOWN;
     resultStr = "";
 
-    uint8_t *dataPtr = nullptr;
-    size_t dataLen;
+    int fd = open(fileName, O_RDONLY);
+    if (fd != -1) {
+        struct stat sb = {0};
+        result = fstat(fd, &sb); 
+        if (result == 0) {
+            result = SYSTEM_ERROR_NONE;
 
-    result = readBytes(fileName, dataPtr, dataLen, true);
-    if (result == SYSTEM_ERROR_NONE) {
-        if (dataPtr && dataLen) {
-            resultStr = (const char *)dataPtr;
+            if (sb.st_size > 0 && !resultStr.reserve(sb.st_size)) {
+                result = SYSTEM_ERROR_NO_MEMORY;
+            }
+
+            size_t offset = 0;
+            while(result == SYSTEM_ERROR_NONE && offset < (size_t)sb.st_size) {
+                char buf[129];
+
+                size_t count = (size_t)sb.st_size - offset;
+                if (count > sizeof(buf) - 1) {
+                    count = sizeof(buf) - 1;
+                }
+                int readLen = read(fd, buf, count);
+                if (readLen != (int)count) {
+                    _fileHelperLog.error("readString bad length expected=%d got=%d", (int)count, (int)readLen);
+                    result = errnoToSystemError();
+                    break;
+                }
+                buf[count] = 0;
+                resultStr.concat(buf);
+                if (strlen(buf) < count) {
+                    // Null byte in file, String ends there
+                    break;
+                }
+                offset += count;
+            }
+
+            close(fd);
+        }
+        else {
+            result = errnoToSystemError();
+            close(fd);
         }
     }
-    
-    if (dataPtr) {
-        delete[] dataPtr;
+    else {
+        _fileHelperLog.info("readString did not open fileName=%s errno=%d", fileName, errno);
+        result = errnoToSystemError();
+    }
+
+    if (result != SYSTEM_ERROR_NONE) {
+        resultStr = "";
+    }
+
+    return result;
+}
+
+int FileHelperRK::readString(const char *fileName, char *buf, size_t &len)
+{
+    if (!buf || len == 0) {
+        len = 0;
+        return SYSTEM_ERROR_INVALID_ARGUMENT;
+    }
+
+    size_t dataLen = len - 1;
+    int result = readBytesNoAlloc(fileName, (uint8_t *)buf, dataLen);
+    if (result != SYSTEM_ERROR_NONE) {
+        dataLen = 0;
+    }
+    buf[dataLen] = 0;
+    len = strlen(buf);
+
+    return result;
+}
+
+/**
+ * @brief Sort order for readBatch() and storeBatch(): directory, then the whole path
+ */
+static bool _batchCompare(const FileHelperRK::BatchItem *a, const FileHelperRK::BatchItem *b) {
+    const char *slashA = strrchr(a->fileName, FileHelperRK::pathDelim[0]);
+    const char *slashB = strrchr(b->fileName, FileHelperRK::pathDelim[0]);
+    size_t dirLenA = slashA ? (size_t)(slashA - a->fileName) : 0;
+    size_t dirLenB = slashB ? (size_t)(slashB - b->fileName) : 0;
+
+    int cmp = strncmp(a->fileName, b->fileName, (dirLenA < dirLenB) ? dirLenA : dirLenB);
+    if (cmp != 0) {
+        return cmp < 0;
+    }
+    if (dirLenA != dirLenB) {
+        return dirLenA < dirLenB;
+    }
+    return strcmp(a->fileName, b->fileName) < 0;
+}
+
+/**
+ * @brief Runs readBatch() or storeBatch() items in order, optionally on multiple threads
+ * 
+ * @param items Items passed to readBatch() or storeBatch()
+ * @param numItems Number of items
+ * @param options Options passed to readBatch() or storeBatch()
+ * @param fn Called for each item with the scratch buffer for the thread
+ * @return int The first error in items (in the order passed in), or SYSTEM_ERROR_NONE
+ */
+static int _batchRun(FileHelperRK::BatchItem *items, size_t numItems, const FileHelperRK::BatchOptions &options, 
+    std::function<int(FileHelperRK::BatchItem &item, FileHelperRK::OwnedBuffer &scratch)> fn) {
+
+    std::vector<FileHelperRK::BatchItem *> order;
+    order.reserve(numItems);
+    for(size_t ii = 0; ii < numItems; ii++) {
+        order.push_back(&items[ii]);
+    }
+    if (options.sortByDirectory) {
+        std::sort(order.begin(), order.end(), _batchCompare);
+    }
+
+#ifdef FILEHELPER_HAS_THREADS
+    if (options.numThreads > 1 && numItems > 1) {
+        std::atomic<size_t> next{0};
+        auto worker = [&order, &next, &fn]() {
+            FileHelperRK::OwnedBuffer scratch;
+            size_t index;
+            while((index = next++) < order.size()) {
+                order[index]->result = fn(*order[index], scratch);
+            }
+        };
+        std::vector<std::thread> threads;
+        for(size_t ii = 1; ii < options.numThreads && ii < numItems; ii++) {
+            threads.push_back(std::thread(worker));
+        }
+        worker();
+        for(auto &thread : threads) {
+            thread.join();
+        }
+    }
+    else
+#endif // FILEHELPER_HAS_THREADS
+    {
+        FileHelperRK::OwnedBuffer scratch;
+        for(auto it = order.begin(); it != order.end(); it++) {
+            (*it)->result = fn(**it, scratch);
+        }
     }
 
+    int result = SYSTEM_ERROR_NONE;
+    size_t numFailed = 0;
+    for(size_t ii = 0; ii < numItems; ii++) {
+        if (items[ii].result != SYSTEM_ERROR_NONE) {
+            if (numFailed++ == 0) {
+                result = items[ii].result;
+                _fileHelperLog.info("batch failed fileName=%s result=%d", items[ii].fileName, result);
+            }
+        }
+    }
+    if (numFailed > 1) {
+        _fileHelperLog.info("batch %d of %d items failed", (int)numFailed, (int)numItems);
+    }
     return result;
 }
 
+int FileHelperRK::readBatch(BatchItem *items, size_t numItems, const BatchOptions &options) {
+    Allocator &allocator = options.allocator ? *options.allocator : HeapAllocator::instance();
+
+#ifdef FILEHELPER_HAS_THREADS
+    if (options.numThreads > 1 && &allocator != &HeapAllocator::instance()) {
+        // Other allocators, such as ArenaAllocator, are not thread-safe
+        _fileHelperLog.info("readBatch allocator must be HeapAllocator when using threads");
+        return SYSTEM_ERROR_INVALID_ARGUMENT;
+    }
+#endif
+
+    return _batchRun(items, numItems, options, [&allocator](BatchItem &item, OwnedBuffer &scratch) {
+        int fd = open(item.fileName, O_RDONLY);
+        if (fd == -1) {
+            item.size = 0;
+            return errnoToSystemError();
+        }
+
+        int result = SYSTEM_ERROR_NONE;
+        struct stat sb;
+        uint8_t *dest = item.buf;
+        size_t len = item.size;
+
+        if (fstat(fd, &sb) == -1) {
+            result = errnoToSystemError();
+            len = 0;
+        }
+        else
+        if (!dest) {
+            // Scratch buffer is only reallocated when a larger file is read
+            len = (size_t)sb.st_size;
+            if (scratch.size() < len) {
+                scratch.free();
+                uint8_t *ptr = allocator.allocate(len);
+                if (ptr) {
+                    scratch.set(ptr, len, &allocator);
+                }
+                else {
+                    result = SYSTEM_ERROR_NO_MEMORY;
+                    len = 0;
+                }
+            }
+            dest = scratch.data();
+        }
+        else
+        if (len > (size_t)sb.st_size) {
+            len = (size_t)sb.st_size;
+        }
+
+        if (result == SYSTEM_ERROR_NONE && len > 0) {
+            ssize_t readLen = ::read(fd, dest, len);
+            if (readLen != (ssize_t)len) {
+                result = (readLen < 0) ? errnoToSystemError() : SYSTEM_ERROR_IO;
+                len = (readLen < 0) ? 0 : (size_t)readLen;
+            }
+        }
+        close(fd);
+
+        item.size = len;
+        if (result == SYSTEM_ERROR_NONE && !item.buf && item.callback) {
+            result = item.callback(item.fileName, dest, len);
+        }
+        return result;
+    });
+}
+
+int FileHelperRK::storeBatch(BatchItem *items, size_t numItems, const BatchOptions &options) {
+    return _batchRun(items, numItems, options, [](BatchItem &item, OwnedBuffer &) {
+        return storeBytes(item.fileName, item.data, item.size, item.flags);
+    });
+}
+
 #if defined(SYSTEM_VERSION_560) || defined(UNITTEST)
 int FileHelperRK::readVariant(const char *fileName, particle::Variant &variant) {
+    _variantRecover(fileName);
+
+    return _variantRead(fileName, variant, nullptr);
+}
+
+int FileHelperRK::applyVariantDelta(const char *fileName, particle::Variant &variant) {
+    return _variantScanDelta(fileName, &variant, nullptr, nullptr);
+}
+
+int FileHelperRK::readVariantPath(const char *fileName, const char *path, particle::Variant &variant) {
     int result = SYSTEM_ERROR_UNKNOWN;
 
+    _variantRecover(fileName);
+
+    if (_fileExists(String(fileName) + variantDeltaSuffix)) {
+        // Read the items along path, then apply the changes from patchVariant() to them
+        particle::Variant doc;
+        result = _variantReadPartial(fileName, path, true, doc, nullptr);
+        if (result != SYSTEM_ERROR_NONE) {
+            return result;
+        }
+        return _variantGetPath(doc, path, variant);
+    }
+
     FileHelperRK::FileStreamRead stream;
 
     result = stream.open(fileName);
@@ -647,13 +5141,250 @@ int FileHelperRK::readVariant(const char *fileName, particle::Variant &variant)
         return result;
     }
 
-    result = particle::decodeFromCBOR(variant, stream);
+    result = readVariantPath(stream, path, variant);
 
     stream.close();
     return result;
 }
+
+int FileHelperRK::readVariantPath(FileStreamRead &stream, const char *path, particle::Variant &variant) {
+    int result = seekCborPath(stream, path);
+    if (result == SYSTEM_ERROR_NONE) {
+        result = particle::decodeFromCBOR(variant, stream);
+    }
+    return result;
+}
 #endif // SYSTEM_VERSION_560
 
+/**
+ * @brief Read the initial byte and argument of a CBOR item
+ * 
+ * @param stream Stream to read from
+ * @param majorType Filled in with the major type (0 - 7)
+ * @param info Filled in with the additional information (0 - 31). 31 is indefinite length (or break for major type 7).
+ * @param value Filled in with the argument (length, count, or value)
+ * @return int SYSTEM_ERROR_NONE (0) on success or a system error code (non-zero)
+ */
+static int _cborReadHead(FileHelperRK::FileStreamRead &stream, uint8_t &majorType, uint8_t &info, uint64_t &value) {
+    int c = stream.read();
+    if (c < 0) {
+        return SYSTEM_ERROR_BAD_DATA;
+    }
+    majorType = (uint8_t)(c >> 5);
+    info = (uint8_t)(c & 0x1f);
+    value = info;
+
+    if (info >= 24 && info <= 27) {
+        value = 0;
+        for(int ii = 0; ii < (1 << (info - 24)); ii++) {
+            c = stream.read();
+            if (c < 0) {
+                return SYSTEM_ERROR_BAD_DATA;
+            }
+            value = (value << 8) | (uint8_t)c;
+        }
+    }
+    else
+    if (info > 27 && (info != 31 || majorType == 0 || majorType == 1 || majorType == 6)) {
+        return SYSTEM_ERROR_BAD_DATA;
+    }
+    return SYSTEM_ERROR_NONE;
+}
+
+/**
+ * @brief Returns true if the stream is at the break byte of an indefinite length item, and consumes it
+ */
+static bool _cborReadBreak(FileHelperRK::FileStreamRead &stream) {
+    if (stream.peek() == 0xff) {
+        stream.read();
+        return true;
+    }
+    return false;
+}
+
+static int _cborSkip(FileHelperRK::FileStreamRead &stream, int depth) {
+    uint8_t majorType, info;
+    uint64_t value;
+
+    if (depth > FileHelperRK::cborMaxDepth) {
+        return SYSTEM_ERROR_BAD_DATA;
+    }
+    int result = _cborReadHead(stream, majorType, info, value);
+    if (result != SYSTEM_ERROR_NONE) {
+        return result;
+    }
+
+    switch(majorType) {
+        case 2: // byte string
+        case 3: // text string
+            if (info == 31) {
+                // Indefinite length: definite length chunks until break
+                while(!_cborReadBreak(stream)) {
+                    result = _cborSkip(stream, depth + 1);
+                    if (result != SYSTEM_ERROR_NONE) {
+                        break;
+                    }
+                }
+            }
+            else {
+                if (value > (uint64_t)stream.available()) {
+                    return SYSTEM_ERROR_BAD_DATA;
+                }
+                result = stream.seek(stream.tell() + (size_t)value);
+            }
+            break;
+
+        case 4: // array
+        case 5: // map
+            if (info == 31) {
+                while(!_cborReadBreak(stream)) {
+                    result = _cborSkip(stream, depth + 1);
+                    if (result != SYSTEM_ERROR_NONE) {
+                        break;
+                    }
+                }
+            }
+            else {
+                uint64_t count = (majorType == 5) ? (value * 2) : value;
+                for(uint64_t ii = 0; ii < count && result == SYSTEM_ERROR_NONE; ii++) {
+                    result = _cborSkip(stream, depth + 1);
+                }
+            }
+            break;
+
+        case 6: // tag, followed by one item
+            result = _cborSkip(stream, depth + 1);
+            break;
+
+        case 7: // simple value or float, already read by _cborReadHead
+            if (info == 31) {
+                // Unexpected break
+                result = SYSTEM_ERROR_BAD_DATA;
+            }
+            break;
+
+        default: // unsigned and negative integer, already read by _cborReadHead
+            break;
+    }
+    return result;
+}
+
+int FileHelperRK::skipCborItem(FileStreamRead &stream) {
+    return _cborSkip(stream, 0);
+}
+
+int FileHelperRK::seekCborPath(FileStreamRead &stream, const char *path) {
+    int result = SYSTEM_ERROR_NONE;
+
+    const char *segment = path;
+    while(segment && *segment) {
+        const char *end = strchr(segment, pathDelim[0]);
+        size_t segmentLen = end ? (size_t)(end - segment) : strlen(segment);
+        if (segmentLen == 0) {
+            // Leading, trailing, or double slash
+            segment++;
+            continue;
+        }
+
+        uint8_t majorType, info;
+        uint64_t value;
+        do {
+            // Tags are ignored
+            result = _cborReadHead(stream, majorType, info, value);
+            if (result != SYSTEM_ERROR_NONE) {
+                return result;
+            }
+        } while(majorType == 6);
+
+        bool indefinite = (info == 31);
+
+        if (majorType == 5) {
+            // Map: find the text string key that matches segment
+            bool found = false;
+            for(uint64_t ii = 0; indefinite || ii < value; ii++) {
+                if (indefinite && _cborReadBreak(stream)) {
+                    break;
+                }
+                size_t keyStart = stream.tell();
+
+                uint8_t keyType, keyInfo;
+                uint64_t keyLen;
+                result = _cborReadHead(stream, keyType, keyInfo, keyLen);
+                if (result != SYSTEM_ERROR_NONE) {
+                    return result;
+                }
+                if (keyType == 3 && keyInfo != 31 && keyLen == segmentLen) {
+                    found = true;
+                    for(size_t offset = 0; offset < segmentLen && found; ) {
+                        char buf[32];
+                        size_t chunk = segmentLen - offset;
+                        if (chunk > sizeof(buf)) {
+                            chunk = sizeof(buf);
+                        }
+                        if (stream.readBytes(buf, chunk) != chunk) {
+                            return SYSTEM_ERROR_BAD_DATA;
+                        }
+                        found = (memcmp(buf, &segment[offset], chunk) == 0);
+                        offset += chunk;
+                    }
+                    if (found) {
+                        break;
+                    }
+                }
+
+                // Not a match: skip the key and the value
+                result = stream.seek(keyStart);
+                if (result == SYSTEM_ERROR_NONE) {
+                    result = _cborSkip(stream, 0);
+                }
+                if (result == SYSTEM_ERROR_NONE) {
+                    result = _cborSkip(stream, 0);
+                }
+                if (result != SYSTEM_ERROR_NONE) {
+                    return result;
+                }
+            }
+            if (!found) {
+                return SYSTEM_ERROR_NOT_FOUND;
+            }
+        }
+        else
+        if (majorType == 4) {
+            // Array: segment is a decimal index
+            uint64_t index = 0;
+            for(size_t ii = 0; ii < segmentLen; ii++) {
+                if (segment[ii] < '0' || segment[ii] > '9') {
+                    return SYSTEM_ERROR_NOT_FOUND;
+                }
+                index = index * 10 + (segment[ii] - '0');
+            }
+            if (!indefinite && index >= value) {
+                return SYSTEM_ERROR_NOT_FOUND;
+            }
+            for(uint64_t ii = 0; ii < index; ii++) {
+                if (indefinite && _cborReadBreak(stream)) {
+                    return SYSTEM_ERROR_NOT_FOUND;
+                }
+                result = _cborSkip(stream, 0);
+                if (result != SYSTEM_ERROR_NONE) {
+                    return result;
+                }
+            }
+            if (indefinite && stream.peek() == 0xff) {
+                return SYSTEM_ERROR_NOT_FOUND;
+            }
+        }
+        else {
+            // Scalar value, cannot go deeper
+            return SYSTEM_ERROR_NOT_FOUND;
+        }
+
+        segment = end;
+    }
+
+    return result;
+}
+
 int FileHelperRK::errnoToSystemError() {
 
     // Earlier versions of Device OS don't define these constants, so just always return unknown
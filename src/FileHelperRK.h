@@ -3,6 +3,7 @@
 
 #include "Particle.h"
 
+#include <fcntl.h>
 #include <vector>
 
 
@@ -15,6 +16,158 @@
  */
 class FileHelperRK {
 public:
+    /**
+     * @brief File system size information from statvfs
+     */
+    struct FileSystemInfo {
+        size_t blockSize = 0;       //!< Block size in bytes
+        size_t totalBlocks = 0;     //!< Number of blocks in the file system
+        size_t freeBlocks = 0;      //!< Number of free blocks
+
+        /**
+         * @brief Number of bytes in the file system
+         */
+        size_t getTotalBytes() const { return totalBlocks * blockSize; };
+
+        /**
+         * @brief Number of bytes free
+         */
+        size_t getFreeBytes() const { return freeBlocks * blockSize; };
+    };
+
+    /**
+     * @brief Get the block size and number of total and free blocks of the file system containing path
+     * 
+     * @param path Any file or directory in the file system, typically "/"
+     * @param info Filled in with the file system information
+     * @return int SYSTEM_ERROR_NONE (0) on success or a system error code (non-zero). SYSTEM_ERROR_NOT_SUPPORTED
+     * on devices, where statvfs() is not available; only host (UNITTEST) builds use statvfs().
+     */
+    static int getFileSystemInfo(const char *path, FileSystemInfo &info);
+
+    /**
+     * @brief Interface for estimating how many file system blocks files and directories use
+     * 
+     * Usage and UsageTracker use this to convert file sizes into blocks. The default model is a
+     * LittleFSUsageModel. You can subclass this to model a different file system.
+     */
+    class UsageModel {
+    public:
+        /**
+         * @brief Destructor
+         */
+        virtual ~UsageModel() {};
+
+        /**
+         * @brief Block size in bytes
+         */
+        virtual size_t getBlockSize() const = 0;
+
+        /**
+         * @brief Number of blocks used by the data of a file, not including its directory entry
+         * 
+         * @param fileSize Size of the file in bytes
+         */
+        virtual size_t fileBlocks(size_t fileSize) const = 0;
+
+        /**
+         * @brief Number of bytes of directory metadata used by an entry
+         * 
+         * @param nameLen Length of the file or directory name (not the whole path)
+         * @param fileSize Size of the file in bytes (0 for directories)
+         * @param isDirectory true if the entry is a directory
+         */
+        virtual size_t entryBytes(size_t nameLen, size_t fileSize, bool isDirectory) const = 0;
+
+        /**
+         * @brief Number of blocks used by a directory
+         * 
+         * @param metadataBytes Sum of entryBytes() for all entries in the directory
+         */
+        virtual size_t directoryBlocks(size_t metadataBytes) const = 0;
+
+        /**
+         * @brief Get the model used when one is not specified
+         * 
+         * @return UsageModel& By default, LittleFSUsageModel::instance()
+         */
+        static UsageModel &getDefault();
+
+        /**
+         * @brief Set the model used when one is not specified
+         * 
+         * @param model Model to use. It must remain valid while in use; typically a global variable.
+         */
+        static void setDefault(UsageModel &model) { defaultModel = &model; };
+
+    protected:
+        static UsageModel *defaultModel; //!< Model returned by getDefault(), or nullptr for LittleFSUsageModel::instance()
+    };
+
+    /**
+     * @brief Usage model for LittleFS
+     * 
+     * - Each directory is a metadata pair (2 blocks). A directory whose entries do not fit in 
+     * half a block uses additional metadata pairs.
+     * - Small files (up to the inline limit) are stored in the directory metadata and use no blocks.
+     * - Larger files are stored as a CTZ skip-list; block n (n > 0) of the file starts with ctz(n) + 1
+     * 4-byte pointers to previous blocks.
+     * 
+     * The default geometry is 4096 byte blocks with a 512 byte inline limit, which matches the
+     * flash file system on Gen 3 and later devices. Use calibrate() to read the block size from
+     * the file system where statvfs is available.
+     */
+    class LittleFSUsageModel : public UsageModel {
+    public:
+        /**
+         * @brief Set the block size in bytes (default: 4096)
+         * 
+         * If the inline limit has not been set, it's one eighth of the block size.
+         */
+        LittleFSUsageModel &withBlockSize(size_t blockSize) { this->blockSize = blockSize; return *this; };
+
+        /**
+         * @brief Set the largest file size that is stored inline in the directory (default: one eighth of the block size)
+         */
+        LittleFSUsageModel &withInlineMax(size_t inlineMax) { this->inlineMax = inlineMax; return *this; };
+
+        /**
+         * @brief Set the block size from the file system
+         * 
+         * @param path Any file or directory in the file system (default: "/")
+         * @return int SYSTEM_ERROR_NONE (0) on success or a system error code (non-zero). SYSTEM_ERROR_NOT_SUPPORTED
+         * if statvfs is not available on this platform, in which case the geometry is not changed.
+         * 
+         * The file system information is saved and can be retrieved using getFileSystemInfo().
+         */
+        int calibrate(const char *path = "/");
+
+        /**
+         * @brief Get the file system information saved by calibrate()
+         */
+        const FileSystemInfo &getFileSystemInfo() const { return fsInfo; };
+
+        /**
+         * @brief Get the largest file size that is stored inline in the directory
+         */
+        size_t getInlineMax() const { return inlineMax ? inlineMax : (blockSize / 8); };
+
+        virtual size_t getBlockSize() const { return blockSize; };
+        virtual size_t fileBlocks(size_t fileSize) const;
+        virtual size_t entryBytes(size_t nameLen, size_t fileSize, bool isDirectory) const;
+        virtual size_t directoryBlocks(size_t metadataBytes) const;
+
+        /**
+         * @brief Model used by default
+         */
+        static LittleFSUsageModel &instance();
+
+    protected:
+        size_t blockSize = 4096; //!< Block size in bytes
+        size_t inlineMax = 0; //!< Inline limit, or 0 to use blockSize / 8
+        FileSystemInfo fsInfo; //!< Saved by calibrate()
+    };
+
     /**
      * @brief Measure file system usage
      */
@@ -29,6 +182,26 @@ public:
          */
         int measure(const char *path, bool clearStats = true);
 
+        /**
+         * @brief Set the usage model used to calculate blocks
+         * 
+         * @param model Model to use. It must remain valid while this object is in use.
+         * @return Usage& This object, for chaining options, fluent-style
+         * 
+         * If not set, UsageModel::getDefault() is used.
+         */
+        Usage &withModel(const UsageModel &model) { this->model = &model; return *this; };
+
+        /**
+         * @brief Get the usage model used by this object
+         */
+        const UsageModel &getModel() const { return model ? *model : UsageModel::getDefault(); };
+
+        /**
+         * @brief Number of bytes used on the file system (blocks * blockSize)
+         */
+        size_t getUsedBytes() const { return blocks * blockSize; };
+
         /**
          * @brief Clear the measurement stats
          */
@@ -54,10 +227,21 @@ public:
          * Each sector is 512 bytes. Each file takes one sector for metadata plus enough
          * sectors to hold all of the data. Each directory takes one sector.
          * 
-         * This is an approximate value and may vary from the actual usage.
+         * This is an approximate value and may vary from the actual usage. The blocks field
+         * uses the usage model and is more accurate.
          */
         size_t sectors = 0;
 
+        /**
+         * @brief Number of file system blocks used, calculated using the usage model
+         */
+        size_t blocks = 0;
+
+        /**
+         * @brief Size of a block in bytes, from the usage model
+         */
+        size_t blockSize = 0;
+
         /**
          * @brief Number of files
          */
@@ -67,254 +251,2121 @@ public:
          * @brief Number of directories
          */
         size_t numDirectories = 0;
+
+    protected:
+        const UsageModel *model = nullptr; //!< Model to use, or nullptr for the default
     };
 
     /**
-     * @brief Container for a parsed pathname (Unix-style, with slashes)
+     * @brief Incrementally measure file system usage for a directory tree
+     * 
+     * Usage::measure() walks the whole tree and stats every file each time. This class keeps 
+     * the totals for each directory and on update() only rescans the directories that have 
+     * changed, which is much faster when only a few directories (such as a log directory) change.
+     * 
+     * A directory is rescanned when:
+     * - A FileHelperRK function that modifies the file system (storeBytes(), storeVariant(), 
+     *   mkdirs(), deleteRecursive(), FileStreamWrite::open(), etc.) is called for a path in it,
+     *   while this object is active (between begin() and destruction)
+     * - markDirty() is called for a path in it
+     * - Its modification time changed (on file systems that support directory modification times)
+     * - The number of entries in it changed (unless disabled with withEntryCountCheck(false))
+     * 
+     * Files changed outside of FileHelperRK without changing the number of entries (such as 
+     * appending to a file using write()), or written using a FileStreamWrite that stays open 
+     * across update(), are not detected; call markDirty() after modifying them.
+     * 
+     * The per-directory totals can be persisted to a snapshot file so they survive a reset. 
+     * Usage::measure() remains available as a full measurement fallback.
+     * 
+     * Only one UsageTracker can be active at a time. Paths are compared as strings, so use the 
+     * same form (absolute or relative) for the root and for the paths passed to FileHelperRK functions.
      */
-    class ParsedPath {
+    class UsageTracker {
     public:
         /**
-         * @brief Parse a pathname (Unix-style, with slashes)
+         * @brief Construct a tracker for a directory tree
          * 
-         * @param path c-string containing an absolute or relative Unix-style pathname (slash separated)
-         * @return int SYSTEM_ERROR_NONE (0) on success or a system error code (non-zero)
+         * @param root Top directory to track
          */
-        int parse(const char *path);
+        UsageTracker(const char *root);
 
         /**
-         * @brief Clear the parsed data in this object
+         * @brief Destructor. Stops receiving notifications from FileHelperRK functions.
          */
-        void clear();
+        virtual ~UsageTracker();
 
         /**
-         * @brief Returns true if path starts with a slash (is absolute)
-         * 
-         * @return true Absolute path
-         * @return false Relative path
+         * @brief This class is not copyable
          */
-        bool getStartsWithSlash() const { return startsWithSlash; };
+        UsageTracker(const UsageTracker&) = delete;
 
         /**
-         * @brief Returns true if the path ends with a slash
-         * 
-         * @return true Path ends with a slash
-         * 
-         * Normally a path ending with a slash signifies a directory, but this function
-         * does not validate that this is true on the file system. It merely tests
-         * the input string.
+         * @brief This class is not copyable
          */
-        bool getEndsWithSlash() const { return endsWithSlash; };
+        UsageTracker &operator=(const UsageTracker&) = delete;
 
         /**
-         * @brief Get the number of path parts
+         * @brief Set a file to save the per-directory totals to, so they can be reloaded after reset
          * 
-         * @return int (0 = empty path, 1 = one part)
+         * @param snapshotPath Filename for the snapshot. Best if it is outside of root.
+         * @return UsageTracker& This object, for chaining options, fluent-style
          */
-        int getNumParts() const { return parts.size(); };
+        UsageTracker &withSnapshotFile(const char *snapshotPath) { this->snapshotPath = snapshotPath; return *this; };
 
         /**
-         * @brief Get a pathname part from its index
+         * @brief Whether to read each unchanged directory to check its number of entries on update()
          * 
-         * @param index 0-based index to retrieve, must be 0 <= index < getNumParts()
-         * @return String Copy of the pathname part
+         * @param check true (default) to check. false to only rely on notifications and modification time, which avoids reading unchanged directories.
+         * @return UsageTracker& This object, for chaining options, fluent-style
          */
-        String getPart(size_t index) const { return parts[index]; };
+        UsageTracker &withEntryCountCheck(bool check) { this->entryCountCheck = check; return *this; };
 
         /**
-         * @brief Get a pathname part from its index
+         * @brief Set the usage model used to calculate blocks
          * 
-         * @param index 0-based index to retrieve, must be 0 <= index < getNumParts()
-         * @return String Copy of the pathname part
-         */
-        String operator[](size_t index) const { return getPart(index); };
-
-        /**
-         * @brief Generate a new pathname string
+         * @param model Model to use. It must remain valid while this object is in use.
+         * @return UsageTracker& This object, for chaining options, fluent-style
          * 
-         * @param numParts -1 to include the whole string
-         * @return String 
+         * If not set, UsageModel::getDefault() is used. Call measure() after changing the model.
          */
-        String generatePathString(int numParts = -1);
+        UsageTracker &withModel(const UsageModel &model) { this->model = &model; return *this; };
 
         /**
-         * @brief Get the filename of the last component of the path without an extension
+         * @brief Load the snapshot (if configured) and start receiving notifications from FileHelperRK functions
          * 
-         * @return String 
+         * @return int SYSTEM_ERROR_NONE (0) on success or a system error code (non-zero). A missing or invalid
+         * snapshot is not an error; the whole tree will be measured on the first update().
          */
-        String getFileBaseName() const { return fileBaseName; };
+        int begin();
 
         /**
-         * @brief Get the filename extension of the last component of the path
+         * @brief Update the totals, rescanning only changed directories
          * 
-         * @return String 
-         */
-        String getFileExtension() const { return fileExtension; };
-
-    protected:
-        bool startsWithSlash = false; //!< true if the parsed path began with a slash (absolute path)
-        bool endsWithSlash = false; //!< true if the parsed path ended with a slash
-        String fileBaseName; //!< Filename (last part of path) without extension
-        String fileExtension; //!< Filename (last part of path) extension (does not contain dot)
-        std::vector<String> parts; //!< parsed parts of the pathname. Does not contain empty parts.
-    };
-
-    /**
-     * @brief Class for providing Stream and Print object for reading or writing a file
-     * 
-     * Important limitations:
-     * - This class is only for reading or writing, not both at the same time
-     * - When reading from a stream, the underling file is not expected to change; it cannot be used for live tail for example
-     */
-    class FileStreamBase {
-    public:
-        /**
-         * @brief Construct object; you will typically do this and then call openForReading or openForWriting
+         * @param usage Filled in with the totals for the whole tree
+         * @return int SYSTEM_ERROR_NONE (0) on success or a system error code (non-zero)
          */
-        FileStreamBase();
+        int update(Usage &usage);
 
         /**
-         * @brief Construct object from an existing file descriptor from open()
+         * @brief Discard the per-directory totals and measure the whole tree again
          * 
-         * @param fd File descriptor from open(). Will not be closed on destruction.
+         * @param usage Filled in with the totals for the whole tree
+         * @return int SYSTEM_ERROR_NONE (0) on success or a system error code (non-zero)
          */
-        FileStreamBase(int fd);
+        int measure(Usage &usage);
 
         /**
-         * @brief Destructor. 
+         * @brief Save the per-directory totals to the snapshot file. 
          * 
-         * If file was opened using openForReading(), openForWriting(), or open() and close()
-         * has not been called, the file will be closed when the object is deleted. 
+         * @return int SYSTEM_ERROR_NONE (0) on success or a system error code (non-zero)
+         * 
+         * Typically called after update(). Directories that are dirty are saved as dirty.
          */
-        virtual ~FileStreamBase();
-        
+        int save();
+
         /**
-         * @brief Open a file
+         * @brief Load the per-directory totals from the snapshot file. Called from begin().
          * 
-         * @param path Filename to open.
-         * @param mode Mode such as O_RDONLY, or O_RDWR | O_CREAT | O_TRUNC.
-         * @param perm Permissions, defaults to 0666 (read and write for everyone).
          * @return int SYSTEM_ERROR_NONE (0) on success or a system error code (non-zero)
          */
-        int open(const char *path, int mode, int perm = 0666);
+        int load();
 
         /**
-         * @brief Close the underling file if it was opened using open()
+         * @brief Mark the directory containing path as changed so it will be rescanned on the next update()
          * 
-         * @return int SYSTEM_ERROR_NONE (0) on success or a system error code (non-zero)
+         * @param path File or directory that was created, modified, or deleted
          * 
-         * If you don't call close(), the file will be closed on object destruction if
-         * it was opened.
+         * If path is a tracked directory, it is also marked as changed.
          */
-        int close();
+        void markDirty(const char *path);
 
-    protected:
-        int fd = -1; //!< File descriptor from open()
-        bool closeFile = false; //!< Close file on destructor
-    };
-
-    /**
-     * @brief Class for reading from a file as a Stream
-     * 
-     * Used for reading a Variant from a file as CBOR.
-     */
-    class FileStreamRead : public Stream, public FileStreamBase {
-    public:
         /**
-         * @brief Open a file for reading. Opens as O_RDONLY.
+         * @brief Get the number of directories that were rescanned on the last update() or measure()
          * 
-         * @param path Filename to read from.
-         * @return int SYSTEM_ERROR_NONE (0) on success or a system error code (non-zero)
+         * @return size_t 
          */
-        int open(const char *path);
+        size_t getNumRescanned() const { return numRescanned; };
 
         /**
-         * @brief Start reading from the beginning of the file again.
+         * @brief Get the active tracker that receives notifications, or nullptr if none
          * 
-         * @return int SYSTEM_ERROR_NONE (0) on success or a system error code (non-zero)
+         * @return UsageTracker* 
          */
-        int rewind();
-
-        // Overrides for stream
+        static UsageTracker *getActiveTracker() { return activeTracker; };
 
         /**
-         * @brief Returns number of bytes available to read. Override for Stream pure virtual function.
-         * 
-         * @return int Number of bytes to read or 0 at end of file
+         * @brief Version number of the snapshot file format
          */
-        virtual int available();
+        static const uint16_t snapshotVersion = 2;
 
+    protected:
         /**
-         * @brief Read a byte from the file.  Override for Stream pure virtual function.
-         * 
-         * @return int A value from 0 - 255 inclusive or -1 on error.
+         * @brief Per-directory totals for the files directly in the directory (not subdirectories)
          */
-        virtual int read();
+        struct DirInfo {
+            String path;                //!< Directory path
+            uint32_t mtime;             //!< Modification time when last scanned
+            uint32_t numEntries;        //!< Number of files and directories in this directory
+            uint32_t numFiles;          //!< Number of files in this directory
+            uint32_t fileBytes;         //!< Sum of the sizes of files in this directory
+            uint32_t sectors;           //!< Sectors used by files in this directory, plus one for the directory
+            uint32_t blocks;            //!< Blocks used by files in this directory and the directory itself
+            bool dirty;                 //!< Needs to be rescanned
+        };
 
         /**
-         * @brief Read a byte from the file without consuming it.  Override for Stream pure virtual function.
+         * @brief Find a directory in dirs
          * 
-         * @return int A value from 0 - 255 inclusive or -1 on error.
+         * @param path Directory path
+         * @return int index into dirs or -1 if not found
          */
-        virtual int peek();
+        int findDir(const char *path) const;
 
         /**
-         * @brief Doesn't do anything. Override for Stream pure virtual function.
+         * @brief Read a directory and update its DirInfo, adding new subdirectories and removing deleted ones
+         * 
+         * @param index Index into dirs
+         * @return int SYSTEM_ERROR_NONE (0) on success or a system error code (non-zero)
          */
-        virtual void flush();
+        int scanDir(size_t index);
 
         /**
-         * @brief Doesn't do anything. Override for Stream::Print pure virtual function.
+         * @brief Remove a directory and all of its subdirectories from dirs
+         * 
+         * @param path Directory path
          */
-        virtual size_t write(uint8_t);
+        void removeDir(const char *path);
 
         /**
-         * @brief Updates the fileSize parameter. Called from open().
+         * @brief Count the number of entries in a directory without calling stat
+         * 
+         * @param path Directory path
+         * @return int Number of entries or -1 if the directory could not be opened
          */
-        void updateFileSize();
+        static int countEntries(const char *path);
 
-    protected:
-        size_t fileSize = 0;  //!< File size in bytes, set in open() and updateFileSize().
-        size_t fileOffset = 0; //!< File position, set in open() and rewind(), updated on read()
+        String root; //!< Top directory being tracked
+        String snapshotPath; //!< Snapshot filename, or empty for no snapshot
+        bool entryCountCheck = true; //!< Read unchanged directories to check their entry count
+        const UsageModel *model = nullptr; //!< Model to use, or nullptr for the default
+        bool saving = false; //!< Ignore notifications while saving the snapshot
+        size_t numRescanned = 0; //!< Number of directories rescanned on the last update
+        std::vector<DirInfo> dirs; //!< Per-directory totals
 
+        static UsageTracker *activeTracker; //!< Tracker receiving notifications, or nullptr
     };
 
     /**
-     * @brief Class for writing to a file as a Print
+     * @brief Container for a parsed pathname (Unix-style, with slashes)
      * 
-     * Used for writing a Variant to a file as CBOR.
+     * The path is copied into a single buffer with duplicate and trailing slashes removed, and 
+     * each part is stored as an offset and length in that buffer. getPartView() and getPrefix() 
+     * return pointers into the buffer without allocating memory. Parsing another path into the
+     * same object reuses the buffer, so a ParsedPath that is reused does not allocate memory 
+     * once its buffer is large enough.
      */
-    class FileStreamWrite : public Print, public FileStreamBase {
+    class ParsedPath {
     public:
         /**
-         * @brief Open a file for writing. Opens as O_RDWR | O_CREAT | O_TRUNC.
-         * 
-         * @param path Filename to write to. File will be created and truncated.
-         * @return int SYSTEM_ERROR_NONE (0) on success or a system error code (non-zero)
+         * @brief Non-owning view of part of a ParsedPath. It is not null-terminated.
          * 
-         * If you want to use a different mode, call the open() method in the base class.
+         * Valid until the ParsedPath is parsed again, cleared, or deleted.
          */
-        int open(const char *path);
+        struct PartView {
+            const char *data = nullptr;     //!< Pointer to the first character
+            size_t length = 0;              //!< Number of characters
+
+            /**
+             * @brief Returns true if the view is the same as a c-string
+             */
+            bool equals(const char *str) const { return strlen(str) == length && memcmp(str, data, length) == 0; };
+
+            /**
+             * @brief Returns a copy of the view as a String
+             */
+            String toString() const { String result; result.concat(data, length); return result; };
+        };
 
-        // Overrides for Print
         /**
-         * @brief Writes a character to the file Override for Print pure virtual function.
-         * 
-         * @param c Byte to write. Can be binary data.
-         * @return size_t Number of bytes written (normally 1). 0 on error.
+         * @brief Construct an empty object. Call parse() to parse a path.
          */
-        virtual size_t write(uint8_t c);
+        ParsedPath() {};
 
         /**
-         * @brief Writes multiple bytes to the file Override for Print pure virtual function.
-         * 
-         * @param buffer Pointer to a buffer of bytes to write
-         * @param size Number of bytes to write.
-         * @return size_t Number of bytes written (normally size).
+         * @brief Copy constructor. Allocates a new buffer.
          */
-        virtual size_t write(const uint8_t *buffer, size_t size);
-    };
+        ParsedPath(const ParsedPath &other) { *this = other; };
 
+        /**
+         * @brief Destructor. Frees the buffer.
+         */
+        virtual ~ParsedPath();
+
+        /**
+         * @brief Copy from another object. Allocates a new buffer if this object's buffer is too small.
+         */
+        ParsedPath &operator=(const ParsedPath &other);
+
+        /**
+         * @brief Parse a pathname (Unix-style, with slashes)
+         * 
+         * @param path c-string containing an absolute or relative Unix-style pathname (slash separated)
+         * @return int SYSTEM_ERROR_NONE (0) on success or a system error code (non-zero)
+         */
+        int parse(const char *path);
+
+        /**
+         * @brief Parse a pathname, optionally relative to a base directory, and normalize it
+         * 
+         * @param path c-string containing an absolute or relative Unix-style pathname (slash separated)
+         * @param baseDir If not null or empty and path is relative, path is relative to this directory
+         * @return int SYSTEM_ERROR_NONE (0) on success or a system error code (non-zero)
+         * 
+         * The result is the same as joining baseDir and path, calling parse(), then normalize(). 
+         * Use the result of generatePathString() as a key for caches and comparisons, so different 
+         * ways of writing the same path are the same. Symbolic links are not resolved (LittleFS 
+         * does not support them).
+         */
+        int canonical(const char *path, const char *baseDir = nullptr);
+
+        /**
+         * @brief Remove . parts and resolve .. parts in the parsed path
+         * 
+         * For example, "a/./b/../c" becomes "a/c". In an absolute path, .. at the root is 
+         * removed ("/../a" is "/a"). In a relative path, .. that cannot be resolved is kept 
+         * ("../a" is unchanged). A relative path that resolves to the current directory, such as 
+         * "a/..", has no parts and generatePathString() returns an empty string.
+         * 
+         * This is done in a single pass in the buffer; no memory is allocated. Duplicate slashes 
+         * are already removed by parse().
+         */
+        void normalize();
+
+        /**
+         * @brief Clear the parsed data in this object. The buffer is kept to be reused by parse().
+         */
+        void clear();
+
+        /**
+         * @brief Returns true if path starts with a slash (is absolute)
+         * 
+         * @return true Absolute path
+         * @return false Relative path
+         */
+        bool getStartsWithSlash() const { return startsWithSlash; };
+
+        /**
+         * @brief Returns true if the path ends with a slash
+         * 
+         * @return true Path ends with a slash
+         * 
+         * Normally a path ending with a slash signifies a directory, but this function
+         * does not validate that this is true on the file system. It merely tests
+         * the input string.
+         */
+        bool getEndsWithSlash() const { return endsWithSlash; };
+
+        /**
+         * @brief Get the number of path parts
+         * 
+         * @return int (0 = empty path, 1 = one part)
+         */
+        int getNumParts() const { return parts.size(); };
+
+        /**
+         * @brief Get a pathname part from its index
+         * 
+         * @param index 0-based index to retrieve, must be 0 <= index < getNumParts()
+         * @return String Copy of the pathname part
+         */
+        String getPart(size_t index) const { return getPartView(index).toString(); };
+
+        /**
+         * @brief Get a pathname part from its index without copying it
+         * 
+         * @param index 0-based index to retrieve, must be 0 <= index < getNumParts()
+         * @return PartView Pointer and length of the part in the buffer
+         */
+        PartView getPartView(size_t index) const;
+
+        /**
+         * @brief Get a pathname part from its index
+         * 
+         * @param index 0-based index to retrieve, must be 0 <= index < getNumParts()
+         * @return String Copy of the pathname part
+         */
+        String operator[](size_t index) const { return getPart(index); };
+
+        /**
+         * @brief Generate a new pathname string
+         * 
+         * @param numParts -1 to include the whole string
+         * @return String 
+         */
+        String generatePathString(int numParts = -1);
+
+        /**
+         * @brief Get the path containing the first numParts parts, without allocating memory
+         * 
+         * @param numParts -1 to include the whole path
+         * @return const char* Null-terminated path in the buffer. Same as generatePathString(numParts).
+         * 
+         * The buffer is null-terminated after the last part requested. The next call to getPrefix(), 
+         * generatePathString(), normalize(), parse(), or clear() removes the terminator, so the pointer 
+         * returned here must not be used after that. PartView objects are not affected.
+         */
+        const char *getPrefix(int numParts = -1);
+
+        /**
+         * @brief Get the filename of the last component of the path without an extension
+         * 
+         * @return String 
+         */
+        String getFileBaseName() const { return getFileBaseNameView().toString(); };
+
+        /**
+         * @brief Get the filename of the last component of the path without an extension, without copying it
+         */
+        PartView getFileBaseNameView() const;
+
+        /**
+         * @brief Get the filename extension of the last component of the path
+         * 
+         * @return String 
+         */
+        String getFileExtension() const { return getFileExtensionView().toString(); };
+
+        /**
+         * @brief Get the filename extension of the last component of the path (without the dot), without copying it
+         */
+        PartView getFileExtensionView() const;
+
+    protected:
+        /**
+         * @brief Location of a part in the buffer
+         */
+        struct Part {
+            size_t offset;  //!< Offset in buffer
+            size_t length;  //!< Length in characters
+        };
+
+        /**
+         * @brief Make sure the buffer can hold size bytes, including the null terminator
+         * 
+         * @param size Number of bytes
+         * @return int SYSTEM_ERROR_NONE (0) on success or a system error code (non-zero)
+         */
+        int reserve(size_t size);
+
+        /**
+         * @brief Add the parts of path to the end of the buffer. The buffer must be large enough.
+         * 
+         * @param path Path to add. Empty parts are skipped.
+         */
+        void appendParts(const char *path);
+
+        /**
+         * @brief Put back the slash that was replaced by a null terminator by getPrefix()
+         */
+        void restorePrefix();
+
+        /**
+         * @brief Offset in the buffer of the end of the first numParts parts
+         */
+        size_t prefixLength(int numParts) const;
+
+        bool startsWithSlash = false; //!< true if the parsed path began with a slash (absolute path)
+        bool endsWithSlash = false; //!< true if the parsed path ended with a slash
+        char *buffer = nullptr; //!< Path with duplicate and trailing slashes removed, null-terminated
+        size_t bufferSize = 0; //!< Allocated size of buffer in bytes
+        size_t pathLength = 0; //!< Length of the path in buffer
+        size_t prefixEnd = 0; //!< Offset of the null terminator written by getPrefix(), or 0 for none
+        std::vector<Part> parts; //!< parsed parts of the pathname. Does not contain empty parts.
+    };
+
+    /**
+     * @brief Class for providing Stream and Print object for reading or writing a file
+     * 
+     * Important limitations:
+     * - This class is only for reading or writing, not both at the same time
+     * - When reading from a stream, the underling file is not expected to change; it cannot be used for live tail for example
+     */
+    class FileStreamBase {
+    public:
+        /**
+         * @brief Construct object; you will typically do this and then call openForReading or openForWriting
+         */
+        FileStreamBase();
+
+        /**
+         * @brief Construct object from an existing file descriptor from open()
+         * 
+         * @param fd File descriptor from open(). Will not be closed on destruction.
+         */
+        FileStreamBase(int fd);
+
+        /**
+         * @brief Destructor. 
+         * 
+         * If file was opened using openForReading(), openForWriting(), or open() and close()
+         * has not been called, the file will be closed when the object is deleted. 
+         */
+        virtual ~FileStreamBase();
+        
+        /**
+         * @brief Open a file
+         * 
+         * @param path Filename to open.
+         * @param mode Mode such as O_RDONLY, or O_RDWR | O_CREAT | O_TRUNC.
+         * @param perm Permissions, defaults to 0666 (read and write for everyone).
+         * @return int SYSTEM_ERROR_NONE (0) on success or a system error code (non-zero)
+         */
+        int open(const char *path, int mode, int perm = 0666);
+
+        /**
+         * @brief Close the underling file if it was opened using open()
+         * 
+         * @return int SYSTEM_ERROR_NONE (0) on success or a system error code (non-zero)
+         * 
+         * If you don't call close(), the file will be closed on object destruction if
+         * it was opened.
+         */
+        int close();
+
+    protected:
+        int fd = -1; //!< File descriptor from open()
+        bool closeFile = false; //!< Close file on destructor
+    };
+
+    /**
+     * @brief Class for reading from a file as a Stream
+     * 
+     * Used for reading a Variant from a file as CBOR.
+     * 
+     * Reads are done in blocks into a read-ahead buffer, so reading a byte at a time
+     * using read() does not make a file system call for every byte. By default, a buffer
+     * of defaultBufferSize bytes is allocated on the heap in open(). You can change the
+     * size using withBufferSize() or pass in your own buffer using withBuffer() before
+     * calling open().
+     */
+    class FileStreamRead : public Stream, public FileStreamBase {
+    public:
+        /**
+         * @brief Construct object; you will typically do this and then call open()
+         */
+        FileStreamRead();
+
+        /**
+         * @brief Destructor. Closes the file if opened by open() and releases the read buffer.
+         */
+        virtual ~FileStreamRead();
+
+        /**
+         * @brief This class is not copyable
+         */
+        FileStreamRead(const FileStreamRead&) = delete;
+
+        /**
+         * @brief This class is not copyable
+         */
+        FileStreamRead &operator=(const FileStreamRead&) = delete;
+
+        /**
+         * @brief Use a caller-provided buffer instead of allocating one on the heap
+         * 
+         * @param buf Buffer to use. Must remain valid until close() or object destruction.
+         * @param size Size of buf in bytes. Must be at least 1.
+         * @return FileStreamRead& This object, for chaining options, fluent-style
+         * 
+         * Must be called before open().
+         */
+        FileStreamRead &withBuffer(uint8_t *buf, size_t size);
+
+        /**
+         * @brief Set the size of the buffer allocated on the heap by open()
+         * 
+         * @param size Size in bytes. Default is defaultBufferSize. Must be at least 1.
+         * @return FileStreamRead& This object, for chaining options, fluent-style
+         * 
+         * Must be called before open(). Ignored if withBuffer() is used.
+         */
+        FileStreamRead &withBufferSize(size_t size);
+
+        /**
+         * @brief Open a file for reading. Opens as O_RDONLY.
+         * 
+         * @param path Filename to read from.
+         * @return int SYSTEM_ERROR_NONE (0) on success or a system error code (non-zero)
+         */
+        int open(const char *path);
+
+        /**
+         * @brief Close the file and release the read buffer if it was allocated by open()
+         * 
+         * @return int SYSTEM_ERROR_NONE (0) on success or a system error code (non-zero)
+         */
+        int close();
+
+        /**
+         * @brief Start reading from the beginning of the file again.
+         * 
+         * @return int SYSTEM_ERROR_NONE (0) on success or a system error code (non-zero)
+         */
+        int rewind();
+
+        /**
+         * @brief Set the position in the file that the next read() or peek() will return
+         * 
+         * @param offset Offset from the beginning of the file in bytes (0 <= offset <= file size)
+         * @return int SYSTEM_ERROR_NONE (0) on success or a system error code (non-zero)
+         * 
+         * If the offset is within the data currently in the read buffer, no file system call is made.
+         */
+        int seek(size_t offset);
+
+        /**
+         * @brief Get the current position in the file
+         * 
+         * @return size_t Offset from the beginning of the file of the next byte that read() will return
+         */
+        size_t tell() const { return fileOffset; };
+
+        // Overrides for stream
+
+        /**
+         * @brief Returns number of bytes available to read. Override for Stream pure virtual function.
+         * 
+         * @return int Number of bytes to read or 0 at end of file
+         */
+        virtual int available();
+
+        /**
+         * @brief Read a byte from the file.  Override for Stream pure virtual function.
+         * 
+         * @return int A value from 0 - 255 inclusive or -1 on error.
+         */
+        virtual int read();
+
+        /**
+         * @brief Read a byte from the file without consuming it.  Override for Stream pure virtual function.
+         * 
+         * @return int A value from 0 - 255 inclusive or -1 on error.
+         * 
+         * The byte is returned from the read buffer, filling it if necessary. Calling peek() 
+         * repeatedly does not make any additional file system calls.
+         */
+        virtual int peek();
+
+        /**
+         * @brief Read multiple bytes from the file. Override for Stream function.
+         * 
+         * @param buffer Buffer to copy data to
+         * @param length Maximum number of bytes to read
+         * @return size_t Number of bytes read. Will be less than length at end of file or on error.
+         * 
+         * Data is copied out of the read buffer. Large reads bypass the buffer and read
+         * directly into buffer.
+         */
+        virtual size_t readBytes(char *buffer, size_t length);
+
+        /**
+         * @brief Read multiple bytes from the file
+         * 
+         * @param buffer Buffer to copy data to
+         * @param length Maximum number of bytes to read
+         * @return size_t Number of bytes read. Will be less than length at end of file or on error.
+         */
+        size_t readBytes(uint8_t *buffer, size_t length) { return readBytes((char *)buffer, length); };
+
+        /**
+         * @brief Doesn't do anything. Override for Stream pure virtual function.
+         */
+        virtual void flush();
+
+        /**
+         * @brief Doesn't do anything. Override for Stream::Print pure virtual function.
+         */
+        virtual size_t write(uint8_t);
+
+        /**
+         * @brief Updates the fileSize parameter. Called from open().
+         */
+        void updateFileSize();
+
+        /**
+         * @brief Default size of the read buffer allocated by open() (256 bytes)
+         */
+        static const size_t defaultBufferSize = 256;
+
+    protected:
+        /**
+         * @brief Discard the contents of the read buffer
+         */
+        void discardBuffer();
+
+        /**
+         * @brief Read the next block of the file into the read buffer
+         * 
+         * @return true if there is at least one byte in the buffer
+         */
+        bool fillBuffer();
+
+        size_t fileSize = 0;  //!< File size in bytes, set in open() and updateFileSize().
+        size_t fileOffset = 0; //!< Logical file position of the next byte returned by read(), set in open(), rewind(), and seek(), updated on read()
+
+        uint8_t *buffer = nullptr; //!< Read buffer (caller-provided or allocated)
+        size_t bufferSize = defaultBufferSize; //!< Size of buffer in bytes
+        size_t bufferPos = 0; //!< Index in buffer of the next byte to return
+        size_t bufferLen = 0; //!< Number of valid bytes in buffer
+        bool bufferAllocated = false; //!< true if buffer was allocated by open() and must be deleted
+    };
+
+    /**
+     * @brief Class for writing to a file as a Print
+     * 
+     * Used for writing a Variant to a file as CBOR.
+     * 
+     * Writes are accumulated in a buffer and written to the file in blocks, so writing a byte
+     * at a time, or using print(), println(), or printf() does not make a file system call for 
+     * every byte. By default, a buffer of defaultBufferSize bytes is allocated on the heap in 
+     * open(). You can change the size using withBufferSize() or pass in your own buffer using 
+     * withBuffer() before calling open().
+     * 
+     * The buffer is written to the file when it is full, and on flush(), close(), and object 
+     * destruction. If a write to the file fails or is short, getWriteError() will return 
+     * non-zero and close() will return an error.
+     */
+    class FileStreamWrite : public Print, public FileStreamBase {
+    public:
+        /**
+         * @brief Construct object; you will typically do this and then call open()
+         */
+        FileStreamWrite();
+
+        /**
+         * @brief Destructor. Writes any buffered data, closes the file if opened by open(), and releases the write buffer.
+         */
+        virtual ~FileStreamWrite();
+
+        /**
+         * @brief This class is not copyable
+         */
+        FileStreamWrite(const FileStreamWrite&) = delete;
+
+        /**
+         * @brief This class is not copyable
+         */
+        FileStreamWrite &operator=(const FileStreamWrite&) = delete;
+
+        /**
+         * @brief Use a caller-provided buffer instead of allocating one on the heap
+         * 
+         * @param buf Buffer to use. Must remain valid until close() or object destruction.
+         * @param size Size of buf in bytes. Must be at least 1.
+         * @return FileStreamWrite& This object, for chaining options, fluent-style
+         * 
+         * Must be called before open().
+         */
+        FileStreamWrite &withBuffer(uint8_t *buf, size_t size);
+
+        /**
+         * @brief Set the size of the buffer allocated on the heap by open()
+         * 
+         * @param size Size in bytes. Default is defaultBufferSize. Must be at least 1.
+         * @return FileStreamWrite& This object, for chaining options, fluent-style
+         * 
+         * Must be called before open(). Ignored if withBuffer() is used.
+         */
+        FileStreamWrite &withBufferSize(size_t size);
+
+        /**
+         * @brief Open a file for writing. Opens as O_RDWR | O_CREAT | O_TRUNC.
+         * 
+         * @param path Filename to write to. File will be created and truncated.
+         * @return int SYSTEM_ERROR_NONE (0) on success or a system error code (non-zero)
+         */
+        int open(const char *path);
+
+        /**
+         * @brief Open a file for writing with a specific mode
+         * 
+         * @param path Filename to write to.
+         * @param mode Mode such as O_RDWR | O_CREAT | O_TRUNC, or O_WRONLY | O_CREAT | O_APPEND.
+         * @param perm Permissions, defaults to 0666 (read and write for everyone).
+         * @return int SYSTEM_ERROR_NONE (0) on success or a system error code (non-zero)
+         */
+        int open(const char *path, int mode, int perm = 0666);
+
+        /**
+         * @brief Write any buffered data, then close the file and release the write buffer if it was allocated by open()
+         * 
+         * @return int SYSTEM_ERROR_NONE (0) on success or a system error code (non-zero). An error
+         * is returned if any write to the file failed while the file was open.
+         */
+        int close();
+
+        /**
+         * @brief Write any buffered data to the file
+         * 
+         * Sets the write error (getWriteError()) if the write fails.
+         */
+        virtual void flush();
+
+        /**
+         * @brief Write any buffered data to the file
+         * 
+         * @return int SYSTEM_ERROR_NONE (0) on success or a system error code (non-zero)
+         * 
+         * If data has been written to the file since the last flush, notifyChanged() is called so
+         * UsageTracker and listDirectory() see the new size. Callers do not need to call it again.
+         * close() also calls it if the file was opened but nothing was written.
+         */
+        int flushBuffer();
+
+        /**
+         * @brief Write any buffered data to the file and call fsync() to commit it to the file system
+         * 
+         * @return int SYSTEM_ERROR_NONE (0) on success or a system error code (non-zero)
+         */
+        int sync();
+
+        // Overrides for Print
+        /**
+         * @brief Writes a character to the file Override for Print pure virtual function.
+         * 
+         * @param c Byte to write. Can be binary data.
+         * @return size_t Number of bytes written (normally 1). 0 on error.
+         */
+        virtual size_t write(uint8_t c);
+
+        /**
+         * @brief Writes multiple bytes to the file Override for Print pure virtual function.
+         * 
+         * @param buffer Pointer to a buffer of bytes to write
+         * @param size Number of bytes to write.
+         * @return size_t Number of bytes written (normally size).
+         * 
+         * Data is copied to the write buffer. Writes at least as large as the buffer
+         * are written directly to the file after flushing the buffer.
+         */
+        virtual size_t write(const uint8_t *buffer, size_t size);
+
+        /**
+         * @brief Default size of the write buffer allocated by open() (256 bytes)
+         */
+        static const size_t defaultBufferSize = 256;
+
+    protected:
+        /**
+         * @brief Write data directly to the file, bypassing the buffer
+         * 
+         * @param data Data to write
+         * @param size Number of bytes to write
+         * @return int SYSTEM_ERROR_NONE (0) on success or a system error code (non-zero)
+         */
+        int writeFile(const uint8_t *data, size_t size);
+
+        uint8_t *buffer = nullptr; //!< Write buffer (caller-provided or allocated)
+        size_t bufferSize = defaultBufferSize; //!< Size of buffer in bytes
+        size_t bufferLen = 0; //!< Number of bytes in buffer not yet written to the file
+        bool bufferAllocated = false; //!< true if buffer was allocated by open() and must be deleted
+        int writeResult = SYSTEM_ERROR_NONE; //!< First error from writing to the file, returned by close()
+        String path; //!< Path passed to open(), for notifyChanged()
+        bool changed = false; //!< Data written to the file since notifyChanged() was last called
+        bool notified = false; //!< notifyChanged() was called since open()
+    };
+
+    /**
+     * @brief Append-only log writer that rotates between segment files
+     * 
+     * Records are appended to the current segment file, which is opened with O_APPEND, through
+     * a FileStreamWrite buffer, so adding a record does not read or rewrite the existing data.
+     * When the current segment reaches the maximum size or number of records, a new segment 
+     * is started. When the total size of all segments exceeds the maximum total size, the oldest
+     * segments are deleted.
+     * 
+     * Segment files are stored in a directory and are named baseName.NNNNNNNN, where NNNNNNNN 
+     * is an increasing sequence number. A record is never split across segments. The contents 
+     * of the record are not interpreted; for text logs, include the line ending in the record.
+     */
+    class LogWriter {
+    public:
+        /**
+         * @brief Construct a log writer. You will typically set options and call begin().
+         * 
+         * @param dirPath Directory to store segment files in. Created by begin() if it does not exist.
+         * @param baseName Base name of the segment files (default: "log")
+         */
+        LogWriter(const char *dirPath, const char *baseName = "log");
+
+        /**
+         * @brief Destructor. Writes any buffered records and closes the current segment.
+         */
+        virtual ~LogWriter();
+
+        /**
+         * @brief This class is not copyable
+         */
+        LogWriter(const LogWriter&) = delete;
+
+        /**
+         * @brief This class is not copyable
+         */
+        LogWriter &operator=(const LogWriter&) = delete;
+
+        /**
+         * @brief Start a new segment when the current segment would exceed this size in bytes (default: 16384)
+         * 
+         * 0 means no limit. A record larger than this is written to its own segment.
+         */
+        LogWriter &withMaxSegmentSize(size_t maxSegmentSize) { this->maxSegmentSize = maxSegmentSize; return *this; };
+
+        /**
+         * @brief Start a new segment after this many records (default: 0, no limit)
+         * 
+         * If set, begin() always starts a new segment, because the number of records in an 
+         * existing segment is not known.
+         */
+        LogWriter &withMaxSegmentRecords(size_t maxSegmentRecords) { this->maxSegmentRecords = maxSegmentRecords; return *this; };
+
+        /**
+         * @brief Delete the oldest segments when the total size in bytes exceeds this (default: 65536)
+         * 
+         * 0 means no limit. The current segment is never deleted.
+         */
+        LogWriter &withMaxTotalSize(size_t maxTotalSize) { this->maxTotalSize = maxTotalSize; return *this; };
+
+        /**
+         * @brief Set the size of the write buffer (default: FileStreamWrite::defaultBufferSize)
+         * 
+         * Must be called before begin().
+         */
+        LogWriter &withBufferSize(size_t bufferSize) { stream.withBufferSize(bufferSize); return *this; };
+
+        /**
+         * @brief Write and fsync each record as it is appended (default: false)
+         * 
+         * If false, records are buffered until the buffer is full, or flush(), sync(), rotate(), or close() is called.
+         */
+        LogWriter &withSyncEachRecord(bool syncEachRecord) { this->syncEachRecord = syncEachRecord; return *this; };
+
+        /**
+         * @brief Create the directory if necessary, find existing segments, and open the newest one for appending
+         * 
+         * @return int SYSTEM_ERROR_NONE (0) on success or a system error code (non-zero)
+         */
+        int begin();
+
+        /**
+         * @brief Append a record
+         * 
+         * @param data Pointer to the record data
+         * @param size Size of the record in bytes
+         * @return int SYSTEM_ERROR_NONE (0) on success or a system error code (non-zero)
+         */
+        int append(const void *data, size_t size);
+
+        /**
+         * @brief Append a c-string record (not including the null terminator)
+         * 
+         * @param str c-string to append. Include the line ending if you want one.
+         * @return int SYSTEM_ERROR_NONE (0) on success or a system error code (non-zero)
+         */
+        int append(const char *str) { return append(str, strlen(str)); };
+
+        /**
+         * @brief Close the current segment and start a new one
+         * 
+         * @return int SYSTEM_ERROR_NONE (0) on success or a system error code (non-zero)
+         */
+        int rotate();
+
+        /**
+         * @brief Write any buffered records to the current segment
+         * 
+         * @return int SYSTEM_ERROR_NONE (0) on success or a system error code (non-zero)
+         */
+        int flush();
+
+        /**
+         * @brief Write any buffered records and fsync the current segment
+         * 
+         * @return int SYSTEM_ERROR_NONE (0) on success or a system error code (non-zero)
+         */
+        int sync();
+
+        /**
+         * @brief Write any buffered records and close the current segment. Call begin() to open again.
+         * 
+         * @return int SYSTEM_ERROR_NONE (0) on success or a system error code (non-zero)
+         */
+        int close();
+
+        /**
+         * @brief Get the paths of all segments, oldest first. The last one is the current segment.
+         * 
+         * @param paths Vector to fill in. It is cleared first.
+         * 
+         * Call flush() first if you will read the current segment.
+         */
+        void getSegmentPaths(std::vector<String> &paths) const;
+
+        /**
+         * @brief Get the path to the segment file for a sequence number
+         * 
+         * @param seq Sequence number
+         * @return String Path to the segment file
+         */
+        String getSegmentPath(uint32_t seq) const;
+
+        /**
+         * @brief Get the sequence number of the current segment
+         */
+        uint32_t getCurrentSequence() const { return segments.empty() ? 0 : segments.back().seq; };
+
+        /**
+         * @brief Get the number of segments, including the current segment
+         */
+        size_t getNumSegments() const { return segments.size(); };
+
+        /**
+         * @brief Get the size in bytes of the current segment, including buffered records
+         */
+        size_t getSegmentSize() const { return segments.empty() ? 0 : segments.back().size; };
+
+        /**
+         * @brief Get the total size in bytes of all segments, including buffered records
+         */
+        size_t getTotalSize() const { return totalSize; };
+
+        /**
+         * @brief Default maximum segment size in bytes (16384)
+         */
+        static const size_t defaultMaxSegmentSize = 16384;
+
+        /**
+         * @brief Default maximum total size in bytes (65536)
+         */
+        static const size_t defaultMaxTotalSize = 65536;
+
+    protected:
+        /**
+         * @brief Information about a segment file
+         */
+        struct Segment {
+            uint32_t seq;   //!< Sequence number
+            size_t size;    //!< Size in bytes
+        };
+
+        /**
+         * @brief Open a segment for appending and make it the current segment
+         * 
+         * @param seq Sequence number
+         * @return int SYSTEM_ERROR_NONE (0) on success or a system error code (non-zero)
+         */
+        int openSegment(uint32_t seq);
+
+        /**
+         * @brief Delete the oldest segments until the total size is not more than maxTotalSize
+         */
+        void enforceTotalSize();
+
+        /**
+         * @brief Parse a segment sequence number from a filename
+         * 
+         * @param name Filename (not path)
+         * @param seq Filled in with the sequence number
+         * @return true if name is a segment file
+         */
+        bool parseSegmentName(const char *name, uint32_t &seq) const;
+
+        String dirPath; //!< Directory containing the segments
+        String baseName; //!< Base name of the segment files
+        size_t maxSegmentSize = defaultMaxSegmentSize; //!< Maximum segment size in bytes, 0 for no limit
+        size_t maxSegmentRecords = 0; //!< Maximum records per segment, 0 for no limit
+        size_t maxTotalSize = defaultMaxTotalSize; //!< Maximum size of all segments in bytes, 0 for no limit
+        bool syncEachRecord = false; //!< Write and fsync after each record
+        bool isOpen = false; //!< true after begin() succeeds
+        size_t segmentRecords = 0; //!< Number of records appended to the current segment
+        size_t totalSize = 0; //!< Total size of all segments in bytes
+        std::vector<Segment> segments; //!< Segments, oldest first
+        FileStreamWrite stream; //!< Stream for the current segment
+    };
+
+
+    /**
+     * @brief Interface for allocating the buffer returned by readBytes()
+     * 
+     * The default is HeapAllocator, which uses new[] and delete[]. Use ArenaAllocator to 
+     * read into a fixed block of memory to avoid fragmenting the heap.
+     */
+    class Allocator {
+    public:
+        /**
+         * @brief Destructor
+         */
+        virtual ~Allocator() {};
+
+        /**
+         * @brief Allocate a block of memory
+         * 
+         * @param size Number of bytes to allocate (at least 1)
+         * @return uint8_t* Pointer to the memory or nullptr if it could not be allocated
+         */
+        virtual uint8_t *allocate(size_t size) = 0;
+
+        /**
+         * @brief Release a block of memory returned by allocate()
+         * 
+         * @param ptr Pointer returned by allocate(). Is never nullptr.
+         */
+        virtual void release(uint8_t *ptr) = 0;
+    };
+
+    /**
+     * @brief Allocator that uses the heap (new[] and delete[])
+     */
+    class HeapAllocator : public Allocator {
+    public:
+        /**
+         * @brief Allocate a block of memory using new[]
+         * 
+         * @param size Number of bytes to allocate
+         * @return uint8_t* Pointer to the memory or nullptr if it could not be allocated
+         */
+        virtual uint8_t *allocate(size_t size) { return new uint8_t[size]; };
+
+        /**
+         * @brief Release a block of memory using delete[]
+         * 
+         * @param ptr Pointer returned by allocate()
+         */
+        virtual void release(uint8_t *ptr) { delete[] ptr; };
+
+        /**
+         * @brief Get the shared HeapAllocator instance
+         * 
+         * @return HeapAllocator& 
+         */
+        static HeapAllocator &instance();
+    };
+
+    /**
+     * @brief Allocator that allocates from a fixed block of memory
+     * 
+     * Allocations are made sequentially from the block. Space is reclaimed in last-in, first-out
+     * order: releasing the most recent allocation makes its space available again, along with any
+     * allocations below it that were already released. The offsets of the most recent maxTracked
+     * allocations are kept; space for deeper allocations is only reclaimed when all allocations 
+     * have been released. This works well for the typical pattern of reading a file, processing 
+     * it, and releasing it, and never fragments the heap.
+     * 
+     * This class is not thread-safe.
+     */
+    class ArenaAllocator : public Allocator {
+    public:
+        /**
+         * @brief Construct an allocator using a caller-provided block of memory
+         * 
+         * @param arena Block of memory. Must remain valid for the life of this object.
+         * @param arenaSize Size of arena in bytes
+         */
+        ArenaAllocator(uint8_t *arena, size_t arenaSize) : arena(arena), arenaSize(arenaSize) {};
+
+        /**
+         * @brief Allocate a block of memory from the arena
+         * 
+         * @param size Number of bytes to allocate
+         * @return uint8_t* Pointer to the memory or nullptr if there is not enough free space in the arena
+         */
+        virtual uint8_t *allocate(size_t size);
+
+        /**
+         * @brief Release a block of memory returned by allocate()
+         * 
+         * @param ptr Pointer returned by allocate()
+         */
+        virtual void release(uint8_t *ptr);
+
+        /**
+         * @brief Release all allocations. Any previously allocated pointers must not be used after this.
+         */
+        void reset() { used = 0; numAllocations = 0; numTracked = 0; numUntracked = 0; };
+
+        /**
+         * @brief Get the number of bytes in the arena that are currently in use
+         * 
+         * @return size_t 
+         */
+        size_t getUsed() const { return used; };
+
+        /**
+         * @brief Get the size of the arena in bytes
+         * 
+         * @return size_t 
+         */
+        size_t getArenaSize() const { return arenaSize; };
+
+        /**
+         * @brief Allocations are rounded up to a multiple of this many bytes (8)
+         */
+        static const size_t alignment = 8;
+
+        /**
+         * @brief Number of nested allocations whose space can be reclaimed individually (8)
+         */
+        static const size_t maxTracked = 8;
+
+    protected:
+        uint8_t *arena; //!< Block of memory to allocate from
+        size_t arenaSize; //!< Size of arena in bytes
+        size_t used = 0; //!< Offset of the first free byte in arena
+        size_t numAllocations = 0; //!< Number of allocations that have not been released
+        size_t tracked[maxTracked]; //!< Offsets of allocations, oldest first
+        bool trackedReleased[maxTracked]; //!< true if the allocation in tracked has been released
+        size_t numTracked = 0; //!< Number of entries in tracked
+        size_t numUntracked = 0; //!< Allocations above the last tracked allocation that have not been released
+    };
+
+    /**
+     * @brief Arena allocator that contains its own block of memory
+     * 
+     * @tparam SIZE Size of the arena in bytes
+     * 
+     * Typically declared as a global variable so the memory is allocated at compile time.
+     */
+    template<size_t SIZE>
+    class StaticArenaAllocator : public ArenaAllocator {
+    public:
+        /**
+         * @brief Construct the allocator using the internal block of memory
+         */
+        StaticArenaAllocator() : ArenaAllocator(staticArena, SIZE) {};
+
+    protected:
+        alignas(8) uint8_t staticArena[SIZE]; //!< Block of memory to allocate from
+    };
+
+    /**
+     * @brief Buffer returned by readBytes() that releases its memory when destroyed
+     * 
+     * This class can be moved but not copied.
+     */
+    class OwnedBuffer {
+    public:
+        /**
+         * @brief Construct an empty buffer
+         */
+        OwnedBuffer() {};
+
+        /**
+         * @brief Destructor. Releases the buffer to the allocator it came from.
+         */
+        ~OwnedBuffer() { free(); };
+
+        /**
+         * @brief This class is not copyable
+         */
+        OwnedBuffer(const OwnedBuffer&) = delete;
+
+        /**
+         * @brief This class is not copyable
+         */
+        OwnedBuffer &operator=(const OwnedBuffer&) = delete;
+
+        /**
+         * @brief Move constructor. Takes ownership of the buffer in other.
+         * 
+         * @param other Buffer to take from. It will be empty after this call.
+         */
+        OwnedBuffer(OwnedBuffer &&other) { *this = std::move(other); };
+
+        /**
+         * @brief Move assignment. Releases the current buffer and takes ownership of the buffer in other.
+         * 
+         * @param other Buffer to take from. It will be empty after this call.
+         * @return OwnedBuffer& 
+         */
+        OwnedBuffer &operator=(OwnedBuffer &&other);
+
+        /**
+         * @brief Set the buffer. Releases the current buffer first.
+         * 
+         * @param ptr Pointer returned by allocator.allocate()
+         * @param len Length of the data in bytes
+         * @param allocator Allocator that ptr came from
+         */
+        void set(uint8_t *ptr, size_t len, Allocator *allocator);
+
+        /**
+         * @brief Release the buffer to the allocator it came from. The buffer will be empty after this call.
+         */
+        void free();
+
+        /**
+         * @brief Get a pointer to the data, or nullptr if empty
+         * 
+         * @return uint8_t* 
+         */
+        uint8_t *data() const { return ptr; };
+
+        /**
+         * @brief Get the data as a c-string. Only valid when read with nullTerminate set to true.
+         * 
+         * @return const char* 
+         */
+        const char *c_str() const { return (const char *)ptr; };
+
+        /**
+         * @brief Get the length of the data in bytes
+         * 
+         * @return size_t 
+         */
+        size_t size() const { return len; };
+
+    protected:
+        uint8_t *ptr = nullptr; //!< Buffer
+        size_t len = 0; //!< Length of data in bytes
+        Allocator *allocator = nullptr; //!< Allocator that ptr came from
+    };
+
+    /**
+     * @brief Persistent first-in, first-out queue of records stored in segment files
+     * 
+     * This is intended for store-and-forward: push events while offline, then peek, publish,
+     * and pop them when connected. Push appends to the newest segment file, and pop only 
+     * advances the head pointer, so neither reads nor rewrites the rest of the queue. 
+     * A segment file is deleted once all of its records have been popped.
+     * 
+     * Each record is stored as a 4-byte length, the data, and a 4-byte CRC-32 of the length
+     * and data. The head pointer (segment and offset) is stored in a separate file using
+     * storeStructVersioned() atomically.
+     * 
+     * After a reset or power loss, begin() recovers the queue:
+     * - A record that was partially written (bad length or CRC) at the end of the newest
+     *   segment is ignored, and the next push starts a new segment.
+     * - Records popped after the head pointer was last saved are returned again, so delivery
+     *   is at least once. Use withHeadSaveInterval(1) (the default) to minimize this.
+     */
+    class RecordQueue {
+    public:
+        /**
+         * @brief Construct a queue. You will typically set options and call begin().
+         * 
+         * @param dirPath Directory to store the queue in. Created by begin() if it does not exist.
+         * It should only be used for this queue.
+         */
+        RecordQueue(const char *dirPath);
+
+        /**
+         * @brief Destructor. Saves the head pointer and closes the files.
+         */
+        virtual ~RecordQueue();
+
+        /**
+         * @brief This class is not copyable
+         */
+        RecordQueue(const RecordQueue&) = delete;
+
+        /**
+         * @brief This class is not copyable
+         */
+        RecordQueue &operator=(const RecordQueue&) = delete;
+
+        /**
+         * @brief Start a new segment when the current segment would exceed this size in bytes (default: 4096)
+         */
+        RecordQueue &withMaxSegmentSize(size_t maxSegmentSize) { this->maxSegmentSize = maxSegmentSize; return *this; };
+
+        /**
+         * @brief Call fsync() after each push so the record survives a power loss (default: true)
+         * 
+         * If false, records are written to the file system on each push, but may not be
+         * committed to flash until close() or sync().
+         */
+        RecordQueue &withSyncEachPush(bool syncEachPush) { this->syncEachPush = syncEachPush; return *this; };
+
+        /**
+         * @brief Save the head pointer after this many pops (default: 1)
+         * 
+         * Larger values reduce flash writes, but up to this many records may be returned
+         * again after a power loss. The head pointer is always saved when a segment is deleted
+         * and on close().
+         */
+        RecordQueue &withHeadSaveInterval(size_t headSaveInterval) { this->headSaveInterval = headSaveInterval; return *this; };
+
+        /**
+         * @brief Create the directory if necessary and recover the queue from the files
+         * 
+         * @return int SYSTEM_ERROR_NONE (0) on success or a system error code (non-zero)
+         */
+        int begin();
+
+        /**
+         * @brief Add a record to the end of the queue
+         * 
+         * @param data Pointer to the record data
+         * @param size Size of the record in bytes
+         * @return int SYSTEM_ERROR_NONE (0) on success or a system error code (non-zero)
+         */
+        int push(const void *data, size_t size);
+
+        /**
+         * @brief Copy the record at the front of the queue without removing it
+         * 
+         * @param buf Buffer to copy the record to
+         * @param size On input, the size of buf. On output, the size of the record.
+         * @return int SYSTEM_ERROR_NONE (0) on success or a system error code (non-zero).
+         * SYSTEM_ERROR_NOT_FOUND if the queue is empty, SYSTEM_ERROR_TOO_LARGE if buf is too small 
+         * (size is set to the size required), or SYSTEM_ERROR_BAD_DATA if the record is corrupted
+         * (call pop() to skip it).
+         */
+        int peek(uint8_t *buf, size_t &size);
+
+        /**
+         * @brief Copy the record at the front of the queue into an allocated buffer without removing it
+         * 
+         * @param buffer Filled in with the record. Allocated using allocator.
+         * @param allocator Allocator to use (default: HeapAllocator)
+         * @return int SYSTEM_ERROR_NONE (0) on success or a system error code (non-zero)
+         */
+        int peek(OwnedBuffer &buffer, Allocator &allocator = HeapAllocator::instance());
+
+        /**
+         * @brief Remove the record at the front of the queue
+         * 
+         * @return int SYSTEM_ERROR_NONE (0) on success or a system error code (non-zero).
+         * SYSTEM_ERROR_NOT_FOUND if the queue is empty.
+         */
+        int pop();
+
+#if defined(SYSTEM_VERSION_560) || defined(UNITTEST)
+        /**
+         * @brief Add a Variant to the end of the queue, encoded as CBOR
+         * 
+         * @param variant Variant to add
+         * @return int SYSTEM_ERROR_NONE (0) on success or a system error code (non-zero)
+         * 
+         * The Variant is encoded directly to the file without an intermediate buffer.
+         */
+        int pushVariant(const particle::Variant &variant);
+
+        /**
+         * @brief Decode the record at the front of the queue as a Variant without removing it
+         * 
+         * @param variant Filled in with the record
+         * @return int SYSTEM_ERROR_NONE (0) on success or a system error code (non-zero)
+         */
+        int peekVariant(particle::Variant &variant);
+#endif // SYSTEM_VERSION_560
+
+        /**
+         * @brief Commit pushed records to flash and save the head pointer
+         * 
+         * @return int SYSTEM_ERROR_NONE (0) on success or a system error code (non-zero)
+         */
+        int sync();
+
+        /**
+         * @brief Save the head pointer and close the files. Call begin() to open again.
+         * 
+         * @return int SYSTEM_ERROR_NONE (0) on success or a system error code (non-zero)
+         */
+        int close();
+
+        /**
+         * @brief Save the head pointer now
+         * 
+         * @return int SYSTEM_ERROR_NONE (0) on success or a system error code (non-zero)
+         */
+        int saveHead();
+
+        /**
+         * @brief Get the number of records in the queue
+         */
+        size_t getCount() const { return count; };
+
+        /**
+         * @brief Returns true if there are no records in the queue
+         */
+        bool isEmpty() const { return count == 0; };
+
+        /**
+         * @brief Get the number of segment files
+         */
+        size_t getNumSegments() const { return segments.size(); };
+
+        /**
+         * @brief Name of the file in dirPath containing the head pointer
+         */
+        static const char *headFileName;
+
+        /**
+         * @brief Version of the head pointer file
+         */
+        static const uint16_t headVersion = 1;
+
+        /**
+         * @brief Default maximum segment size in bytes (4096)
+         */
+        static const size_t defaultMaxSegmentSize = 4096;
+
+    protected:
+        /**
+         * @brief Head pointer, saved to headFileName
+         */
+        struct QueueHead {
+            uint32_t seq;       //!< Sequence number of the segment containing the first record
+            uint32_t offset;    //!< Offset in the segment of the first record
+        };
+
+        /**
+         * @brief Information about a segment file
+         */
+        struct Segment {
+            uint32_t seq;   //!< Sequence number
+            size_t end;     //!< Offset after the last valid record
+        };
+
+        /**
+         * @brief Get the path to the segment file for a sequence number
+         */
+        String getSegmentPath(uint32_t seq) const;
+
+        /**
+         * @brief Scan the records in a segment, stopping at the first invalid one
+         * 
+         * @param seq Sequence number
+         * @param offset Offset to start at
+         * @param checkCrc Read the data and check the CRC (slower) or only check the lengths
+         * @param end Filled in with the offset after the last valid record
+         * @param fileSize Filled in with the size of the file
+         * @return size_t Number of valid records
+         */
+        size_t scanSegment(uint32_t seq, size_t offset, bool checkCrc, size_t &end, size_t &fileSize);
+
+        /**
+         * @brief Open the writer on a new segment after the current last segment
+         * 
+         * @return int SYSTEM_ERROR_NONE (0) on success or a system error code (non-zero)
+         */
+        int openNewSegment();
+
+        /**
+         * @brief Position the reader at the data of the record at the front of the queue
+         * 
+         * @param size Filled in with the size of the record
+         * @return int SYSTEM_ERROR_NONE (0) on success or a system error code (non-zero)
+         */
+        int seekHead(size_t &size);
+
+        /**
+         * @brief Read the data of the record at the reader position and check its CRC
+         * 
+         * @param size Size of the record from seekHead()
+         * @param buf Buffer to copy the data to, or nullptr to only check the CRC
+         * @return int SYSTEM_ERROR_NONE (0) on success or a system error code (non-zero)
+         */
+        int readHeadData(size_t size, uint8_t *buf);
+
+        /**
+         * @brief Write the record trailer and update the state after writing a record
+         * 
+         * @param size Size of the record data
+         * @param crc CRC-32 of the length and data
+         * @return int SYSTEM_ERROR_NONE (0) on success or a system error code (non-zero)
+         */
+        int finishPush(size_t size, uint32_t crc);
+
+        /**
+         * @brief Delete segments before the head segment that have been completely popped
+         */
+        void removeConsumedSegments();
+
+        String dirPath; //!< Directory containing the queue
+        size_t maxSegmentSize = defaultMaxSegmentSize; //!< Maximum segment size in bytes
+        bool syncEachPush = true; //!< fsync after each push
+        size_t headSaveInterval = 1; //!< Save the head pointer after this many pops
+        bool isOpen = false; //!< true after begin() succeeds
+        bool writerOpen = false; //!< true if writer is open on the last segment
+        bool writerDirty = false; //!< true if records were written but not synced
+        bool readerOpen = false; //!< true if reader is open on the head segment
+        uint32_t readerSeq = 0; //!< Sequence number of the segment reader is open on
+        size_t readerEnd = 0; //!< File size when reader was opened
+        QueueHead head = {0, 0}; //!< Current head pointer
+        size_t pendingPops = 0; //!< Number of pops since the head was saved
+        size_t count = 0; //!< Number of records in the queue
+        std::vector<Segment> segments; //!< Segments, oldest first
+        FileStreamWrite writer; //!< Appends to the last segment
+        FileStreamRead reader; //!< Reads the head segment
+    };
+
+    /**
+     * @brief Key-value store in a single append-only file with an index in RAM
+     * 
+     * Storing each setting in its own file uses a directory entry and at least one block per
+     * setting, and requires opening and closing a file for each access. This class stores all 
+     * of the values in one file instead.
+     * 
+     * Each put() or remove() appends a record to the end of the file, so it does not rewrite
+     * the existing data. A remove() appends a tombstone record. The index in RAM maps a hash of
+     * each key to the offset of its most recent record (12 bytes per key; the keys themselves are
+     * only stored in the file), so get() is a seek and a read.
+     * 
+     * Replaced and removed records are garbage. When the garbage exceeds the compaction threshold
+     * the live records are copied to a new file, which atomically replaces the old one. You can 
+     * also disable automatic compaction and call compactIfNeeded() from loop() when convenient.
+     * 
+     * Each record has a CRC-32. After a reset, begin() ignores a partially written record at the
+     * end of the file and compacts the file to remove it.
+     */
+    class KeyValueStore {
+    public:
+        /**
+         * @brief Construct a key-value store. You will typically set options and call begin().
+         * 
+         * @param fileName File to store data in. The directory it is in must exist.
+         */
+        KeyValueStore(const char *fileName);
+
+        /**
+         * @brief Destructor. Closes the file.
+         */
+        virtual ~KeyValueStore();
+
+        /**
+         * @brief This class is not copyable
+         */
+        KeyValueStore(const KeyValueStore&) = delete;
+
+        /**
+         * @brief This class is not copyable
+         */
+        KeyValueStore &operator=(const KeyValueStore&) = delete;
+
+        /**
+         * @brief Call fsync() after each put() or remove() so the change survives a power loss (default: true)
+         */
+        KeyValueStore &withSyncEachWrite(bool syncEachWrite) { this->syncEachWrite = syncEachWrite; return *this; };
+
+        /**
+         * @brief Set when compaction is needed
+         * 
+         * @param minGarbageBytes Do not compact unless there are at least this many bytes of garbage (default: 2048)
+         * @param garbagePercent Compact when garbage is at least this percentage of the file (default: 50)
+         * @return KeyValueStore& This object, for chaining options, fluent-style
+         */
+        KeyValueStore &withCompactThreshold(size_t minGarbageBytes, int garbagePercent = 50) { this->minGarbageBytes = minGarbageBytes; this->garbagePercent = garbagePercent; return *this; };
+
+        /**
+         * @brief Compact automatically from put() and remove() when the threshold is reached (default: true)
+         * 
+         * If false, call compactIfNeeded() periodically, such as from loop().
+         */
+        KeyValueStore &withAutoCompact(bool autoCompact) { this->autoCompact = autoCompact; return *this; };
+
+        /**
+         * @brief Read the file and build the index
+         * 
+         * @return int SYSTEM_ERROR_NONE (0) on success or a system error code (non-zero). SYSTEM_ERROR_BAD_DATA
+         * if the file exists but is not a key-value store file.
+         */
+        int begin();
+
+        /**
+         * @brief Set the value for a key
+         * 
+         * @param key Key (c-string, 1 to maxKeyLen characters)
+         * @param data Value data
+         * @param size Size of value in bytes
+         * @return int SYSTEM_ERROR_NONE (0) on success or a system error code (non-zero)
+         */
+        int put(const char *key, const void *data, size_t size);
+
+        /**
+         * @brief Set the value for a key to a string
+         * 
+         * @param key Key (c-string, 1 to maxKeyLen characters)
+         * @param value Value (c-string). The null terminator is not stored.
+         * @return int SYSTEM_ERROR_NONE (0) on success or a system error code (non-zero)
+         */
+        int putString(const char *key, const char *value) { return put(key, value, strlen(value)); };
+
+        /**
+         * @brief Get the value for a key
+         * 
+         * @param key Key to get
+         * @param buf Buffer to copy the value to
+         * @param size On input, the size of buf. On output, the size of the value.
+         * @return int SYSTEM_ERROR_NONE (0) on success or a system error code (non-zero). SYSTEM_ERROR_NOT_FOUND
+         * if the key does not exist, SYSTEM_ERROR_TOO_LARGE if buf is too small (size is set to the size required).
+         */
+        int get(const char *key, uint8_t *buf, size_t &size);
+
+        /**
+         * @brief Get the value for a key into an allocated buffer
+         * 
+         * @param key Key to get
+         * @param buffer Filled in with the value. Allocated using allocator. 
+         * @param allocator Allocator to use (default: HeapAllocator)
+         * @return int SYSTEM_ERROR_NONE (0) on success or a system error code (non-zero)
+         * 
+         * The buffer is null terminated (not included in the size) so string values can be used with c_str().
+         */
+        int get(const char *key, OwnedBuffer &buffer, Allocator &allocator = HeapAllocator::instance());
+
+        /**
+         * @brief Get the value for a key as a String
+         * 
+         * @param key Key to get
+         * @param value Filled in with the value
+         * @return int SYSTEM_ERROR_NONE (0) on success or a system error code (non-zero)
+         */
+        int getString(const char *key, String &value);
+
+        /**
+         * @brief Remove a key
+         * 
+         * @param key Key to remove
+         * @return int SYSTEM_ERROR_NONE (0) on success or a system error code (non-zero). SYSTEM_ERROR_NOT_FOUND
+         * if the key does not exist.
+         */
+        int remove(const char *key);
+
+        /**
+         * @brief Returns true if the key exists
+         */
+        bool has(const char *key);
+
+#if defined(SYSTEM_VERSION_560) || defined(UNITTEST)
+        /**
+         * @brief Set the value for a key to a Variant, encoded as CBOR like storeVariant()
+         * 
+         * @param key Key (c-string, 1 to maxKeyLen characters)
+         * @param variant Value
+         * @return int SYSTEM_ERROR_NONE (0) on success or a system error code (non-zero)
+         */
+        int putVariant(const char *key, const particle::Variant &variant);
+
+        /**
+         * @brief Get the value for a key stored by putVariant()
+         * 
+         * @param key Key to get
+         * @param variant Filled in with the value
+         * @return int SYSTEM_ERROR_NONE (0) on success or a system error code (non-zero). 
+         * SYSTEM_ERROR_BAD_DATA if the value was not stored by putVariant().
+         */
+        int getVariant(const char *key, particle::Variant &variant);
+#endif // SYSTEM_VERSION_560
+
+        /**
+         * @brief Get all of the keys
+         * 
+         * @param keys Filled in with the keys, in no particular order. It is cleared first.
+         * @return int SYSTEM_ERROR_NONE (0) on success or a system error code (non-zero)
+         */
+        int getKeys(std::vector<String> &keys);
+
+        /**
+         * @brief Copy the live records to a new file that replaces the current file
+         * 
+         * @return int SYSTEM_ERROR_NONE (0) on success or a system error code (non-zero)
+         */
+        int compact();
+
+        /**
+         * @brief Compact if the garbage exceeds the compaction threshold
+         * 
+         * @return int SYSTEM_ERROR_NONE (0) on success or a system error code (non-zero)
+         */
+        int compactIfNeeded();
+
+        /**
+         * @brief Commit any unsynced changes to flash
+         * 
+         * @return int SYSTEM_ERROR_NONE (0) on success or a system error code (non-zero)
+         */
+        int sync();
+
+        /**
+         * @brief Close the file. Call begin() to open again.
+         * 
+         * @return int SYSTEM_ERROR_NONE (0) on success or a system error code (non-zero)
+         */
+        int close();
+
+        /**
+         * @brief Get the number of keys
+         */
+        size_t getNumKeys() const { return index.size(); };
+
+        /**
+         * @brief Get the size of the file in bytes
+         */
+        size_t getFileSize() const { return fileSize; };
+
+        /**
+         * @brief Get the number of bytes of replaced and removed records in the file
+         */
+        size_t getGarbageBytes() const { return garbageBytes; };
+
+        /**
+         * @brief Maximum length of a key
+         */
+        static const size_t maxKeyLen = 255;
+
+        /**
+         * @brief Magic bytes at the beginning of the file ("FHKV" in little endian)
+         */
+        static const uint32_t fileMagic = 0x564b4846;
+
+        /**
+         * @brief File format version
+         */
+        static const uint16_t fileVersion = 1;
+
+    protected:
+        /**
+         * @brief Header at the beginning of the file
+         */
+        struct FileHeader {
+            uint32_t magic;         //!< fileMagic
+            uint16_t version;       //!< fileVersion
+            uint16_t headerSize;    //!< sizeof(FileHeader)
+        };
+
+        /**
+         * @brief Header at the beginning of each record. It's followed by the key, the value, and a CRC-32 of all three.
+         */
+        struct RecordHeader {
+            uint8_t type;           //!< RecordType
+            uint8_t keyLen;         //!< Length of the key (not null terminated)
+            uint16_t reserved;      //!< Always 0
+            uint32_t valueLen;      //!< Length of the value
+        };
+
+        /**
+         * @brief Type of record
+         */
+        enum RecordType : uint8_t {
+            RECORD_BYTES = 1,       //!< Value stored by put()
+            RECORD_CBOR = 2,        //!< Value stored by putVariant()
+            RECORD_TOMBSTONE = 3    //!< Key removed
+        };
+
+        /**
+         * @brief Entry in the index. The index is sorted by hash.
+         */
+        struct IndexEntry {
+            uint32_t hash;          //!< Hash of the key
+            uint32_t offset;        //!< Offset of the record in the file
+            uint32_t recordSize;    //!< Size of the record including the header and CRC
+        };
+
+        /**
+         * @brief Find the index entry for a key
+         * 
+         * @param key Key to find
+         * @param hash Hash of key
+         * @param header Filled in with the record header if found
+         * @return int Index into index, or -1 if not found. If found, the reader is positioned at the value.
+         */
+        int findKey(const char *key, uint32_t hash, RecordHeader &header);
+
+        /**
+         * @brief Read a record header and key into keyBuf, and check that the key matches
+         * 
+         * @param entry Index entry for the record
+         * @param key Key to match, or nullptr to not check the key
+         * @param header Filled in with the record header
+         * @return int SYSTEM_ERROR_NONE (0) on success or a system error code (non-zero). SYSTEM_ERROR_NOT_FOUND 
+         * if the key does not match. The reader is positioned at the value.
+         */
+        int readRecordHeader(const IndexEntry &entry, const char *key, RecordHeader &header);
+
+        /**
+         * @brief Read the value of the record at the reader position and check the CRC
+         * 
+         * @param header Record header from readRecordHeader(). The key must be in keyBuf.
+         * @param buf Buffer to copy the value to, or nullptr to only check the CRC
+         * @return int SYSTEM_ERROR_NONE (0) on success or a system error code (non-zero)
+         */
+        int readRecordValue(const RecordHeader &header, uint8_t *buf);
+
+        /**
+         * @brief Make sure the reader is open and can read up to end
+         * 
+         * @param end Offset in the file that needs to be readable
+         * @return int SYSTEM_ERROR_NONE (0) on success or a system error code (non-zero)
+         */
+        int openReader(size_t end);
+
+        /**
+         * @brief Write a record header and key to the file
+         * 
+         * @param type Type of record
+         * @param key Key
+         * @param valueLen Length of the value that will be written next
+         * @param crc Filled in with the CRC-32 so far
+         * @return int SYSTEM_ERROR_NONE (0) on success or a system error code (non-zero)
+         */
+        int beginRecord(RecordType type, const char *key, size_t valueLen, uint32_t &crc);
+
+        /**
+         * @brief Write the CRC and update the index after writing a record
+         * 
+         * @param type Type of record
+         * @param key Key
+         * @param entryIndex Index of the existing entry for key from findKey(), or -1
+         * @param valueLen Length of the value
+         * @param crc CRC-32 of the header, key, and value
+         * @return int SYSTEM_ERROR_NONE (0) on success or a system error code (non-zero)
+         */
+        int finishRecord(RecordType type, const char *key, int entryIndex, size_t valueLen, uint32_t crc);
+
+        /**
+         * @brief Open the writer and reader
+         * 
+         * @return int SYSTEM_ERROR_NONE (0) on success or a system error code (non-zero)
+         */
+        int openFiles();
+
+        /**
+         * @brief Close the writer and reader
+         */
+        void closeFiles();
+
+        /**
+         * @brief Returns true if the garbage exceeds the compaction threshold
+         */
+        bool needsCompaction() const;
+
+        /**
+         * @brief Hash of a key
+         */
+        static uint32_t hashKey(const char *key) { return crc32(key, strlen(key)); };
+
+        String fileName; //!< File containing the data
+        bool syncEachWrite = true; //!< fsync after each put or remove
+        bool autoCompact = true; //!< Compact from put() and remove()
+        size_t minGarbageBytes = 2048; //!< Minimum garbage before compacting
+        int garbagePercent = 50; //!< Percentage of garbage in the file to compact
+        bool isOpen = false; //!< true after begin() succeeds
+        bool writerDirty = false; //!< true if records were written but not synced
+        bool readerOpen = false; //!< true if reader is open
+        size_t readerEnd = 0; //!< File size when reader was opened
+        size_t fileSize = 0; //!< Size of the valid data in the file
+        size_t garbageBytes = 0; //!< Bytes of replaced or removed records
+        std::vector<IndexEntry> index; //!< Index sorted by hash
+        FileStreamWrite writer; //!< Appends to the file
+        FileStreamRead reader; //!< Reads records
+        char keyBuf[maxKeyLen + 1]; //!< Key read by readRecordHeader()
+    };
+
+    /**
+     * @brief File of fixed-size records with random access. Use RecordFile<T> instead of using this directly.
+     * 
+     * Instead of storing one struct per file with storeStruct(), store an array of structs in one 
+     * file. Record n is stored at a fixed offset after a small header, so reading or writing a 
+     * record, or a range of records, is one seek and one read or write. There is no buffering and
+     * no memory is allocated.
+     * 
+     * The header contains a version number and the record size. If either does not match when
+     * the file is opened, begin() fails.
+     */
+    class RecordFileBase {
+    public:
+        /**
+         * @brief Construct a record file. You will typically set options and call begin().
+         * 
+         * @param fileName File to store the records in
+         * @param recordSize Size of each record in bytes (must be greater than 0)
+         * @param version Version number of the record layout. Increment this when the layout changes.
+         */
+        RecordFileBase(const char *fileName, size_t recordSize, uint16_t version = 0);
+
+        /**
+         * @brief Destructor. Closes the file.
+         */
+        virtual ~RecordFileBase();
+
+        /**
+         * @brief This class is not copyable
+         */
+        RecordFileBase(const RecordFileBase&) = delete;
+
+        /**
+         * @brief This class is not copyable
+         */
+        RecordFileBase &operator=(const RecordFileBase&) = delete;
+
+        /**
+         * @brief fsync after each write (default: false)
+         */
+        RecordFileBase &withSyncEachWrite(bool syncEachWrite) { this->syncEachWrite = syncEachWrite; return *this; };
+
+        /**
+         * @brief Open the file, creating it if it does not exist
+         * 
+         * @return int SYSTEM_ERROR_NONE (0) on success or a system error code (non-zero)
+         * 
+         * Returns SYSTEM_ERROR_BAD_DATA if the file is not a record file or the record size is different, 
+         * and SYSTEM_ERROR_NOT_SUPPORTED if the version is different. A partially written record at the
+         * end of the file is ignored and will be overwritten by the next append.
+         */
+        int begin();
+
+        /**
+         * @brief Close the file. Call begin() to open again.
+         * 
+         * @return int SYSTEM_ERROR_NONE (0) on success or a system error code (non-zero)
+         */
+        int close();
+
+        /**
+         * @brief fsync the file
+         * 
+         * @return int SYSTEM_ERROR_NONE (0) on success or a system error code (non-zero)
+         */
+        int sync();
+
+        /**
+         * @brief Read one or more consecutive records
+         * 
+         * @param index Index of the first record to read (0 = first record)
+         * @param buf Buffer to read into, at least count * recordSize bytes
+         * @param count Number of records to read
+         * @param countRead If not null, filled in with the number of records read. If null, it is
+         * an error if there are fewer than count records starting at index.
+         * @return int SYSTEM_ERROR_NONE (0) on success or a system error code (non-zero).
+         * SYSTEM_ERROR_NOT_FOUND if index is past the last record.
+         */
+        int readRecords(size_t index, void *buf, size_t count, size_t *countRead = nullptr);
+
+        /**
+         * @brief Write one or more consecutive records
+         * 
+         * @param index Index of the first record to write. Can be size() to append.
+         * @param buf Buffer containing count * recordSize bytes
+         * @param count Number of records to write
+         * @return int SYSTEM_ERROR_NONE (0) on success or a system error code (non-zero).
+         * SYSTEM_ERROR_INVALID_ARGUMENT if index is greater than size().
+         */
+        int writeRecords(size_t index, const void *buf, size_t count);
+
+        /**
+         * @brief Remove records from the end so there are count records
+         * 
+         * @param count Number of records to keep
+         * @return int SYSTEM_ERROR_NONE (0) on success or a system error code (non-zero)
+         */
+        int truncate(size_t count);
+
+        /**
+         * @brief Get the number of records in the file
+         */
+        size_t size() const { return numRecords; };
+
+        /**
+         * @brief Get the size of each record in bytes
+         */
+        size_t getRecordSize() const { return recordSize; };
+
+        /**
+         * @brief Header at the beginning of the file
+         */
+        struct FileHeader {
+            uint32_t magic;         //!< recordFileMagic
+            uint16_t version;       //!< Version number passed to the constructor
+            uint16_t headerSize;    //!< sizeof(FileHeader), allows the header to be extended in the future
+            uint32_t recordSize;    //!< Size of each record in bytes
+        };
+
+        /**
+         * @brief Magic bytes at the beginning of the file ("FHRF" in little endian)
+         */
+        static const uint32_t recordFileMagic = 0x46524846;
+
+    protected:
+        String fileName; //!< File containing the records
+        size_t recordSize; //!< Size of each record in bytes
+        uint16_t version; //!< Version number of the record layout
+        bool syncEachWrite = false; //!< fsync after each write
+        int fd = -1; //!< File descriptor, -1 if not open
+        size_t headerSize = sizeof(FileHeader); //!< Offset of the first record
+        size_t numRecords = 0; //!< Number of complete records in the file
+    };
+
+    /**
+     * @brief File of fixed-size structs with random access
+     * 
+     * @tparam T The struct/class to store. It must be flat; embedded objects including String 
+     * are not serialized and will not be saved and restored properly.
+     * 
+     * For example, 500 sensor calibration records can be stored in one file instead of 500 files
+     * using storeStruct(). See RecordFileBase.
+     */
+    template <typename T>
+    class RecordFile : public RecordFileBase {
+    public:
+        /**
+         * @brief Construct a record file. You will typically set options and call begin().
+         * 
+         * @param fileName File to store the records in
+         * @param version Version number of T. Increment this when the layout of T changes.
+         */
+        RecordFile(const char *fileName, uint16_t version = 0) : RecordFileBase(fileName, sizeof(T), version) {};
+
+        /**
+         * @brief Read a record
+         * 
+         * @param index Index of the record (0 = first record)
+         * @param t Filled in with the record
+         * @return int SYSTEM_ERROR_NONE (0) on success or a system error code (non-zero).
+         * SYSTEM_ERROR_NOT_FOUND if index is past the last record.
+         */
+        int read(size_t index, T &t) { return readRecords(index, &t, 1); };
+
+        /**
+         * @brief Read a range of records into an array
+         * 
+         * @param index Index of the first record
+         * @param array Array of at least count elements
+         * @param count Number of records to read
+         * @param countRead If not null, filled in with the number of records read, which can be
+         * fewer than count at the end of the file. If null, all count records must exist.
+         * @return int SYSTEM_ERROR_NONE (0) on success or a system error code (non-zero)
+         */
+        int readRange(size_t index, T *array, size_t count, size_t *countRead = nullptr) { return readRecords(index, array, count, countRead); };
+
+        /**
+         * @brief Write a record
+         * 
+         * @param index Index of the record. Can be size() to append.
+         * @param t Record to write
+         * @return int SYSTEM_ERROR_NONE (0) on success or a system error code (non-zero)
+         */
+        int write(size_t index, const T &t) { return writeRecords(index, &t, 1); };
+
+        /**
+         * @brief Write a range of records from an array
+         * 
+         * @param index Index of the first record. Can be size() to append.
+         * @param array Array of count elements
+         * @param count Number of records to write
+         * @return int SYSTEM_ERROR_NONE (0) on success or a system error code (non-zero)
+         */
+        int writeRange(size_t index, const T *array, size_t count) { return writeRecords(index, array, count); };
+
+        /**
+         * @brief Append a record to the end of the file
+         * 
+         * @param t Record to write
+         * @return int SYSTEM_ERROR_NONE (0) on success or a system error code (non-zero)
+         */
+        int append(const T &t) { return writeRecords(numRecords, &t, 1); };
+    };
 
     /**
      * @brief Create all of the directories in path
@@ -323,116 +2374,586 @@ public:
      * @return int SYSTEM_ERROR_NONE (0) on success or a system error code (non-zero)
      * 
      * The standard mkdir() function only will create the last component of the path.
+     * 
+     * The most recently used directories that are known to exist are cached (mkdirsCacheSize), 
+     * so calling mkdirs() before every write to a file in the same directory does not make any
+     * file system calls. Only absolute paths are cached. Otherwise, the whole path is created 
+     * first, and if a parent does not exist, the parents are created from the top down. 
+     * Directories that already exist are not an error.
      */
     static int mkdirs(const char *path);
 
+    /**
+     * @brief Remove directories from the mkdirs() cache
+     * 
+     * @param path Directory that was removed or renamed. It and all of its subdirectories are removed
+     * from the cache. nullptr (the default) or a relative path clears the whole cache.
+     * 
+     * deleteRecursive() does this automatically. Call this if you remove or rename directories 
+     * without using FileHelperRK, for example using rmdir() or rename(), otherwise mkdirs() may 
+     * not recreate them.
+     */
+    static void invalidateMkdirsCache(const char *path = nullptr);
+
+    /**
+     * @brief Number of directories in the mkdirs() cache (8)
+     */
+    static const size_t mkdirsCacheSize = 8;
+
     /**
      * @brief Delete a directory and all of the subdirectories and files
      * 
      * @param path The directory (or contents of the directory) to delete
      * @param contentsOfPathOnly If true, only delete the contents of path, leaving the top directory.
      * @return int SYSTEM_ERROR_NONE (0) on success or a system error code (non-zero)
+     * 
+     * Stops at the first file or directory that cannot be deleted and returns its error.
+     * Use DeleteOptions::withContinueOnFailure() to delete as much as possible instead.
      */
     static int deleteRecursive(const char *path, bool contentsOfPathOnly = false);
 
+    /**
+     * @brief Options for deleteRecursive()
+     */
+    class DeleteOptions {
+    public:
+        /**
+         * @brief Only delete the contents of the path, leaving the top directory (default: false)
+         * 
+         * @return DeleteOptions& This object, for chaining options, fluent-style
+         */
+        DeleteOptions &withContentsOfPathOnly(bool contentsOfPathOnly = true) { this->contentsOfPathOnly = contentsOfPathOnly; return *this; };
+
+        /**
+         * @brief Delete subdirectories in parallel using this many threads (default: 0, serial)
+         * 
+         * @param numThreads Number of worker threads. 0 or 1 deletes serially in the calling thread.
+         * Limited to the number of CPU cores (std::thread::hardware_concurrency()).
+         * @return DeleteOptions& This object, for chaining options, fluent-style
+         * 
+         * Only supported on host (UNITTEST) builds, for removing large trees such as test output.
+         * Idle threads wait for more directories instead of polling.
+         * On devices this is ignored and the tree is deleted serially.
+         */
+        DeleteOptions &withNumThreads(size_t numThreads) { this->numThreads = numThreads; return *this; };
+
+        /**
+         * @brief Keep deleting after a file or directory cannot be deleted (default: false, stop at the first failure)
+         * 
+         * @return DeleteOptions& This object, for chaining options, fluent-style
+         * 
+         * Everything that can be deleted is deleted in one pass. The directories containing the
+         * failures cannot be removed, and are also reported as failures. The first error is returned.
+         */
+        DeleteOptions &withContinueOnFailure(bool continueOnFailure = true) { this->continueOnFailure = continueOnFailure; return *this; };
+
+        bool contentsOfPathOnly = false; //!< Leave the top directory
+        size_t numThreads = 0; //!< Number of worker threads, 0 or 1 for serial
+        bool continueOnFailure = false; //!< Keep going after a failure
+    };
+
+    /**
+     * @brief Results from deleteRecursive()
+     */
+    struct DeleteResult {
+        /**
+         * @brief A file or directory that could not be deleted
+         */
+        struct Failure {
+            String path;    //!< Path of the file or directory
+            int error;      //!< System error code
+        };
+
+        size_t filesDeleted = 0;            //!< Number of files deleted
+        size_t directoriesDeleted = 0;      //!< Number of directories removed
+        uint64_t bytesFreed = 0;            //!< Total size of the files deleted in bytes (not including file system overhead)
+        std::vector<Failure> failures;      //!< Files and directories that could not be deleted
+        unsigned long elapsedMs = 0;        //!< Time taken in milliseconds
+
+        /**
+         * @brief Clear the results. Called by deleteRecursive().
+         */
+        void clear() { filesDeleted = directoriesDeleted = 0; bytesFreed = 0; failures.clear(); elapsedMs = 0; };
+    };
+
+    /**
+     * @brief Delete a directory and all of the subdirectories and files, with options
+     * 
+     * @param path The directory (or contents of the directory) to delete
+     * @param options Options such as the number of threads to use
+     * @param deleteResult If not null, filled in with the number of files and directories deleted, bytes 
+     * freed, failures, and the elapsed time. Each file is stat()ed to get its size only if this is not null.
+     * @return int SYSTEM_ERROR_NONE (0) on success or a system error code (non-zero)
+     * 
+     * When using multiple threads, each directory is a unit of work. Idle threads take work from
+     * other threads' queues. The files in a directory are always deleted, and all of its 
+     * subdirectories removed, before the directory itself is removed. The first error is returned.
+     */
+    static int deleteRecursive(const char *path, const DeleteOptions &options, DeleteResult *deleteResult = nullptr);
+
+    /**
+     * @brief Flag for storeBytes(), storeString(), storeStruct(), and storeVariant() to store the file atomically
+     * 
+     * The data is written to a temporary file in the same directory (fileName with tempFileSuffix appended)
+     * which is then renamed over fileName. If a reset or power loss occurs during the write, fileName
+     * will contain either the old or the new contents, never a truncated file. 
+     * 
+     * Stale temporary files from an interrupted store can be removed with cleanupTempFiles().
+     */
+    static const int STORE_ATOMIC = 0x01;
+
+    /**
+     * @brief Flag for storeBytes(), storeString(), storeStruct(), and storeVariant() to call fsync() before closing the file
+     */
+    static const int STORE_SYNC = 0x02;
+
+    /**
+     * @brief Flag for storeBytes(), storeString(), and storeStruct() to only write the file if the contents changed
+     * 
+     * The existing file is read and compared to the new data first. If they are the same, the file is not
+     * written, saving flash wear and time. Use the written parameter to find out whether a write occurred.
+     */
+    static const int STORE_IF_CHANGED = 0x04;
+
     /**
      * @brief Store bytes to a file
      * 
      * @param fileName Filename to write to. File will be created and truncated.
      * @param dataPtr Pointer to binary data to write
      * @param dataLen Length of data (0 or more bytes)
+     * @param flags 0 or a combination of STORE_ATOMIC, STORE_SYNC, and STORE_IF_CHANGED
+     * @param written If non-null, set to true if the file was written or false if STORE_IF_CHANGED was used and the contents were unchanged
      * @return int SYSTEM_ERROR_NONE (0) on success or a system error code (non-zero)
      * 
      * See also storeString()
      */
-    static int storeBytes(const char *fileName, const uint8_t *dataPtr, size_t dataLen);
+    static int storeBytes(const char *fileName, const uint8_t *dataPtr, size_t dataLen, int flags = 0, bool *written = nullptr);
 
     /**
      * @brief Store a String object to a file
      * 
      * @param fileName Filename to write to. File will be created and truncated.
      * @param data String object to write. It only needs to remain valid until this method returns.
+     * @param flags 0 or a combination of STORE_ATOMIC, STORE_SYNC, and STORE_IF_CHANGED
+     * @param written If non-null, set to true if the file was written or false if STORE_IF_CHANGED was used and the contents were unchanged
+     * @return int SYSTEM_ERROR_NONE (0) on success or a system error code (non-zero)
+     */
+    static int storeString(const char *fileName, const String &data, int flags = 0, bool *written = nullptr);
+
+    /**
+     * @brief Store a c-string to a file
+     * 
+     * @param fileName Filename to write to. File will be created and truncated.
+     * @param str c-string to write. Can be an empty string or NULL to save an empty file.
+     * @param flags 0 or a combination of STORE_ATOMIC, STORE_SYNC, and STORE_IF_CHANGED
+     * @param written If non-null, set to true if the file was written or false if STORE_IF_CHANGED was used and the contents were unchanged
+     * @return int SYSTEM_ERROR_NONE (0) on success or a system error code (non-zero)
+     */
+    static int storeString(const char *fileName, const char *str, int flags = 0, bool *written = nullptr);
+
+#if defined(SYSTEM_VERSION_560) || defined(UNITTEST)
+    /**
+     * @brief Store a Variant to a file
+     * 
+     * @param fileName Filename to write to. File will be created and truncated.
+     * @param variant Variant to write.
+     * @param flags 0 or a combination of STORE_ATOMIC and STORE_SYNC. STORE_IF_CHANGED is not supported and is ignored.
+     * @return int SYSTEM_ERROR_NONE (0) on success or a system error code (non-zero)
+     * 
+     * Variant is used for storing any structured data including primitive types (int, boolean, string)
+     * as well as maps and arrays. It's also directly translatable to JSON.
+     * 
+     * Internally, when stored to a file, the data is saved as CBOR (not JSON).
+     * 
+     * Variant is only defined in Device OS 5.6.0 and later. This method is npt
+     * available on earlier versions of Device OS.
+     * 
+     * If the file has changes from patchVariant(), they are discarded and the file is always
+     * replaced atomically.
+     */
+    static int storeVariant(const char *fileName, const particle::Variant &variant, int flags = 0);
+
+    /**
+     * @brief Set the value at a path in a Variant file without rewriting the file
+     * 
+     * @param fileName Variant file, stored by storeVariant(). It does not need to exist.
+     * @param path Slash-separated path of map keys and array indexes, for example "sensors/3/threshold".
+     * Missing map keys are created. An array index equal to the size of the array appends. An empty
+     * path replaces the whole document.
+     * @param value Value to set
+     * @param flags 0 or STORE_SYNC
+     * @param bytesWritten If not null, filled in with the number of bytes written to the file system
+     * @return int SYSTEM_ERROR_NONE (0) on success or a system error code (non-zero). 
+     * SYSTEM_ERROR_NOT_FOUND if an array index in path is past the end of the array.
+     * 
+     * The change is appended to a delta log file (fileName with variantDeltaSuffix appended) instead
+     * of rewriting the file. readVariant() and readVariantPath() apply the changes in the delta log.
+     * The items along path are read from the file, with the changes already in the log applied, to 
+     * check the path before the change is appended. A record at the end of the log that was only 
+     * partially written is removed first.
+     * When the delta log is at least variantDeltaCompactSize bytes and as large as the file, it is 
+     * compacted into the file, and bytesWritten includes the size of the rewritten file.
+     */
+    static int patchVariant(const char *fileName, const char *path, const particle::Variant &value, int flags = 0, size_t *bytesWritten = nullptr);
+
+    /**
+     * @brief Remove a map key or array element from a Variant file without rewriting the file
+     * 
+     * @param fileName Variant file, stored by storeVariant()
+     * @param path Slash-separated path of map keys and array indexes
+     * @param flags 0 or STORE_SYNC
+     * @param bytesWritten If not null, filled in with the number of bytes written to the file system
+     * @return int SYSTEM_ERROR_NONE (0) on success or a system error code (non-zero)
+     * 
+     * See patchVariant(). Removing a path that does not exist is not an error.
+     */
+    static int patchVariantRemove(const char *fileName, const char *path, int flags = 0, size_t *bytesWritten = nullptr);
+
+    /**
+     * @brief Apply the changes in the delta log of a Variant file to the file and remove the delta log
+     * 
+     * @param fileName Variant file, stored by storeVariant()
+     * @param bytesWritten If not null, filled in with the number of bytes written to the file system
+     * @return int SYSTEM_ERROR_NONE (0) on success or a system error code (non-zero)
+     * 
+     * This is done automatically by patchVariant() but can be done sooner, for example when idle.
+     * If there is no delta log, nothing is written.
+     */
+    static int compactVariant(const char *fileName, size_t *bytesWritten = nullptr);
+
+    /**
+     * @brief Suffix added to the filename for the delta log of patchVariant()
+     */
+    static const char *variantDeltaSuffix;
+
+    /**
+     * @brief Compact the delta log when it is at least this many bytes and as large as the file (1024)
+     */
+    static const size_t variantDeltaCompactSize = 1024;
+#endif // SYSTEM_VERSION_560
+
+    /**
+     * @brief Store a struct in a file
+     * 
+     * @tparam T The struct/class to read
+     * @param fileName Filename to read from
+     * @param t The variable to write
+     * @param flags 0 or a combination of STORE_ATOMIC, STORE_SYNC, and STORE_IF_CHANGED
+     * @param written If non-null, set to true if the file was written or false if STORE_IF_CHANGED was used and the contents were unchanged
+     * @return const T& returns t that was passed in
+     * 
+     * The struct must be flat; embedded objects including String are not serialized
+     * and will not be saved and restored properly.
+     */
+    template <typename T> 
+    static const T &storeStruct(const char *fileName, const T &t, int flags = 0, bool *written = nullptr) {
+        storeBytes(fileName, (const uint8_t *)&t, sizeof(T), flags, written);
+        return t;
+    }
+
+    /**
+     * @brief Compare the contents of a file to a buffer
+     * 
+     * @param fileName Filename to compare
+     * @param dataPtr Pointer to binary data to compare
+     * @param dataLen Length of data (0 or more bytes)
+     * @return true The file exists and its contents are exactly the data
+     * @return false The file does not exist, could not be read, or is different
+     * 
+     * The file is read in small blocks on the stack; no memory is allocated.
+     */
+    static bool compareBytes(const char *fileName, const uint8_t *dataPtr, size_t dataLen);
+
+    /**
+     * @brief Get the name of the temporary file used by STORE_ATOMIC for fileName
+     * 
+     * @param fileName Filename being stored
+     * @return String fileName with tempFileSuffix appended
+     */
+    static String getTempFileName(const char *fileName);
+
+    /**
+     * @brief Delete temporary files left by a STORE_ATOMIC store that was interrupted
+     * 
+     * @param path Directory to clean up
+     * @param recursive If true, subdirectories of path are also cleaned up
+     * @return int SYSTEM_ERROR_NONE (0) on success or a system error code (non-zero)
+     * 
+     * Typically called once from setup() for the directories that contain atomically
+     * stored files. The original files are not affected; an interrupted store leaves the
+     * previous contents of the file in place.
+     */
+    static int cleanupTempFiles(const char *path, bool recursive = true);
+
+    /**
+     * @brief Internal function to finish a STORE_ATOMIC store
+     * 
+     * @param tempName Temporary file that was written
+     * @param fileName Final filename
+     * @param result Result from writing the temporary file
+     * @return int SYSTEM_ERROR_NONE (0) on success or a system error code (non-zero)
+     * 
+     * If result is SYSTEM_ERROR_NONE, tempName is renamed to fileName, otherwise tempName is deleted.
+     */
+    static int finishTempFile(const char *tempName, const char *fileName, int result);
+
+    /**
+     * @brief Read bytes from a file
+     * 
+     * @param fileName Filename to read from
+     * @param dataPtr Filled in with an allocated pointer containing the data
+     * @param dataLen On return, the length of the data in bytes
+     * @param nullTerminate Set to true to null-terminate the buffer. Default is false. If null terminated, the dataLen is the actual string length, not including the null terminator.
+     * @return int SYSTEM_ERROR_NONE (0) on success or a system error code (non-zero)
+     * 
+     * If the returned value in dataPtr is non-zero, you must delete it using delete[] dataPtr.
+     */
+    static int readBytes(const char *fileName, uint8_t *&dataPtr, size_t &dataLen, bool nullTerminate = false);
+
+    /**
+     * @brief Read bytes from a file into a buffer from an allocator
+     * 
+     * @param fileName Filename to read from
+     * @param allocator Allocator to allocate the buffer from, such as an ArenaAllocator
+     * @param dataPtr Filled in with an allocated pointer containing the data
+     * @param dataLen On return, the length of the data in bytes
+     * @param nullTerminate Set to true to null-terminate the buffer. Default is false. If null terminated, the dataLen is the actual string length, not including the null terminator.
+     * @return int SYSTEM_ERROR_NONE (0) on success or a system error code (non-zero)
+     * 
+     * If the returned value in dataPtr is non-zero, you must release it using allocator.release(dataPtr).
+     */
+    static int readBytes(const char *fileName, Allocator &allocator, uint8_t *&dataPtr, size_t &dataLen, bool nullTerminate = false);
+
+    /**
+     * @brief Read bytes from a file into an OwnedBuffer that releases the memory automatically
+     * 
+     * @param fileName Filename to read from
+     * @param buffer Filled in with the data. Any previous data is released first.
+     * @param nullTerminate Set to true to null-terminate the buffer. Default is false. If null terminated, the size() is the actual string length, not including the null terminator.
+     * @return int SYSTEM_ERROR_NONE (0) on success or a system error code (non-zero)
+     * 
+     * The memory is allocated from the heap.
+     */
+    static int readBytes(const char *fileName, OwnedBuffer &buffer, bool nullTerminate = false);
+
+    /**
+     * @brief Read bytes from a file into an OwnedBuffer allocated from allocator
+     * 
+     * @param fileName Filename to read from
+     * @param allocator Allocator to allocate the buffer from, such as an ArenaAllocator. Must remain valid until the buffer is released.
+     * @param buffer Filled in with the data. Any previous data is released first.
+     * @param nullTerminate Set to true to null-terminate the buffer. Default is false. If null terminated, the size() is the actual string length, not including the null terminator.
+     * @return int SYSTEM_ERROR_NONE (0) on success or a system error code (non-zero)
+     */
+    static int readBytes(const char *fileName, Allocator &allocator, OwnedBuffer &buffer, bool nullTerminate = false);
+
+    /**
+     * @brief Read bytes from a file into a buffer instead of allocating one
+     * 
+     * @param fileName Filename to read from
+     * @param dataPtr Buffer filled in with up to dataLen bytes
+     * @param dataLen On entry, size of the buffer in dataPtr. On exit, number of bytes copied to dataPtr
+     * @return int SYSTEM_ERROR_NONE (0) on success or a system error code (non-zero)
+     */
+    static int readBytesNoAlloc(const char *fileName, uint8_t *dataPtr, size_t &dataLen);
+
+    /**
+     * @brief Read file contents to a String object
+     * 
+     * @param fileName Filename to read from
+     * @param result String object filled in with the data
+     * @return int SYSTEM_ERROR_NONE (0) on success or a system error code (non-zero)
+     * 
+     * The String is reserved to the file size once and the file is read into it in small 
+     * blocks on the stack, so the only allocation is the String buffer. If you pass the same 
+     * String object for repeated reads, its existing buffer is reused when it is large enough.
+     * 
+     * If the file contains a null byte, the String ends before it.
+     */
+    static int readString(const char *fileName, String &result);
+
+    /**
+     * @brief Read file contents into a c-string buffer instead of allocating memory
+     * 
+     * @param fileName Filename to read from
+     * @param buf Buffer to store the c-string
+     * @param len On entry, the size of buf in bytes including the null terminator. On exit, the length of the string (not including the null terminator).
      * @return int SYSTEM_ERROR_NONE (0) on success or a system error code (non-zero)
+     * 
+     * buf is always null terminated if len is at least 1 on entry. If the file is larger than len - 1
+     * bytes, only the first len - 1 bytes are returned, the same as readBytesNoAlloc().
+     */
+    static int readString(const char *fileName, char *buf, size_t &len);
+
+    /**
+     * @brief One file to read or store using readBatch() or storeBatch()
+     * 
+     * Use the static read() and store() functions to create items.
+     */
+    struct BatchItem {
+        /**
+         * @brief Called by readBatch() with the contents of a file when buf is nullptr
+         * 
+         * The data is in a scratch buffer shared by all items and is only valid during the call.
+         * Return SYSTEM_ERROR_NONE or an error code, which is stored in result.
+         */
+        typedef std::function<int(const char *fileName, const uint8_t *data, size_t dataLen)> ReadCallback;
+
+        const char *fileName = nullptr;         //!< File to read or store. Must remain valid during the call.
+        uint8_t *buf = nullptr;                 //!< Read: buffer to read into, or nullptr to use callback
+        const uint8_t *data = nullptr;          //!< Store: data to write
+        size_t size = 0;                        //!< Read: size of buf on entry, bytes read on return. Store: length of data.
+        int flags = 0;                          //!< Store: flags for storeBytes(), such as STORE_ATOMIC
+        ReadCallback callback = nullptr;        //!< Read: called with the file contents if buf is nullptr
+        int result = SYSTEM_ERROR_UNKNOWN;      //!< Filled in with the result for this item
+
+        /**
+         * @brief Read a file into a buffer, like readBytesNoAlloc()
+         * 
+         * @param fileName File to read
+         * @param buf Buffer to read into. For a struct, pass &t and sizeof(t).
+         * @param size Size of buf in bytes. If the file is larger, only size bytes are read.
+         */
+        static BatchItem read(const char *fileName, void *buf, size_t size) {
+            BatchItem item;
+            item.fileName = fileName;
+            item.buf = (uint8_t *)buf;
+            item.size = size;
+            return item;
+        };
+
+        /**
+         * @brief Read a file into the shared scratch buffer and pass it to a callback
+         * 
+         * @param fileName File to read
+         * @param callback Function or lambda to call with the data
+         */
+        static BatchItem read(const char *fileName, ReadCallback callback) {
+            BatchItem item;
+            item.fileName = fileName;
+            item.callback = callback;
+            return item;
+        };
+
+        /**
+         * @brief Store data to a file, like storeBytes()
+         * 
+         * @param fileName File to write
+         * @param data Data to write. Must remain valid during the call.
+         * @param size Length of data in bytes
+         * @param flags 0 or a combination of STORE_ATOMIC, STORE_SYNC, and STORE_IF_CHANGED
+         */
+        static BatchItem store(const char *fileName, const void *data, size_t size, int flags = 0) {
+            BatchItem item;
+            item.fileName = fileName;
+            item.data = (const uint8_t *)data;
+            item.size = size;
+            item.flags = flags;
+            return item;
+        };
+    };
+
+    /**
+     * @brief Options for readBatch() and storeBatch()
      */
-    static int storeString(const char *fileName, const String &data);
+    class BatchOptions {
+    public:
+        /**
+         * @brief Process the items in order of directory and name instead of the order passed in (default: true)
+         * 
+         * @return BatchOptions& This object, for chaining options, fluent-style
+         */
+        BatchOptions &withSortByDirectory(bool sortByDirectory = true) { this->sortByDirectory = sortByDirectory; return *this; };
+
+        /**
+         * @brief Process items in parallel using this many threads (default: 0, serial)
+         * 
+         * @return BatchOptions& This object, for chaining options, fluent-style
+         * 
+         * Only supported on host (UNITTEST) builds; ignored on devices. When using more than one
+         * thread, read callbacks may be called from any of the threads, but each thread has its 
+         * own scratch buffer.
+         */
+        BatchOptions &withNumThreads(size_t numThreads) { this->numThreads = numThreads; return *this; };
+
+        /**
+         * @brief Allocator for the scratch buffer used by read callbacks (default: HeapAllocator)
+         * 
+         * @return BatchOptions& This object, for chaining options, fluent-style
+         * 
+         * When using more than one thread, the allocator is shared by the threads, so only the 
+         * shared HeapAllocator::instance() can be used; readBatch() returns SYSTEM_ERROR_INVALID_ARGUMENT
+         * for other allocators.
+         */
+        BatchOptions &withAllocator(Allocator &allocator) { this->allocator = &allocator; return *this; };
+
+        bool sortByDirectory = true; //!< Sort items by directory and name
+        size_t numThreads = 0; //!< Number of threads, 0 or 1 for serial
+        Allocator *allocator = nullptr; //!< Scratch buffer allocator, or nullptr for HeapAllocator
+    };
 
     /**
-     * @brief Store a c-string to a file
+     * @brief Read many small files in one call, such as configuration files at boot
      * 
-     * @param fileName Filename to write to. File will be created and truncated.
-     * @param str c-string to write. Can be an empty string or NULL to save an empty file.
-     * @return int SYSTEM_ERROR_NONE (0) on success or a system error code (non-zero)
+     * @param items Array of items created by BatchItem::read(). result and size are filled in for each item.
+     * @param numItems Number of items
+     * @param options Options, such as whether to sort by directory
+     * @return int SYSTEM_ERROR_NONE (0) if all items succeeded, otherwise the first error in items
+     * 
+     * Each file is opened, read, and closed once. Items with callbacks share one scratch buffer,
+     * which is only enlarged when a larger file is read, so reading 30 files makes at most a 
+     * few allocations. Errors are logged once for the whole batch instead of once per file.
      */
-    static int storeString(const char *fileName, const char *str);
+    static int readBatch(BatchItem *items, size_t numItems, const BatchOptions &options);
 
-#if defined(SYSTEM_VERSION_560) || defined(UNITTEST)
     /**
-     * @brief Store a Variant to a file
-     * 
-     * @param fileName Filename to write to. File will be created and truncated.
-     * @param variant Variant to write.
-     * @return int SYSTEM_ERROR_NONE (0) on success or a system error code (non-zero)
-     * 
-     * Variant is used for storing any structured data including primitive types (int, boolean, string)
-     * as well as maps and arrays. It's also directly translatable to JSON.
-     * 
-     * Internally, when stored to a file, the data is saved as CBOR (not JSON).
+     * @brief Read many small files in one call with the default options
      * 
-     * Variant is only defined in Device OS 5.6.0 and later. This method is npt
-     * available on earlier versions of Device OS.
+     * @param items Array of items created by BatchItem::read()
+     * @param numItems Number of items
+     * @return int SYSTEM_ERROR_NONE (0) if all items succeeded, otherwise the first error in items
      */
-    static int storeVariant(const char *fileName, const particle::Variant &variant);
-#endif // SYSTEM_VERSION_560
+    static int readBatch(BatchItem *items, size_t numItems) { return readBatch(items, numItems, BatchOptions()); };
 
     /**
-     * @brief Store a struct in a file
-     * 
-     * @tparam T The struct/class to read
-     * @param fileName Filename to read from
-     * @param t The variable to write
-     * @return const T& returns t that was passed in
+     * @brief Read many small files in one call
      * 
-     * The struct must be flat; embedded objects including String are not serialized
-     * and will not be saved and restored properly.
+     * @param items Vector of items created by BatchItem::read()
+     * @param options Options, such as whether to sort by directory
+     * @return int SYSTEM_ERROR_NONE (0) if all items succeeded, otherwise the first error in items
      */
-    template <typename T> 
-    static const T &storeStruct(const char *fileName, const T &t) {
-        storeBytes(fileName, (const uint8_t *)&t, sizeof(T));
-        return t;
-    }
-    
+    static int readBatch(std::vector<BatchItem> &items, const BatchOptions &options) { return readBatch(items.data(), items.size(), options); };
 
     /**
-     * @brief Read bytes from a file
+     * @brief Store many small files in one call
      * 
-     * @param fileName Filename to read from
-     * @param dataPtr Filled in with an allocated pointer containing the data
-     * @param dataLen On return, the length of the data in bytes
-     * @param nullTerminate Set to true to null-terminate the buffer. Default is false. If null terminated, the dataLen is the actual string length, not including the null terminator.
-     * @return int SYSTEM_ERROR_NONE (0) on success or a system error code (non-zero)
+     * @param items Array of items created by BatchItem::store(). result is filled in for each item.
+     * @param numItems Number of items
+     * @param options Options, such as whether to sort by directory
+     * @return int SYSTEM_ERROR_NONE (0) if all items succeeded, otherwise the first error in items
      * 
-     * If the returned value in dataPtr is non-zero, you must delete it using delete[] dataPtr.
+     * Each item is stored using storeBytes() with its flags. Directories are not created; call 
+     * mkdirs() first if necessary.
      */
-    static int readBytes(const char *fileName, uint8_t *&dataPtr, size_t &dataLen, bool nullTerminate = false);
+    static int storeBatch(BatchItem *items, size_t numItems, const BatchOptions &options);
 
     /**
-     * @brief Read bytes from a file into a buffer instead of allocating one
+     * @brief Store many small files in one call with the default options
      * 
-     * @param fileName Filename to read from
-     * @param dataPtr Buffer filled in with up to dataLen bytes
-     * @param dataLen On entry, size of the buffer in dataPtr. On exit, number of bytes copied to dataPtr
-     * @return int SYSTEM_ERROR_NONE (0) on success or a system error code (non-zero)
+     * @param items Array of items created by BatchItem::store()
+     * @param numItems Number of items
+     * @return int SYSTEM_ERROR_NONE (0) if all items succeeded, otherwise the first error in items
      */
-    static int readBytesNoAlloc(const char *fileName, uint8_t *dataPtr, size_t &dataLen);
+    static int storeBatch(BatchItem *items, size_t numItems) { return storeBatch(items, numItems, BatchOptions()); };
 
     /**
-     * @brief Read file contents to a String object
+     * @brief Store many small files in one call
      * 
-     * @param fileName Filename to read from
-     * @param result String object filled in with the data
-     * @return int SYSTEM_ERROR_NONE (0) on success or a system error code (non-zero)
+     * @param items Vector of items created by BatchItem::store()
+     * @param options Options, such as whether to sort by directory
+     * @return int SYSTEM_ERROR_NONE (0) if all items succeeded, otherwise the first error in items
      */
-    static int readString(const char *fileName, String &result);
+    static int storeBatch(std::vector<BatchItem> &items, const BatchOptions &options) { return storeBatch(items.data(), items.size(), options); };
 
     /**
      * @brief Read file contents to a struct
@@ -459,6 +2980,111 @@ public:
     }
 
 
+    /**
+     * @brief Header stored before the struct data by storeStructVersioned()
+     */
+    struct StructHeader {
+        uint32_t magic;         //!< structMagic
+        uint16_t version;       //!< Version number passed to storeStructVersioned()
+        uint16_t headerSize;    //!< sizeof(StructHeader), allows the header to be extended in the future
+        uint32_t dataSize;      //!< Number of bytes of struct data after the header
+        uint32_t crc;           //!< CRC-32 of the header bytes before this field and the struct data
+    };
+
+    /**
+     * @brief Magic bytes at the beginning of a file stored by storeStructVersioned() ("FHRS" in little endian)
+     */
+    static const uint32_t structMagic = 0x53524846;
+
+    /**
+     * @brief Store a struct in a file with a header containing a version number, size, and CRC-32
+     * 
+     * @tparam T The struct/class to store
+     * @param fileName Filename to write to
+     * @param t The variable to write
+     * @param version Version number of the struct. Increment this when the layout of T changes.
+     * @param flags 0 or a combination of STORE_ATOMIC, STORE_SYNC, and STORE_IF_CHANGED
+     * @return int SYSTEM_ERROR_NONE (0) on success or a system error code (non-zero)
+     * 
+     * The struct must be flat; embedded objects including String are not serialized
+     * and will not be saved and restored properly. Use readStructVersioned() to read it.
+     */
+    template <typename T>
+    static int storeStructVersioned(const char *fileName, const T &t, uint16_t version, int flags = 0) {
+        return storeBytesVersioned(fileName, (const uint8_t *)&t, sizeof(T), version, flags);
+    }
+
+    /**
+     * @brief Read a struct stored by storeStructVersioned(), validating the header and CRC
+     * 
+     * @tparam T The struct/class to read
+     * @param fileName Filename to read from
+     * @param t The variable to read into
+     * @param version The current version number of the struct
+     * @param migrate Optional function or lambda to convert data stored with an older version to T. 
+     * @return int SYSTEM_ERROR_NONE (0) on success or a system error code (non-zero)
+     * 
+     * Returns SYSTEM_ERROR_BAD_DATA if the file is not a versioned struct, is truncated, or the
+     * CRC does not match. If an error occurs, the struct is filled with 0 bytes.
+     * 
+     * If the version in the file is the same as version, the size must also match sizeof(T). If the 
+     * version is different, migrate is called with the version from the file and the validated data
+     * from the file. It should fill in t and return SYSTEM_ERROR_NONE, or return an error code. If 
+     * migrate is not specified, SYSTEM_ERROR_NOT_SUPPORTED is returned.
+     * 
+     * The migrated struct is not stored automatically; call storeStructVersioned() to update the file.
+     */
+    template <typename T>
+    static int readStructVersioned(const char *fileName, T &t, uint16_t version, std::function<int(uint16_t fileVersion, const uint8_t *data, size_t dataLen, T &t)> migrate = nullptr) {
+        std::function<int(uint16_t, const uint8_t *, size_t)> migrateInternal = nullptr;
+        if (migrate) {
+            migrateInternal = [&t, &migrate](uint16_t fileVersion, const uint8_t *data, size_t dataLen) {
+                return migrate(fileVersion, data, dataLen, t);
+            };
+        }
+        int result = readBytesVersioned(fileName, (uint8_t *)&t, sizeof(T), version, migrateInternal);
+        if (result != SYSTEM_ERROR_NONE) {
+            memset((uint8_t *)&t, 0, sizeof(T));
+        }
+        return result;
+    }
+
+    /**
+     * @brief Store bytes with a StructHeader. Used internally by storeStructVersioned().
+     * 
+     * @param fileName Filename to write to
+     * @param dataPtr Pointer to binary data to write
+     * @param dataLen Length of data (0 or more bytes)
+     * @param version Version number to store in the header
+     * @param flags 0 or a combination of STORE_ATOMIC, STORE_SYNC, and STORE_IF_CHANGED
+     * @return int SYSTEM_ERROR_NONE (0) on success or a system error code (non-zero)
+     */
+    static int storeBytesVersioned(const char *fileName, const uint8_t *dataPtr, size_t dataLen, uint16_t version, int flags = 0);
+
+    /**
+     * @brief Read bytes stored with storeBytesVersioned(). Used internally by readStructVersioned().
+     * 
+     * @param fileName Filename to read from
+     * @param dataPtr Buffer to read into
+     * @param dataLen Size of dataPtr. If the version matches, the size in the file must match this exactly.
+     * @param version Expected version number
+     * @param migrate Called with the file version and data if the version does not match. Can be nullptr.
+     * @return int SYSTEM_ERROR_NONE (0) on success or a system error code (non-zero)
+     */
+    static int readBytesVersioned(const char *fileName, uint8_t *dataPtr, size_t dataLen, uint16_t version, std::function<int(uint16_t fileVersion, const uint8_t *data, size_t dataLen)> migrate);
+
+    /**
+     * @brief Calculate a CRC-32 (same as zlib and Ethernet)
+     * 
+     * @param data Data to calculate the CRC over
+     * @param dataLen Length of data in bytes
+     * @param crc Previous CRC value to continue a calculation, or 0 to start a new one.
+     * @return uint32_t CRC-32 value
+     * 
+     * Uses a 256-entry table (1 Kbyte, stored in flash).
+     */
+    static uint32_t crc32(const void *data, size_t dataLen, uint32_t crc = 0);
+
 #if defined(SYSTEM_VERSION_560) || defined(UNITTEST)
     /**
      * @brief Read file contents to a Variant object
@@ -476,8 +3102,79 @@ public:
      * available on earlier versions of Device OS.
      */
     static int readVariant(const char *fileName, particle::Variant &variant);
+
+    /**
+     * @brief Apply the changes in the delta log created by patchVariant() to variant
+     * 
+     * @param fileName Variant file (not the delta log)
+     * @param variant Variant object read from the file, modified in place
+     * @return int SYSTEM_ERROR_NONE (0) on success or a system error code (non-zero).
+     * SYSTEM_ERROR_NONE if there is no delta log.
+     * 
+     * Used internally by readVariant(). A partially written change at the end of the log is ignored.
+     */
+    static int applyVariantDelta(const char *fileName, particle::Variant &variant);
+
+    /**
+     * @brief Read part of a Variant file without decoding the whole file
+     * 
+     * @param fileName Filename to read from, stored by storeVariant()
+     * @param path Slash-separated path to the item to read. Map keys are matched by name and 
+     * array elements by decimal index, for example "sensors/3/threshold". An empty path reads
+     * the whole file.
+     * @param variant Variant object filled in with the item at path
+     * @return int SYSTEM_ERROR_NONE (0) on success or a system error code (non-zero). SYSTEM_ERROR_NOT_FOUND
+     * if the path does not exist.
+     * 
+     * Items that are not on the path are skipped using their encoded lengths, without 
+     * allocating memory for them, so only the requested item is decoded. This uses much less
+     * RAM than readVariant() for large files.
+     * 
+     * If the file has changes from patchVariant() that have not been compacted yet, the changes 
+     * are applied to the items along path. The whole file is only read if a change removed an
+     * element of an array on path, before the element on path.
+     */
+    static int readVariantPath(const char *fileName, const char *path, particle::Variant &variant);
+
+    /**
+     * @brief Read part of a Variant from a stream without decoding the whole stream
+     * 
+     * @param stream Stream positioned at the beginning of a CBOR item
+     * @param path Slash-separated path within the item, see readVariantPath(const char *, const char *, particle::Variant &)
+     * @param variant Variant object filled in with the item at path
+     * @return int SYSTEM_ERROR_NONE (0) on success or a system error code (non-zero)
+     */
+    static int readVariantPath(FileStreamRead &stream, const char *path, particle::Variant &variant);
 #endif // SYSTEM_VERSION_560
 
+    /**
+     * @brief Move a stream positioned at a CBOR item to an item inside it
+     * 
+     * @param stream Stream positioned at the beginning of a CBOR item
+     * @param path Slash-separated path of map keys and array indexes. An empty path leaves the stream where it is.
+     * @return int SYSTEM_ERROR_NONE (0) on success or a system error code (non-zero). SYSTEM_ERROR_NOT_FOUND
+     * if the path does not exist, SYSTEM_ERROR_BAD_DATA if the data is not valid CBOR.
+     * 
+     * On success, the stream is positioned at the beginning of the item at path. This does not require
+     * Variant, so it can be used on any Device OS version.
+     */
+    static int seekCborPath(FileStreamRead &stream, const char *path);
+
+    /**
+     * @brief Skip over the CBOR item at the current stream position, including its contents
+     * 
+     * @param stream Stream positioned at the beginning of a CBOR item
+     * @return int SYSTEM_ERROR_NONE (0) on success or a system error code (non-zero)
+     * 
+     * Strings are skipped by seeking, so they are not read.
+     */
+    static int skipCborItem(FileStreamRead &stream);
+
+    /**
+     * @brief Maximum nesting of CBOR arrays, maps, and tags for skipCborItem()
+     */
+    static const int cborMaxDepth = 32;
+
     /**
      * @brief Internal function to convert the value of errno into a Particle system error code
      * 
@@ -504,6 +3201,7 @@ public:
         const char *path;   //!< Pathname
         bool isDirectory;   //!< true if a directory, false if a file
         size_t size;        //!< size of file if file (0 for directories)
+        int depth;          //!< 0 for the path passed to walk(), 1 for its contents, and so on
 
         /**
          * @brief Return a readable representation of this class
@@ -513,6 +3211,81 @@ public:
         String toString() const;
     };
 
+    /**
+     * @brief Value returned from the walk callback to control the walk
+     */
+    enum class WalkAction {
+        CONTINUE,       //!< Continue walking
+        SKIP_SUBTREE,   //!< Do not walk the contents of this directory (same as CONTINUE for a file)
+        STOP            //!< Stop walking; walk() returns SYSTEM_ERROR_NONE
+    };
+
+    /**
+     * @brief Options for walk()
+     * 
+     * The default options call the callback for all files and directories at any depth.
+     * The options only control which entries the callback is called for; directories that
+     * are within maxDepth are still walked even if the callback is not called for them.
+     */
+    class WalkOptions {
+    public:
+        /**
+         * @brief Set the maximum depth to walk
+         * 
+         * @param maxDepth 0 for only the path passed to walk(), 1 to include its contents, and so on. -1 (the default) for no limit.
+         * @return WalkOptions& This object, for chaining options, fluent-style
+         */
+        WalkOptions &withMaxDepth(int maxDepth) { this->maxDepth = maxDepth; return *this; };
+
+        /**
+         * @brief Only call the callback for files, not directories
+         * 
+         * @return WalkOptions& This object, for chaining options, fluent-style
+         */
+        WalkOptions &withFilesOnly() { includeFiles = true; includeDirectories = false; return *this; };
+
+        /**
+         * @brief Only call the callback for directories, not files. Files are not stat()ed.
+         * 
+         * @return WalkOptions& This object, for chaining options, fluent-style
+         */
+        WalkOptions &withDirectoriesOnly() { includeFiles = false; includeDirectories = true; return *this; };
+
+        /**
+         * @brief Only call the callback for files and directories whose name matches a glob pattern
+         * 
+         * @param pattern Pattern, such as "*.txt" or "log??". Supports * and ?. Matched against the name only, not the whole path. The pointer must remain valid during walk().
+         * @return WalkOptions& This object, for chaining options, fluent-style
+         */
+        WalkOptions &withPattern(const char *pattern) { this->pattern = pattern; return *this; };
+
+        /**
+         * @brief Only call the callback for files with the specified filename extension
+         * 
+         * @param extension Extension without the dot, such as "txt". Same as ParsedPath::getFileExtension(). The pointer must remain valid during walk().
+         * @return WalkOptions& This object, for chaining options, fluent-style
+         * 
+         * Directories are not affected by this option.
+         */
+        WalkOptions &withExtension(const char *extension) { this->extension = extension; return *this; };
+
+        /**
+         * @brief Returns true if the callback should be called for a file or directory
+         * 
+         * @param name Name of the file or directory (last component of the path)
+         * @param isDirectory true if a directory
+         * @return true Call the callback
+         * @return false Skip the callback
+         */
+        bool matches(const char *name, bool isDirectory) const;
+
+        int maxDepth = -1; //!< Maximum depth, -1 for no limit
+        bool includeFiles = true; //!< Call the callback for files
+        bool includeDirectories = true; //!< Call the callback for directories
+        const char *pattern = nullptr; //!< Glob pattern for names, or nullptr for all
+        const char *extension = nullptr; //!< Filename extension for files (without dot), or nullptr for all
+    };
+
     /**
      * @brief Walk the file system calling the callback function or lambda
      * 
@@ -520,12 +3293,226 @@ public:
      * @param cb Callback function or lambda to call
      * @return int SYSTEM_ERROR_NONE (0) on success or a system error code (non-zero)
      * 
+     * The callback is called for path, then for each directory, followed by its contents, then
+     * for the files in the directory. The walk is iterative, not recursive, and keeps one open 
+     * directory per level of depth, so stack and heap usage grow with the depth of the tree,
+     * not with the number of entries in each directory. The path passed to the callback is
+     * only valid during the callback.
      */
     static int walk(const char *path, std::function<void(const WalkParameters &walkParameters)> cb);
 
+    /**
+     * @brief Walk the file system with options, with a callback that can control the walk
+     * 
+     * @param path Path to start checking (can be file or directory)
+     * @param options Options such as maximum depth and filters
+     * @param cb Callback function or lambda to call. Returns a WalkAction to continue, skip the contents of a directory, or stop.
+     * @return int SYSTEM_ERROR_NONE (0) on success or a system error code (non-zero)
+     * 
+     * Directories that are skipped using SKIP_SUBTREE or are beyond maxDepth are not opened.
+     */
+    static int walk(const char *path, const WalkOptions &options, std::function<WalkAction(const WalkParameters &walkParameters)> cb);
+
+    /**
+     * @brief Match a name against a glob pattern
+     * 
+     * @param pattern Pattern. * matches any number of characters and ? matches exactly one character.
+     * @param name Name to match
+     * @return true The name matches the pattern
+     * @return false The name does not match
+     */
+    static bool globMatch(const char *pattern, const char *name);
+
+    /**
+     * @brief Sort order for listDirectory()
+     */
+    enum class ListSort {
+        NONE,       //!< Order returned by readdir()
+        NAME,       //!< By name (strcmp)
+        SIZE,       //!< By file size (directories are 0), then name
+        MTIME       //!< By modification time, then name
+    };
+
+    /**
+     * @brief Options for listDirectory()
+     */
+    class ListOptions {
+    public:
+        /**
+         * @brief stat() each entry to get the file size and modification time (default: false)
+         * 
+         * @return ListOptions& This object, for chaining options, fluent-style
+         * 
+         * This is turned on automatically when sorting by SIZE or MTIME.
+         */
+        ListOptions &withStat(bool stat = true) { this->stat = stat; return *this; };
+
+        /**
+         * @brief Sort the entries (default: ListSort::NAME)
+         * 
+         * @param sort Sort order
+         * @param descending true for largest, newest, or last name first
+         * @return ListOptions& This object, for chaining options, fluent-style
+         */
+        ListOptions &withSort(ListSort sort, bool descending = false) { this->sort = sort; this->descending = descending; return *this; };
+
+        /**
+         * @brief Only include files, not directories
+         * 
+         * @return ListOptions& This object, for chaining options, fluent-style
+         */
+        ListOptions &withFilesOnly() { includeFiles = true; includeDirectories = false; return *this; };
+
+        /**
+         * @brief Only include directories, not files
+         * 
+         * @return ListOptions& This object, for chaining options, fluent-style
+         */
+        ListOptions &withDirectoriesOnly() { includeFiles = false; includeDirectories = true; return *this; };
+
+        /**
+         * @brief Only include entries whose name matches a glob pattern, see globMatch()
+         * 
+         * @param pattern Pattern, such as "log.*", or nullptr or an empty string for all entries
+         * @return ListOptions& This object, for chaining options, fluent-style
+         */
+        ListOptions &withPattern(const char *pattern) { this->pattern = pattern; return *this; };
+
+        /**
+         * @brief Reuse the snapshot in the DirectoryListing if the directory has not changed (default: true)
+         * 
+         * @return ListOptions& This object, for chaining options, fluent-style
+         */
+        ListOptions &withCache(bool cache = true) { this->cache = cache; return *this; };
+
+        /**
+         * @brief Returns true if two options produce the same listing
+         */
+        bool operator==(const ListOptions &other) const {
+            return stat == other.stat && sort == other.sort && descending == other.descending && includeFiles == other.includeFiles && 
+                includeDirectories == other.includeDirectories && (pattern == other.pattern || (pattern && other.pattern && strcmp(pattern, other.pattern) == 0));
+        };
+
+        bool stat = false; //!< stat() each entry
+        ListSort sort = ListSort::NAME; //!< Sort order
+        bool descending = false; //!< Reverse the sort order
+        bool includeFiles = true; //!< Include files
+        bool includeDirectories = true; //!< Include directories
+        const char *pattern = nullptr; //!< Glob pattern for names, or nullptr for all
+        bool cache = true; //!< Reuse the previous snapshot if unchanged
+    };
+
+    /**
+     * @brief Snapshot of the contents of a directory, filled in by listDirectory()
+     * 
+     * All of the names are stored in one contiguous block of memory, and each entry is a small
+     * fixed-size struct, so listing a directory makes a few allocations regardless of the number
+     * of entries. The memory is reused when the same object is filled in again.
+     */
+    class DirectoryListing {
+    public:
+        /**
+         * @brief One file or directory
+         */
+        struct Entry {
+            uint32_t nameOffset;    //!< Offset of the null-terminated name in the name block. Use getName().
+            bool isDirectory;       //!< true if a directory, false if a file
+            size_t size;            //!< Size of a file in bytes (0 for directories, or if not using withStat())
+            time_t mtime;           //!< Modification time (0 if not using withStat() or not supported by the file system)
+        };
+
+        /**
+         * @brief Number of entries
+         */
+        size_t size() const { return entries.size(); };
+
+        /**
+         * @brief Get an entry
+         * 
+         * @param index 0 <= index < size()
+         */
+        const Entry &operator[](size_t index) const { return entries[index]; };
+
+        /**
+         * @brief Get the name of an entry (not the whole path)
+         * 
+         * @param index 0 <= index < size()
+         * @return const char* Name, valid until the listing is changed or deleted
+         */
+        const char *getName(size_t index) const { return &names[entries[index].nameOffset]; };
+
+        /**
+         * @brief Get the path of an entry (directory path and name)
+         * 
+         * @param index 0 <= index < size()
+         */
+        String getPath(size_t index) const { return pathJoin(dirPath, getName(index)); };
+
+        /**
+         * @brief Get the directory that was listed
+         */
+        const char *getDirPath() const { return dirPath; };
+
+        /**
+         * @brief Returns true if the last listDirectory() call used the cached snapshot
+         */
+        bool getFromCache() const { return fromCache; };
+
+        /**
+         * @brief Remove all entries and the cached snapshot
+         */
+        void clear();
+
+    protected:
+        friend class FileHelperRK;
+
+        std::vector<Entry> entries; //!< Entries in sorted order
+        std::vector<char> names; //!< Null-terminated names, one after another
+        String dirPath; //!< Directory that was listed
+        ListOptions options; //!< Options used to create the snapshot (pattern is always nullptr)
+        String pattern; //!< Copy of the pattern used to create the snapshot, empty for none
+        bool valid = false; //!< true if the snapshot can be reused
+        bool fromCache = false; //!< true if the last call used the snapshot
+        time_t dirMtime = 0; //!< Modification time of the directory when listed
+        uint32_t changeCount = 0; //!< Value of the notifyChanged() counter for dirPath when listed
+    };
+
+    /**
+     * @brief List the contents of one directory into a snapshot
+     * 
+     * @param path Directory to list
+     * @param options Options for sorting, filtering, and stat
+     * @param listing Filled in with the entries. Pass the same object again to use the cache.
+     * @return int SYSTEM_ERROR_NONE (0) on success or a system error code (non-zero)
+     * 
+     * Unlike walk(), this is not recursive and does not stat() entries unless requested. . and .. 
+     * are not included.
+     * 
+     * If listing already holds a snapshot of the same path with the same options, and neither 
+     * the modification time of the directory nor the notifyChanged() counter for the directory 
+     * has changed, the snapshot is kept and only the directory is stat()ed. Changes in other 
+     * directories do not invalidate the snapshot, except other directories with the same hash
+     * of their name. On file systems that do not store 
+     * modification times, changes made without FileHelperRK (or notifyChanged()) are not detected; 
+     * use withCache(false). The size and mtime of entries are from when the snapshot was made.
+     */
+    static int listDirectory(const char *path, const ListOptions &options, DirectoryListing &listing);
 
+    /**
+     * @brief Notify the active UsageTracker, if any, that path was created, modified, or deleted
+     * 
+     * @param path File or directory path
+     * 
+     * Called by FileHelperRK functions that modify the file system. You can call it if you modify
+     * files using other functions. It also invalidates the snapshots cached by listDirectory() for 
+     * the directory containing path, and for path if it is a directory.
+     * On host builds with threads, it can be called from multiple threads at the same time.
+     */
+    static void notifyChanged(const char *path);
 
     static const char *pathDelim; //!< Path delimeter ("/")
+
+    static const char *tempFileSuffix; //!< Suffix appended to the filename for STORE_ATOMIC temporary files (".fhtmp")
 };
 
 
@@ -110,6 +110,86 @@ void runTestParsePath() {
         assert_cstr("foo", parsed[1].c_str());
         assert_cstr("./foo", parsed.generatePathString().c_str());
     }    
+    {
+        const char *path = "//usr//foo/bar.txt/";
+        FileHelperRK::ParsedPath parsed;
+        int result = parsed.parse(path);
+
+        assert_int(SYSTEM_ERROR_NONE, result);
+        assert_int(true, parsed.getStartsWithSlash());
+        assert_int(true, parsed.getEndsWithSlash());
+        assert_int(3, parsed.getNumParts());
+        assert_cstr("/usr/foo/bar.txt", parsed.generatePathString().c_str());
+
+        // Views and prefixes point into the buffer
+        assert_int(true, parsed.getPartView(1).equals("foo"));
+        assert_int(false, parsed.getPartView(1).equals("fo"));
+        assert_int(true, parsed.getFileBaseNameView().equals("bar"));
+        assert_int(true, parsed.getFileExtensionView().equals("txt"));
+        assert_cstr("/", parsed.getPrefix(0));
+        assert_cstr("/usr", parsed.getPrefix(1));
+        assert_cstr("usr", parsed[0].c_str());
+        assert_cstr("/usr/foo", parsed.getPrefix(2));
+        assert_cstr("/usr/foo/bar.txt", parsed.getPrefix());
+        assert_cstr("/usr", parsed.getPrefix(1));
+
+        // Copy is not affected by the null terminator from getPrefix()
+        FileHelperRK::ParsedPath parsed2(parsed);
+        assert_cstr("/usr/foo/bar.txt", parsed2.getPrefix());
+
+        // Nor is generatePathString()
+        String pathStr = parsed.generatePathString();
+        assert_int(16, pathStr.length());
+        assert_int(16, strlen(pathStr.c_str()));
+        assert_cstr("/usr/foo/bar.txt", pathStr.c_str());
+
+        // Reuse the buffer
+        result = parsed.parse("a");
+        assert_int(SYSTEM_ERROR_NONE, result);
+        assert_int(1, parsed.getNumParts());
+        assert_cstr("", parsed.getPrefix(0));
+        assert_cstr("a", parsed.getPrefix(1));
+        assert_cstr("a", parsed.getFileBaseName().c_str());
+        assert_cstr("", parsed.getFileExtension().c_str());
+
+        result = parsed.parse("");
+        assert_int(SYSTEM_ERROR_NONE, result);
+        assert_int(0, parsed.getNumParts());
+        assert_cstr("", parsed.generatePathString().c_str());
+    }
+    {
+        // Normalize and canonical
+        const char *tests[][3] = {
+            // path, baseDir, expected
+            {"./foo", nullptr, "foo"},
+            {"a/../a/b", nullptr, "a/b"},
+            {"/a/./b/../../c/", nullptr, "/c"},
+            {"/../a", nullptr, "/a"},
+            {"../a/..", nullptr, ".."},
+            {"a/..", nullptr, ""},
+            {"a//b///c", nullptr, "a/b/c"},
+            {"b/../c", "/usr//foo", "/usr/foo/c"},
+            {"../../../x", "/usr/foo", "/x"},
+            {"/etc/x", "/usr/foo", "/etc/x"},
+            {"", "/usr/foo/", "/usr/foo"},
+            {"x", "./rel/..", "x"},
+        };
+        FileHelperRK::ParsedPath parsed;
+        for(size_t ii = 0; ii < sizeof(tests) / sizeof(tests[0]); ii++) {
+            int result = parsed.canonical(tests[ii][0], tests[ii][1]);
+            assert_int(SYSTEM_ERROR_NONE, result);
+            assert_cstr(tests[ii][2], parsed.generatePathString().c_str());
+        }
+
+        parsed.parse("/a/b/../c.txt");
+        assert_int(4, parsed.getNumParts());
+        assert_cstr("/a/b", parsed.getPrefix(2));
+        parsed.normalize();
+        assert_int(2, parsed.getNumParts());
+        assert_cstr("/a/c.txt", parsed.getPrefix());
+        assert_cstr("c", parsed.getFileBaseName().c_str());
+        assert_cstr("/a", parsed.getPrefix(1));
+    }
 
     {
         String s;
@@ -213,6 +293,53 @@ void runTestReadStoreString() {
         assert_cstr("", s2.c_str());
     }
 
+    // Larger than the read block size, reusing the same String
+    {
+        String s1;
+        for(int ii = 0; ii < 50; ii++) {
+            s1 += "0123456789";
+        }
+        int result = FileHelperRK::storeString(pathTest1, s1);
+        assert_int(SYSTEM_ERROR_NONE, result);
+
+        String s2 = "previous contents";
+        result = FileHelperRK::readString(pathTest1, s2);
+        assert_int(SYSTEM_ERROR_NONE, result);
+        assert_cstr(s1.c_str(), s2.c_str());
+
+        result = FileHelperRK::storeString(pathTest1, "short");
+        result = FileHelperRK::readString(pathTest1, s2);
+        assert_int(SYSTEM_ERROR_NONE, result);
+        assert_cstr("short", s2.c_str());
+    }
+
+    // File does not exist
+    {
+        String s2 = "previous contents";
+        int result = FileHelperRK::readString(FileHelperRK::pathJoin(baseDir, "foo/doesNotExist"), s2);
+        assert_int(SYSTEM_ERROR_FILESYSTEM_NOENT, result);
+        assert_cstr("", s2.c_str());
+    }
+
+    // Read into a c-string buffer
+    {
+        int result = FileHelperRK::storeString(pathTest1, "this is a test 4");
+        assert_int(SYSTEM_ERROR_NONE, result);
+
+        char buf[32];
+        size_t len = sizeof(buf);
+        result = FileHelperRK::readString(pathTest1, buf, len);
+        assert_int(SYSTEM_ERROR_NONE, result);
+        assert_cstr("this is a test 4", buf);
+        assert_int(16, len);
+
+        // Buffer too small, truncated
+        len = 5;
+        result = FileHelperRK::readString(pathTest1, buf, len);
+        assert_int(SYSTEM_ERROR_NONE, result);
+        assert_cstr("this", buf);
+        assert_int(4, len);
+    }
 }
 
 void runTestVariant() {
@@ -262,6 +389,230 @@ void runTestVariant() {
         String s = v2.toJSON();
         assert_cstr(jsonStr, s.c_str());
     }
+
+    // Read part of a file
+    {
+        const char *jsonStr = "{\"name\":\"device\",\"notes\":\"0123456789012345678901234567890123456789\","
+            "\"sensors\":[{\"threshold\":1},{\"threshold\":2},{\"threshold\":3},{\"id\":\"t4\",\"threshold\":4.5}]}";
+        particle::Variant v1 = particle::Variant::fromJSON(JSONValue::parseCopy(jsonStr));
+
+        result = FileHelperRK::storeVariant(pathTest2, v1);       
+        assert_int(SYSTEM_ERROR_NONE, result);
+
+        particle::Variant v2;
+        result = FileHelperRK::readVariantPath(pathTest2, "sensors/3/threshold", v2);
+        assert_int(SYSTEM_ERROR_NONE, result);
+        assert_cstr("4.5", v2.toString().c_str());
+
+        result = FileHelperRK::readVariantPath(pathTest2, "/sensors/1", v2);
+        assert_int(SYSTEM_ERROR_NONE, result);
+        assert_cstr("{\"threshold\":2}", v2.toJSON().c_str());
+
+        result = FileHelperRK::readVariantPath(pathTest2, "name", v2);
+        assert_int(SYSTEM_ERROR_NONE, result);
+        assert_cstr("device", v2.toString().c_str());
+
+        result = FileHelperRK::readVariantPath(pathTest2, "", v2);
+        assert_int(SYSTEM_ERROR_NONE, result);
+        assert_cstr(jsonStr, v2.toJSON().c_str());
+
+        result = FileHelperRK::readVariantPath(pathTest2, "sensors/4", v2);
+        assert_int(SYSTEM_ERROR_NOT_FOUND, result);
+        result = FileHelperRK::readVariantPath(pathTest2, "sensors/x", v2);
+        assert_int(SYSTEM_ERROR_NOT_FOUND, result);
+        result = FileHelperRK::readVariantPath(pathTest2, "nam", v2);
+        assert_int(SYSTEM_ERROR_NOT_FOUND, result);
+        result = FileHelperRK::readVariantPath(pathTest2, "name/x", v2);
+        assert_int(SYSTEM_ERROR_NOT_FOUND, result);
+    }
+
+    // Indefinite length map and array: {_ "a": [_ 1, 2], "b": 3}
+    {
+        const uint8_t cbor[] = {0xbf, 0x61, 'a', 0x9f, 0x01, 0x02, 0xff, 0x61, 'b', 0x03, 0xff};
+        result = FileHelperRK::storeBytes(pathTest2, cbor, sizeof(cbor));
+        assert_int(SYSTEM_ERROR_NONE, result);
+
+        particle::Variant v2;
+        result = FileHelperRK::readVariantPath(pathTest2, "b", v2);
+        assert_int(SYSTEM_ERROR_NONE, result);
+        assert_int(3, v2.toInt());
+
+        result = FileHelperRK::readVariantPath(pathTest2, "a/1", v2);
+        assert_int(SYSTEM_ERROR_NONE, result);
+        assert_int(2, v2.toInt());
+
+        result = FileHelperRK::readVariantPath(pathTest2, "a/2", v2);
+        assert_int(SYSTEM_ERROR_NOT_FOUND, result);
+        result = FileHelperRK::readVariantPath(pathTest2, "c", v2);
+        assert_int(SYSTEM_ERROR_NOT_FOUND, result);
+    }
+
+    // Partial update with a delta log
+    {
+        String deltaName = String(pathTest2) + FileHelperRK::variantDeltaSuffix;
+        const char *jsonStr = "{\"name\":\"device\",\"notes\":\"0123456789012345678901234567890123456789\","
+            "\"sensors\":[{\"threshold\":1},{\"threshold\":2}]}";
+        particle::Variant v1 = particle::Variant::fromJSON(JSONValue::parseCopy(jsonStr));
+
+        result = FileHelperRK::storeVariant(pathTest2, v1);       
+        assert_int(SYSTEM_ERROR_NONE, result);
+        struct stat sb;
+        stat(pathTest2, &sb);
+        size_t baseSize = (size_t)sb.st_size;
+
+        size_t bytesWritten = 0;
+        result = FileHelperRK::patchVariant(pathTest2, "sensors/1/threshold", particle::Variant(5), 0, &bytesWritten);
+        assert_int(SYSTEM_ERROR_NONE, result);
+        bool smaller = (bytesWritten > 0 && bytesWritten < baseSize);
+        assert_int(true, smaller);
+
+        result = FileHelperRK::patchVariant(pathTest2, "sensors/2", particle::Variant::fromJSON("{\"id\":\"t3\"}"));
+        assert_int(SYSTEM_ERROR_NONE, result);
+        result = FileHelperRK::patchVariant(pathTest2, "sensors/4", particle::Variant(1));
+        assert_int(SYSTEM_ERROR_NOT_FOUND, result);
+        result = FileHelperRK::patchVariant(pathTest2, "config/rate", particle::Variant(10));
+        assert_int(SYSTEM_ERROR_NONE, result);
+        result = FileHelperRK::patchVariantRemove(pathTest2, "notes");
+        assert_int(SYSTEM_ERROR_NONE, result);
+        result = FileHelperRK::patchVariantRemove(pathTest2, "sensors/0");
+        assert_int(SYSTEM_ERROR_NONE, result);
+
+        // Invalid array index is an error and is not written to the log
+        stat(deltaName, &sb);
+        size_t deltaSize = (size_t)sb.st_size;
+        bytesWritten = 1;
+        result = FileHelperRK::patchVariant(pathTest2, "sensors/5", particle::Variant(1), 0, &bytesWritten);
+        assert_int(SYSTEM_ERROR_NOT_FOUND, result);
+        assert_int(0, bytesWritten);
+        stat(deltaName, &sb);
+        assert_int(deltaSize, (size_t)sb.st_size);
+
+        const char *expected = "{\"name\":\"device\",\"sensors\":[{\"threshold\":5},{\"id\":\"t3\"}],\"config\":{\"rate\":10}}";
+
+        // Base file is unchanged
+        stat(pathTest2, &sb);
+        assert_int(baseSize, (size_t)sb.st_size);
+
+        particle::Variant v2;
+        result = FileHelperRK::readVariant(pathTest2, v2);
+        assert_int(SYSTEM_ERROR_NONE, result);
+        assert_cstr(expected, v2.toJSON().c_str());
+
+        result = FileHelperRK::readVariantPath(pathTest2, "sensors/1/id", v2);
+        assert_int(SYSTEM_ERROR_NONE, result);
+        assert_cstr("t3", v2.toString().c_str());
+        result = FileHelperRK::readVariantPath(pathTest2, "notes", v2);
+        assert_int(SYSTEM_ERROR_NOT_FOUND, result);
+        result = FileHelperRK::readVariantPath(pathTest2, "sensors/0/threshold", v2);
+        assert_int(SYSTEM_ERROR_NONE, result);
+        assert_int(5, v2.toInt());
+        result = FileHelperRK::readVariantPath(pathTest2, "sensors/2", v2);
+        assert_int(SYSTEM_ERROR_NOT_FOUND, result);
+        result = FileHelperRK::readVariantPath(pathTest2, "config", v2);
+        assert_int(SYSTEM_ERROR_NONE, result);
+        assert_cstr("{\"rate\":10}", v2.toJSON().c_str());
+        result = FileHelperRK::readVariantPath(pathTest2, "name", v2);
+        assert_int(SYSTEM_ERROR_NONE, result);
+        assert_cstr("device", v2.toString().c_str());
+
+        // A partially written record at the end is ignored
+        {
+            int fd = open(deltaName, O_WRONLY | O_APPEND);
+            const uint8_t partial[] = {0x20, 0x00, 0x00, 0x00, 0x83, 0x01};
+            write(fd, partial, sizeof(partial));
+            close(fd);
+        }
+        result = FileHelperRK::readVariant(pathTest2, v2);
+        assert_int(SYSTEM_ERROR_NONE, result);
+        assert_cstr(expected, v2.toJSON().c_str());
+
+        // Patches after a partially written record are not lost
+        result = FileHelperRK::patchVariant(pathTest2, "config/rate", particle::Variant(11), 0, &bytesWritten);
+        assert_int(SYSTEM_ERROR_NONE, result);
+        stat(deltaName, &sb);
+        assert_int(deltaSize + bytesWritten, (size_t)sb.st_size);
+        result = FileHelperRK::readVariantPath(pathTest2, "config/rate", v2);
+        assert_int(SYSTEM_ERROR_NONE, result);
+        assert_int(11, v2.toInt());
+        result = FileHelperRK::patchVariant(pathTest2, "config/rate", particle::Variant(10));
+        assert_int(SYSTEM_ERROR_NONE, result);
+        result = FileHelperRK::readVariant(pathTest2, v2);
+        assert_int(SYSTEM_ERROR_NONE, result);
+        assert_cstr(expected, v2.toJSON().c_str());
+
+        // Compact into the base file
+        result = FileHelperRK::compactVariant(pathTest2, &bytesWritten);
+        assert_int(SYSTEM_ERROR_NONE, result);
+        stat(pathTest2, &sb);
+        assert_int((size_t)sb.st_size, bytesWritten);
+        assert_int(-1, stat(deltaName, &sb));
+
+        result = FileHelperRK::readVariant(pathTest2, v2);
+        assert_int(SYSTEM_ERROR_NONE, result);
+        assert_cstr(expected, v2.toJSON().c_str());
+
+        // storeVariant discards the delta log
+        result = FileHelperRK::patchVariant(pathTest2, "name", particle::Variant("x"));
+        assert_int(SYSTEM_ERROR_NONE, result);
+        result = FileHelperRK::storeVariant(pathTest2, v1);
+        assert_int(SYSTEM_ERROR_NONE, result);
+        assert_int(-1, stat(deltaName, &sb));
+        result = FileHelperRK::readVariant(pathTest2, v2);
+        assert_int(SYSTEM_ERROR_NONE, result);
+        assert_cstr(jsonStr, v2.toJSON().c_str());
+
+        // Many patches are compacted automatically
+        for(int ii = 0; ii < 100; ii++) {
+            result = FileHelperRK::patchVariant(pathTest2, "counter", particle::Variant(ii));
+            assert_int(SYSTEM_ERROR_NONE, result);
+        }
+        stat(deltaName, &sb);
+        bool compacted = ((size_t)sb.st_size < FileHelperRK::variantDeltaCompactSize);
+        assert_int(true, compacted);
+        result = FileHelperRK::readVariantPath(pathTest2, "counter", v2);
+        assert_int(SYSTEM_ERROR_NONE, result);
+        assert_int(99, v2.toInt());
+
+        // Patch a file that does not exist
+        unlink(pathTest2);
+        unlink(deltaName);
+        result = FileHelperRK::patchVariant(pathTest2, "a/b", particle::Variant(1));
+        assert_int(SYSTEM_ERROR_NONE, result);
+        result = FileHelperRK::readVariant(pathTest2, v2);
+        assert_int(SYSTEM_ERROR_NONE, result);
+        assert_cstr("{\"a\":{\"b\":1}}", v2.toJSON().c_str());
+
+        // Paths under a replaced item and in a shifted array
+        result = FileHelperRK::patchVariant(pathTest2, "a", particle::Variant::fromJSON("{\"c\":[1,2]}"));
+        assert_int(SYSTEM_ERROR_NONE, result);
+        result = FileHelperRK::readVariantPath(pathTest2, "a/c/1", v2);
+        assert_int(SYSTEM_ERROR_NONE, result);
+        assert_int(2, v2.toInt());
+        result = FileHelperRK::readVariantPath(pathTest2, "a/b", v2);
+        assert_int(SYSTEM_ERROR_NOT_FOUND, result);
+        result = FileHelperRK::patchVariant(pathTest2, "a/c/2", particle::Variant(3));
+        assert_int(SYSTEM_ERROR_NONE, result);
+        result = FileHelperRK::patchVariant(pathTest2, "a/c/4", particle::Variant(5));
+        assert_int(SYSTEM_ERROR_NOT_FOUND, result);
+        result = FileHelperRK::compactVariant(pathTest2);
+        assert_int(SYSTEM_ERROR_NONE, result);
+        result = FileHelperRK::patchVariantRemove(pathTest2, "a/c/0");
+        assert_int(SYSTEM_ERROR_NONE, result);
+        result = FileHelperRK::readVariantPath(pathTest2, "a/c/0", v2);
+        assert_int(SYSTEM_ERROR_NONE, result);
+        assert_int(2, v2.toInt());
+        result = FileHelperRK::readVariantPath(pathTest2, "a/c/2", v2);
+        assert_int(SYSTEM_ERROR_NOT_FOUND, result);
+        result = FileHelperRK::patchVariant(pathTest2, "a/c/3", particle::Variant(4));
+        assert_int(SYSTEM_ERROR_NOT_FOUND, result);
+        result = FileHelperRK::patchVariant(pathTest2, "a/c/2", particle::Variant(4));
+        assert_int(SYSTEM_ERROR_NONE, result);
+        result = FileHelperRK::readVariant(pathTest2, v2);
+        assert_int(SYSTEM_ERROR_NONE, result);
+        assert_cstr("{\"a\":{\"c\":[2,3,4]}}", v2.toJSON().c_str());
+
+        unlink(deltaName);
+    }
 #else  
     Log.info("Variant tests skipped");
 #endif // defined(SYSTEM_VERSION_560) || defined(UNITTEST)
@@ -321,12 +672,1845 @@ void runTestStruct() {
 }
 
 
+void runTestFileStreamRead() {
+    String pathTest3 = FileHelperRK::pathJoin(baseDir, "foo/test3");
+    int result;
+
+    uint8_t data[1000];
+    for(size_t ii = 0; ii < sizeof(data); ii++) {
+        data[ii] = (uint8_t)(ii * 7);
+    }
+    result = FileHelperRK::storeBytes(pathTest3, data, sizeof(data));
+    assert_int(SYSTEM_ERROR_NONE, result);
+
+    // Default heap-allocated buffer, byte at a time
+    {
+        FileHelperRK::FileStreamRead stream;
+        result = stream.open(pathTest3);
+        assert_int(SYSTEM_ERROR_NONE, result);
+        assert_int(sizeof(data), stream.available());
+
+        for(size_t ii = 0; ii < sizeof(data); ii++) {
+            assert_int(data[ii], stream.peek());
+            assert_int(data[ii], stream.read());
+            assert_int((int)(sizeof(data) - ii - 1), stream.available());
+        }
+        assert_int(-1, stream.read());
+        assert_int(-1, stream.peek());
+        assert_int(0, stream.available());
+    }
+
+    // Small caller-provided buffer, mix of read() and readBytes()
+    {
+        uint8_t buf[16];
+        uint8_t readBuf[100];
+
+        FileHelperRK::FileStreamRead stream;
+        result = stream.withBuffer(buf, sizeof(buf)).open(pathTest3);
+        assert_int(SYSTEM_ERROR_NONE, result);
+
+        size_t offset = 0;
+        assert_int(data[offset], stream.read());
+        offset++;
+
+        // Less than the buffer size
+        size_t count = stream.readBytes(readBuf, 10);
+        assert_int(10, count);
+        assert_int(0, memcmp(readBuf, &data[offset], count));
+        offset += count;
+
+        // Larger than the buffer size (bypasses buffer)
+        count = stream.readBytes(readBuf, sizeof(readBuf));
+        assert_int(sizeof(readBuf), count);
+        assert_int(0, memcmp(readBuf, &data[offset], count));
+        offset += count;
+        assert_int((int)(sizeof(data) - offset), stream.available());
+
+        while(true) {
+            count = stream.readBytes(readBuf, 37);
+            assert_int(0, memcmp(readBuf, &data[offset], count));
+            offset += count;
+            if (count < 37) {
+                break;
+            }
+        }
+        assert_int(sizeof(data), offset);
+        assert_int(0, stream.available());
+
+        stream.rewind();
+        assert_int(sizeof(data), stream.available());
+        assert_int(data[0], stream.read());
+    }
+
+    // seek and tell
+    {
+        uint8_t buf[16];
+        uint8_t readBuf[20];
+
+        FileHelperRK::FileStreamRead stream;
+        result = stream.withBuffer(buf, sizeof(buf)).open(pathTest3);
+        assert_int(SYSTEM_ERROR_NONE, result);
+
+        // Within the buffer
+        assert_int(data[0], stream.read());
+        result = stream.seek(10);
+        assert_int(SYSTEM_ERROR_NONE, result);
+        assert_int(10, stream.tell());
+        assert_int(data[10], stream.peek());
+        assert_int(data[10], stream.read());
+        result = stream.seek(2);
+        assert_int(SYSTEM_ERROR_NONE, result);
+        assert_int(data[2], stream.read());
+
+        // Outside of the buffer, forward and backward
+        result = stream.seek(500);
+        assert_int(SYSTEM_ERROR_NONE, result);
+        assert_int(500, stream.tell());
+        assert_int(sizeof(data) - 500, stream.available());
+        assert_int(data[500], stream.read());
+        result = stream.seek(100);
+        assert_int(SYSTEM_ERROR_NONE, result);
+        assert_int(data[100], stream.read());
+
+        // After a large read that bypasses the buffer
+        size_t count = stream.readBytes(readBuf, sizeof(readBuf));
+        assert_int(sizeof(readBuf), count);
+        assert_int(0, memcmp(readBuf, &data[101], count));
+        result = stream.seek(110);
+        assert_int(SYSTEM_ERROR_NONE, result);
+        assert_int(data[110], stream.read());
+
+        // End of file and past end of file
+        result = stream.seek(sizeof(data));
+        assert_int(SYSTEM_ERROR_NONE, result);
+        assert_int(-1, stream.read());
+        result = stream.seek(sizeof(data) + 1);
+        assert_int(SYSTEM_ERROR_INVALID_ARGUMENT, result);
+    }
+}
+
+void runTestFileStreamWrite() {
+    String pathTest3 = FileHelperRK::pathJoin(baseDir, "foo/test3");
+    int result;
+
+    // Default heap-allocated buffer
+    {
+        FileHelperRK::FileStreamWrite stream;
+        result = stream.open(pathTest3);
+        assert_int(SYSTEM_ERROR_NONE, result);
+
+        for(int ii = 0; ii < 100; ii++) {
+            stream.printf("line %d\n", ii);
+        }
+        result = stream.close();
+        assert_int(SYSTEM_ERROR_NONE, result);
+
+        String s;
+        result = FileHelperRK::readString(pathTest3, s);
+        assert_int(SYSTEM_ERROR_NONE, result);
+        assert_int(0, s.indexOf("line 0\nline 1\n"));
+        assert_int(true, s.endsWith("line 98\nline 99\n"));
+    }
+
+    // Small caller-provided buffer, mix of single byte and large writes, flush on destruction
+    {
+        uint8_t buf[16];
+        uint8_t data[100];
+        for(size_t ii = 0; ii < sizeof(data); ii++) {
+            data[ii] = (uint8_t)('a' + (ii % 26));
+        }
+
+        {
+            FileHelperRK::FileStreamWrite stream;
+            result = stream.withBuffer(buf, sizeof(buf)).open(pathTest3);
+            assert_int(SYSTEM_ERROR_NONE, result);
+
+            stream.write('x');
+            assert_int(sizeof(data), stream.write(data, sizeof(data)));
+            assert_int(10, stream.write(data, 10));
+            stream.write('y');
+        }
+
+        uint8_t readBuf[200];
+        size_t readLen = sizeof(readBuf);
+        result = FileHelperRK::readBytesNoAlloc(pathTest3, readBuf, readLen);
+        assert_int(SYSTEM_ERROR_NONE, result);
+        assert_int(1 + sizeof(data) + 10 + 1, readLen);
+        assert_int('x', readBuf[0]);
+        assert_int(0, memcmp(&readBuf[1], data, sizeof(data)));
+        assert_int(0, memcmp(&readBuf[1 + sizeof(data)], data, 10));
+        assert_int('y', readBuf[readLen - 1]);
+    }
+
+    // Write errors are reported by close()
+    {
+        FileHelperRK::FileStreamWrite stream;
+        result = stream.open(pathTest3, O_RDONLY);
+        assert_int(SYSTEM_ERROR_NONE, result);
+
+        stream.print("testing");
+        stream.flush();
+        bool hasError = (stream.getWriteError() != 0);
+        assert_int(true, hasError);
+
+        result = stream.close();
+        hasError = (result != SYSTEM_ERROR_NONE);
+        assert_int(true, hasError);
+    }
+}
+
+void runTestAtomicStore() {
+    String pathTest4 = FileHelperRK::pathJoin(baseDir, "foo/test4");
+    String pathTest4Temp = FileHelperRK::getTempFileName(pathTest4);
+    int result;
+    struct stat sb;
+
+    {
+        result = FileHelperRK::storeString(pathTest4, "atomic 1", FileHelperRK::STORE_ATOMIC | FileHelperRK::STORE_SYNC);
+        assert_int(SYSTEM_ERROR_NONE, result);
+        assert_int(-1, stat(pathTest4Temp, &sb));
+
+        String s;
+        result = FileHelperRK::readString(pathTest4, s);
+        assert_int(SYSTEM_ERROR_NONE, result);
+        assert_cstr("atomic 1", s.c_str());
+
+        // Replace existing file
+        result = FileHelperRK::storeString(pathTest4, "atomic 2", FileHelperRK::STORE_ATOMIC);
+        assert_int(SYSTEM_ERROR_NONE, result);
+        assert_int(-1, stat(pathTest4Temp, &sb));
+
+        result = FileHelperRK::readString(pathTest4, s);
+        assert_int(SYSTEM_ERROR_NONE, result);
+        assert_cstr("atomic 2", s.c_str());
+    }
+
+    {
+        TestStruct1 ts1a;
+        memset(&ts1a, 0, sizeof(ts1a));
+        ts1a.f1 = 0x12345678;
+        strcpy(ts1a.f2, "atomic");
+        FileHelperRK::storeStruct(pathTest4, ts1a, FileHelperRK::STORE_ATOMIC);
+
+        TestStruct1 ts1b;
+        FileHelperRK::readStruct(pathTest4, ts1b);
+        assert_int(ts1a.f1, ts1b.f1);
+        assert_cstr(ts1a.f2, ts1b.f2);
+    }
+
+#if defined(SYSTEM_VERSION_560) || defined(UNITTEST)
+    {
+        particle::Variant v1("atomic variant");
+        result = FileHelperRK::storeVariant(pathTest4, v1, FileHelperRK::STORE_ATOMIC | FileHelperRK::STORE_SYNC);
+        assert_int(SYSTEM_ERROR_NONE, result);
+        assert_int(-1, stat(pathTest4Temp, &sb));
+
+        particle::Variant v2;
+        result = FileHelperRK::readVariant(pathTest4, v2);
+        assert_int(SYSTEM_ERROR_NONE, result);
+        assert_cstr(v1.toString().c_str(), v2.toString().c_str());
+    }
+#endif // defined(SYSTEM_VERSION_560) || defined(UNITTEST)
+
+    // Simulate an interrupted store, which leaves a temporary file and the original file
+    {
+        FileHelperRK::storeString(pathTest4, "original");
+        FileHelperRK::storeString(pathTest4Temp, "partial");
+        FileHelperRK::storeString(FileHelperRK::pathJoin(baseDir, "foo/a/b/test5.fhtmp"), "partial");
+
+        result = FileHelperRK::cleanupTempFiles(FileHelperRK::pathJoin(baseDir, "foo"));
+        assert_int(SYSTEM_ERROR_NONE, result);
+        assert_int(-1, stat(pathTest4Temp, &sb));
+        assert_int(-1, stat(FileHelperRK::pathJoin(baseDir, "foo/a/b/test5.fhtmp"), &sb));
+
+        String s;
+        result = FileHelperRK::readString(pathTest4, s);
+        assert_int(SYSTEM_ERROR_NONE, result);
+        assert_cstr("original", s.c_str());
+    }
+}
+
+void runTestStoreIfChanged() {
+    String pathTest4 = FileHelperRK::pathJoin(baseDir, "foo/test4");
+    int result;
+    bool written;
+
+    unlink(pathTest4);
+
+    // File does not exist
+    result = FileHelperRK::storeString(pathTest4, "test1", FileHelperRK::STORE_IF_CHANGED, &written);
+    assert_int(SYSTEM_ERROR_NONE, result);
+    assert_int(true, written);
+
+    // Same contents
+    result = FileHelperRK::storeString(pathTest4, "test1", FileHelperRK::STORE_IF_CHANGED, &written);
+    assert_int(SYSTEM_ERROR_NONE, result);
+    assert_int(false, written);
+
+    // Same length, different contents
+    result = FileHelperRK::storeString(pathTest4, "test2", FileHelperRK::STORE_IF_CHANGED | FileHelperRK::STORE_ATOMIC, &written);
+    assert_int(SYSTEM_ERROR_NONE, result);
+    assert_int(true, written);
+
+    // Different length
+    result = FileHelperRK::storeString(pathTest4, "test22", FileHelperRK::STORE_IF_CHANGED, &written);
+    assert_int(SYSTEM_ERROR_NONE, result);
+    assert_int(true, written);
+
+    String s;
+    FileHelperRK::readString(pathTest4, s);
+    assert_cstr("test22", s.c_str());
+
+    // Without STORE_IF_CHANGED always writes
+    result = FileHelperRK::storeString(pathTest4, "test22", 0, &written);
+    assert_int(SYSTEM_ERROR_NONE, result);
+    assert_int(true, written);
+
+    // Struct larger than the compare buffer
+    {
+        struct {
+            uint8_t data[200];
+        } ts1;
+        for(size_t ii = 0; ii < sizeof(ts1.data); ii++) {
+            ts1.data[ii] = (uint8_t) ii;
+        }
+        FileHelperRK::storeStruct(pathTest4, ts1, FileHelperRK::STORE_IF_CHANGED, &written);
+        assert_int(true, written);
+        FileHelperRK::storeStruct(pathTest4, ts1, FileHelperRK::STORE_IF_CHANGED, &written);
+        assert_int(false, written);
+
+        ts1.data[150]++;
+        FileHelperRK::storeStruct(pathTest4, ts1, FileHelperRK::STORE_IF_CHANGED, &written);
+        assert_int(true, written);
+    }
+}
+
+void runTestStructVersioned() {
+    String pathTest5 = FileHelperRK::pathJoin(baseDir, "foo/test5");
+    int result;
+
+    // Standard check value for CRC-32
+    assert_int(0xcbf43926, FileHelperRK::crc32("123456789", 9));
+    assert_int(0xcbf43926, FileHelperRK::crc32("6789", 4, FileHelperRK::crc32("12345", 5)));
+
+    TestStruct1 ts1a;
+    memset(&ts1a, 0, sizeof(ts1a));
+    ts1a.f1 = 0x12345678;
+    strcpy(ts1a.f2, "version1");
+
+    result = FileHelperRK::storeStructVersioned(pathTest5, ts1a, 1);
+    assert_int(SYSTEM_ERROR_NONE, result);
+
+    {
+        TestStruct1 ts1b;
+        result = FileHelperRK::readStructVersioned(pathTest5, ts1b, 1);
+        assert_int(SYSTEM_ERROR_NONE, result);
+        assert_int(ts1a.f1, ts1b.f1);
+        assert_cstr(ts1a.f2, ts1b.f2);
+    }
+
+    // Version 2 without a migration function
+    {
+        TestStruct2 ts2;
+        result = FileHelperRK::readStructVersioned(pathTest5, ts2, 2);
+        assert_int(SYSTEM_ERROR_NOT_SUPPORTED, result);
+        assert_int(0, ts2.f1);
+    }
+
+    // Migrate from version 1 to version 2
+    {
+        TestStruct2 ts2;
+        result = FileHelperRK::readStructVersioned<TestStruct2>(pathTest5, ts2, 2, [](uint16_t fileVersion, const uint8_t *data, size_t dataLen, TestStruct2 &t) {
+            if (fileVersion != 1 || dataLen != sizeof(TestStruct1)) {
+                return (int)SYSTEM_ERROR_NOT_SUPPORTED;
+            }
+            const TestStruct1 *old = (const TestStruct1 *)data;
+            t.f1 = old->f1;
+            memcpy(t.f2, old->f2, sizeof(t.f2));
+            t.f3 = 0x55aa55aa;
+            return (int)SYSTEM_ERROR_NONE;
+        });
+        assert_int(SYSTEM_ERROR_NONE, result);
+        assert_int(ts1a.f1, ts2.f1);
+        assert_cstr(ts1a.f2, ts2.f2);
+        assert_int(0x55aa55aa, ts2.f3);
+    }
+
+    // Corrupt one byte of the data
+    {
+        uint8_t buf[64];
+        size_t bufLen = sizeof(buf);
+        result = FileHelperRK::readBytesNoAlloc(pathTest5, buf, bufLen);
+        assert_int(SYSTEM_ERROR_NONE, result);
+        assert_int(sizeof(FileHelperRK::StructHeader) + sizeof(TestStruct1), bufLen);
+
+        buf[bufLen - 2] ^= 0x01;
+        FileHelperRK::storeBytes(pathTest5, buf, bufLen);
+
+        TestStruct1 ts1b;
+        result = FileHelperRK::readStructVersioned(pathTest5, ts1b, 1);
+        assert_int(SYSTEM_ERROR_BAD_DATA, result);
+        assert_int(0, ts1b.f1);
+
+        // Truncated
+        FileHelperRK::storeBytes(pathTest5, buf, bufLen - 1);
+        result = FileHelperRK::readStructVersioned(pathTest5, ts1b, 1);
+        assert_int(SYSTEM_ERROR_BAD_DATA, result);
+
+        // Data size in the header larger than the file is rejected before allocating
+        buf[bufLen - 2] ^= 0x01;
+        FileHelperRK::StructHeader *header = (FileHelperRK::StructHeader *)buf;
+        header->dataSize = 0x7fffffff;
+        FileHelperRK::storeBytes(pathTest5, buf, bufLen);
+        bool migrateCalled = false;
+        result = FileHelperRK::readBytesVersioned(pathTest5, buf, bufLen, 2, [&migrateCalled](uint16_t fileVersion, const uint8_t *data, size_t dataLen) {
+            migrateCalled = true;
+            return (int)SYSTEM_ERROR_NONE;
+        });
+        assert_int(SYSTEM_ERROR_BAD_DATA, result);
+        assert_int(false, migrateCalled);
+
+        // Not a versioned struct
+        FileHelperRK::storeStruct(pathTest5, ts1a);
+        result = FileHelperRK::readStructVersioned(pathTest5, ts1b, 1);
+        assert_int(SYSTEM_ERROR_BAD_DATA, result);
+    }
+}
+
+void runTestAllocator() {
+    String pathTest1 = FileHelperRK::pathJoin(baseDir, "foo/test1");
+    String pathTest3 = FileHelperRK::pathJoin(baseDir, "foo/test3");
+    int result;
+
+    FileHelperRK::storeString(pathTest1, "this is a test");
+
+    uint8_t data[100];
+    for(size_t ii = 0; ii < sizeof(data); ii++) {
+        data[ii] = (uint8_t)ii;
+    }
+    FileHelperRK::storeBytes(pathTest3, data, sizeof(data));
+
+    // OwnedBuffer from the heap
+    {
+        FileHelperRK::OwnedBuffer buf;
+        result = FileHelperRK::readBytes(pathTest1, buf, true);
+        assert_int(SYSTEM_ERROR_NONE, result);
+        assert_int(14, buf.size());
+        assert_cstr("this is a test", buf.c_str());
+
+        FileHelperRK::OwnedBuffer buf2 = std::move(buf);
+        assert_int(0, buf.size());
+        bool isNull = (buf.data() == nullptr);
+        assert_int(true, isNull);
+        assert_cstr("this is a test", buf2.c_str());
+    }
+
+    // Arena
+    {
+        FileHelperRK::StaticArenaAllocator<128> arena;
+
+        {
+            FileHelperRK::OwnedBuffer buf1;
+            result = FileHelperRK::readBytes(pathTest3, arena, buf1);
+            assert_int(SYSTEM_ERROR_NONE, result);
+            assert_int(sizeof(data), buf1.size());
+            assert_int(0, memcmp(data, buf1.data(), sizeof(data)));
+            assert_int(100, arena.getUsed());
+
+            // Does not fit
+            FileHelperRK::OwnedBuffer buf2;
+            result = FileHelperRK::readBytes(pathTest3, arena, buf2);
+            assert_int(SYSTEM_ERROR_NO_MEMORY, result);
+            assert_int(0, buf2.size());
+
+            // Fits
+            result = FileHelperRK::readBytes(pathTest1, arena, buf2, true);
+            assert_int(SYSTEM_ERROR_NONE, result);
+            assert_cstr("this is a test", buf2.c_str());
+            assert_int(104 + 15, arena.getUsed());
+        }
+        // Both buffers released
+        assert_int(0, arena.getUsed());
+
+        // Raw pointer interface
+        uint8_t *dataPtr;
+        size_t dataLen;
+        result = FileHelperRK::readBytes(pathTest3, arena, dataPtr, dataLen);
+        assert_int(SYSTEM_ERROR_NONE, result);
+        assert_int(sizeof(data), dataLen);
+        arena.release(dataPtr);
+        assert_int(0, arena.getUsed());
+
+        // Nested allocations are reclaimed last-in, first-out, including ones released out of order
+        uint8_t *p1 = arena.allocate(10);
+        uint8_t *p2 = arena.allocate(10);
+        uint8_t *p3 = arena.allocate(10);
+        uint8_t *p4 = arena.allocate(10);
+        assert_int(58, arena.getUsed());
+        arena.release(p4);
+        assert_int(48, arena.getUsed());
+        arena.release(p2);
+        assert_int(48, arena.getUsed());
+        arena.release(p3);
+        assert_int(16, arena.getUsed());
+        p2 = arena.allocate(10);
+        assert_int(26, arena.getUsed());
+        arena.release(p2);
+        arena.release(p1);
+        assert_int(0, arena.getUsed());
+    }
+}
+
+void runTestWalk() {
+    String pathWalk = FileHelperRK::pathJoin(baseDir, "foo/walk");
+    int result;
+
+    FileHelperRK::deleteRecursive(pathWalk);
+    FileHelperRK::mkdirs(FileHelperRK::pathJoin(pathWalk, "a/b"));
+    FileHelperRK::mkdirs(FileHelperRK::pathJoin(pathWalk, "c"));
+    FileHelperRK::storeString(FileHelperRK::pathJoin(pathWalk, "f1"), "12345");
+    FileHelperRK::storeString(FileHelperRK::pathJoin(pathWalk, "a/f2"), "1234567890");
+    FileHelperRK::storeString(FileHelperRK::pathJoin(pathWalk, "a/b/f3"), "1");
+    FileHelperRK::storeString(FileHelperRK::pathJoin(pathWalk, "a/b/f4"), "12");
+
+    {
+        std::vector<String> paths;
+        size_t numFiles = 0, numDirectories = 0, fileBytes = 0;
+
+        result = FileHelperRK::walk(pathWalk, [&](const FileHelperRK::WalkParameters &walkParameters) {
+            paths.push_back(walkParameters.path);
+            if (walkParameters.isDirectory) {
+                numDirectories++;
+            }
+            else {
+                numFiles++;
+                fileBytes += walkParameters.size;
+            }
+        });
+        assert_int(SYSTEM_ERROR_NONE, result);
+        assert_int(4, numDirectories);
+        assert_int(4, numFiles);
+        assert_int(18, fileBytes);
+        assert_int(8, paths.size());
+        assert_cstr(pathWalk.c_str(), paths[0].c_str());
+
+        // Directories are returned before their contents, and subdirectories before files
+        auto indexOf = [&](const char *rel) {
+            String p = FileHelperRK::pathJoin(pathWalk, rel);
+            for(size_t ii = 0; ii < paths.size(); ii++) {
+                if (paths[ii] == p) {
+                    return (int)ii;
+                }
+            }
+            return -1;
+        };
+        bool orderCorrect = indexOf("a") > 0 && indexOf("a") < indexOf("a/b") && indexOf("a/b") < indexOf("a/b/f3") &&
+            indexOf("a/b/f4") < indexOf("a/f2") && indexOf("c") < indexOf("f1") && indexOf("a/f2") < indexOf("f1");
+        assert_int(true, orderCorrect);
+    }
+
+    // Deep tree
+    {
+        String deepPath = pathWalk;
+        for(int ii = 0; ii < 20; ii++) {
+            deepPath = FileHelperRK::pathJoin(deepPath, "d");
+        }
+        result = FileHelperRK::mkdirs(deepPath);
+        assert_int(SYSTEM_ERROR_NONE, result);
+        FileHelperRK::storeString(FileHelperRK::pathJoin(deepPath, "deep"), "deep");
+
+        String foundPath;
+        result = FileHelperRK::walk(pathWalk, [&](const FileHelperRK::WalkParameters &walkParameters) {
+            if (!walkParameters.isDirectory && walkParameters.size == 4) {
+                foundPath = walkParameters.path;
+            }
+        });
+        assert_int(SYSTEM_ERROR_NONE, result);
+        assert_cstr(FileHelperRK::pathJoin(deepPath, "deep").c_str(), foundPath.c_str());
+    }
+
+    // Single file
+    {
+        size_t count = 0;
+        result = FileHelperRK::walk(FileHelperRK::pathJoin(pathWalk, "f1"), [&](const FileHelperRK::WalkParameters &walkParameters) {
+            assert_int(false, walkParameters.isDirectory);
+            assert_int(5, walkParameters.size);
+            count++;
+        });
+        assert_int(SYSTEM_ERROR_NONE, result);
+        assert_int(1, count);
+    }
+
+    // Does not exist
+    result = FileHelperRK::walk(FileHelperRK::pathJoin(pathWalk, "doesNotExist"), [&](const FileHelperRK::WalkParameters &walkParameters) {
+    });
+    assert_int(SYSTEM_ERROR_FILESYSTEM_NOENT, result);
+
+    assert_int(true, FileHelperRK::globMatch("*.txt", "test.txt"));
+    assert_int(false, FileHelperRK::globMatch("*.txt", "test.txt1"));
+    assert_int(true, FileHelperRK::globMatch("f?", "f1"));
+    assert_int(false, FileHelperRK::globMatch("f?", "f12"));
+    assert_int(true, FileHelperRK::globMatch("*a*b*", "xxaxxbxx"));
+    assert_int(true, FileHelperRK::globMatch("*", ""));
+    assert_int(false, FileHelperRK::globMatch("a", ""));
+
+    FileHelperRK::storeString(FileHelperRK::pathJoin(pathWalk, "a/log1.txt"), "log1");
+    FileHelperRK::storeString(FileHelperRK::pathJoin(pathWalk, "c/log2.txt"), "log2");
+
+    // Filters
+    {
+        size_t numFiles = 0, numDirectories = 0;
+        result = FileHelperRK::walk(pathWalk, FileHelperRK::WalkOptions().withExtension("txt"), [&](const FileHelperRK::WalkParameters &walkParameters) {
+            if (walkParameters.isDirectory) {
+                numDirectories++;
+            }
+            else {
+                numFiles++;
+            }
+            return FileHelperRK::WalkAction::CONTINUE;
+        });
+        assert_int(SYSTEM_ERROR_NONE, result);
+        assert_int(2, numFiles);
+        assert_int(24, numDirectories);
+
+        numFiles = numDirectories = 0;
+        result = FileHelperRK::walk(pathWalk, FileHelperRK::WalkOptions().withFilesOnly().withPattern("f?"), [&](const FileHelperRK::WalkParameters &walkParameters) {
+            if (walkParameters.isDirectory) {
+                numDirectories++;
+            }
+            else {
+                numFiles++;
+            }
+            return FileHelperRK::WalkAction::CONTINUE;
+        });
+        assert_int(SYSTEM_ERROR_NONE, result);
+        assert_int(4, numFiles);
+        assert_int(0, numDirectories);
+
+        numFiles = numDirectories = 0;
+        result = FileHelperRK::walk(pathWalk, FileHelperRK::WalkOptions().withDirectoriesOnly().withMaxDepth(1), [&](const FileHelperRK::WalkParameters &walkParameters) {
+            if (walkParameters.isDirectory) {
+                numDirectories++;
+            }
+            else {
+                numFiles++;
+            }
+            return FileHelperRK::WalkAction::CONTINUE;
+        });
+        assert_int(SYSTEM_ERROR_NONE, result);
+        assert_int(0, numFiles);
+        assert_int(4, numDirectories); // walk, a, c, d
+    }
+
+    // Skip subtree and stop
+    {
+        size_t count = 0;
+        result = FileHelperRK::walk(pathWalk, FileHelperRK::WalkOptions(), [&](const FileHelperRK::WalkParameters &walkParameters) {
+            count++;
+            if (walkParameters.depth == 1 && walkParameters.isDirectory) {
+                return FileHelperRK::WalkAction::SKIP_SUBTREE;
+            }
+            return FileHelperRK::WalkAction::CONTINUE;
+        });
+        assert_int(SYSTEM_ERROR_NONE, result);
+        assert_int(5, count); // walk, a, c, d, f1
+
+        count = 0;
+        String foundPath;
+        result = FileHelperRK::walk(pathWalk, FileHelperRK::WalkOptions().withPattern("log*"), [&](const FileHelperRK::WalkParameters &walkParameters) {
+            count++;
+            foundPath = walkParameters.path;
+            return FileHelperRK::WalkAction::STOP;
+        });
+        assert_int(SYSTEM_ERROR_NONE, result);
+        assert_int(1, count);
+        bool foundLog = foundPath.endsWith("log1.txt") || foundPath.endsWith("log2.txt");
+        assert_int(true, foundLog);
+    }
+}
+
+void runTestListDirectory() {
+    String pathList = FileHelperRK::pathJoin(baseDir, "foo/list");
+    int result;
+    bool bResult;
+
+    FileHelperRK::mkdirs(pathList + "/sub");
+    FileHelperRK::storeString(pathList + "/b.txt", "bb");
+    FileHelperRK::storeString(pathList + "/a.txt", "aaaa");
+    FileHelperRK::storeString(pathList + "/c.log", "c");
+
+    FileHelperRK::DirectoryListing listing;
+
+    // Default: sorted by name, files and directories
+    result = FileHelperRK::listDirectory(pathList, FileHelperRK::ListOptions(), listing);
+    assert_int(SYSTEM_ERROR_NONE, result);
+    assert_int(4, (int)listing.size());
+    assert_cstr("a.txt", listing.getName(0));
+    assert_cstr("b.txt", listing.getName(1));
+    assert_cstr("c.log", listing.getName(2));
+    assert_cstr("sub", listing.getName(3));
+    assert_int(true, listing[3].isDirectory);
+    assert_int(false, listing[0].isDirectory);
+    assert_cstr(String(pathList + "/a.txt").c_str(), listing.getPath(0).c_str());
+    assert_int(false, listing.getFromCache());
+
+    // Same listing again uses the snapshot
+    result = FileHelperRK::listDirectory(pathList, FileHelperRK::ListOptions(), listing);
+    assert_int(SYSTEM_ERROR_NONE, result);
+    assert_int(true, listing.getFromCache());
+    assert_int(4, (int)listing.size());
+
+    // Changing the options rescans
+    result = FileHelperRK::listDirectory(pathList, FileHelperRK::ListOptions().withFilesOnly().withSort(FileHelperRK::ListSort::SIZE, true), listing);
+    assert_int(SYSTEM_ERROR_NONE, result);
+    assert_int(false, listing.getFromCache());
+    assert_int(3, (int)listing.size());
+    assert_cstr("a.txt", listing.getName(0));
+    assert_int(4, (int)listing[0].size);
+    assert_cstr("b.txt", listing.getName(1));
+    assert_cstr("c.log", listing.getName(2));
+    assert_int(1, (int)listing[2].size);
+
+    // Pattern, the pattern string does not need to outlive the call
+    {
+        String pattern = "*.txt";
+        result = FileHelperRK::listDirectory(pathList, FileHelperRK::ListOptions().withPattern(pattern), listing);
+        assert_int(SYSTEM_ERROR_NONE, result);
+        assert_int(2, (int)listing.size());
+        assert_cstr("a.txt", listing.getName(0));
+        assert_cstr("b.txt", listing.getName(1));
+    }
+    result = FileHelperRK::listDirectory(pathList, FileHelperRK::ListOptions().withPattern("*.txt"), listing);
+    assert_int(SYSTEM_ERROR_NONE, result);
+    assert_int(true, listing.getFromCache());
+
+    result = FileHelperRK::listDirectory(pathList, FileHelperRK::ListOptions().withDirectoriesOnly(), listing);
+    assert_int(SYSTEM_ERROR_NONE, result);
+    assert_int(1, (int)listing.size());
+    assert_cstr("sub", listing.getName(0));
+
+    // Changes made with FileHelperRK invalidate the snapshot even within the same second
+    result = FileHelperRK::listDirectory(pathList, FileHelperRK::ListOptions(), listing);
+    assert_int(SYSTEM_ERROR_NONE, result);
+    FileHelperRK::storeString(pathList + "/0.txt", "0");
+    result = FileHelperRK::listDirectory(pathList, FileHelperRK::ListOptions(), listing);
+    assert_int(SYSTEM_ERROR_NONE, result);
+    assert_int(false, listing.getFromCache());
+    assert_int(5, (int)listing.size());
+    assert_cstr("0.txt", listing.getName(0));
+
+    // Writing to a file does not change the directory, data written by FileStreamWrite is reported on flush and close
+    {
+        FileHelperRK::ListOptions statOptions = FileHelperRK::ListOptions().withStat().withFilesOnly();
+        FileHelperRK::FileStreamWrite stream;
+        stream.withBufferSize(16);
+        result = stream.open(pathList + "/0.txt");
+        assert_int(SYSTEM_ERROR_NONE, result);
+        result = FileHelperRK::listDirectory(pathList, statOptions, listing);
+        assert_int(SYSTEM_ERROR_NONE, result);
+        assert_int(0, (int)listing[0].size);
+
+        stream.print("0123456789");
+        stream.flushBuffer();
+        result = FileHelperRK::listDirectory(pathList, statOptions, listing);
+        assert_int(SYSTEM_ERROR_NONE, result);
+        assert_int(false, listing.getFromCache());
+        assert_int(10, (int)listing[0].size);
+
+        stream.print("abc");
+        result = stream.close();
+        assert_int(SYSTEM_ERROR_NONE, result);
+        result = FileHelperRK::listDirectory(pathList, statOptions, listing);
+        assert_int(SYSTEM_ERROR_NONE, result);
+        assert_int(false, listing.getFromCache());
+        assert_int(13, (int)listing[0].size);
+    }
+
+    // Changes in other directories keep the snapshot
+    result = FileHelperRK::listDirectory(pathList, FileHelperRK::ListOptions(), listing);
+    assert_int(SYSTEM_ERROR_NONE, result);
+    FileHelperRK::storeString(pathList + "/sub/d.txt", "d");
+    FileHelperRK::storeString(FileHelperRK::pathJoin(baseDir, "foo/list2.txt"), "e");
+    result = FileHelperRK::listDirectory(pathList, FileHelperRK::ListOptions(), listing);
+    assert_int(SYSTEM_ERROR_NONE, result);
+    assert_int(true, listing.getFromCache());
+
+    // Directory changes are matched by name, absolute or relative
+    FileHelperRK::notifyChanged("list/x.txt");
+    result = FileHelperRK::listDirectory(pathList, FileHelperRK::ListOptions(), listing);
+    assert_int(SYSTEM_ERROR_NONE, result);
+    assert_int(false, listing.getFromCache());
+
+    result = FileHelperRK::listDirectory(pathList, FileHelperRK::ListOptions().withCache(false), listing);
+    assert_int(SYSTEM_ERROR_NONE, result);
+    assert_int(false, listing.getFromCache());
+
+    // Errors clear the listing
+    result = FileHelperRK::listDirectory(pathList + "/missing", FileHelperRK::ListOptions(), listing);
+    bResult = (result != SYSTEM_ERROR_NONE);
+    assert_int(true, bResult);
+    assert_int(0, (int)listing.size());
+
+    result = FileHelperRK::listDirectory(pathList + "/a.txt", FileHelperRK::ListOptions(), listing);
+    bResult = (result != SYSTEM_ERROR_NONE);
+    assert_int(true, bResult);
+
+    FileHelperRK::deleteRecursive(pathList);
+}
+
+void runTestBatch() {
+    String pathBatch = FileHelperRK::pathJoin(baseDir, "foo/batch");
+    int result;
+
+    FileHelperRK::mkdirs(pathBatch + "/b");
+    FileHelperRK::mkdirs(pathBatch + "/a");
+
+    struct Config {
+        int32_t interval;
+        uint8_t flags;
+    };
+
+    // Paths must remain valid during the call
+    std::vector<String> paths;
+    for(int ii = 0; ii < 10; ii++) {
+        paths.push_back(pathBatch + String::format("/%c/file%d.txt", (ii % 2) ? 'a' : 'b', ii));
+    }
+    String pathConfig = pathBatch + "/config.dat";
+    String pathMissing = pathBatch + "/missing.txt";
+
+    // Stores from multiple threads notify the active tracker at the same time
+    FileHelperRK::UsageTracker tracker(pathBatch);
+    result = tracker.begin();
+    assert_int(SYSTEM_ERROR_NONE, result);
+
+    for(size_t numThreads = 0; numThreads <= 4; numThreads += 4) {
+        FileHelperRK::BatchOptions options;
+        options.withNumThreads(numThreads);
+
+        std::vector<String> contents;
+        std::vector<FileHelperRK::BatchItem> items;
+        for(size_t ii = 0; ii < paths.size(); ii++) {
+            contents.push_back(String::format("contents %d", (int)ii));
+        }
+        for(size_t ii = 0; ii < paths.size(); ii++) {
+            items.push_back(FileHelperRK::BatchItem::store(paths[ii], contents[ii].c_str(), contents[ii].length()));
+        }
+        Config config = {60, 3};
+        items.push_back(FileHelperRK::BatchItem::store(pathConfig, &config, sizeof(config), FileHelperRK::STORE_ATOMIC));
+
+        result = FileHelperRK::storeBatch(items, options);
+        assert_int(SYSTEM_ERROR_NONE, result);
+        for(auto it = items.begin(); it != items.end(); it++) {
+            assert_int(SYSTEM_ERROR_NONE, it->result);
+        }
+        {
+            FileHelperRK::Usage usage, fullUsage;
+            result = tracker.update(usage);
+            assert_int(SYSTEM_ERROR_NONE, result);
+            fullUsage.measure(pathBatch);
+            assert_int(fullUsage.fileBytes, usage.fileBytes);
+            assert_int(fullUsage.numFiles, usage.numFiles);
+        }
+
+        // Read back: callbacks, a struct, and a file that does not exist
+        items.clear();
+        std::vector<String> results(paths.size());
+        for(size_t ii = 0; ii < paths.size(); ii++) {
+            String *dest = &results[ii];
+            items.push_back(FileHelperRK::BatchItem::read(paths[ii], [dest](const char *fileName, const uint8_t *data, size_t dataLen) {
+                dest->concat((const char *)data, dataLen);
+                return (int)SYSTEM_ERROR_NONE;
+            }));
+        }
+        Config config2 = {0};
+        items.push_back(FileHelperRK::BatchItem::read(pathConfig, &config2, sizeof(config2)));
+        items.push_back(FileHelperRK::BatchItem::read(pathMissing, &config2, sizeof(config2)));
+
+        result = FileHelperRK::readBatch(items, options);
+        bool failed = (result != SYSTEM_ERROR_NONE);
+        assert_int(true, failed);
+        assert_int(result, items[paths.size() + 1].result);
+        assert_int(0, items[paths.size() + 1].size);
+
+        for(size_t ii = 0; ii < paths.size(); ii++) {
+            assert_int(SYSTEM_ERROR_NONE, items[ii].result);
+            assert_cstr(contents[ii].c_str(), results[ii].c_str());
+            assert_int(contents[ii].length(), items[ii].size);
+        }
+        assert_int(SYSTEM_ERROR_NONE, items[paths.size()].result);
+        assert_int(sizeof(Config), items[paths.size()].size);
+        assert_int(60, config2.interval);
+        assert_int(3, config2.flags);
+
+#if defined(UNITTEST)
+        // ArenaAllocator is not thread-safe
+        if (numThreads > 1) {
+            FileHelperRK::StaticArenaAllocator<256> arena;
+            FileHelperRK::BatchOptions arenaOptions = options;
+            arenaOptions.withAllocator(arena);
+            result = FileHelperRK::readBatch(items, arenaOptions);
+            assert_int(SYSTEM_ERROR_INVALID_ARGUMENT, result);
+        }
+#endif // UNITTEST
+    }
+
+    FileHelperRK::deleteRecursive(pathBatch);
+}
+
+void runTestMkdirs() {
+    String pathDir = FileHelperRK::pathJoin(baseDir, "foo/mk/a/b");
+    String pathTop = FileHelperRK::pathJoin(baseDir, "foo/mk");
+    int result;
+    struct stat sb;
+
+    FileHelperRK::deleteRecursive(pathTop);
+
+    result = FileHelperRK::mkdirs(pathDir);
+    assert_int(SYSTEM_ERROR_NONE, result);
+    assert_int(0, stat(pathDir, &sb));
+
+    // Cached; different ways of writing the same path
+    result = FileHelperRK::mkdirs(pathDir);
+    assert_int(SYSTEM_ERROR_NONE, result);
+    result = FileHelperRK::mkdirs(pathDir + "/../b/");
+    assert_int(SYSTEM_ERROR_NONE, result);
+
+    // deleteRecursive invalidates the cache
+    result = FileHelperRK::deleteRecursive(pathTop);
+    assert_int(SYSTEM_ERROR_NONE, result);
+    result = FileHelperRK::mkdirs(pathDir);
+    assert_int(SYSTEM_ERROR_NONE, result);
+    assert_int(0, stat(pathDir, &sb));
+
+    // Removed without FileHelperRK; still in the cache until invalidated
+    rmdir(pathDir);
+    result = FileHelperRK::mkdirs(pathDir);
+    assert_int(SYSTEM_ERROR_NONE, result);
+    assert_int(-1, stat(pathDir, &sb));
+    FileHelperRK::invalidateMkdirsCache(pathTop + "/a");
+    result = FileHelperRK::mkdirs(pathDir);
+    assert_int(SYSTEM_ERROR_NONE, result);
+    assert_int(0, stat(pathDir, &sb));
+
+    // Parent exists
+    result = FileHelperRK::mkdirs(pathDir + "/c");
+    assert_int(SYSTEM_ERROR_NONE, result);
+    assert_int(0, stat(pathDir + "/c", &sb));
+
+    // Existing file in the path
+    FileHelperRK::storeString(pathDir + "/file", "test");
+    result = FileHelperRK::mkdirs(pathDir + "/file");
+    bool failed = (result != SYSTEM_ERROR_NONE);
+    assert_int(true, failed);
+    result = FileHelperRK::mkdirs(pathDir + "/file/d");
+    failed = (result != SYSTEM_ERROR_NONE);
+    assert_int(true, failed);
+
+#if defined(UNITTEST)
+    // Relative and absolute paths to the same directory; the test runs with baseDir as the current directory
+    {
+        String pathRelative = "foo/mk/r/s";
+        String pathAbsolute = pathTop + "/r/s";
+
+        result = FileHelperRK::mkdirs(pathRelative);
+        assert_int(SYSTEM_ERROR_NONE, result);
+        result = FileHelperRK::deleteRecursive(pathTop + "/r");
+        assert_int(SYSTEM_ERROR_NONE, result);
+        result = FileHelperRK::mkdirs(pathRelative);
+        assert_int(SYSTEM_ERROR_NONE, result);
+        assert_int(0, stat(pathAbsolute, &sb));
+
+        result = FileHelperRK::mkdirs(pathAbsolute);
+        assert_int(SYSTEM_ERROR_NONE, result);
+        result = FileHelperRK::deleteRecursive("foo/mk/r");
+        assert_int(SYSTEM_ERROR_NONE, result);
+        result = FileHelperRK::mkdirs(pathAbsolute);
+        assert_int(SYSTEM_ERROR_NONE, result);
+        assert_int(0, stat(pathAbsolute, &sb));
+    }
+#endif // UNITTEST
+
+    // More directories than the cache holds
+    for(int ii = 0; ii < (int)FileHelperRK::mkdirsCacheSize * 2; ii++) {
+        result = FileHelperRK::mkdirs(pathTop + String::format("/d%d/e", ii));
+        assert_int(SYSTEM_ERROR_NONE, result);
+    }
+    FileHelperRK::invalidateMkdirsCache();
+    for(int ii = 0; ii < (int)FileHelperRK::mkdirsCacheSize * 2; ii++) {
+        assert_int(0, stat(pathTop + String::format("/d%d/e", ii), &sb));
+    }
+
+    FileHelperRK::deleteRecursive(pathTop);
+}
+
+void runTestDeleteRecursive() {
+    String pathDel = FileHelperRK::pathJoin(baseDir, "foo/del");
+    int result;
+    struct stat sb;
+
+    // Tree with 4 subdirectories, each with 3 subdirectories, and 5 files in every directory
+    auto makeTree = [&pathDel]() {
+        for(int ii = 0; ii < 4; ii++) {
+            for(int jj = 0; jj < 3; jj++) {
+                String dir = FileHelperRK::pathJoin(pathDel, String::format("d%d/e%d", ii, jj));
+                FileHelperRK::mkdirs(dir);
+                for(int kk = 0; kk < 5; kk++) {
+                    FileHelperRK::storeString(FileHelperRK::pathJoin(dir, String::format("f%d.txt", kk)), "test");
+                    FileHelperRK::storeString(FileHelperRK::pathJoin(pathDel, String::format("d%d/f%d.txt", ii, kk)), "test");
+                }
+            }
+            FileHelperRK::storeString(FileHelperRK::pathJoin(pathDel, String::format("f%d.txt", ii)), "test");
+        }
+    };
+
+    makeTree();
+    result = FileHelperRK::deleteRecursive(pathDel, FileHelperRK::DeleteOptions().withNumThreads(4));
+    assert_int(SYSTEM_ERROR_NONE, result);
+    assert_int(-1, stat(pathDel, &sb));
+
+    makeTree();
+    result = FileHelperRK::deleteRecursive(pathDel, FileHelperRK::DeleteOptions().withNumThreads(4).withContentsOfPathOnly());
+    assert_int(SYSTEM_ERROR_NONE, result);
+    assert_int(0, stat(pathDel, &sb));
+    assert_int(-1, stat(FileHelperRK::pathJoin(pathDel, "d0"), &sb));
+
+    makeTree();
+    result = FileHelperRK::deleteRecursive(pathDel, FileHelperRK::DeleteOptions());
+    assert_int(SYSTEM_ERROR_NONE, result);
+    assert_int(-1, stat(pathDel, &sb));
+
+    // Results: 4 + 4 * 5 + 4 * 3 * 5 files of 4 bytes, 1 + 4 + 4 * 3 directories
+    for(size_t numThreads = 0; numThreads <= 4; numThreads += 4) {
+        FileHelperRK::DeleteResult deleteResult;
+
+        makeTree();
+        result = FileHelperRK::deleteRecursive(pathDel, FileHelperRK::DeleteOptions().withNumThreads(numThreads).withContinueOnFailure(), &deleteResult);
+        assert_int(SYSTEM_ERROR_NONE, result);
+        assert_int(84, deleteResult.filesDeleted);
+        assert_int(17, deleteResult.directoriesDeleted);
+        assert_int(336, deleteResult.bytesFreed);
+        assert_int(0, deleteResult.failures.size());
+
+        // Contents of a file is a failure
+        String pathFile = FileHelperRK::pathJoin(baseDir, "foo/delfile.txt");
+        FileHelperRK::storeString(pathFile, "test");
+        result = FileHelperRK::deleteRecursive(pathFile, FileHelperRK::DeleteOptions().withNumThreads(numThreads).withContentsOfPathOnly(), &deleteResult);
+        bool failed = (result != SYSTEM_ERROR_NONE);
+        assert_int(true, failed);
+        assert_int(1, deleteResult.failures.size());
+        assert_cstr(pathFile.c_str(), deleteResult.failures[0].path.c_str());
+        assert_int(result, deleteResult.failures[0].error);
+        assert_int(0, deleteResult.filesDeleted);
+        unlink(pathFile);
+
+        // Directory that does not exist
+        result = FileHelperRK::deleteRecursive(pathDel, FileHelperRK::DeleteOptions().withNumThreads(numThreads), &deleteResult);
+        failed = (result != SYSTEM_ERROR_NONE);
+        assert_int(true, failed);
+        assert_int(1, deleteResult.failures.size());
+        assert_cstr(pathDel.c_str(), deleteResult.failures[0].path.c_str());
+    }
+}
+
+void runTestRecordFile() {
+    String pathRf = FileHelperRK::pathJoin(baseDir, "foo/cal.dat");
+    int result;
+
+    struct Calibration {
+        uint32_t sensorId;
+        int32_t offset;
+        int32_t scale;
+    };
+
+    unlink(pathRf);
+
+    // Writes and truncates update the active tracker
+    String pathDir = FileHelperRK::pathJoin(baseDir, "foo");
+    FileHelperRK::UsageTracker tracker(pathDir);
+    result = tracker.begin();
+    assert_int(SYSTEM_ERROR_NONE, result);
+
+    {
+        FileHelperRK::RecordFile<Calibration> rf(pathRf, 1);
+        result = rf.begin();
+        assert_int(SYSTEM_ERROR_NONE, result);
+        assert_int(0, rf.size());
+
+        for(uint32_t ii = 0; ii < 500; ii++) {
+            Calibration cal = {ii, (int32_t)ii * 10, 1};
+            result = rf.append(cal);
+            assert_int(SYSTEM_ERROR_NONE, result);
+        }
+        assert_int(500, rf.size());
+
+        Calibration cal;
+        result = rf.read(123, cal);
+        assert_int(SYSTEM_ERROR_NONE, result);
+        assert_int(123, cal.sensorId);
+        assert_int(1230, cal.offset);
+
+        cal.scale = 2;
+        result = rf.write(123, cal);
+        assert_int(SYSTEM_ERROR_NONE, result);
+        assert_int(500, rf.size());
+
+        result = rf.read(500, cal);
+        assert_int(SYSTEM_ERROR_NOT_FOUND, result);
+        result = rf.write(501, cal);
+        assert_int(SYSTEM_ERROR_INVALID_ARGUMENT, result);
+
+        Calibration cals[10];
+        result = rf.readRange(120, cals, 10);
+        assert_int(SYSTEM_ERROR_NONE, result);
+        assert_int(120, cals[0].sensorId);
+        assert_int(129, cals[9].sensorId);
+        assert_int(2, cals[3].scale);
+        assert_int(1, cals[4].scale);
+
+        size_t countRead = 0;
+        result = rf.readRange(495, cals, 10, &countRead);
+        assert_int(SYSTEM_ERROR_NONE, result);
+        assert_int(5, countRead);
+        assert_int(499, cals[4].sensorId);
+
+        result = rf.readRange(495, cals, 10);
+        assert_int(SYSTEM_ERROR_NOT_FOUND, result);
+
+        FileHelperRK::Usage usage, fullUsage;
+        result = tracker.update(usage);
+        assert_int(SYSTEM_ERROR_NONE, result);
+        fullUsage.measure(pathDir);
+        assert_int(fullUsage.fileBytes, usage.fileBytes);
+
+        result = rf.truncate(400);
+        assert_int(SYSTEM_ERROR_NONE, result);
+        assert_int(400, rf.size());
+
+        result = tracker.update(usage);
+        assert_int(SYSTEM_ERROR_NONE, result);
+        fullUsage.measure(pathDir);
+        assert_int(fullUsage.fileBytes, usage.fileBytes);
+    }
+
+    // Reopen
+    {
+        FileHelperRK::RecordFile<Calibration> rf(pathRf, 1);
+        result = rf.begin();
+        assert_int(SYSTEM_ERROR_NONE, result);
+        assert_int(400, rf.size());
+
+        Calibration cal;
+        result = rf.read(123, cal);
+        assert_int(SYSTEM_ERROR_NONE, result);
+        assert_int(2, cal.scale);
+    }
+
+    // Partially written record at the end is ignored and overwritten by append
+    {
+        int fd = open(pathRf, O_WRONLY | O_APPEND);
+        const uint8_t partial[5] = {0};
+        write(fd, partial, sizeof(partial));
+        close(fd);
+
+        FileHelperRK::RecordFile<Calibration> rf(pathRf, 1);
+        result = rf.begin();
+        assert_int(SYSTEM_ERROR_NONE, result);
+        assert_int(400, rf.size());
+
+        Calibration cal = {1000, 0, 1};
+        result = rf.append(cal);
+        assert_int(SYSTEM_ERROR_NONE, result);
+        result = rf.read(400, cal);
+        assert_int(SYSTEM_ERROR_NONE, result);
+        assert_int(1000, cal.sensorId);
+    }
+
+    // Version and record size mismatch
+    {
+        FileHelperRK::RecordFile<Calibration> rf(pathRf, 2);
+        result = rf.begin();
+        assert_int(SYSTEM_ERROR_NOT_SUPPORTED, result);
+
+        FileHelperRK::RecordFile<uint32_t> rf2(pathRf, 1);
+        result = rf2.begin();
+        assert_int(SYSTEM_ERROR_BAD_DATA, result);
+    }
+
+    unlink(pathRf);
+}
+
+void runTestKeyValueStore() {
+    String pathKv = FileHelperRK::pathJoin(baseDir, "foo/kv.dat");
+    int result;
+    char buf[64];
+    size_t size;
+
+    unlink(pathKv);
+
+    {
+        FileHelperRK::KeyValueStore kv(pathKv);
+        kv.withAutoCompact(false);
+        result = kv.begin();
+        assert_int(SYSTEM_ERROR_NONE, result);
+        assert_int(0, kv.getNumKeys());
+
+        result = kv.putString("name", "test device");
+        assert_int(SYSTEM_ERROR_NONE, result);
+        result = kv.putString("interval", "60");
+        assert_int(SYSTEM_ERROR_NONE, result);
+        uint32_t u32 = 0x12345678;
+        result = kv.put("u32", &u32, sizeof(u32));
+        assert_int(SYSTEM_ERROR_NONE, result);
+        assert_int(3, kv.getNumKeys());
+        assert_int(0, kv.getGarbageBytes());
+
+        String s;
+        result = kv.getString("name", s);
+        assert_int(SYSTEM_ERROR_NONE, result);
+        assert_cstr("test device", s.c_str());
+
+        uint32_t u32b = 0;
+        size = sizeof(u32b);
+        result = kv.get("u32", (uint8_t *)&u32b, size);
+        assert_int(SYSTEM_ERROR_NONE, result);
+        assert_int(sizeof(u32b), size);
+        assert_int(0x12345678, u32b);
+
+        size = 2;
+        result = kv.get("name", (uint8_t *)buf, size);
+        assert_int(SYSTEM_ERROR_TOO_LARGE, result);
+        assert_int(11, size);
+
+        result = kv.getString("missing", s);
+        assert_int(SYSTEM_ERROR_NOT_FOUND, result);
+        assert_int(false, kv.has("missing"));
+        assert_int(true, kv.has("interval"));
+
+        // Replace and remove
+        result = kv.putString("interval", "120");
+        assert_int(SYSTEM_ERROR_NONE, result);
+        result = kv.remove("name");
+        assert_int(SYSTEM_ERROR_NONE, result);
+        result = kv.remove("name");
+        assert_int(SYSTEM_ERROR_NOT_FOUND, result);
+        assert_int(2, kv.getNumKeys());
+        assert_int(false, kv.has("name"));
+        bool hasGarbage = kv.getGarbageBytes() > 0;
+        assert_int(true, hasGarbage);
+
+        FileHelperRK::OwnedBuffer ownedBuf;
+        result = kv.get("interval", ownedBuf);
+        assert_int(SYSTEM_ERROR_NONE, result);
+        assert_cstr("120", ownedBuf.c_str());
+
+        result = kv.putString("", "x");
+        assert_int(SYSTEM_ERROR_INVALID_ARGUMENT, result);
+    }
+
+    // Reopen and rebuild the index from the file
+    {
+        FileHelperRK::KeyValueStore kv(pathKv);
+        result = kv.begin();
+        assert_int(SYSTEM_ERROR_NONE, result);
+        assert_int(2, kv.getNumKeys());
+
+        String s;
+        result = kv.getString("interval", s);
+        assert_int(SYSTEM_ERROR_NONE, result);
+        assert_cstr("120", s.c_str());
+        assert_int(false, kv.has("name"));
+
+        std::vector<String> keys;
+        kv.getKeys(keys);
+        assert_int(2, keys.size());
+
+        size_t oldSize = kv.getFileSize();
+        result = kv.compact();
+        assert_int(SYSTEM_ERROR_NONE, result);
+        assert_int(0, kv.getGarbageBytes());
+        bool smaller = kv.getFileSize() < oldSize;
+        assert_int(true, smaller);
+
+        result = kv.getString("interval", s);
+        assert_int(SYSTEM_ERROR_NONE, result);
+        assert_cstr("120", s.c_str());
+    }
+
+    // Automatic compaction
+    {
+        FileHelperRK::KeyValueStore kv(pathKv);
+        kv.withCompactThreshold(256, 50).withSyncEachWrite(false);
+        result = kv.begin();
+        assert_int(SYSTEM_ERROR_NONE, result);
+
+        for(int ii = 0; ii < 100; ii++) {
+            String key = String::format("key%d", ii % 10);
+            String value = String::format("value%d", ii);
+            result = kv.putString(key, value);
+            assert_int(SYSTEM_ERROR_NONE, result);
+        }
+        assert_int(12, kv.getNumKeys());
+        bool compacted = kv.getFileSize() < 1024;
+        assert_int(true, compacted);
+
+        for(int ii = 0; ii < 10; ii++) {
+            String s;
+            result = kv.getString(String::format("key%d", ii), s);
+            assert_int(SYSTEM_ERROR_NONE, result);
+            assert_cstr(String::format("value%d", 90 + ii).c_str(), s.c_str());
+        }
+    }
+
+    // Partial record at the end of the file
+    {
+        int fd = open(pathKv, O_WRONLY | O_APPEND);
+        write(fd, "\x01\x03\x00\x00\xff", 5);
+        close(fd);
+
+        FileHelperRK::KeyValueStore kv(pathKv);
+        result = kv.begin();
+        assert_int(SYSTEM_ERROR_NONE, result);
+        assert_int(12, kv.getNumKeys());
+
+        result = kv.putString("after", "ok");
+        assert_int(SYSTEM_ERROR_NONE, result);
+        kv.close();
+
+        result = kv.begin();
+        assert_int(SYSTEM_ERROR_NONE, result);
+        assert_int(13, kv.getNumKeys());
+        String s;
+        kv.getString("after", s);
+        assert_cstr("ok", s.c_str());
+    }
+
+#if defined(SYSTEM_VERSION_560) || defined(UNITTEST)
+    {
+        FileHelperRK::KeyValueStore kv(pathKv);
+        result = kv.begin();
+        assert_int(SYSTEM_ERROR_NONE, result);
+
+        particle::Variant v1;
+        v1.set("a", 1);
+        v1.set("b", "two");
+        result = kv.putVariant("config", v1);
+        assert_int(SYSTEM_ERROR_NONE, result);
+
+        particle::Variant v2;
+        result = kv.getVariant("config", v2);
+        assert_int(SYSTEM_ERROR_NONE, result);
+        bool isEqual = (v1 == v2);
+        assert_int(true, isEqual);
+
+        result = kv.getVariant("after", v2);
+        assert_int(SYSTEM_ERROR_BAD_DATA, result);
+    }
+#endif // defined(SYSTEM_VERSION_560) || defined(UNITTEST)
+
+    unlink(pathKv);
+}
+
+void runTestRecordQueue() {
+    String pathQueue = FileHelperRK::pathJoin(baseDir, "foo/queue");
+    int result;
+    char buf[32];
+    size_t size;
+
+    FileHelperRK::deleteRecursive(pathQueue);
+
+    {
+        FileHelperRK::RecordQueue queue(pathQueue);
+        queue.withMaxSegmentSize(64);
+        result = queue.begin();
+        assert_int(SYSTEM_ERROR_NONE, result);
+        assert_int(true, queue.isEmpty());
+
+        size = sizeof(buf);
+        result = queue.peek((uint8_t *)buf, size);
+        assert_int(SYSTEM_ERROR_NOT_FOUND, result);
+        result = queue.pop();
+        assert_int(SYSTEM_ERROR_NOT_FOUND, result);
+
+        for(int ii = 0; ii < 20; ii++) {
+            String rec = String::format("rec%02d", ii);
+            result = queue.push(rec.c_str(), rec.length());
+            assert_int(SYSTEM_ERROR_NONE, result);
+        }
+        assert_int(20, queue.getCount());
+        // 13 bytes per record, 4 records per 64 byte segment
+        assert_int(5, queue.getNumSegments());
+
+        for(int ii = 0; ii < 5; ii++) {
+            size = sizeof(buf) - 1;
+            result = queue.peek((uint8_t *)buf, size);
+            assert_int(SYSTEM_ERROR_NONE, result);
+            buf[size] = 0;
+            assert_cstr(String::format("rec%02d", ii).c_str(), buf);
+            result = queue.pop();
+            assert_int(SYSTEM_ERROR_NONE, result);
+        }
+        assert_int(15, queue.getCount());
+        assert_int(4, queue.getNumSegments());
+
+        // Buffer too small
+        size = 2;
+        result = queue.peek((uint8_t *)buf, size);
+        assert_int(SYSTEM_ERROR_TOO_LARGE, result);
+        assert_int(5, size);
+    }
+
+    // Reopen
+    {
+        FileHelperRK::RecordQueue queue(pathQueue);
+        queue.withMaxSegmentSize(64);
+        result = queue.begin();
+        assert_int(SYSTEM_ERROR_NONE, result);
+        assert_int(15, queue.getCount());
+
+        FileHelperRK::OwnedBuffer ownedBuf;
+        result = queue.peek(ownedBuf);
+        assert_int(SYSTEM_ERROR_NONE, result);
+        assert_int(5, ownedBuf.size());
+        assert_int(0, memcmp(ownedBuf.data(), "rec05", 5));
+    }
+
+    // Partial record written at the end of the last segment before a power loss
+    {
+        int fd = open(FileHelperRK::pathJoin(pathQueue, "queue.00000005"), O_WRONLY | O_APPEND);
+        uint32_t len = 100;
+        write(fd, &len, sizeof(len));
+        write(fd, "partial", 7);
+        close(fd);
+
+        FileHelperRK::RecordQueue queue(pathQueue);
+        queue.withMaxSegmentSize(64);
+        result = queue.begin();
+        assert_int(SYSTEM_ERROR_NONE, result);
+        assert_int(15, queue.getCount());
+
+        result = queue.push("after", 5);
+        assert_int(SYSTEM_ERROR_NONE, result);
+        assert_int(16, queue.getCount());
+        assert_int(5, queue.getNumSegments());
+
+        for(int ii = 5; ii < 20; ii++) {
+            size = sizeof(buf) - 1;
+            result = queue.peek((uint8_t *)buf, size);
+            assert_int(SYSTEM_ERROR_NONE, result);
+            buf[size] = 0;
+            assert_cstr(String::format("rec%02d", ii).c_str(), buf);
+            result = queue.pop();
+            assert_int(SYSTEM_ERROR_NONE, result);
+        }
+        size = sizeof(buf) - 1;
+        result = queue.peek((uint8_t *)buf, size);
+        assert_int(SYSTEM_ERROR_NONE, result);
+        buf[size] = 0;
+        assert_cstr("after", buf);
+        result = queue.pop();
+        assert_int(SYSTEM_ERROR_NONE, result);
+        assert_int(true, queue.isEmpty());
+        assert_int(1, queue.getNumSegments());
+    }
+
+    // Lost head pointer: records are returned again (at least once delivery)
+    {
+        FileHelperRK::RecordQueue queue(pathQueue);
+        result = queue.begin();
+        assert_int(SYSTEM_ERROR_NONE, result);
+        assert_int(true, queue.isEmpty());
+
+        queue.push("a", 1);
+        queue.push("b", 1);
+        queue.pop();
+        result = queue.close();
+        assert_int(SYSTEM_ERROR_NONE, result);
+
+        unlink(FileHelperRK::pathJoin(pathQueue, FileHelperRK::RecordQueue::headFileName));
+
+        // "after" is in the same segment as "a" and "b" so it is also returned again
+        result = queue.begin();
+        assert_int(SYSTEM_ERROR_NONE, result);
+        assert_int(3, queue.getCount());
+        size = sizeof(buf) - 1;
+        result = queue.peek((uint8_t *)buf, size);
+        assert_int(SYSTEM_ERROR_NONE, result);
+        buf[size] = 0;
+        assert_cstr("after", buf);
+        queue.pop();
+        queue.pop();
+        queue.pop();
+        assert_int(true, queue.isEmpty());
+    }
+
+    // Corrupted record is reported and can be skipped
+    {
+        FileHelperRK::RecordQueue queue(pathQueue);
+        queue.withSyncEachPush(false);
+        result = queue.begin();
+        assert_int(SYSTEM_ERROR_NONE, result);
+
+        queue.push("xyz", 3);
+        queue.push("good", 4);
+        queue.sync();
+
+        // Corrupt the first byte of "xyz" (the "good" record is 12 bytes, "xyz" data is 7 bytes before it)
+        String segmentPath = FileHelperRK::pathJoin(pathQueue, "queue.00000006");
+        FileHelperRK::FileStreamRead stream;
+        stream.open(segmentPath);
+        size_t segmentSize = stream.available();
+        stream.close();
+        int fd = open(segmentPath, O_WRONLY);
+        lseek(fd, segmentSize - 12 - 7, SEEK_SET);
+        write(fd, "X", 1);
+        close(fd);
+
+        size = sizeof(buf);
+        result = queue.peek((uint8_t *)buf, size);
+        assert_int(SYSTEM_ERROR_BAD_DATA, result);
+        result = queue.pop();
+        assert_int(SYSTEM_ERROR_NONE, result);
+
+        size = sizeof(buf) - 1;
+        result = queue.peek((uint8_t *)buf, size);
+        assert_int(SYSTEM_ERROR_NONE, result);
+        buf[size] = 0;
+        assert_cstr("good", buf);
+        queue.pop();
+    }
+
+#if defined(SYSTEM_VERSION_560) || defined(UNITTEST)
+    {
+        FileHelperRK::RecordQueue queue(pathQueue);
+        result = queue.begin();
+        assert_int(SYSTEM_ERROR_NONE, result);
+
+        for(int ii = 0; ii < 3; ii++) {
+            particle::Variant v;
+            v.set("id", ii);
+            v.set("name", "event");
+            result = queue.pushVariant(v);
+            assert_int(SYSTEM_ERROR_NONE, result);
+        }
+        for(int ii = 0; ii < 3; ii++) {
+            particle::Variant v;
+            result = queue.peekVariant(v);
+            assert_int(SYSTEM_ERROR_NONE, result);
+            assert_int(ii, v.get("id").toInt());
+            assert_cstr("event", v.get("name").toString().c_str());
+            queue.pop();
+        }
+        assert_int(true, queue.isEmpty());
+    }
+#endif // defined(SYSTEM_VERSION_560) || defined(UNITTEST)
+
+    FileHelperRK::deleteRecursive(pathQueue);
+}
+
+void runTestLogWriter() {
+    String pathLog = FileHelperRK::pathJoin(baseDir, "foo/log");
+    int result;
+
+    FileHelperRK::deleteRecursive(pathLog);
+
+    {
+        FileHelperRK::LogWriter logWriter(pathLog);
+        logWriter.withMaxSegmentSize(100).withMaxTotalSize(350);
+        result = logWriter.begin();
+        assert_int(SYSTEM_ERROR_NONE, result);
+        assert_int(1, logWriter.getCurrentSequence());
+        assert_int(1, logWriter.getNumSegments());
+
+        for(int ii = 0; ii < 50; ii++) {
+            String rec = String::format("record%03d\n", ii);
+            result = logWriter.append(rec.c_str());
+            assert_int(SYSTEM_ERROR_NONE, result);
+            bool sizeOk = (logWriter.getSegmentSize() <= 100 && logWriter.getTotalSize() <= 350);
+            assert_int(true, sizeOk);
+        }
+        result = logWriter.flush();
+        assert_int(SYSTEM_ERROR_NONE, result);
+
+        // 10 records per segment; segments 1 and 2 were deleted to stay under the total size
+        assert_int(5, logWriter.getCurrentSequence());
+        assert_int(3, logWriter.getNumSegments());
+        assert_int(300, logWriter.getTotalSize());
+
+        std::vector<String> paths;
+        logWriter.getSegmentPaths(paths);
+        assert_int(3, paths.size());
+        String expected, contents;
+        for(int ii = 20; ii < 50; ii++) {
+            expected += String::format("record%03d\n", ii);
+        }
+        for(auto it = paths.begin(); it != paths.end(); it++) {
+            String s;
+            result = FileHelperRK::readString(*it, s);
+            assert_int(SYSTEM_ERROR_NONE, result);
+            contents += s;
+        }
+        assert_cstr(expected.c_str(), contents.c_str());
+
+        result = logWriter.close();
+        assert_int(SYSTEM_ERROR_NONE, result);
+        result = logWriter.append("x");
+        assert_int(SYSTEM_ERROR_INVALID_STATE, result);
+    }
+
+    // Reopen: the last segment is full so a new one is started
+    {
+        FileHelperRK::LogWriter logWriter(pathLog);
+        logWriter.withMaxSegmentSize(100).withMaxTotalSize(350);
+        result = logWriter.begin();
+        assert_int(SYSTEM_ERROR_NONE, result);
+        assert_int(6, logWriter.getCurrentSequence());
+        assert_int(300, logWriter.getTotalSize());
+
+        result = logWriter.append("abc");
+        assert_int(SYSTEM_ERROR_NONE, result);
+    }
+
+    // Reopen: the last segment has room so records are appended to it
+    {
+        FileHelperRK::LogWriter logWriter(pathLog);
+        logWriter.withMaxSegmentSize(100).withMaxTotalSize(350);
+        result = logWriter.begin();
+        assert_int(SYSTEM_ERROR_NONE, result);
+        assert_int(6, logWriter.getCurrentSequence());
+        assert_int(3, logWriter.getSegmentSize());
+
+        result = logWriter.append("def");
+        assert_int(SYSTEM_ERROR_NONE, result);
+        result = logWriter.close();
+        assert_int(SYSTEM_ERROR_NONE, result);
+
+        String s;
+        FileHelperRK::readString(logWriter.getSegmentPath(6), s);
+        assert_cstr("abcdef", s.c_str());
+    }
+
+    // Rotate by number of records
+    {
+        FileHelperRK::LogWriter logWriter(pathLog);
+        logWriter.withMaxSegmentSize(0).withMaxTotalSize(0).withMaxSegmentRecords(2);
+        result = logWriter.begin();
+        assert_int(SYSTEM_ERROR_NONE, result);
+        assert_int(7, logWriter.getCurrentSequence());
+
+        for(int ii = 0; ii < 5; ii++) {
+            result = logWriter.append("1234");
+            assert_int(SYSTEM_ERROR_NONE, result);
+        }
+        assert_int(9, logWriter.getCurrentSequence());
+        assert_int(4, logWriter.getSegmentSize());
+    }
+
+    FileHelperRK::deleteRecursive(pathLog);
+}
+
+void runTestUsageModel() {
+    String pathUsage = FileHelperRK::pathJoin(baseDir, "foo/usageModel");
+    int result;
+
+    FileHelperRK::LittleFSUsageModel model;
+    assert_int(4096, model.getBlockSize());
+    assert_int(512, model.getInlineMax());
+
+    // Inline files use no blocks
+    assert_int(0, model.fileBlocks(0));
+    assert_int(0, model.fileBlocks(512));
+    assert_int(1, model.fileBlocks(513));
+    assert_int(1, model.fileBlocks(4096));
+    // Block 1 holds 4092 bytes (one pointer), block 2 holds 4088 (two pointers)
+    assert_int(2, model.fileBlocks(4096 + 4092));
+    assert_int(3, model.fileBlocks(4096 + 4092 + 1));
+    assert_int(3, model.fileBlocks(4096 + 4092 + 4088));
+    assert_int(4, model.fileBlocks(4096 + 4092 + 4088 + 1));
+
+    assert_int(2, model.directoryBlocks(0));
+    assert_int(2, model.directoryBlocks(2048));
+    assert_int(4, model.directoryBlocks(2049));
+
+    FileHelperRK::deleteRecursive(pathUsage);
+    FileHelperRK::mkdirs(FileHelperRK::pathJoin(pathUsage, "a"));
+    FileHelperRK::storeString(FileHelperRK::pathJoin(pathUsage, "f1"), "12345");
+    {
+        String s;
+        for(int ii = 0; ii < 1000; ii++) {
+            s += "0123456789";
+        }
+        FileHelperRK::storeString(FileHelperRK::pathJoin(pathUsage, "a/f2"), s);
+    }
+
+    FileHelperRK::Usage usage;
+    usage.withModel(model);
+    result = usage.measure(pathUsage);
+    assert_int(SYSTEM_ERROR_NONE, result);
+    assert_int(4096, usage.blockSize);
+    // 2 directories (2 blocks each) + f1 inline + f2 10000 bytes (3 blocks)
+    assert_int(7, usage.blocks);
+    assert_int(7 * 4096, usage.getUsedBytes());
+
+    // Tracker uses the same model
+    FileHelperRK::UsageTracker tracker(pathUsage);
+    tracker.withModel(model);
+    tracker.begin();
+    FileHelperRK::Usage trackerUsage;
+    result = tracker.measure(trackerUsage);
+    assert_int(SYSTEM_ERROR_NONE, result);
+    assert_int(usage.blocks, trackerUsage.blocks);
+    assert_int(usage.blockSize, trackerUsage.blockSize);
+
+    // Smaller blocks also lower the inline limit to 128 bytes
+    model.withBlockSize(1024);
+    result = usage.measure(pathUsage);
+    assert_int(SYSTEM_ERROR_NONE, result);
+    assert_int(1024, usage.blockSize);
+    // 2 directories (2 blocks each) + f1 inline + f2 as a skip-list of 1024 byte blocks
+    assert_int(4 + model.fileBlocks(10000), usage.blocks);
+
+    FileHelperRK::FileSystemInfo fsInfo;
+    result = FileHelperRK::getFileSystemInfo("/", fsInfo);
+    if (result == SYSTEM_ERROR_NONE) {
+        result = model.calibrate("/");
+        assert_int(SYSTEM_ERROR_NONE, result);
+        assert_int(fsInfo.blockSize, model.getBlockSize());
+        assert_int(fsInfo.totalBlocks, model.getFileSystemInfo().totalBlocks);
+    }
+    else {
+        assert_int(SYSTEM_ERROR_NOT_SUPPORTED, result);
+    }
+
+    FileHelperRK::deleteRecursive(pathUsage);
+}
+
+void runTestUsageTracker() {
+    String pathUsage = FileHelperRK::pathJoin(baseDir, "foo/usage");
+    String pathSnapshot = FileHelperRK::pathJoin(baseDir, "foo/usageSnapshot");
+    int result;
+
+    FileHelperRK::deleteRecursive(pathUsage);
+    unlink(pathSnapshot);
+
+    FileHelperRK::mkdirs(FileHelperRK::pathJoin(pathUsage, "a/b"));
+    FileHelperRK::mkdirs(FileHelperRK::pathJoin(pathUsage, "c"));
+    FileHelperRK::storeString(FileHelperRK::pathJoin(pathUsage, "f1"), "12345");
+    FileHelperRK::storeString(FileHelperRK::pathJoin(pathUsage, "a/f2"), "1234567890");
+    FileHelperRK::storeString(FileHelperRK::pathJoin(pathUsage, "a/b/f3"), "1");
+
+    auto checkUsage = [&](const FileHelperRK::Usage &usage) {
+        FileHelperRK::Usage fullUsage;
+        fullUsage.measure(pathUsage);
+        assert_int(fullUsage.fileBytes, usage.fileBytes);
+        assert_int(fullUsage.sectors, usage.sectors);
+        assert_int(fullUsage.numFiles, usage.numFiles);
+        assert_int(fullUsage.numDirectories, usage.numDirectories);
+    };
+
+    {
+        FileHelperRK::UsageTracker tracker(pathUsage);
+        tracker.withSnapshotFile(pathSnapshot);
+        result = tracker.begin();
+        assert_int(SYSTEM_ERROR_NONE, result);
+
+        FileHelperRK::Usage usage;
+        result = tracker.update(usage);
+        assert_int(SYSTEM_ERROR_NONE, result);
+        assert_int(4, tracker.getNumRescanned());
+        assert_int(3, usage.numFiles);
+        assert_int(4, usage.numDirectories);
+        assert_int(16, usage.fileBytes);
+        checkUsage(usage);
+
+        // Nothing changed
+        result = tracker.update(usage);
+        assert_int(SYSTEM_ERROR_NONE, result);
+        assert_int(0, tracker.getNumRescanned());
+        checkUsage(usage);
+
+        // Modify a file using FileHelperRK
+        FileHelperRK::storeString(FileHelperRK::pathJoin(pathUsage, "a/b/f3"), "123");
+        result = tracker.update(usage);
+        assert_int(SYSTEM_ERROR_NONE, result);
+        assert_int(1, tracker.getNumRescanned());
+        assert_int(18, usage.fileBytes);
+        checkUsage(usage);
+
+        // New directory tree
+        FileHelperRK::mkdirs(FileHelperRK::pathJoin(pathUsage, "c/d/e"));
+        FileHelperRK::storeString(FileHelperRK::pathJoin(pathUsage, "c/d/e/f4"), "1234");
+        result = tracker.update(usage);
+        assert_int(SYSTEM_ERROR_NONE, result);
+        assert_int(6, usage.numDirectories);
+        checkUsage(usage);
+
+        // Delete a directory tree
+        FileHelperRK::deleteRecursive(FileHelperRK::pathJoin(pathUsage, "a"));
+        result = tracker.update(usage);
+        assert_int(SYSTEM_ERROR_NONE, result);
+        assert_int(4, usage.numDirectories);
+        checkUsage(usage);
+
+        // File created without FileHelperRK is detected by the entry count
+        int fd = open(FileHelperRK::pathJoin(pathUsage, "c/f5"), O_RDWR | O_CREAT | O_TRUNC, 0666);
+        write(fd, "12", 2);
+        close(fd);
+        result = tracker.update(usage);
+        assert_int(SYSTEM_ERROR_NONE, result);
+        checkUsage(usage);
+
+        result = tracker.save();
+        assert_int(SYSTEM_ERROR_NONE, result);
+    }
+
+    // Reload from snapshot
+    {
+        FileHelperRK::UsageTracker tracker(pathUsage);
+        tracker.withSnapshotFile(pathSnapshot);
+        result = tracker.begin();
+        assert_int(SYSTEM_ERROR_NONE, result);
+
+        FileHelperRK::Usage usage;
+        result = tracker.update(usage);
+        assert_int(SYSTEM_ERROR_NONE, result);
+        assert_int(0, tracker.getNumRescanned());
+        checkUsage(usage);
+
+        // Full measure
+        result = tracker.measure(usage);
+        assert_int(SYSTEM_ERROR_NONE, result);
+        assert_int(4, tracker.getNumRescanned());
+        checkUsage(usage);
+    }
+    bool noActiveTracker = (FileHelperRK::UsageTracker::getActiveTracker() == nullptr);
+    assert_int(true, noActiveTracker);
+
+    unlink(pathSnapshot);
+}
+
 void runTest() {
     runTestParsePath();
     runTestDirs();
     runTestReadStoreString();
     runTestVariant();
     runTestStruct();
+    runTestFileStreamRead();
+    runTestFileStreamWrite();
+    runTestAtomicStore();
+    runTestStoreIfChanged();
+    runTestStructVersioned();
+    runTestAllocator();
+    runTestWalk();
+    runTestUsageTracker();
+    runTestUsageModel();
+    runTestLogWriter();
+    runTestRecordQueue();
+    runTestKeyValueStore();
+    runTestRecordFile();
+    runTestDeleteRecursive();
+    runTestMkdirs();
+    runTestBatch();
+    runTestListDirectory();
 
     FileHelperRK::deleteRecursive(FileHelperRK::pathJoin(baseDir, "foo"));
 